@@ -1,7 +1,12 @@
 #include "apebitmap.h"
+#include <algorithm>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 ApeBitMap::ApeBitMap()
-    : bits_(NULL), size_(0)
+    : bits_(NULL), size_(0), rover_(0), unsetcount_(0), chunksize_(0), dirtycount_(0)
 {
 }
 
@@ -9,11 +14,13 @@ void ApeBitMap::reserve(uint32_t size)
 {
     if (bits_)
         delete[] bits_;
+    bits_ = NULL;
+    size_ = size;
+    rover_ = 0;
     if (size > 0)
-    {
-        size_ = size;
         bits_ = new uint8_t[size];
-    }
+    setchunksize(chunksize_);
+    summaryrebuild();
 }
 
 void* ApeBitMap::bits() const
@@ -25,6 +32,8 @@ void ApeBitMap::frombuffer(void* bitbuffer, uint32_t size)
 {
     reserve(size);
     memcpy(bits_, bitbuffer, size);
+    cleardirty();
+    summaryrebuild();
 }
 
 ApeBitMap::~ApeBitMap()
@@ -40,6 +49,10 @@ bool ApeBitMap::setbit(uint32_t bitnum)
     if (newbyte == bits_[bytenum])
         return false;
     bits_[bytenum] = newbyte;
+    markdirty(bytenum);
+    unsetcount_--;
+    if (newbyte == 0xFF)
+        summaryupdate(bytenum / 8);
     return true;
 }
 
@@ -51,6 +64,9 @@ bool ApeBitMap::unsetbit(uint32_t bitnum)
     if (newbyte == bits_[bytenum])
         return false;
     bits_[bytenum] = newbyte;
+    markdirty(bytenum);
+    unsetcount_++;
+    summaryupdate(bytenum / 8);
     return true;
 }
 
@@ -61,38 +77,289 @@ bool ApeBitMap::getbit(uint32_t bitnum)
     return (bits_[bytenum] & (1 << bytebit)) != 0;
 }
 
+/*
+    Index of the first byte in [from, to) with an unset bit, or to.
+    Full bytes are skipped 32/16/8 at a time.
+*/
+uint32_t ApeBitMap::findnonfullbyte(uint32_t from, uint32_t to) const
+{
+    uint32_t i = from;
+
+#if defined(__AVX2__)
+    const __m256i ones256 = _mm256_set1_epi8((char)0xFF);
+    for (; i + 32 <= to; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)&bits_[i]);
+        uint32_t full = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, ones256));
+        if (full != 0xFFFFFFFF)
+            return i + __builtin_ctz(~full);
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i ones128 = _mm_set1_epi8((char)0xFF);
+    for (; i + 16 <= to; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)&bits_[i]);
+        uint32_t full = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, ones128));
+        if (full != 0xFFFF)
+            return i + __builtin_ctz(~full & 0xFFFF);
+    }
+#endif
+
+    for (; i + 8 <= to; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, &bits_[i], sizeof(word));
+        if (word != ~(uint64_t)0)
+        {
+            // the lowest addressed byte is the least significant on little endian
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return i + __builtin_ctzll(~word) / 8;
+#else
+            return i + __builtin_clzll(~word) / 8;
+#endif
+        }
+    }
+
+    for (; i < to; i++)
+    {
+        if (bits_[i] != 0xFF)
+            return i;
+    }
+    return to;
+}
+
+/*
+    First unset bit in [from, to) or NOBIT
+*/
+uint32_t ApeBitMap::findunsetbit(uint32_t from, uint32_t to)
+{
+    if (to > size_ * 8)
+        to = size_ * 8;
+    if (from >= to)
+        return NOBIT;
+
+    // the first word may be partially out of the range
+    uint32_t word = from / 64;
+    uint64_t unset = ~loadword(word) & (~(uint64_t)0 >> (from % 64));
+    if (unset == 0)
+    {
+        word = nextnonfullword(word + 1);
+        if (word == NOBIT)
+            return NOBIT;
+        unset = ~loadword(word);
+    }
+
+    // bit 0 is the most significant bit of the word
+    uint32_t bit = word * 64 + __builtin_clzll(unset);
+    return bit < to ? bit : NOBIT;
+}
+
+/*
+    Searches from the rover, where the last search stopped,
+    wrapping around to the start of the bitmap
+*/
 uint32_t ApeBitMap::findunsetbit()
 {
-    for (uint32_t i = 0; i < size_; i++)
+    uint32_t bit = findunsetbit(rover_, size_ * 8);
+    if (bit == NOBIT)
+        bit = findunsetbit(0, rover_);
+    if (bit != NOBIT)
+        rover_ = bit;
+    return bit;
+}
+
+uint32_t ApeBitMap::size() const
+{
+    return size_;
+}
+
+uint32_t ApeBitMap::countunset() const
+{
+    return unsetcount_;
+}
+
+/*
+    The 64 bits of a word, bit 0 as the most significant one.
+    Bytes past the end of the map read as full.
+*/
+uint64_t ApeBitMap::loadword(uint32_t word) const
+{
+    uint32_t start = word * 8;
+    uint64_t value;
+    if (start + 8 <= size_)
+    {
+        memcpy(&value, &bits_[start], sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        value = __builtin_bswap64(value);
+#endif
+        return value;
+    }
+
+    value = 0;
+    for (uint32_t i = start; i < start + 8; i++)
+        value = (value << 8) | (i < size_ ? bits_[i] : 0xFF);
+    return value;
+}
+
+/*
+    First word >= word with an unset bit or NOBIT,
+    full regions are skipped through the summaries
+*/
+uint32_t ApeBitMap::nextnonfullword(uint32_t word) const
+{
+    const uint64_t allones = ~(uint64_t)0;
+    uint32_t n1 = word / 64;
+    if (n1 >= summary1_.size())
+        return NOBIT;
+
+    uint64_t unset1 = ~summary1_[n1] & (allones << (word % 64));
+    if (unset1 == 0)
     {
-        if (bits_[i] != 255)
+        // look for the next summary1 word that isn't full
+        n1 = NOBIT;
+        for (uint32_t next = word / 64 + 1; next < summary1_.size(); next = (next / 64 + 1) * 64)
         {
-            uint8_t byte = bits_[i];
-            uint32_t bit = i * 8;
-            uint8_t mask = 128;
-            while ((byte & mask) != 0)
+            uint64_t unset2 = ~summary2_[next / 64] & (allones << (next % 64));
+            if (unset2 != 0)
             {
-                mask >>= 1;
-                bit++;
+                n1 = (next / 64) * 64 + __builtin_ctzll(unset2);
+                break;
             }
-            return bit;
         }
+        if (n1 == NOBIT)
+            return NOBIT;
+        unset1 = ~summary1_[n1];
     }
-    return NOBIT;
+
+    return n1 * 64 + __builtin_ctzll(unset1);
 }
 
-uint32_t ApeBitMap::size() const
+/*
+    Refreshes the summary bits of a word after it changed
+*/
+void ApeBitMap::summaryupdate(uint32_t word)
 {
-    return size_;
+    uint32_t n1 = word / 64;
+    uint32_t n2 = n1 / 64;
+    uint64_t bit1 = (uint64_t)1 << (word % 64);
+    uint64_t bit2 = (uint64_t)1 << (n1 % 64);
+
+    if (loadword(word) == ~(uint64_t)0)
+        summary1_[n1] |= bit1;
+    else
+        summary1_[n1] &= ~bit1;
+
+    if (summary1_[n1] == ~(uint64_t)0)
+        summary2_[n2] |= bit2;
+    else
+        summary2_[n2] &= ~bit2;
+}
+
+/*
+    Recomputes the summaries and the unset count from the bits
+*/
+void ApeBitMap::summaryrebuild()
+{
+    uint32_t words = (size_ + 7) / 8;
+    uint32_t words1 = (words + 63) / 64;
+    uint32_t words2 = (words1 + 63) / 64;
+
+    // start as all full, then clear the words with unset bits
+    summary1_.assign(words1, ~(uint64_t)0);
+    summary2_.assign(words2, ~(uint64_t)0);
+    unsetcount_ = 0;
+
+    uint32_t bytenum = findnonfullbyte(0, size_);
+    while (bytenum < size_)
+    {
+        uint32_t word = bytenum / 8;
+        uint32_t wordend = std::min(word * 8 + 8, size_);
+        for (uint32_t i = word * 8; i < wordend; i++)
+            unsetcount_ += 8 - __builtin_popcount(bits_[i]);
+        summary1_[word / 64] &= ~((uint64_t)1 << (word % 64));
+        summary2_[word / 64 / 64] &= ~((uint64_t)1 << (word / 64 % 64));
+        bytenum = findnonfullbyte(wordend, size_);
+    }
 }
 
 void ApeBitMap::setall()
 {
     memset(bits_, 0xFF, size_);
+    markalldirty();
+    summaryrebuild();
 }
 
 
 void ApeBitMap::unsetall()
 {
     memset(bits_, 0, size_);
+    markalldirty();
+    summaryrebuild();
+}
+
+/*
+    Changes the dirty tracking granularity, all chunks become clean.
+    A chunksize of 0 tracks the whole bitmap as a single chunk.
+*/
+void ApeBitMap::setchunksize(uint32_t chunksize)
+{
+    chunksize_ = chunksize;
+    uint32_t chunks = 0;
+    if (size_ > 0)
+        chunks = chunksize_ ? (size_ + chunksize_ - 1) / chunksize_ : 1;
+    dirty_.assign(chunks, false);
+    dirtycount_ = 0;
+}
+
+uint32_t ApeBitMap::chunksize() const
+{
+    return chunksize_ ? chunksize_ : size_;
+}
+
+bool ApeBitMap::isdirty() const
+{
+    return dirtycount_ != 0;
+}
+
+uint32_t ApeBitMap::dirtychunks() const
+{
+    return dirtycount_;
+}
+
+/*
+    Returns the first dirty chunk >= chunk or NOBIT
+*/
+uint32_t ApeBitMap::nextdirtychunk(uint32_t chunk) const
+{
+    if (dirtycount_ == 0)
+        return NOBIT;
+    for (; chunk < dirty_.size(); chunk++)
+    {
+        if (dirty_[chunk])
+            return chunk;
+    }
+    return NOBIT;
+}
+
+void ApeBitMap::cleardirty()
+{
+    dirty_.assign(dirty_.size(), false);
+    dirtycount_ = 0;
+}
+
+void ApeBitMap::markdirty(uint32_t bytenum)
+{
+    uint32_t chunk = chunksize_ ? bytenum / chunksize_ : 0;
+    if (!dirty_[chunk])
+    {
+        dirty_[chunk] = true;
+        dirtycount_++;
+    }
+}
+
+void ApeBitMap::markalldirty()
+{
+    dirty_.assign(dirty_.size(), true);
+    dirtycount_ = dirty_.size();
 }
@@ -4,6 +4,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <stdint.h>
+#include <vector>
 
 const uint32_t NOBIT = (-1);
 
@@ -20,11 +21,41 @@ class ApeBitMap
         bool unsetbit(uint32_t bitnum);
         bool getbit(uint32_t bitnum);
         uint32_t findunsetbit();
+        uint32_t findunsetbit(uint32_t from, uint32_t to);
 		void* bits() const;
         uint32_t size() const; // in bytes!
+        uint32_t countunset() const;
+        // dirty tracking, in chunks of chunksize bytes
+        void setchunksize(uint32_t chunksize);
+        uint32_t chunksize() const;
+        bool isdirty() const;
+        uint32_t dirtychunks() const;
+        uint32_t nextdirtychunk(uint32_t chunk) const;
+        void cleardirty();
     private:
+        void markdirty(uint32_t bytenum);
+        void markalldirty();
+        uint32_t findnonfullbyte(uint32_t from, uint32_t to) const;
+        // summary related
+        uint64_t loadword(uint32_t word) const;
+        uint32_t nextnonfullword(uint32_t word) const;
+        void summaryupdate(uint32_t word);
+        void summaryrebuild();
+
         uint8_t* bits_;
         uint32_t size_;
+        uint32_t rover_; // where the next findunsetbit() starts
+        uint32_t unsetcount_;
+        /*
+            Two summary levels, bit i of word n is set when the
+            lower level word n * 64 + i is full (all ones).
+            Missing words at the end count as full.
+        */
+        std::vector<uint64_t> summary1_; // over the 64 bit words of bits_
+        std::vector<uint64_t> summary2_; // over the words of summary1_
+        uint32_t chunksize_;
+        uint32_t dirtycount_;
+        std::vector<bool> dirty_;
 };
 
 #endif // APEBITMAP_H
@@ -0,0 +1,267 @@
+#include "apeblockcache.h"
+
+ApeBlockCache::ApeBlockCache(ApeBlockSource& source, uint32_t blocksize)
+    : source_(source), blocksize_(blocksize), capacity_(0), slots_(NULL), data_(NULL),
+      head_(NOSLOT), tail_(NOSLOT), dirty_(0)
+{
+    resetstats();
+}
+
+ApeBlockCache::~ApeBlockCache()
+{
+    reserve(0);
+}
+
+void ApeBlockCache::reserve(uint32_t capacity)
+{
+    lock_guard<mutex> lock(lock_);
+    delete[] slots_;
+    delete[] data_;
+    slots_ = NULL;
+    data_ = NULL;
+    capacity_ = capacity;
+    index_.clear();
+    head_ = tail_ = NOSLOT;
+    dirty_ = 0;
+
+    if (capacity_ == 0)
+        return;
+
+    slots_ = new Slot[capacity_];
+    data_ = new uint8_t[capacity_ * blocksize_];
+    // chain all the (unused) slots in the lru list
+    for (uint32_t i = 0; i < capacity_; i++)
+    {
+        slots_[i].used = false;
+        slots_[i].dirty = false;
+        slots_[i].prev = NOSLOT;
+        slots_[i].next = NOSLOT;
+        slotpushfront(i);
+    }
+}
+
+uint32_t ApeBlockCache::capacity() const
+{
+    return capacity_;
+}
+
+uint8_t* ApeBlockCache::slotdata(uint32_t slot)
+{
+    return &data_[slot * blocksize_];
+}
+
+void ApeBlockCache::slotunlink(uint32_t slot)
+{
+    Slot& s = slots_[slot];
+    if (s.prev != NOSLOT)
+        slots_[s.prev].next = s.next;
+    else
+        head_ = s.next;
+    if (s.next != NOSLOT)
+        slots_[s.next].prev = s.prev;
+    else
+        tail_ = s.prev;
+    s.prev = s.next = NOSLOT;
+}
+
+void ApeBlockCache::slotpushfront(uint32_t slot)
+{
+    Slot& s = slots_[slot];
+    s.prev = NOSLOT;
+    s.next = head_;
+    if (head_ != NOSLOT)
+        slots_[head_].prev = slot;
+    head_ = slot;
+    if (tail_ == NOSLOT)
+        tail_ = slot;
+}
+
+void ApeBlockCache::slotpushback(uint32_t slot)
+{
+    Slot& s = slots_[slot];
+    s.next = NOSLOT;
+    s.prev = tail_;
+    if (tail_ != NOSLOT)
+        slots_[tail_].next = slot;
+    tail_ = slot;
+    if (head_ == NOSLOT)
+        head_ = slot;
+}
+
+bool ApeBlockCache::slotevict(uint32_t slot)
+{
+    Slot& s = slots_[slot];
+    if (!s.used)
+        return true;
+
+    if (s.dirty)
+    {
+        if (!source_.sourcewrite(s.blocknum, slotdata(slot)))
+            return false;
+        stats_.writebacks++;
+        s.dirty = false;
+        dirty_--;
+    }
+
+    index_.erase(s.blocknum);
+    s.used = false;
+    stats_.evictions++;
+    return true;
+}
+
+/*
+    Returns the slot holding blocknum, making it the most recently used.
+    On a miss the least recently used slot is recycled and,
+    if load is set, filled from the source.
+*/
+uint32_t ApeBlockCache::slotget(uint32_t blocknum, bool load)
+{
+    map<uint32_t, uint32_t>::iterator it = index_.find(blocknum);
+    if (it != index_.end())
+    {
+        stats_.hits++;
+        slotunlink(it->second);
+        slotpushfront(it->second);
+        return it->second;
+    }
+
+    stats_.misses++;
+    uint32_t slot = tail_;
+    if (!slotevict(slot))
+        return NOSLOT;
+
+    if (load && !source_.sourceread(blocknum, slotdata(slot)))
+        return NOSLOT;
+
+    slots_[slot].blocknum = blocknum;
+    slots_[slot].used = true;
+    slots_[slot].dirty = false;
+    index_[blocknum] = slot;
+    slotunlink(slot);
+    slotpushfront(slot);
+    return slot;
+}
+
+bool ApeBlockCache::read(uint32_t blocknum, void* data)
+{
+    if (capacity_ == 0)
+        return source_.sourceread(blocknum, data);
+
+    lock_guard<mutex> lock(lock_);
+    uint32_t slot = slotget(blocknum, true);
+    if (slot == NOSLOT)
+        return false;
+    memcpy(data, slotdata(slot), blocksize_);
+    return true;
+}
+
+bool ApeBlockCache::write(uint32_t blocknum, const void* data)
+{
+    if (capacity_ == 0)
+        return source_.sourcewrite(blocknum, data);
+
+    lock_guard<mutex> lock(lock_);
+    // the whole block is overwritten, no need to load it
+    uint32_t slot = slotget(blocknum, false);
+    if (slot == NOSLOT)
+        return false;
+    memcpy(slotdata(slot), data, blocksize_);
+    if (!slots_[slot].dirty)
+        dirty_++;
+    slots_[slot].dirty = true;
+    return true;
+}
+
+/*
+    Copies blocknum if it's cached, never goes to the source.
+    Blocks that bypass the cache must be checked here first.
+*/
+bool ApeBlockCache::peek(uint32_t blocknum, void* data)
+{
+    if (capacity_ == 0)
+        return false;
+
+    lock_guard<mutex> lock(lock_);
+    map<uint32_t, uint32_t>::iterator it = index_.find(blocknum);
+    if (it == index_.end())
+        return false;
+    stats_.hits++;
+    memcpy(data, slotdata(it->second), blocksize_);
+    return true;
+}
+
+/*
+    For blocks about to be written straight to the source,
+    a cached copy would be stale and a dirty one would overwrite them
+*/
+void ApeBlockCache::drop(uint32_t blocknum)
+{
+    if (capacity_ == 0)
+        return;
+
+    lock_guard<mutex> lock(lock_);
+    map<uint32_t, uint32_t>::iterator it = index_.find(blocknum);
+    if (it == index_.end())
+        return;
+    uint32_t slot = it->second;
+    index_.erase(it);
+    if (slots_[slot].dirty)
+        dirty_--;
+    slots_[slot].used = false;
+    slots_[slot].dirty = false;
+    // reused first
+    slotunlink(slot);
+    slotpushback(slot);
+}
+
+/*
+    Writes back all the dirty blocks, in ascending block order
+*/
+bool ApeBlockCache::flush()
+{
+    lock_guard<mutex> lock(lock_);
+    bool ok = true;
+    for (map<uint32_t, uint32_t>::iterator it = index_.begin(); it != index_.end(); ++it)
+    {
+        Slot& s = slots_[it->second];
+        if (!s.dirty)
+            continue;
+        if (source_.sourcewrite(s.blocknum, slotdata(it->second)))
+        {
+            s.dirty = false;
+            dirty_--;
+            stats_.writebacks++;
+        }
+        else
+        {
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/*
+    Drops all blocks without writing them back
+*/
+void ApeBlockCache::clear()
+{
+    reserve(capacity_);
+}
+
+uint32_t ApeBlockCache::dirtycount()
+{
+    lock_guard<mutex> lock(lock_);
+    return dirty_;
+}
+
+ApeCacheStats ApeBlockCache::stats() const
+{
+    lock_guard<mutex> lock(lock_);
+    return stats_;
+}
+
+void ApeBlockCache::resetstats()
+{
+    lock_guard<mutex> lock(lock_);
+    memset(&stats_, 0, sizeof(stats_));
+}
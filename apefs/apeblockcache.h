@@ -0,0 +1,87 @@
+#ifndef APEBLOCKCACHE_H
+#define APEBLOCKCACHE_H
+
+#include <string.h>
+#include <stdint.h>
+#include <map>
+#include <mutex>
+
+using namespace std;
+
+const uint32_t NOSLOT = (-1);
+
+/*
+    Where the cache loads missing blocks from
+    and writes dirty blocks back to
+*/
+class ApeBlockSource
+{
+public:
+    virtual ~ApeBlockSource() {}
+    virtual bool sourceread(uint32_t blocknum, void* data) = 0;
+    virtual bool sourcewrite(uint32_t blocknum, const void* data) = 0;
+};
+
+/*
+    Cache counters, useful to size the cache for a given image
+*/
+struct ApeCacheStats
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;
+};
+
+/*
+    Fixed capacity write-back LRU block cache.
+    A capacity of 0 disables caching, every call goes to the source.
+    Calls may come from several threads, they're serialized.
+*/
+class ApeBlockCache
+{
+public:
+    ApeBlockCache(ApeBlockSource& source, uint32_t blocksize);
+    ~ApeBlockCache();
+    void reserve(uint32_t capacity); // drops all blocks, flush() first!
+    uint32_t capacity() const;
+    bool read(uint32_t blocknum, void* data);
+    bool write(uint32_t blocknum, const void* data);
+    bool peek(uint32_t blocknum, void* data); // read only if cached
+    void drop(uint32_t blocknum); // forgets the block, dirty or not
+    bool flush();
+    void clear();
+    uint32_t dirtycount(); // blocks flush() would write back
+    ApeCacheStats stats() const; // a copy, taken under the lock
+    void resetstats();
+private:
+    struct Slot
+    {
+        uint32_t blocknum;
+        uint32_t prev; // towards the most recently used
+        uint32_t next; // towards the least recently used
+        bool used;
+        bool dirty;
+    };
+
+    uint32_t slotget(uint32_t blocknum, bool load);
+    bool slotevict(uint32_t slot);
+    void slotunlink(uint32_t slot);
+    void slotpushfront(uint32_t slot);
+    void slotpushback(uint32_t slot);
+    uint8_t* slotdata(uint32_t slot);
+
+    ApeBlockSource& source_;
+    uint32_t blocksize_;
+    uint32_t capacity_;
+    Slot* slots_;
+    uint8_t* data_;
+    uint32_t head_;
+    uint32_t tail_;
+    map<uint32_t, uint32_t> index_; // blocknum -> slot
+    uint32_t dirty_;
+    ApeCacheStats stats_;
+    mutable mutex lock_;
+};
+
+#endif // APEBLOCKCACHE_H
@@ -1,6 +1,7 @@
 #include "apefilesystem.h"
+#include "apelz.h"
 #include <assert.h>
-#include <math.h>
+#include <sstream>
 
 void ApeBlock::fill(uint8_t fillbyte)
 {
@@ -17,64 +18,322 @@ bool ApeInode::isfile() const
     return (flags & APEFLAG_FILE) != 0;
 }
 
-ApeFileSystem::ApeFileSystem()
+bool ApeInode::hasextents() const
+{
+    return (flags & APEFLAG_EXTENTS) != 0;
+}
+
+ApeExtent* ApeInode::extents()
+{
+    return (ApeExtent*)blocks;
+}
+
+bool ApeInode::ishashed() const
+{
+    return (flags & APEFLAG_HASHED) != 0;
+}
+
+bool ApeInode::isinline() const
+{
+    return (flags & APEFLAG_INLINE) != 0;
+}
+
+const ApeExtent* ApeInode::extents() const
+{
+    return (const ApeExtent*)blocks;
+}
+
+uint8_t* ApeInode::inlinedata()
 {
+    return (uint8_t*)blocks;
+}
+
+const uint8_t* ApeInode::inlinedata() const
+{
+    return (const uint8_t*)blocks;
+}
+
+bool ApeInode::ispacked() const
+{
+    return (flags & APEFLAG_PACKED) != 0;
+}
+
+bool ApeInode::iscompressed() const
+{
+    return (flags & APEFLAG_COMPRESSED) != 0;
+}
+
+ApeFragments* ApeInode::fragments()
+{
+    return (ApeFragments*)tail;
+}
+
+const ApeFragments* ApeInode::fragments() const
+{
+    return (const ApeFragments*)tail;
+}
 
+ApeFileSystem::ApeFileSystem()
+    : inodesize_(sizeof(ApeInodeRawV1)), inodetableblocks_(0), storage_(ApeStorage::make(APESTORAGE_STREAM)), syncpolicy_(APESYNC_NONE), blockcache_(*this, BLOCKSIZE),
+      readaheadmax_(READAHEADMAX), tailpacking_(true), dirtyinodes_(0), journalreserved_(0)
+{
+    memset(&readaheadstats_, 0, sizeof(readaheadstats_));
+    memset(&dedupstats_, 0, sizeof(dedupstats_));
+    // bitmaps are persisted one dirty block at a time
+    inodesbitmap_.setchunksize(BLOCKSIZE);
+    blocksbitmap_.setchunksize(BLOCKSIZE);
 }
 
 ApeFileSystem::~ApeFileSystem()
 {
     close();
+    delete storage_;
 }
 
-bool ApeFileSystem::open(const string& fspath)
+bool ApeFileSystem::open(const string& fspath, uint32_t cacheblocks, ApeStorageType storage, ApeSyncPolicy sync)
 {
     close();
-    file_.open(fspath.c_str(), ios::in | ios::out | ios::binary);
-    if (!file_.good())
+    if (!storageopen(fspath, false, storage, sync))
+        return false;
+    syncpolicy_ = sync;
+    blockcache_.reserve(storage_->mapped() ? 0 : cacheblocks);
+    blockcache_.resetstats();
+
+    // read superblock, and verify if it's valid
+    if (!storage_->read(0, &superblock_, sizeof(ApeSuperBlock)) ||
+        strncmp("apefs", superblock_.magic, 5) != 0 || superblock_.version > APEVERSION)
+    {
+        storage_->close();
+        return false;
+    }
+
+    // version 1 has no fields past SUPERBLOCKV1SIZE
+    if (superblock_.version == APEVERSION_1)
+        memset((uint8_t*)&superblock_ + SUPERBLOCKV1SIZE, 0, sizeof(ApeSuperBlock) - SUPERBLOCKV1SIZE);
+
+    // features or codecs we don't know would be misread
+    if ((superblock_.features & ~APEFEATURES) != 0 ||
+        ((superblock_.features & APEFEATURE_COMPRESS) && superblock_.compression != APECOMPRESS_LZ) ||
+        ((superblock_.features & APEFEATURE_HOSTINFO) && !(superblock_.features & APEFEATURE_INLINE)) ||
+        (superblock_.version >= APEVERSION_3 && !(superblock_.features & APEFEATURE_INLINE)) ||
+        ((superblock_.features & APEFEATURE_DEDUP) &&
+         (uint64_t)superblock_.dedupblocks * DEDUPENTRIESPERBLOCK < (uint64_t)superblock_.blockmaps * BLOCKSIZE * 8))
+    {
+        storage_->close();
         return false;
+    }
 
-    // read superblock
-    file_.read((char*)&superblock_, sizeof(ApeSuperBlock));
+    setoffsets();
 
-    // verify if it's valid
-    if (strncmp("apefs", superblock_.magic, 5) != 0)
+    // images written by older code may end at their last used block
+    if (!storage_->grow(imagesize()))
+    {
+        storage_->close();
         return false;
+    }
 
-    // set the offsets
-	inodesbitmapoffset_ = sizeof(ApeSuperBlock);
-	blocksbitmapoffset_ = inodesbitmapoffset_ + superblock_.inodemaps * BLOCKSIZE;
-	inodesoffset_ = blocksbitmapoffset_ + superblock_.blockmaps * BLOCKSIZE;
-	blocksoffset_ = inodesoffset_ + superblock_.inodeblocks * BLOCKSIZE;
+    // committed metadata that may not have made it in place
+    if (superblock_.features & APEFEATURE_JOURNAL)
+    {
+        uint32_t replayed;
+        journal_.attach(storage_, journaloffset_, superblock_.journalblocks, BLOCKSIZE);
+        if (!journal_.replay(replayed))
+        {
+            journal_.detach();
+            storage_->close();
+            return false;
+        }
+    }
 
     // read bitmaps into memory
     int buffersize = max(superblock_.blockmaps, (uint32_t)superblock_.inodemaps) * BLOCKSIZE;
     char *buffer = new char[buffersize];
+    bool ok;
 
-	file_.seekp(inodesbitmapoffset_);
 	buffersize = superblock_.inodemaps * BLOCKSIZE;
-    file_.read(buffer, buffersize);
+    ok = storage_->read(inodesbitmapoffset_, buffer, buffersize);
     inodesbitmap_.frombuffer(buffer, buffersize);
 
-	file_.seekp(blocksbitmapoffset_);
     buffersize = superblock_.blockmaps * BLOCKSIZE;
-    file_.read(buffer, buffersize);
+    ok = storage_->read(blocksbitmapoffset_, buffer, buffersize) && ok;
     blocksbitmap_.frombuffer(buffer, buffersize);
 
     delete[] buffer;
 
-    return file_.good();
+    bitmaplimit(inodesbitmap_, inodetableblocks_ * BLOCKSIZE / inodesize_);
+
+    // the dedup table, its fingerprints are looked up in memory
+    if (superblock_.features & APEFEATURE_DEDUP)
+    {
+        dedupentries_.resize((size_t)superblock_.dedupblocks * DEDUPENTRIESPERBLOCK);
+        ok = storage_->read(dedupoffset_, &dedupentries_[0], (size_t)superblock_.dedupblocks * BLOCKSIZE) && ok;
+        for (blocknum_t num = 0; num < dedupentries_.size(); num++)
+        {
+            if (dedupentries_[num].refs > 0)
+                dedupindex_.insert(make_pair(dedupentries_[num].fingerprint, num));
+        }
+    }
+
+    if (journal_.attached())
+    {
+        vector<uint32_t> pages;
+        vector<blocknum_t> blocks;
+        journal_.replayablepages(pages);
+        for (size_t i = 0; i < pages.size(); i++)
+        {
+            uint64_t offset = (uint64_t)pages[i] * BLOCKSIZE;
+            if (offset >= blocksoffset_ && offset < imagesize())
+                blocks.push_back((offset - blocksoffset_) / BLOCKSIZE);
+        }
+        journalhold(blocks);
+    }
+
+    return ok;
+}
+
+/*
+    Opens the image with the wanted backend, falling back to plain streams.
+    Streams can't sync, a sync policy fails with them rather than going unkept.
+*/
+bool ApeFileSystem::storageopen(const string& fspath, bool truncate, ApeStorageType storage, ApeSyncPolicy sync)
+{
+    delete storage_;
+    storage_ = ApeStorage::make(storage);
+    if (!storage_->open(fspath, truncate) && storage != APESTORAGE_STREAM)
+    {
+        delete storage_;
+        storage_ = ApeStorage::make(APESTORAGE_STREAM);
+        storage_->open(fspath, truncate);
+    }
+    if (storage_->isopen() && sync != APESYNC_NONE && !storage_->durable())
+        storage_->close();
+    return storage_->isopen();
+}
+
+/*
+    With a journal, commits whatever is pending
+*/
+bool ApeFileSystem::flush()
+{
+    if (!storage_->isopen())
+        return false;
+    if (journal_.attached())
+        return journalcommit(true);
+    bool ok = inodeflush();
+    ok = blockcache_.flush() && ok;
+    ok = dedupflush() && ok;
+    {
+        lock_guard<mutex> lock(inodeslock_);
+        ok = bitmapflush(inodesbitmap_, inodesbitmapoffset_) && ok;
+    }
+    {
+        lock_guard<mutex> lock(blockslock_);
+        ok = blocksbitmapflush() && ok;
+    }
+    return storage_->sync() && ok;
 }
 
 bool ApeFileSystem::close()
 {
-    file_.close();
-    return file_.good();
+    // handles still open write back what they buffered and give their
+    // pinned inode back, before the flush and before the cache goes
+    set<ApeFile*> files;
+    {
+        lock_guard<mutex> lock(openfileslock_);
+        files = openfiles_;
+    }
+    for (set<ApeFile*>::iterator it = files.begin(); it != files.end(); ++it)
+        fileclose(**it);
+    reservationreleaseall();
+    if (storage_->isopen())
+        flush();
+    journal_.detach();
+    journalpages_.clear();
+    journalfreed_.clear();
+    dedupentries_.clear();
+    dedupindex_.clear();
+    dedupdirty_.clear();
+    memset(&dedupstats_, 0, sizeof(dedupstats_));
+    fragmentblocks_.clear();
+    for (uint32_t i = 0; i < FRAGMENTSPERBLOCK; i++)
+        fragmentruns_[i].clear();
+    dirtyinodes_ = 0;
+    blockcache_.clear();
+    inodecache_.clear();
+    inodelru_.clear();
+    dentrycache_.clear();
+    dentrylru_.clear();
+    return storage_->close();
+}
+
+ApeCacheStats ApeFileSystem::cachestats() const
+{
+    return blockcache_.stats();
+}
+
+void ApeFileSystem::readahead(uint32_t maxblocks)
+{
+    readaheadmax_ = maxblocks;
+}
+
+uint32_t ApeFileSystem::readahead() const
+{
+    return readaheadmax_;
+}
+
+ApeReadaheadStats ApeFileSystem::readaheadstats() const
+{
+    lock_guard<mutex> lock(readaheadlock_);
+    return readaheadstats_;
+}
+
+void ApeFileSystem::tailpacking(bool enabled)
+{
+    tailpacking_ = enabled;
+}
+
+bool ApeFileSystem::tailpacking() const
+{
+    return tailpacking_;
+}
+
+void ApeBlockMap::invalidate()
+{
+    blockscount = INVALIDBLOCK;
+    indirect = indirectbuf;
+    dindirect = dindirectbuf;
+    dindirecttable = dindirecttablebuf;
+    extentblock = &extentblockbuf;
+    indirectnum = INVALIDBLOCK;
+    dindirectnum = INVALIDBLOCK;
+    dindirecttablenum = INVALIDBLOCK;
+    extent.count = 0;
+    extentblocknum = INVALIDBLOCK;
 }
 
 ApeFile::ApeFile(ApeFileSystem& owner)
-    : position(0), inodenum(INVALIDINODE), owner_(owner)
+    : position(0), inodenum(INVALIDINODE), owner_(owner), inode_(NULL)
 {
+    map_.invalidate();
+    readahead_.maxwindow = owner.readahead();
+    readahead_.window = 0;
+    readahead_.next = 0;
+    readahead_.generation = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        readahead_.buffers[i].start = 0;
+        readahead_.buffers[i].count = 0;
+        readahead_.buffers[i].pending = false;
+    }
+    memset(&readahead_.stats, 0, sizeof(readahead_.stats));
+    // every write is synced anyway
+    writebuffer_.capacity = owner.syncpolicy() == APESYNC_WRITE ? 0 : WRITEBUFFERSIZE;
+    writebuffer_.start = 0;
+    cluster_.index = 0;
+    cluster_.generation = 0;
+    cluster_.size = 0;
+    maxsize_ = 0;
+    written_ = false;
 }
 
 bool ApeFile::open(const string& filepath, ApeFileMode mode)
@@ -89,8 +348,7 @@ bool ApeFile::good() const
 
 void ApeFile::close()
 {
-    inodenum = INVALIDINODE;
-    position = 0;
+    owner_.fileclose(*this);
 }
 
 uint32_t ApeFile::read(void* buffer, uint32_t size)
@@ -98,17 +356,74 @@ uint32_t ApeFile::read(void* buffer, uint32_t size)
     return owner_.fileread(*this, buffer, size);
 }
 
-bool ApeFile::seek(ApeFileSeekMode seekmode, int32_t offset)
+bool ApeFile::seek(ApeFileSeekMode seekmode, int64_t offset)
 {
     return owner_.fileseek(*this, seekmode, offset);
 }
 
-uint32_t ApeFile::size() const
+uint64_t ApeFile::size() const
 {
     return owner_.filesize(*this);
 }
 
-uint32_t ApeFile::tell() const
+bool ApeFile::submitread(void* buffer, uint32_t size, ApeFileRequest& request)
+{
+    return owner_.filesubmitread(*this, buffer, size, request);
+}
+
+bool ApeFile::submitwrite(const void* buffer, uint32_t size, ApeFileRequest& request)
+{
+    return owner_.filesubmitwrite(*this, buffer, size, request);
+}
+
+uint32_t ApeFile::complete(ApeFileRequest& request)
+{
+    return owner_.filecomplete(*this, request);
+}
+
+bool ApeFile::flush()
+{
+    return owner_.fileflush(*this);
+}
+
+bool ApeFile::sync()
+{
+    return owner_.filesync(*this);
+}
+
+void ApeFile::writebuffer(uint32_t bytes)
+{
+    owner_.fileflush(*this);
+    writebuffer_.capacity = bytes;
+}
+
+void ApeFile::readahead(uint32_t maxblocks)
+{
+    readahead_.maxwindow = maxblocks;
+    readahead_.window = min(readahead_.window, maxblocks);
+}
+
+const ApeReadaheadStats& ApeFile::readaheadstats() const
+{
+    return readahead_.stats;
+}
+
+bool ApeFile::extents(vector<ApeExtent>& extents, ApeFragments& tail)
+{
+    return owner_.fileextents(*this, extents, tail);
+}
+
+bool ApeFile::hostinfo(ApeHostInfo& info)
+{
+    return owner_.filehostinfo(*this, info);
+}
+
+bool ApeFile::sethostinfo(const ApeHostInfo& info)
+{
+    return owner_.filesethostinfo(*this, info);
+}
+
+uint64_t ApeFile::tell() const
 {
     return position;
 }
@@ -125,20 +440,21 @@ ApeFile::~ApeFile()
 
 bool ApeFileSystem::blockalloc(ApeBlock& block)
 {
+    lock_guard<mutex> lock(blockslock_);
     uint32_t freebit = blocksbitmap_.findunsetbit();
     if (freebit == NOBIT)
         return false;
 
     blocksbitmap_.setbit(freebit);
     block.num = freebit;
-
-	file_.seekg(blocksbitmapoffset_);
-	file_.write((char*)blocksbitmap_.bits(), blocksbitmap_.size());
-    return file_.good();
+    return true;
 }
 
-bool ApeFileSystem::blockalloc(ApeInode& inode, ApeBlock& block)
+bool ApeFileSystem::blockalloc(ApeInode& inode, ApeBlock& block, uint32_t upcoming)
 {
+    if (inode.hasextents())
+        return extentappend(inode, block, upcoming);
+
     // TODO: free in case of a failure
     if (!blockalloc(block))
         return false;
@@ -247,133 +563,745 @@ bool ApeFileSystem::blockalloc(ApeInode& inode, ApeBlock& block)
 
 bool ApeFileSystem::blockfree(blocknum_t blocknum)
 {
-    if (!blocksbitmap_.unsetbit(blocknum))
-		return false;
-
-	file_.seekg(blocksbitmapoffset_);
-	file_.write((char*)blocksbitmap_.bits(), blocksbitmap_.size());
-	return file_.good();
+    // shared blocks stay until their last file lets go of them
+    if (!deduprelease(blocknum))
+        return true;
+    lock_guard<mutex> lock(blockslock_);
+    // data written to it in place must not land in a block the image still uses
+    if (journal_.attached())
+    {
+        journalfreed_.push_back(blocknum);
+        return true;
+    }
+    return blocksbitmap_.unsetbit(blocknum);
 }
 
-bool ApeFileSystem::blockread(blocknum_t blocknum, ApeBlock& block)
+/*
+    Gets the next block for a growing file, from its reservation if there
+    is one left, otherwise a new reservation is made right after the last
+    block of the file. The reservation grows with the file, or covers
+    the upcoming blocks the caller already knows it will append.
+*/
+bool ApeFileSystem::extentreserve(ApeInode& inode, blocknum_t& blocknum, uint32_t upcoming)
 {
-    file_.seekp(blocksoffset_ + blocknum * BLOCKSIZE);
-    block.num = blocknum;
-    file_.read((char*)&block.data, BLOCKSIZE);
-    return file_.good();
-}
+    {
+        lock_guard<mutex> lock(blockslock_);
+        map<inodenum_t, ApeReservation>::iterator it = reservations_.find(inode.num);
+        if (it != reservations_.end() && it->second.count > 0)
+        {
+            blocknum = it->second.start++;
+            it->second.count--;
+            return true;
+        }
+    }
 
-bool ApeFileSystem::blockread(const ApeInode& inode, uint32_t blockpos, ApeBlock& block)
-{
-    if (blockpos >= inode.blockscount)
-        return false;
-    if (blockpos < 8)
-        return blockread(inode.blocks[blockpos], block);
+    blocknum_t goal = INVALIDBLOCK;
+    uint32_t run;
+    if (inode.blockscount > 0 && blockmap(inode, inode.blockscount - 1, goal, run))
+        goal++;
 
-    uint32_t rpos = blockpos - 8;
-    ApeBlock iblock;
+    // directories grow slowly, don't hold blocks for them
+    uint32_t count = 1;
+    if (inode.isfile())
+        count = min(max((uint32_t)inode.blockscount, MINRESERVATION), MAXRESERVATION);
+    count = max(count, min(upcoming + 1, MAXALLOCRUN));
 
-    if (rpos < 1024)
-    {
-        if (!blockread(inode.blocks[8], iblock))
-            return false;
-        return blockread(((blocknum_t*)iblock.data)[rpos], block);
-    }
-    else if (rpos < 1024 * 1024)
+    uint32_t allocated;
+    if (!blockallocrun(goal, count, blocknum, allocated))
+        return false;
+
+    if (allocated > 1)
     {
-        ApeBlock diblock;
-        if (!blockread(inode.blocks[9], diblock))
-            return false;
-        if (!blockread(((blocknum_t*)diblock.data)[rpos / 1024], iblock))
-            return false;
-        return blockread(((blocknum_t*)iblock.data)[rpos % 1024], block);
+        lock_guard<mutex> lock(blockslock_);
+        ApeReservation& reservation = reservations_[inode.num];
+        reservation.start = blocknum + 1;
+        reservation.count = allocated - 1;
     }
-
-    return false;
+    return true;
 }
 
-bool ApeFileSystem::blockwrite(ApeBlock& block)
+void ApeFileSystem::reservationrelease(inodenum_t inodenum)
 {
-    file_.seekp(blocksoffset_ + block.num * BLOCKSIZE);
-    file_.write((char*)&block.data, BLOCKSIZE);
-    return file_.good();
+    lock_guard<mutex> lock(blockslock_);
+    map<inodenum_t, ApeReservation>::iterator it = reservations_.find(inodenum);
+    if (it == reservations_.end())
+        return;
+    for (uint32_t i = 0; i < it->second.count; i++)
+        blocksbitmap_.unsetbit(it->second.start + i);
+    reservations_.erase(it);
 }
 
-bool ApeFileSystem::directorydelete(const string& path)
+void ApeFileSystem::reservationreleaseall()
 {
-    ApeInode inode;
-    if (directoryopen(path, inode) && inode.size == 0)
+    lock_guard<mutex> lock(blockslock_);
+    map<inodenum_t, ApeReservation>::iterator it;
+    for (it = reservations_.begin(); it != reservations_.end(); ++it)
     {
-        ApeInode parent;
-        if (!directoryopen(extractdirectory(path), parent))
-            return false;
-
-        return directoryremoveentry(parent, extractfilename(path));
+        for (uint32_t i = 0; i < it->second.count; i++)
+            blocksbitmap_.unsetbit(it->second.start + i);
     }
-    return false;
+    reservations_.clear();
 }
 
-bool ApeFileSystem::directoryenum(const string& path, vector<ApeDirectoryEntry>& entries)
+/*
+    Appends a new block to an extent mapped inode
+*/
+bool ApeFileSystem::extentappend(ApeInode& inode, ApeBlock& block, uint32_t upcoming)
 {
-    ApeInode inode;
-    if (!directoryopen(path, inode))
+    uint32_t count = inode.blockscount;
+    if (!extentreserve(inode, block.num, upcoming))
         return false;
+    if (extentadd(inode, block.num))
+        return true;
+    // it didn't get mapped, nothing refers to it
+    if (inode.blockscount == count)
+        blockfree(block.num);
+    return false;
+}
 
-    ApeBlock block;
+/*
+    Maps blocknum as the next block of an extent mapped inode,
+    extending the last extent when blocknum follows it on disk
+*/
+bool ApeFileSystem::extentadd(ApeInode& inode, blocknum_t blocknum)
+{
+    ApeExtent* extents = inode.extents();
+    uint32_t inlinecount = 0;
+    while (inlinecount < INODEEXTENTS && extents[inlinecount].count != 0)
+        inlinecount++;
 
-    int n = -1;
-    while (blockread(inode, ++n, block))
+    if (inode.blocks[EXTENTCHAIN] == INVALIDBLOCK)
     {
-        unsigned int i = 0;
-
+        ApeExtent* last = inlinecount > 0 ? &extents[inlinecount - 1] : NULL;
+        if (last && last->start + last->count == blocknum)
+        {
+            last->count++;
+        }
+        else if (inlinecount < INODEEXTENTS)
+        {
+            extents[inlinecount].start = blocknum;
+            extents[inlinecount].count = 1;
+        }
+        else
+        {
+            // first extent block
+            ApeBlock eblock;
+            if (!blockalloc(eblock))
+                return false;
+            eblock.fill(0);
+            ApeExtentBlock* extentblock = (ApeExtentBlock*)eblock.data;
+            extentblock->next = INVALIDBLOCK;
+            extentblock->count = 1;
+            extentblock->extents[0].start = blocknum;
+            extentblock->extents[0].count = 1;
+            if (!blockwrite(eblock))
+            {
+                blockfree(eblock.num);
+                return false;
+            }
+            inode.blocks[EXTENTCHAIN] = eblock.num;
+        }
+    }
+    else
+    {
+        // find the last extent block
+        ApeBlock eblock;
+        ApeBlock neweblock;
+        ApeExtentBlock* extentblock = (ApeExtentBlock*)eblock.data;
+        blocknum_t next = inode.blocks[EXTENTCHAIN];
         do
         {
-            ApeDirectoryEntryRaw* ientry = (ApeDirectoryEntryRaw*)&block.data[i];
-            if (ientry->entrysize == 0)
-                break;
-
-            ApeDirectoryEntry entry;
-            entry.read(ientry);
+            if (!blockread(next, eblock))
+                return false;
+            next = extentblock->next;
+        }
+        while (next != INVALIDBLOCK);
 
-            entries.push_back(entry);
+        ApeExtent& last = extentblock->extents[extentblock->count - 1];
+        if (last.start + last.count == blocknum)
+        {
+            last.count++;
+        }
+        else if (extentblock->count < EXTENTSPERBLOCK)
+        {
+            extentblock->extents[extentblock->count].start = blocknum;
+            extentblock->extents[extentblock->count].count = 1;
+            extentblock->count++;
+        }
+        else
+        {
+            // chain a new extent block
+            if (!blockalloc(neweblock))
+                return false;
+            neweblock.fill(0);
+            ApeExtentBlock* newextentblock = (ApeExtentBlock*)neweblock.data;
+            newextentblock->next = INVALIDBLOCK;
+            newextentblock->count = 1;
+            newextentblock->extents[0].start = blocknum;
+            newextentblock->extents[0].count = 1;
+            if (!blockwrite(neweblock))
+            {
+                blockfree(neweblock.num);
+                return false;
+            }
+            extentblock->next = neweblock.num;
+        }
 
-            i += ientry->entrysize;
+        if (!blockwrite(eblock))
+        {
+            // the chain on the image doesn't reach the new block
+            if (extentblock->next != INVALIDBLOCK)
+                blockfree(neweblock.num);
+            return false;
         }
-        while (i < BLOCKSIZE);
     }
 
-    return false;
+    inode.blockscount++;
+    return inodewrite(inode);
 }
 
-bool ApeFileSystem::directoryexists(const string& path)
+/*
+    Takes the last block out of an extent mapped inode, the block
+    itself is left to the caller. An extent block left empty is freed.
+*/
+bool ApeFileSystem::extentdroplast(ApeInode& inode, blocknum_t& blocknum)
 {
-    ApeInode inode;
-    return directoryopen(path, inode);
+    vector<blocknum_t> blocks;
+    if (!extenttruncate(inode, 1, blocks) || blocks.empty())
+        return false;
+    blocknum = blocks[0];
+    return true;
 }
 
-bool ApeFileSystem::directorycreate(const string& path)
+/*
+    Takes up to count blocks off the end of an extent mapped inode, from the
+    last extent block only, or the inode when it has none. The blocks are
+    added to blocks last first and left to the caller. An extent block
+    left empty is freed.
+*/
+bool ApeFileSystem::extenttruncate(ApeInode& inode, uint32_t count, vector<blocknum_t>& blocks)
 {
-    ApeInode parent;
-
-    if (!directoryopen(extractdirectory(path), parent))
+    if (!inode.hasextents() || inode.blockscount == 0)
         return false;
 
-    ApeDirectoryEntry entry;
-    ApeInode inode;
+    uint32_t dropped = 0;
+    if (inode.blocks[EXTENTCHAIN] == INVALIDBLOCK)
+    {
+        ApeExtent* extents = inode.extents();
+        uint32_t inlinecount = 0;
+        while (inlinecount < INODEEXTENTS && extents[inlinecount].count != 0)
+            inlinecount++;
+        if (inlinecount == 0)
+            return false;
 
-    // TODO: free in case of a failure
-    if (!inodealloc(inode))
-        return false;
-    inode.flags = APEFLAG_DIRECTORY;
-    if (!inodewrite(inode))
-        return false;
+        while (inlinecount > 0 && dropped < count)
+        {
+            ApeExtent& last = extents[inlinecount - 1];
+            for (; last.count > 0 && dropped < count; dropped++)
+                blocks.push_back(last.start + --last.count);
+            if (last.count == 0)
+            {
+                last.start = 0;
+                inlinecount--;
+            }
+        }
+    }
+    else
+    {
+        // find the last extent block, and the one chaining it
+        ApeBlock eblock;
+        ApeBlock previous;
+        ApeExtentBlock* extentblock = (ApeExtentBlock*)eblock.data;
+        previous.num = INVALIDBLOCK;
+        blocknum_t next = inode.blocks[EXTENTCHAIN];
+        while (true)
+        {
+            if (!blockread(next, eblock))
+                return false;
+            if (extentblock->next == INVALIDBLOCK)
+                break;
+            previous = eblock;
+            next = extentblock->next;
+        }
+        if (extentblock->count == 0)
+            return false;
 
-    entry.inodenum = inode.num;
-    entry.flags = APEFLAG_DIRECTORY;
-    entry.entrysize = 0;
-    entry.name = extractfilename(path);
-    if (entry.name == "")
-        return false;
+        while (extentblock->count > 0 && dropped < count)
+        {
+            ApeExtent& last = extentblock->extents[extentblock->count - 1];
+            for (; last.count > 0 && dropped < count; dropped++)
+                blocks.push_back(last.start + --last.count);
+            if (last.count == 0)
+                extentblock->count--;
+        }
+
+        if (extentblock->count > 0)
+        {
+            if (!blockwrite(eblock))
+                return false;
+        }
+        else
+        {
+            if (previous.num == INVALIDBLOCK)
+                inode.blocks[EXTENTCHAIN] = INVALIDBLOCK;
+            else
+            {
+                ((ApeExtentBlock*)previous.data)->next = INVALIDBLOCK;
+                if (!blockwrite(previous))
+                    return false;
+            }
+            if (!blockfree(eblock.num))
+                return false;
+        }
+    }
+
+    inode.blockscount -= dropped;
+    return inodewrite(inode);
+}
+
+/*
+    Replaces the extents of an inode with extents mapping as many blocks.
+    Its extent blocks are reused, more are allocated as needed
+    and those left over freed.
+*/
+bool ApeFileSystem::extentrewrite(ApeInode& inode, const vector<ApeExtent>& extents)
+{
+    ApeBlock block;
+    ApeExtentBlock* extentblock = (ApeExtentBlock*)block.data;
+    vector<blocknum_t> chain;
+    for (blocknum_t next = inode.blocks[EXTENTCHAIN]; next != INVALIDBLOCK; next = extentblock->next)
+    {
+        if (!blockread(next, block))
+            return false;
+        chain.push_back(next);
+    }
+
+    uint32_t inlinecount = min((uint32_t)extents.size(), INODEEXTENTS);
+    uint32_t chained = (extents.size() - inlinecount + EXTENTSPERBLOCK - 1) / EXTENTSPERBLOCK;
+    while (chain.size() < chained)
+    {
+        if (!blockalloc(block))
+            return false;
+        chain.push_back(block.num);
+    }
+
+    memset(inode.extents(), 0, INODEEXTENTS * sizeof(ApeExtent));
+    copy(extents.begin(), extents.begin() + inlinecount, inode.extents());
+    for (uint32_t i = 0; i < chained; i++)
+    {
+        uint32_t first = inlinecount + i * EXTENTSPERBLOCK;
+        block.fill(0);
+        block.num = chain[i];
+        extentblock->next = i + 1 < chained ? chain[i + 1] : INVALIDBLOCK;
+        extentblock->count = min((uint32_t)extents.size() - first, EXTENTSPERBLOCK);
+        copy(extents.begin() + first, extents.begin() + first + extentblock->count, extentblock->extents);
+        if (!blockwrite(block))
+            return false;
+    }
+    inode.blocks[EXTENTCHAIN] = chained > 0 ? chain[0] : INVALIDBLOCK;
+
+    for (size_t i = chained; i < chain.size(); i++)
+    {
+        if (!blockfree(chain[i]))
+            return false;
+    }
+    return inodewrite(inode);
+}
+
+/*
+    Appends count blocks from start on to a list of extents,
+    merged into the last one when they follow it
+*/
+void ApeFileSystem::extentpush(vector<ApeExtent>& extents, blocknum_t start, uint32_t count)
+{
+    if (!extents.empty() && extents.back().start + extents.back().count == start)
+    {
+        extents.back().count += count;
+        return;
+    }
+    ApeExtent extent = {start, count};
+    extents.push_back(extent);
+}
+
+bool ApeFileSystem::blockread(blocknum_t blocknum, ApeBlock& block)
+{
+    block.num = blocknum;
+    return blockcache_.read(blocknum, block.data);
+}
+
+bool ApeFileSystem::blockread(const ApeInode& inode, uint32_t blockpos, ApeBlock& block)
+{
+    blocknum_t blocknum;
+    uint32_t run;
+    if (!blockmap(inode, blockpos, blocknum, run))
+        return false;
+    return blockread(blocknum, block);
+}
+
+/*
+    Returns the contents of a block for reading, straight from the image
+    when the storage is mapped, otherwise read into buffer (BLOCKSIZE bytes)
+*/
+const uint8_t* ApeFileSystem::blockpeek(blocknum_t blocknum, void* buffer)
+{
+    uint64_t offset = blocksoffset_ + (uint64_t)blocknum * BLOCKSIZE;
+    const uint8_t* data = storage_->data(offset, BLOCKSIZE);
+    if (data != NULL)
+        return journalpeek(offset, buffer) ? (const uint8_t*)buffer : data;
+    if (!blockcache_.read(blocknum, buffer))
+        return NULL;
+    return (const uint8_t*)buffer;
+}
+
+const uint8_t* ApeFileSystem::blockpeek(const ApeInode& inode, uint32_t blockpos, void* buffer)
+{
+    blocknum_t blocknum;
+    uint32_t run;
+    if (!blockmap(inode, blockpos, blocknum, run))
+        return NULL;
+    return blockpeek(blocknum, buffer);
+}
+
+/*
+    Translates a block position inside the file to a block number.
+    run receives how many blocks, starting at blocknum, are contiguous
+    on both the file and the disk.
+*/
+bool ApeFileSystem::blockmap(const ApeInode& inode, uint32_t blockpos, blocknum_t& blocknum, uint32_t& run)
+{
+    ApeBlockMap map;
+    map.invalidate();
+    return blockmap(inode, map, blockpos, blocknum, run);
+}
+
+/*
+    Same as above, but tables and extents are looked up in map first
+    and whatever had to be read is left there for the next call
+*/
+bool ApeFileSystem::blockmap(const ApeInode& inode, ApeBlockMap& map, uint32_t blockpos, blocknum_t& blocknum, uint32_t& run)
+{
+    if (blockpos >= inode.blockscount)
+        return false;
+
+    // the file grew (maybe through another handle), cached tables may lack the new blocks
+    if (map.blockscount != inode.blockscount)
+    {
+        map.invalidate();
+        map.blockscount = inode.blockscount;
+    }
+
+    if (inode.hasextents())
+    {
+        ApeExtent& extent = map.extent;
+        if (extent.count == 0 || blockpos < map.extentpos || blockpos >= map.extentpos + extent.count)
+        {
+            // first in the inode, then in the extent blocks
+            const ApeExtent* extents = inode.extents();
+            uint32_t extentpos = 0;
+            uint32_t i;
+            extent.count = 0;
+            for (i = 0; i < INODEEXTENTS && extents[i].count != 0; i++)
+            {
+                if (blockpos < extentpos + extents[i].count)
+                {
+                    extent = extents[i];
+                    map.extentpos = extentpos;
+                    break;
+                }
+                extentpos += extents[i].count;
+            }
+
+            // resume from the cached extent block when possible
+            const ApeExtentBlock*& extentblock = map.extentblock;
+            blocknum_t next = inode.blocks[EXTENTCHAIN];
+            if (map.extentblocknum != INVALIDBLOCK && blockpos >= map.extentblockpos)
+            {
+                next = map.extentblocknum;
+                extentpos = map.extentblockpos;
+            }
+
+            while (extent.count == 0 && next != INVALIDBLOCK)
+            {
+                if (next != map.extentblocknum)
+                {
+                    map.extentblocknum = INVALIDBLOCK;
+                    extentblock = (const ApeExtentBlock*)blockpeek(next, &map.extentblockbuf);
+                    if (extentblock == NULL)
+                        return false;
+                    map.extentblocknum = next;
+                    map.extentblockpos = extentpos;
+                }
+                for (i = 0; i < extentblock->count; i++)
+                {
+                    if (blockpos < extentpos + extentblock->extents[i].count)
+                    {
+                        extent = extentblock->extents[i];
+                        map.extentpos = extentpos;
+                        break;
+                    }
+                    extentpos += extentblock->extents[i].count;
+                }
+                next = extentblock->next;
+            }
+
+            if (extent.count == 0)
+                return false;
+        }
+
+        blocknum = extent.start + (blockpos - map.extentpos);
+        run = extent.count - (blockpos - map.extentpos);
+        return true;
+    }
+
+    run = 1;
+    if (blockpos < 8)
+    {
+        blocknum = inode.blocks[blockpos];
+        while (blockpos + run < 8 && blockpos + run < inode.blockscount && inode.blocks[blockpos + run] == blocknum + run)
+            run++;
+        return true;
+    }
+
+    uint32_t rpos = blockpos - 8;
+    const blocknum_t* table;
+
+    if (rpos < BLOCKSPERTABLE)
+    {
+        if (!blockmaptable(inode.blocks[8], map.indirectnum, map.indirect, map.indirectbuf))
+            return false;
+        table = map.indirect;
+    }
+    else if (rpos < BLOCKSPERTABLE * BLOCKSPERTABLE)
+    {
+        if (!blockmaptable(inode.blocks[9], map.dindirectnum, map.dindirect, map.dindirectbuf))
+            return false;
+        if (!blockmaptable(map.dindirect[rpos / BLOCKSPERTABLE], map.dindirecttablenum, map.dindirecttable, map.dindirecttablebuf))
+            return false;
+        table = map.dindirecttable;
+    }
+    else
+    {
+        return false;
+    }
+
+    // contiguous entries of the same table
+    uint32_t index = rpos % BLOCKSPERTABLE;
+    blocknum = table[index];
+    while (index + run < BLOCKSPERTABLE && blockpos + run < inode.blockscount && table[index + run] == blocknum + run)
+        run++;
+    return true;
+}
+
+/*
+    Makes sure table points at the contents of block tablenum
+*/
+bool ApeFileSystem::blockmaptable(blocknum_t tablenum, blocknum_t& cachednum, const blocknum_t*& table, blocknum_t* buffer)
+{
+    if (cachednum == tablenum)
+        return true;
+    cachednum = INVALIDBLOCK;
+    table = (const blocknum_t*)blockpeek(tablenum, buffer);
+    if (table == NULL)
+        return false;
+    cachednum = tablenum;
+    return true;
+}
+
+/*
+    Allocates up to count free blocks in a row, as close after goal as possible.
+    A run starting right at goal is taken whatever its size,
+    otherwise a few runs are probed for one that is long enough.
+*/
+bool ApeFileSystem::blockallocrun(blocknum_t goal, uint32_t count, blocknum_t& start, uint32_t& allocated)
+{
+    const uint32_t maxprobes = 32;
+    lock_guard<mutex> lock(blockslock_);
+    uint32_t totalblocks = blocksbitmap_.size() * 8;
+
+    blocknum_t pos;
+    if (goal == INVALIDBLOCK || goal >= totalblocks)
+    {
+        // without a goal the rover is just where probing starts
+        pos = blocksbitmap_.findunsetbit();
+        goal = INVALIDBLOCK;
+    }
+    else
+    {
+        pos = blocksbitmap_.findunsetbit(goal, totalblocks);
+        if (pos == NOBIT)
+            pos = blocksbitmap_.findunsetbit(0, goal);
+    }
+    if (pos == NOBIT)
+        return false;
+
+    start = INVALIDBLOCK;
+    allocated = 0;
+    for (uint32_t probe = 0; probe < maxprobes && pos != NOBIT; probe++)
+    {
+        uint32_t length = 1;
+        while (length < count && pos + length < totalblocks && !blocksbitmap_.getbit(pos + length))
+            length++;
+
+        if (length > allocated)
+        {
+            start = pos;
+            allocated = length;
+        }
+        if (allocated == count || pos == goal)
+            break;
+
+        pos = blocksbitmap_.findunsetbit(pos + length, totalblocks);
+    }
+
+    for (uint32_t i = 0; i < allocated; i++)
+        blocksbitmap_.setbit(start + i);
+    return true;
+}
+
+/*
+    Allocates count free blocks in a row, the first run long enough
+    from goal on, wrapping around to the start of the image.
+    Fails only when no run anywhere is long enough.
+*/
+bool ApeFileSystem::blockallocwhole(blocknum_t goal, uint32_t count, blocknum_t& start)
+{
+    lock_guard<mutex> lock(blockslock_);
+    uint32_t totalblocks = blocksbitmap_.size() * 8;
+    if (goal == INVALIDBLOCK || goal >= totalblocks)
+        goal = 0;
+
+    // from goal to the end, then from the start to goal
+    for (uint32_t pass = 0; pass < 2; pass++)
+    {
+        blocknum_t from = pass == 0 ? goal : 0;
+        blocknum_t to = pass == 0 ? totalblocks : goal;
+        blocknum_t pos = blocksbitmap_.findunsetbit(from, to);
+        while (pos != NOBIT)
+        {
+            uint32_t length = 1;
+            while (length < count && pos + length < totalblocks && !blocksbitmap_.getbit(pos + length))
+                length++;
+            if (length == count)
+            {
+                for (uint32_t i = 0; i < count; i++)
+                    blocksbitmap_.setbit(pos + i);
+                start = pos;
+                return true;
+            }
+            pos = blocksbitmap_.findunsetbit(pos + length, to);
+        }
+    }
+    return false;
+}
+
+bool ApeFileSystem::blockwrite(ApeBlock& block)
+{
+    return blockcache_.write(block.num, block.data);
+}
+
+/*
+    With a journal, data goes straight to the image, the block cache
+    would otherwise write it back as metadata
+*/
+bool ApeFileSystem::blockwritedata(blocknum_t blocknum, const void* data, uint32_t count)
+{
+    if (!journal_.attached())
+    {
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (!blockcache_.write(blocknum + i, (const uint8_t*)data + (size_t)i * BLOCKSIZE))
+                return false;
+        }
+        return true;
+    }
+    for (uint32_t i = 0; i < count; i++)
+        blockcache_.drop(blocknum + i);
+    return storage_->write(blocksoffset_ + (uint64_t)blocknum * BLOCKSIZE, data, (size_t)count * BLOCKSIZE);
+}
+
+bool ApeFileSystem::sourceread(uint32_t blocknum, void* data)
+{
+    return metaread(blocksoffset_ + (uint64_t)blocknum * BLOCKSIZE, data, BLOCKSIZE);
+}
+
+bool ApeFileSystem::sourcewrite(uint32_t blocknum, const void* data)
+{
+    return metawrite(blocksoffset_ + (uint64_t)blocknum * BLOCKSIZE, data, BLOCKSIZE);
+}
+
+bool ApeFileSystem::directorydelete(const string& path)
+{
+    ApeJournalHandle transaction(*this);
+    unique_lock<ApeRwLock> lock(namespacelock_);
+    ApeInode inode;
+    if (directoryopen(path, inode) && inode.size == 0)
+    {
+        ApeInode parent;
+        if (!directoryopen(extractdirectory(path), parent))
+            return false;
+
+        if (!directoryremoveentry(parent, extractfilename(path)))
+            return false;
+        return inodefreeblocks(inode) && inodefree(inode.num);
+    }
+    return false;
+}
+
+bool ApeFileSystem::directoryenum(const string& path, vector<ApeDirectoryEntry>& entries)
+{
+    shared_lock<ApeRwLock> lock(namespacelock_);
+    ApeInode inode;
+    return directoryopen(path, inode) && directoryentries(inode, entries);
+}
+
+/*
+    Appends the entries of a directory
+*/
+bool ApeFileSystem::directoryentries(const ApeInode& inode, vector<ApeDirectoryEntry>& entries)
+{
+    ApeBlock block;
+    const uint8_t* data;
+
+    // hashed directories have their index first
+    int n = inode.ishashed() ? (int)DIRINDEXBLOCKS - 1 : -1;
+    while ((data = blockpeek(inode, ++n, block.data)) != NULL)
+        directoryblockentries(data, entries);
+
+    return true;
+}
+
+bool ApeFileSystem::directoryexists(const string& path)
+{
+    shared_lock<ApeRwLock> lock(namespacelock_);
+    ApeInode inode;
+    return directoryopen(path, inode);
+}
+
+bool ApeFileSystem::directorycreate(const string& path)
+{
+    ApeJournalHandle transaction(*this);
+    unique_lock<ApeRwLock> lock(namespacelock_);
+    ApeInode parent;
+
+    if (!directoryopen(extractdirectory(path), parent))
+        return false;
+
+    ApeDirectoryEntry entry;
+    ApeInode inode;
+
+    // TODO: free in case of a failure
+    if (!inodealloc(inode))
+        return false;
+    inode.flags |= APEFLAG_DIRECTORY;
+    if (!inodewrite(inode))
+        return false;
+
+    entry.inodenum = inode.num;
+    entry.flags = APEFLAG_DIRECTORY;
+    entry.entrysize = 0;
+    entry.name = extractfilename(path);
+    if (entry.name == "")
+        return false;
 
     return directoryaddentry(parent, entry);
 }
@@ -385,46 +1313,115 @@ bool ApeFileSystem::directoryopen(const string& path, ApeInode& inode)
 
 bool ApeFileSystem::filedelete(const string& filepath)
 {
-    ApeInode inode;
-    if (inodeopen(filepath, inode) && inode.isfile())
+    // a file grown again since it was trimmed gets trimmed again
+    while (true)
     {
+        if (!filetrim(filepath))
+            return false;
+
+        ApeJournalHandle transaction(*this, true, journalbatch());
+        unique_lock<ApeRwLock> lock(namespacelock_);
+        ApeInode inode;
+        if (!inodeopen(filepath, inode) || !inode.isfile())
+            return false;
+        if (inodetrimmable(inode, journalbatch()))
+            continue;
+
         ApeInode parent;
         if (!directoryopen(extractdirectory(filepath), parent))
             return false;
 
-        return directoryremoveentry(parent, extractfilename(filepath));
+        if (!directoryremoveentry(parent, extractfilename(filepath)))
+            return false;
+        reservationrelease(inode.num);
+
+        // handles still open on the file may be using it, free through the cached inode
+        ApeCachedInode* cached = inodepin(inode.num);
+        if (cached == NULL)
+            return false;
+        bool ok;
+        {
+            unique_lock<ApeRwLock> inodelock(cached->lock);
+            ok = inodefreeblocks(cached->inode);
+        }
+        ok = inodeunpin(inode.num, false) && ok;
+        return ok && inodefree(inode.num);
+    }
+}
+
+/*
+    Before a big file is deleted, gives back its blocks from the end
+    a batch per transaction, until filedelete can free the rest in one.
+    See journalbatch.
+*/
+bool ApeFileSystem::filetrim(const string& filepath)
+{
+    if (!journal_.attached())
+        return true;
+
+    uint32_t batch = journalbatch();
+    while (true)
+    {
+        ApeJournalHandle transaction(*this, true, batch);
+        shared_lock<ApeRwLock> lock(namespacelock_);
+        ApeInode inode;
+        // filedelete tells what's wrong with the path
+        if (!inodeopen(filepath, inode) || !inode.isfile() || !inodetrimmable(inode, batch))
+            return true;
+
+        ApeCachedInode* cached = inodepin(inode.num);
+        if (cached == NULL)
+            return false;
+        bool ok;
+        {
+            unique_lock<ApeRwLock> inodelock(cached->lock);
+            ok = inodetrimblocks(cached->inode, batch);
+            // handles still open on the file drop what they mapped or read ahead
+            cached->generation++;
+            cached->layout++;
+        }
+        if (!inodeunpin(inode.num, true) || !ok)
+            return false;
     }
-    return false;
 }
 
 bool ApeFileSystem::fileopen(const string& filepath, ApeFileMode mode, ApeFile& file)
 {
     ApeInode inode;
 
+    fileclose(file);
+
+    // only creating changes the namespace
+    ApeJournalHandle transaction(*this, mode == APEFILE_CREATE);
+    shared_lock<ApeRwLock> readlock(namespacelock_, defer_lock);
+    unique_lock<ApeRwLock> writelock(namespacelock_, defer_lock);
+    if (mode == APEFILE_CREATE)
+        writelock.lock();
+    else
+        readlock.lock();
+
     switch (mode)
     {
     case APEFILE_APPEND:
-        if (inodeopen(filepath, inode) && inode.isfile())
-        {
-            file.inodenum = inode.num;
-            file.position = inode.size;
+        if (inodeopen(filepath, inode) && inode.isfile() && fileattach(file, inode, inode.size))
             return true;
-        }
         break;
 
     case APEFILE_OPEN:
-        if (inodeopen(filepath, inode) && inode.isfile())
-        {
-            file.inodenum = inode.num;
-            file.position = 0;
+        if (inodeopen(filepath, inode) && inode.isfile() && fileattach(file, inode, 0))
             return true;
-        }
         break;
 
     case APEFILE_CREATE:
         if (inodealloc(inode))
         {
-            inode.flags = APEFLAG_FILE;
+            if (superblock_.features & APEFEATURE_INLINE)
+            {
+                // blocks come with the first write that doesn't fit
+                inode.flags = APEFLAG_INLINE;
+                memset(&inode.blocks, 0, sizeof(inode.blocks));
+            }
+            inode.flags |= APEFLAG_FILE;
             if (inodewrite(inode))
             {
                 ApeInode parent;
@@ -435,12 +1432,8 @@ bool ApeFileSystem::fileopen(const string& filepath, ApeFileMode mode, ApeFile&
                     entry.flags = APEFLAG_FILE;
                     entry.name = extractfilename(filepath);
 
-                    if (directoryaddentry(parent, entry))
-                    {
-                        file.inodenum = inode.num;
-                        file.position = 0;
+                    if (directoryaddentry(parent, entry) && fileattach(file, inode, 0))
                         return true;
-                    }
                 }
             }
         }
@@ -455,177 +1448,2694 @@ bool ApeFileSystem::fileopen(const string& filepath, ApeFileMode mode, ApeFile&
     return false;
 }
 
+/*
+    Binds an open file to its inode, pinned in the inode cache until the file is closed
+*/
+bool ApeFileSystem::fileattach(ApeFile& file, const ApeInode& inode, uint64_t position)
+{
+    file.inode_ = inodepin(inode.num);
+    if (file.inode_ == NULL)
+        return false;
+    file.inodenum = inode.num;
+    file.position = position;
+    file.map_.invalidate();
+    file.map_.layout = file.inode_->layout;
+    file.readahead_.window = 0;
+    file.readahead_.next = position;
+    file.readahead_.generation = file.inode_->generation;
+    file.maxsize_ = inodemaxsize(inode);
+    memset(&file.readahead_.stats, 0, sizeof(file.readahead_.stats));
+    file.cluster_.size = 0;
+    file.written_ = false;
+    lock_guard<mutex> lock(openfileslock_);
+    openfiles_.insert(&file);
+    return true;
+}
+
+/*
+    Unbinds the file from its inode, leaving what it wrote to fileclose
+*/
+void ApeFileSystem::filedetach(ApeFile& file)
+{
+    if (file.good())
+    {
+        // reads ahead in flight land in the handle
+        filereadaheaddrop(file);
+        {
+            lock_guard<mutex> lock(readaheadlock_);
+            const ApeReadaheadStats& stats = file.readahead_.stats;
+            readaheadstats_.hits += stats.hits;
+            readaheadstats_.misses += stats.misses;
+            readaheadstats_.blocks += stats.blocks;
+            readaheadstats_.collapses += stats.collapses;
+        }
+        {
+            lock_guard<mutex> lock(openfileslock_);
+            openfiles_.erase(&file);
+        }
+        inodeunpin(file.inodenum, true);
+    }
+    file.inodenum = INVALIDINODE;
+    file.inode_ = NULL;
+    file.position = 0;
+    file.writebuffer_.data.clear();
+}
+
+/*
+    blockmap through the map of the handle, dropped first
+    when blocks of the file were remapped since it was filled
+*/
+bool ApeFileSystem::fileblockmap(ApeFile& file, uint32_t blockpos, blocknum_t& blocknum, uint32_t& run)
+{
+    if (file.map_.layout != file.inode_->layout)
+    {
+        file.map_.invalidate();
+        file.map_.layout = file.inode_->layout;
+    }
+    return blockmap(file.inode_->inode, file.map_, blockpos, blocknum, run);
+}
+
 uint32_t ApeFileSystem::fileread(ApeFile& file, void* buffer, uint32_t size)
+{
+    // reads see what the handle wrote
+    if (!fileflush(file))
+        return 0;
+
+    shared_lock<ApeRwLock> lock(file.inode_->lock);
+    const ApeInode& inode = file.inode_->inode;
+    if (inode.isinline())
+        return inlineread(file, buffer, size);
+    if (inode.iscompressed())
+        return clusterread(file, buffer, size);
+    if (inode.ispacked())
+        return tailread(file, buffer, size);
+    return filereadblocks(file, buffer, size);
+}
+
+/*
+    Reads from the blocks of the file, the inode lock must be held shared
+*/
+uint32_t ApeFileSystem::filereadblocks(ApeFile& file, void* buffer, uint32_t size)
+{
+    const ApeInode& inode = file.inode_->inode;
+    ApeBlock block;
+    const uint8_t* data;
+    uint32_t bytesread;
+    uint32_t run;
+
+    // a mapped image leaves readahead to the page cache
+    if (file.readahead_.maxwindow > 0 && !storage_->mapped())
+    {
+        bytesread = filereadahead(file, buffer, size);
+        file.readahead_.next = file.position;
+        return bytesread;
+    }
+
+    // reads spanning blocks go out as one batch, a mapped image has nothing to wait for
+    if (!storage_->mapped() && file.position % BLOCKSIZE + size > BLOCKSIZE)
+    {
+        uint64_t position = file.position;
+        ApeFileRequest request;
+        if (filequeueread(file, buffer, size, request) && filefinish(request))
+            return request.size;
+        file.position = position;
+        return 0;
+    }
+
+    bytesread = 0;
+    while (bytesread < size && file.position < inode.size)
+    {
+        uint32_t bytestoread = (uint32_t)min((uint64_t)BLOCKSIZE - file.position % BLOCKSIZE, min(inode.size - file.position, (uint64_t)(size - bytesread)));
+        uint8_t* target = &((uint8_t*)buffer)[bytesread];
+        // a whole block lands straight in the buffer, unless the image is mapped
+        uint8_t* bounce = bytestoread == BLOCKSIZE ? target : block.data;
+        if (!fileblockmap(file, file.position / BLOCKSIZE, block.num, run) || (data = blockpeek(block.num, bounce)) == NULL)
+            return 0;
+        if (data != target)
+            memcpy(target, &data[file.position % BLOCKSIZE], bytestoread);
+        file.position += bytestoread;
+        bytesread += bytestoread;
+    }
+    return bytesread;
+}
+
+/*
+    Small writes carrying on the buffered range go into the handle buffer,
+    the rest are written through once the buffer is flushed
+*/
+uint32_t ApeFileSystem::filewrite(ApeFile& file, const void* buffer, uint32_t size)
+{
+    if (!file.good() || file.position >= file.maxsize_)
+        return 0;
+    size = (uint32_t)min((uint64_t)size, file.maxsize_ - file.position);
+
+    ApeWriteBuffer& writebuffer = file.writebuffer_;
+    if (size >= writebuffer.capacity)
+        return fileflush(file) ? filewritethrough(file, buffer, size) : 0;
+
+    if (!writebuffer.data.empty() &&
+        (file.position != writebuffer.start + writebuffer.data.size() || writebuffer.data.size() + size > writebuffer.capacity))
+    {
+        if (!fileflush(file))
+            return 0;
+    }
+    if (writebuffer.data.empty())
+        writebuffer.start = file.position;
+    writebuffer.data.insert(writebuffer.data.end(), (const uint8_t*)buffer, (const uint8_t*)buffer + size);
+    file.position += size;
+    return size;
+}
+
+/*
+    Writes the handle buffer to the image, the blocks it needs past
+    the end of the file are only allocated now, in one run
+*/
+bool ApeFileSystem::fileflush(ApeFile& file)
 {
     if (!file.good())
+        return false;
+
+    ApeWriteBuffer& writebuffer = file.writebuffer_;
+    if (writebuffer.data.empty())
+        return true;
+
+    uint64_t position = file.position;
+    uint32_t size = writebuffer.data.size();
+    file.position = writebuffer.start;
+    bool ok = filewritethrough(file, &writebuffer.data[0], size) == size;
+    file.position = position;
+    writebuffer.data.clear();
+    return ok;
+}
+
+/*
+    The image is a single file, the whole filesystem goes to the disk with it
+*/
+bool ApeFileSystem::filesync(ApeFile& file)
+{
+    if (!fileflush(file))
+        return false;
+    file.written_ = false;
+    return flush();
+}
+
+/*
+    Writes straight to the image, from the file position on
+*/
+uint32_t ApeFileSystem::filewritethrough(ApeFile& file, const void* buffer, uint32_t size)
+{
+    // with a journal, a transaction per batch of blocks
+    uint32_t batch = journalbatch() * BLOCKSIZE;
+    if (journal_.attached() && size > batch)
+    {
+        uint32_t byteswrote = 0;
+        while (byteswrote < size)
+        {
+            uint32_t part = min(batch, size - byteswrote);
+            uint32_t wrote = filewritethrough(file, (const uint8_t*)buffer + byteswrote, part);
+            byteswrote += wrote;
+            if (wrote < part)
+                break;
+        }
+        return byteswrote;
+    }
+
+    // the blocks the data lands in, those it starts and ends in may be a packed tail or inline
+    ApeJournalHandle transaction(*this, true, size / BLOCKSIZE + 2);
+    unique_lock<ApeRwLock> lock(file.inode_->lock);
+    ApeInode& inode = file.inode_->inode;
+    ApeBlock block;
+    uint32_t byteswrote = 0;
+    uint32_t run;
+
+    bool inlined;
+
+    file.written_ = true;
+    file.inode_->generation++;
+    if (!inlinewrite(file, buffer, size, inlined))
+        return 0;
+    if (inlined)
+        return size;
+    if (!tailunpack(inode, file.position + size))
+        return 0;
+    if (inode.iscompressed())
+        return clusterwrite(file, buffer, size);
+    if (!dedupunshare(file, file.position, size))
+        return 0;
+
+    if (!storage_->mapped() && file.position % BLOCKSIZE + size > BLOCKSIZE)
+    {
+        uint64_t position = file.position;
+        ApeFileRequest request;
+        if (filequeuewrite(file, buffer, size, request) && filefinish(request) && filegrow(file, request))
+            return request.size;
+        file.position = position;
+        return 0;
+    }
+
+    while (byteswrote < size)
+    {
+        bool grow = file.position / BLOCKSIZE >= inode.blockscount;
+        bool shared = false;
+        uint32_t bytestowrite = min(BLOCKSIZE - (uint32_t)(file.position % BLOCKSIZE), size - byteswrote);
+        const uint8_t* source = &((const uint8_t*)buffer)[byteswrote];
+        if (grow)
+        {
+            // file grow, the whole write is placed in one run
+            uint32_t upcoming = (uint32_t)((file.position + size - byteswrote - 1) / BLOCKSIZE - file.position / BLOCKSIZE);
+            if (bytestowrite == BLOCKSIZE ? !dedupalloc(inode, block, source, upcoming, shared) : !blockalloc(inode, block, upcoming))
+                return 0;
+        }
+        else
+        {
+            // get the corresponding block
+            if (!fileblockmap(file, file.position / BLOCKSIZE, block.num, run))
+                return 0;
+        }
+        if (shared)
+        {
+            // the data is in the image already
+        }
+        else if (bytestowrite == BLOCKSIZE)
+        {
+            // whole block overwritten, nothing to read or stage
+            if (!blockwritedata(block.num, source))
+                return false;
+        }
+        else
+        {
+            if (grow)
+                block.fill(0);
+            else if (!blockread(block.num, block))
+                return 0;
+            memcpy(&block.data[file.position % BLOCKSIZE], source, bytestowrite);
+            if (!blockwritedata(block.num, block.data))
+                return false;
+        }
+        file.position += bytestowrite;
+        byteswrote += bytestowrite;
+
+        if (file.position > inode.size)
+        {
+            // only marks the cached inode dirty, it's written back on close
+            inode.size = file.position;
+            if (!inodewrite(inode))
+                return 0; // that's a problem D:
+        }
+    }
+
+    return byteswrote;
+}
+
+bool ApeFileSystem::filesubmitread(ApeFile& file, void* buffer, uint32_t size, ApeFileRequest& request)
+{
+    if (!fileflush(file))
+        return false;
+    shared_lock<ApeRwLock> lock(file.inode_->lock);
+    const ApeInode& inode = file.inode_->inode;
+    if (inode.isinline())
+    {
+        uint32_t bytesread = inlineread(file, buffer, size);
+        inlinerequest(request, false, bytesread, 0);
+        return true;
+    }
+    // reads reaching a packed tail, or decompressed, are done right away
+    if (inode.iscompressed() || (inode.ispacked() && file.position + size > (uint64_t)inode.blockscount * BLOCKSIZE))
+    {
+        uint64_t position = file.position;
+        uint32_t bytesread = inode.iscompressed() ? clusterread(file, buffer, size) : tailread(file, buffer, size);
+        if (bytesread == 0 && position < inode.size)
+            return false;
+        inlinerequest(request, false, bytesread, 0);
+        return true;
+    }
+    return filequeueread(file, buffer, size, request);
+}
+
+bool ApeFileSystem::filesubmitwrite(ApeFile& file, const void* buffer, uint32_t size, ApeFileRequest& request)
+{
+    if (!fileflush(file) || file.position + size > file.maxsize_)
+        return false;
+    // with a journal, what's past a batch of blocks is left to the next request
+    if (journal_.attached())
+        size = min(size, journalbatch() * BLOCKSIZE - (uint32_t)(file.position % BLOCKSIZE));
+    ApeJournalHandle transaction(*this, true, size / BLOCKSIZE + 2);
+    unique_lock<ApeRwLock> lock(file.inode_->lock);
+    file.written_ = true;
+    file.inode_->generation++;
+    bool inlined;
+    if (!inlinewrite(file, buffer, size, inlined))
+        return false;
+    if (inlined)
+    {
+        inlinerequest(request, true, size, file.position);
+        return true;
+    }
+    if (!tailunpack(file.inode_->inode, file.position + size))
+        return false;
+    if (file.inode_->inode.iscompressed())
+    {
+        uint32_t byteswrote = clusterwrite(file, buffer, size);
+        if (byteswrote == 0 && size > 0)
+            return false;
+        inlinerequest(request, true, byteswrote, file.position);
+        return true;
+    }
+    if (!dedupunshare(file, file.position, size))
+        return false;
+    return filequeuewrite(file, buffer, size, request);
+}
+
+uint32_t ApeFileSystem::filecomplete(ApeFile& file, ApeFileRequest& request)
+{
+    if (!filefinish(request))
         return 0;
+    if (request.write)
+    {
+        if (!file.good())
+            return 0;
+        ApeJournalHandle transaction(*this);
+        unique_lock<ApeRwLock> lock(file.inode_->lock);
+        if (!filegrow(file, request))
+            return 0;
+    }
+    return request.size;
+}
+
+/*
+    Queues the transfer of one block, merged into the previous one when
+    both go straight to or from the caller's buffer and are contiguous
+    on the image and in memory, up to MAXTRANSFER
+*/
+void ApeFileSystem::filequeueblock(ApeFileRequest& request, blocknum_t blocknum, uint8_t* data, bool direct)
+{
+    uint64_t offset = blocksoffset_ + (uint64_t)blocknum * BLOCKSIZE;
+    if (direct && !request.io.empty())
+    {
+        ApeIoRequest& last = request.io.back();
+        bool bounced = false;
+        for (size_t i = 0; i < request.blocks.size(); i++)
+            bounced = bounced || last.data == request.blocks[i].data;
+        if (!bounced && last.size < MAXTRANSFER && last.offset + last.size == offset && (uint8_t*)last.data + last.size == data)
+        {
+            last.size += BLOCKSIZE;
+            return;
+        }
+    }
+    ApeIoRequest io = {offset, data, BLOCKSIZE, request.write, &request.batch};
+    request.io.push_back(io);
+}
+
+/*
+    Maps the blocks from the file position on and submits their reads.
+    Whole blocks are read straight into the buffer, the unaligned head
+    and tail go through a bounce block. Cached blocks are copied from
+    the block cache instead. The inode lock must be held, at least shared.
+*/
+bool ApeFileSystem::filequeueread(ApeFile& file, void* buffer, uint32_t size, ApeFileRequest& request)
+{
+    const ApeInode& inode = file.inode_->inode;
+    uint64_t position = file.position;
+    uint64_t end = position + (position < inode.size ? min((uint64_t)size, inode.size - position) : 0);
+
+    request.write = false;
+    request.size = end - position;
+    request.batch.reset();
+    request.blocks.resize(2);
+    request.spans.clear();
+    request.io.clear();
+
+    while (position < end)
+    {
+        blocknum_t blocknum;
+        uint32_t run;
+        if (!fileblockmap(file, position / BLOCKSIZE, blocknum, run))
+            return false;
+
+        uint8_t* target = (uint8_t*)buffer + (position - file.position);
+        uint32_t offset = position % BLOCKSIZE;
+        uint32_t length = (uint32_t)min((uint64_t)BLOCKSIZE - offset, end - position);
+        position += length;
+
+        if (length == BLOCKSIZE)
+        {
+            if (!blockcache_.peek(blocknum, target))
+                filequeueblock(request, blocknum, target, true);
+            continue;
+        }
+
+        ApeBlock& block = request.blocks[request.spans.size()];
+        ApeFileSpan span = {target, offset, length};
+        request.spans.push_back(span);
+        if (!blockcache_.peek(blocknum, block.data))
+            filequeueblock(request, blocknum, block.data, false);
+    }
+
+    request.batch.add(request.io.size());
+    if (!request.io.empty() && !storage_->submit(&request.io[0], request.io.size()))
+        return false;
+    file.position = end;
+    return true;
+}
+
+/*
+    Allocates the blocks the write needs and submits their writes.
+    Whole blocks are written straight from the buffer, the unaligned head
+    and tail are read first into a bounce block. Cached copies are dropped,
+    the new data goes straight to the image. The inode lock must be held.
+*/
+bool ApeFileSystem::filequeuewrite(ApeFile& file, const void* buffer, uint32_t size, ApeFileRequest& request)
+{
+    ApeInode& inode = file.inode_->inode;
+    uint64_t position = file.position;
+    uint64_t end = position + size;
+    uint32_t bounces = 0;
+    ApeBlock allocated;
+
+    request.write = true;
+    request.size = size;
+    request.end = end;
+    request.batch.reset();
+    request.blocks.resize(2);
+    request.spans.clear();
+    request.io.clear();
+
+    while (position < end)
+    {
+        const uint8_t* source = (const uint8_t*)buffer + (position - file.position);
+        uint32_t offset = position % BLOCKSIZE;
+        uint32_t length = (uint32_t)min((uint64_t)BLOCKSIZE - offset, end - position);
+        ApeBlock& block = length < BLOCKSIZE ? request.blocks[bounces++] : allocated;
+        uint32_t run;
+
+        if (position / BLOCKSIZE >= inode.blockscount)
+        {
+            // file grow, the whole write is placed in one run
+            uint32_t upcoming = (uint32_t)((end - 1) / BLOCKSIZE - position / BLOCKSIZE);
+            bool shared = false;
+            if (length == BLOCKSIZE ? !dedupalloc(inode, block, source, upcoming, shared) : !blockalloc(inode, block, upcoming))
+                return false;
+            if (shared)
+            {
+                // the data is in the image already
+                position += length;
+                continue;
+            }
+            if (length < BLOCKSIZE)
+                block.fill(0);
+        }
+        else
+        {
+            if (!fileblockmap(file, position / BLOCKSIZE, block.num, run))
+                return false;
+            // whole blocks are overwritten, no need to read them
+            if (length < BLOCKSIZE && !blockread(block.num, block))
+                return false;
+        }
+
+        blockcache_.drop(block.num);
+        if (length == BLOCKSIZE)
+        {
+            // only read from, it's a write
+            filequeueblock(request, block.num, (uint8_t*)source, true);
+        }
+        else
+        {
+            memcpy(&block.data[offset], source, length);
+            filequeueblock(request, block.num, block.data, false);
+        }
+        position += length;
+    }
+
+    request.batch.add(request.io.size());
+    if (!request.io.empty() && !storage_->submit(&request.io[0], request.io.size()))
+        return false;
+    file.position = end;
+    return true;
+}
+
+/*
+    Waits for the transfers of a request, then hands reads to the caller
+*/
+bool ApeFileSystem::filefinish(ApeFileRequest& request)
+{
+    if (!request.batch.wait())
+        return false;
+    for (size_t i = 0; i < request.spans.size(); i++)
+    {
+        const ApeFileSpan& span = request.spans[i];
+        memcpy(span.target, &request.blocks[i].data[span.offset], span.size);
+    }
+    return true;
+}
+
+/*
+    Grows the file over a completed write, the inode lock must be held
+*/
+bool ApeFileSystem::filegrow(ApeFile& file, const ApeFileRequest& request)
+{
+    ApeInode& inode = file.inode_->inode;
+    // blocks read ahead while the write was in flight may be stale
+    file.inode_->generation++;
+    if (request.end <= inode.size)
+        return true;
+    inode.size = request.end;
+    return inodewrite(inode);
+}
+
+/*
+    Reads of a file kept in its inode, the inode lock must be held shared
+*/
+uint32_t ApeFileSystem::inlineread(ApeFile& file, void* buffer, uint32_t size)
+{
+    const ApeInode& inode = file.inode_->inode;
+    uint32_t bytesread = file.position < inode.size ? (uint32_t)min((uint64_t)size, inode.size - file.position) : 0;
+    memcpy(buffer, inode.inlinedata() + file.position, bytesread);
+    file.position += bytesread;
+    return bytesread;
+}
+
+/*
+    Largest file kept in its inode, the host info takes the end of the record
+*/
+uint32_t ApeFileSystem::inlinesize() const
+{
+    uint32_t size = inodesize_ - inodeheadersize();
+    if (superblock_.features & APEFEATURE_HOSTINFO)
+        size -= sizeof(ApeHostInfo);
+    return size;
+}
+
+/*
+    Writes to a file kept in its inode land there while it still fits,
+    otherwise its data moves to a block first and written is left unset
+    for the caller to go on with the write. The inode lock must be held.
+*/
+bool ApeFileSystem::inlinewrite(ApeFile& file, const void* buffer, uint32_t size, bool& written)
+{
+    ApeInode& inode = file.inode_->inode;
+    written = false;
+    if (!inode.isinline())
+        return true;
+    if (size > inlinesize() || file.position > inlinesize() - size)
+        return inlinemove(inode, (file.position + size - 1) / BLOCKSIZE);
+
+    memcpy(inode.inlinedata() + file.position, buffer, size);
+    file.position += size;
+    inode.size = max(inode.size, file.position);
+    written = true;
+    return inodewrite(inode);
+}
+
+/*
+    Turns an inline file into a regular one, its data goes to its first
+    block, or cluster. upcoming, blocks the caller appends right after it.
+*/
+bool ApeFileSystem::inlinemove(ApeInode& inode, uint32_t upcoming)
+{
+    uint8_t data[INLINEDATASIZE];
+    uint32_t size = (uint32_t)inode.size;
+    memcpy(data, inode.inlinedata(), size);
+
+    inode.flags &= ~APEFLAG_INLINE;
+    if (superblock_.features & APEFEATURE_COMPRESS)
+        inode.flags |= APEFLAG_COMPRESSED;
+    else if (superblock_.features & APEFEATURE_EXTENTS)
+        inode.flags |= APEFLAG_EXTENTS;
+    inodeclearblocks(inode);
+    if (size == 0)
+        return inodewrite(inode);
+    if (inode.iscompressed())
+        return clusterstore(inode, 0, data, size);
+
+    ApeBlock block;
+    if (!blockalloc(inode, block, upcoming))
+        return false;
+    block.fill(0);
+    memcpy(block.data, data, size);
+    return blockwritedata(block.num, block.data);
+}
+
+/*
+    Sets up a request already handled, complete() just returns size
+*/
+void ApeFileSystem::inlinerequest(ApeFileRequest& request, bool write, uint32_t size, uint64_t end)
+{
+    request.write = write;
+    request.size = size;
+    request.end = end;
+    request.batch.reset();
+    request.spans.clear();
+    request.io.clear();
+}
+
+/*
+    Reads of a packed file, from its blocks and then from the fragments
+    holding its tail. The inode lock must be held shared.
+*/
+uint32_t ApeFileSystem::tailread(ApeFile& file, void* buffer, uint32_t size)
+{
+    const ApeInode& inode = file.inode_->inode;
+    const ApeFragments& fragments = *inode.fragments();
+    uint64_t tailstart = (uint64_t)inode.blockscount * BLOCKSIZE;
+    uint32_t bytesread = 0;
+
+    if (file.position < tailstart)
+    {
+        uint32_t head = (uint32_t)min((uint64_t)size, tailstart - file.position);
+        bytesread = filereadblocks(file, buffer, head);
+        if (bytesread < head)
+            return bytesread;
+    }
+
+    uint32_t length = file.position < inode.size ? (uint32_t)min((uint64_t)(size - bytesread), inode.size - file.position) : 0;
+    if (length == 0)
+        return bytesread;
+    ApeBlock block;
+    const uint8_t* data = blockpeek(fragments.block, block.data);
+    if (data == NULL)
+        return bytesread;
+    memcpy((uint8_t*)buffer + bytesread, &data[fragments.first * FRAGMENTSIZE + (file.position - tailstart)], length);
+    file.position += length;
+    return bytesread + length;
+}
+
+/*
+    Moves the data past the last whole block of a file into fragments,
+    if it's small enough, giving back its block. Only done once the last
+    handle closes, another one could be writing the tail right away.
+*/
+bool ApeFileSystem::tailpack(ApeFile& file)
+{
+    if (!(superblock_.features & APEFEATURE_TAILS) || !tailpacking_)
+        return true;
+    {
+        lock_guard<mutex> lock(inodecachelock_);
+        if (file.inode_->pins > 1)
+            return true;
+    }
+
+    ApeJournalHandle transaction(*this);
+    unique_lock<ApeRwLock> lock(file.inode_->lock);
+    ApeInode& inode = file.inode_->inode;
+    uint32_t tail = inode.size % BLOCKSIZE;
+    // blocks past the size are writes that didn't complete, leave those alone
+    if (!inode.isfile() || !inode.hasextents() || inode.ispacked() || tail == 0 || tail > MAXTAILSIZE ||
+        inode.blockscount != (inode.size + BLOCKSIZE - 1) / BLOCKSIZE)
+        return true;
+
+    ApeBlock block;
+    ApeFragments fragments;
+    blocknum_t last;
+    uint32_t run;
+    const uint8_t* data;
+    if (!blockmap(inode, inode.blockscount - 1, last, run) || (data = blockpeek(last, block.data)) == NULL)
+        return false;
+    // the last block becomes a fragment block itself when there's no room elsewhere
+    if (!fragmentalloc(inode.num, data, tail, last, fragments) || !extentdroplast(inode, last))
+        return false;
+    inode.flags |= APEFLAG_PACKED;
+    *inode.fragments() = fragments;
+    file.inode_->generation++;
+    if (!inodewrite(inode))
+        return false;
+    return fragments.block == last || blockfree(last);
+}
+
+/*
+    fileflush of a handle being closed. When the buffer ends the file with
+    a tail tailpack would move, only the whole blocks before it are written,
+    the tail goes straight to fragments. No block is taken for it and given
+    back, that would leave a hole between the blocks of the files.
+*/
+bool ApeFileSystem::tailflush(ApeFile& file)
+{
+    ApeWriteBuffer& writebuffer = file.writebuffer_;
+    uint64_t end = writebuffer.start + writebuffer.data.size();
+    uint32_t tail = end % BLOCKSIZE;
+    // compressed files keep their tail in their last cluster
+    if (!(superblock_.features & APEFEATURE_TAILS) || (superblock_.features & APEFEATURE_COMPRESS) || !tailpacking_ ||
+        writebuffer.data.empty() || tail == 0 || tail > MAXTAILSIZE || end - tail < writebuffer.start)
+        return fileflush(file);
+    {
+        lock_guard<mutex> lock(inodecachelock_);
+        if (file.inode_->pins > 1)
+            return fileflush(file);
+    }
+
+    uint64_t position = file.position;
+    uint32_t head = (uint32_t)(end - tail - writebuffer.start);
+    file.position = writebuffer.start;
+    bool ok = head == 0 || filewritethrough(file, &writebuffer.data[0], head) == head;
+    bool packed = false;
+    // a new fragment block then lands right after the blocks of the file
+    reservationrelease(file.inodenum);
+    if (ok)
+        ok = tailpackdata(file, &writebuffer.data[head], tail, packed);
+    // the tail goes the usual way when the file doesn't end with the buffer
+    if (ok && !packed)
+        ok = filewritethrough(file, &writebuffer.data[head], tail) == tail;
+    file.position = position;
+    writebuffer.data.clear();
+    return ok;
+}
+
+/*
+    Packs size bytes written at the position of the handle, the end of its
+    last block, as the tail of the file. packed is left unset when the file
+    has data or blocks past there, or is kept in its inode.
+*/
+bool ApeFileSystem::tailpackdata(ApeFile& file, const uint8_t* data, uint32_t size, bool& packed)
+{
+    ApeJournalHandle transaction(*this);
+    unique_lock<ApeRwLock> lock(file.inode_->lock);
+    ApeInode& inode = file.inode_->inode;
+    packed = false;
+    if (inode.size != file.position || file.position % BLOCKSIZE != 0 || inode.ispacked())
+        return true;
+    // an empty file kept in its inode gets its data mapped the usual way
+    if (inode.isinline() && inode.size == 0 && size > inlinesize() && !inlinemove(inode, 0))
+        return false;
+    if (!inode.isfile() || !inode.hasextents() || inode.blockscount != inode.size / BLOCKSIZE)
+        return true;
+
+    ApeFragments fragments;
+    if (!fragmentalloc(inode.num, data, size, INVALIDBLOCK, fragments))
+        return false;
+    inode.flags |= APEFLAG_PACKED;
+    *inode.fragments() = fragments;
+    inode.size += size;
+    file.written_ = true;
+    file.inode_->generation++;
+    packed = true;
+    return inodewrite(inode);
+}
+
+/*
+    Gives a packed file a block for its tail again, before a write
+    up to end reaches it. The inode lock must be held.
+*/
+bool ApeFileSystem::tailunpack(ApeInode& inode, uint64_t end)
+{
+    if (!inode.ispacked() || end <= (uint64_t)inode.blockscount * BLOCKSIZE)
+        return true;
+
+    ApeFragments fragments = *inode.fragments();
+    uint32_t tail = (uint32_t)(inode.size - (uint64_t)inode.blockscount * BLOCKSIZE);
+    ApeBlock fragmentblock;
+    ApeBlock block;
+    const uint8_t* data = blockpeek(fragments.block, fragmentblock.data);
+    if (data == NULL)
+        return false;
+    block.fill(0);
+    memcpy(block.data, &data[fragments.first * FRAGMENTSIZE], tail);
+
+    inode.flags &= ~APEFLAG_PACKED;
+    memset(inode.fragments(), 0, sizeof(ApeFragments));
+    if (!blockalloc(inode, block, (uint32_t)((end - 1) / BLOCKSIZE - inode.blockscount)))
+    {
+        inode.flags |= APEFLAG_PACKED;
+        *inode.fragments() = fragments;
+        return false;
+    }
+    return blockwritedata(block.num, block.data) && fragmentfree(fragments);
+}
+
+/*
+    Longest run of set bits
+*/
+uint32_t ApeFileSystem::fragmentrun(uint16_t freemask)
+{
+    uint32_t longest = 0;
+    uint32_t run = 0;
+    for (uint32_t i = 0; i < FRAGMENTSPERBLOCK; i++)
+    {
+        run = (freemask >> i & 1) ? run + 1 : 0;
+        longest = max(longest, run);
+    }
+    return longest;
+}
+
+/*
+    Copies size bytes of tail to a run of free fragments, of the block with
+    the shortest run that fits among those known, otherwise of a new block.
+    spare, a block the caller is done with to use as the new one, if any.
+*/
+bool ApeFileSystem::fragmentalloc(inodenum_t inodenum, const uint8_t* data, uint32_t size, blocknum_t spare, ApeFragments& fragments)
+{
+    lock_guard<mutex> lock(fragmentslock_);
+    uint32_t count = (size + FRAGMENTSIZE - 1) / FRAGMENTSIZE;
+    uint16_t runmask = (1 << count) - 1;
+    ApeBlock block;
+    ApeFragmentHeader* header = (ApeFragmentHeader*)block.data;
+    uint16_t freemask = 0;
+    uint32_t first = 0;
+
+    for (uint32_t longest = count; longest < FRAGMENTSPERBLOCK && freemask == 0; longest++)
+    {
+        if (fragmentruns_[longest].empty())
+            continue;
+        block.num = *fragmentruns_[longest].begin();
+        freemask = fragmentblocks_[block.num];
+    }
+
+    if (freemask != 0)
+    {
+        if (!blockread(block.num, block) || header->magic != FRAGMENTMAGIC)
+            return false;
+        for (first = 1; first + count <= FRAGMENTSPERBLOCK; first++)
+        {
+            if ((freemask >> first & runmask) == runmask)
+                break;
+        }
+    }
+    else
+    {
+        block.num = spare;
+        if (spare == INVALIDBLOCK && !blockalloc(block))
+            return false;
+        block.fill(0);
+        header->magic = FRAGMENTMAGIC;
+        for (uint32_t i = 0; i < FRAGMENTSPERBLOCK; i++)
+            header->owners[i] = INVALIDINODE;
+        // fragment 0 is the header
+        freemask = (1 << FRAGMENTSPERBLOCK) - 2;
+        first = 1;
+    }
+
+    for (uint32_t i = first; i < first + count; i++)
+        header->owners[i] = inodenum;
+    memcpy(&block.data[first * FRAGMENTSIZE], data, size);
+    if (!blockwrite(block))
+        return false;
+
+    fragmentindex(block.num, freemask & ~(runmask << first));
+    fragments.block = block.num;
+    fragments.first = first;
+    fragments.count = count;
+    return true;
+}
+
+/*
+    Gives back the fragments of a tail, and their block once none is used.
+    Blocks are learned from here too, those of an image just opened aren't known.
+*/
+bool ApeFileSystem::fragmentfree(const ApeFragments& fragments)
+{
+    lock_guard<mutex> lock(fragmentslock_);
+    ApeBlock block;
+    ApeFragmentHeader* header = (ApeFragmentHeader*)block.data;
+    if (!blockread(fragments.block, block) || header->magic != FRAGMENTMAGIC ||
+        fragments.first == 0 || fragments.first + fragments.count > FRAGMENTSPERBLOCK)
+        return false;
+
+    uint16_t freemask = 0;
+    for (uint32_t i = fragments.first; i < (uint32_t)fragments.first + fragments.count; i++)
+        header->owners[i] = INVALIDINODE;
+    for (uint32_t i = 1; i < FRAGMENTSPERBLOCK; i++)
+    {
+        if (header->owners[i] == INVALIDINODE)
+            freemask |= 1 << i;
+    }
+
+    if (freemask == (1 << FRAGMENTSPERBLOCK) - 2)
+    {
+        fragmentindex(block.num, 0);
+        return blockfree(block.num);
+    }
+    fragmentindex(block.num, freemask);
+    return blockwrite(block);
+}
+
+/*
+    Records the free fragments of a block, those without any are forgotten
+*/
+void ApeFileSystem::fragmentindex(blocknum_t blocknum, uint16_t freemask)
+{
+    map<blocknum_t, uint16_t>::iterator it = fragmentblocks_.find(blocknum);
+    if (it != fragmentblocks_.end())
+    {
+        fragmentruns_[fragmentrun(it->second)].erase(blocknum);
+        fragmentblocks_.erase(it);
+    }
+    if (freemask == 0)
+        return;
+    fragmentblocks_[blocknum] = freemask;
+    fragmentruns_[fragmentrun(freemask)].insert(blocknum);
+}
+
+/*
+    Reads of a compressed file, one cluster at a time through the handle
+    buffer. The inode lock must be held shared.
+*/
+uint32_t ApeFileSystem::clusterread(ApeFile& file, void* buffer, uint32_t size)
+{
+    const ApeInode& inode = file.inode_->inode;
+    ApeClusterBuffer& cluster = file.cluster_;
+    uint32_t bytesread = 0;
+
+    while (bytesread < size && file.position < inode.size)
+    {
+        if (!clusterload(file, file.position / CLUSTERSIZE))
+            break;
+        uint32_t offset = file.position % CLUSTERSIZE;
+        uint32_t length = min(size - bytesread, cluster.size - offset);
+        memcpy((uint8_t*)buffer + bytesread, &cluster.data[offset], length);
+        file.position += length;
+        bytesread += length;
+    }
+    return bytesread;
+}
+
+/*
+    Writes to a compressed file. Each cluster written to is compressed
+    again as a whole, after reading it if the write doesn't cover it.
+    The inode lock must be held.
+*/
+uint32_t ApeFileSystem::clusterwrite(ApeFile& file, const void* buffer, uint32_t size)
+{
+    ApeInode& inode = file.inode_->inode;
+    ApeClusterBuffer& cluster = file.cluster_;
+    uint32_t byteswrote = 0;
+
+    // the caller moved the generation for this write, the buffer is still good unless another one did
+    if (cluster.size > 0 && cluster.generation + 1 == file.inode_->generation)
+        cluster.generation = file.inode_->generation;
+
+    while (byteswrote < size)
+    {
+        uint32_t index = file.position / CLUSTERSIZE;
+        uint32_t offset = file.position % CLUSTERSIZE;
+        uint32_t length = min(size - byteswrote, CLUSTERSIZE - offset);
+        uint64_t start = (uint64_t)index * CLUSTERSIZE;
+        uint32_t current = inode.size > start ? (uint32_t)min((uint64_t)CLUSTERSIZE, inode.size - start) : 0;
+        if (current > 0 && (offset > 0 || length < current))
+        {
+            if (!clusterload(file, index))
+                break;
+        }
+        cluster.size = 0;
+        cluster.data.resize(CLUSTERSIZE);
+        memcpy(&cluster.data[offset], (const uint8_t*)buffer + byteswrote, length);
+
+        uint32_t clustersize = max(current, offset + length);
+        if (!clusterstore(inode, index, &cluster.data[0], clustersize))
+            break;
+        cluster.index = index;
+        cluster.generation = file.inode_->generation;
+        cluster.size = clustersize;
+        file.position += length;
+        byteswrote += length;
+
+        if (file.position > inode.size)
+        {
+            inode.size = file.position;
+            if (!inodewrite(inode))
+                break;
+        }
+    }
+    return byteswrote;
+}
+
+/*
+    Decompresses cluster index of the file into the handle buffer,
+    unless it's there already. The inode lock must be held.
+*/
+bool ApeFileSystem::clusterload(ApeFile& file, uint32_t index)
+{
+    const ApeInode& inode = file.inode_->inode;
+    ApeClusterBuffer& buffer = file.cluster_;
+    if (buffer.size > 0 && buffer.index == index && buffer.generation == file.inode_->generation)
+        return true;
+
+    ApeCluster cluster;
+    buffer.size = 0;
+    if ((uint64_t)index * CLUSTERSIZE >= inode.size || !clusterentry(inode, index, cluster))
+        return false;
+    uint32_t size = (uint32_t)min((uint64_t)CLUSTERSIZE, inode.size - (uint64_t)index * CLUSTERSIZE);
+    uint32_t stored = cluster.size & ~CLUSTERRAW;
+    bool raw = (cluster.size & CLUSTERRAW) != 0;
+    if (stored == 0 || stored > CLUSTERSIZE || (raw && stored != size))
+        return false;
+
+    buffer.data.resize(CLUSTERSIZE);
+    buffer.stored.resize(CLUSTERSIZE);
+    uint8_t* target = raw ? &buffer.data[0] : &buffer.stored[0];
+    if (!blocksread(cluster.start, clusterblocks(cluster), target))
+        return false;
+    if (!raw && !ApeLz::decompress(target, stored, &buffer.data[0], size))
+        return false;
+    buffer.index = index;
+    buffer.generation = file.inode_->generation;
+    buffer.size = size;
+    return true;
+}
+
+/*
+    Stores size bytes as cluster index of the inode, which may be the one
+    right after its last. The cluster goes to a new run of blocks, after
+    the previous cluster when there's room, and its old blocks are only
+    freed once the table points at the new ones. Its blocks must be free
+    in a row, a full image may have room left in smaller runs.
+*/
+bool ApeFileSystem::clusterstore(ApeInode& inode, uint32_t index, const uint8_t* data, uint32_t size)
+{
+    uint8_t packed[CLUSTERSIZE];
+    ApeCluster cluster;
+    ApeCluster previous;
+    ApeCluster old;
+    blocknum_t goal = INVALIDBLOCK;
+
+    // blockscount counts the clusters
+    if (index > inode.blockscount || (uint64_t)index * CLUSTERSIZE >= inodemaxsize(inode))
+        return false;
+
+    // kept compressed only if it saves a block
+    uint32_t rawblocks = (size + BLOCKSIZE - 1) / BLOCKSIZE;
+    cluster.size = rawblocks > 1 ? ApeLz::compress(data, size, packed, (rawblocks - 1) * BLOCKSIZE) : 0;
+    if (cluster.size == 0)
+    {
+        memcpy(packed, data, size);
+        cluster.size = size | CLUSTERRAW;
+    }
+    uint32_t blocks = clusterblocks(cluster);
+    memset(packed + (cluster.size & ~CLUSTERRAW), 0, blocks * BLOCKSIZE - (cluster.size & ~CLUSTERRAW));
+
+    // right after the previous cluster, else the first run long enough
+    if (index > 0 && clusterentry(inode, index - 1, previous))
+        goal = previous.start + clusterblocks(previous);
+    if (!blockallocwhole(goal, blocks, cluster.start))
+        return false;
+
+    bool replaced = index < inode.blockscount;
+    if (!blockwritedata(cluster.start, packed, blocks) || (replaced && !clusterentry(inode, index, old)) ||
+        !clusterset(inode, index, cluster))
+    {
+        lock_guard<mutex> lock(blockslock_);
+        for (uint32_t i = 0; i < blocks; i++)
+            blocksbitmap_.unsetbit(cluster.start + i);
+        return false;
+    }
+    if (!replaced)
+    {
+        inode.blockscount++;
+        return inodewrite(inode);
+    }
+
+    bool ok = true;
+    for (uint32_t i = 0; i < clusterblocks(old); i++)
+        ok = blockfree(old.start + i) && ok;
+    return ok;
+}
+
+/*
+    Where cluster index of the inode is stored
+*/
+bool ApeFileSystem::clusterentry(const ApeInode& inode, uint32_t index, ApeCluster& cluster)
+{
+    ApeBlock block;
+    const uint8_t* data;
+    blocknum_t tablenum;
+
+    if (index >= inode.blockscount)
+        return false;
+    if (index < CLUSTERDIRECT * CLUSTERSPERTABLE)
+    {
+        tablenum = inode.blocks[index / CLUSTERSPERTABLE];
+    }
+    else
+    {
+        if (inode.blocks[CLUSTERDIRECT] == INVALIDBLOCK || (data = blockpeek(inode.blocks[CLUSTERDIRECT], block.data)) == NULL)
+            return false;
+        tablenum = ((const blocknum_t*)data)[index / CLUSTERSPERTABLE - CLUSTERDIRECT];
+    }
+    if (tablenum == INVALIDBLOCK || (data = blockpeek(tablenum, block.data)) == NULL)
+        return false;
+    cluster = ((const ApeCluster*)data)[index % CLUSTERSPERTABLE];
+    return true;
+}
+
+/*
+    Points cluster index of the inode at cluster, adding the tables it needs.
+    New tables are written before anything points at them, and given back
+    if the cluster can't be set
+*/
+bool ApeFileSystem::clusterset(ApeInode& inode, uint32_t index, const ApeCluster& cluster)
+{
+    ApeBlock table;
+    ApeBlock indirect;
+    blocknum_t* tablenum;
+    bool direct = index < CLUSTERDIRECT * CLUSTERSPERTABLE;
+    bool newindirect = false;
+    bool newtable = false;
+
+    if (direct)
+    {
+        tablenum = &inode.blocks[index / CLUSTERSPERTABLE];
+    }
+    else
+    {
+        if (inode.blocks[CLUSTERDIRECT] == INVALIDBLOCK)
+        {
+            if (!blockalloc(indirect))
+                return false;
+            indirect.fill(0xFF); // fill with invalid blocks
+            newindirect = true;
+        }
+        else if (!blockread(inode.blocks[CLUSTERDIRECT], indirect))
+        {
+            return false;
+        }
+        tablenum = &((blocknum_t*)indirect.data)[index / CLUSTERSPERTABLE - CLUSTERDIRECT];
+    }
+
+    bool ok;
+    if (*tablenum == INVALIDBLOCK)
+    {
+        ok = blockalloc(table);
+        if (ok)
+        {
+            table.fill(0xFF);
+            newtable = true;
+        }
+    }
+    else
+    {
+        ok = blockread(*tablenum, table);
+    }
+    if (ok)
+    {
+        ((ApeCluster*)table.data)[index % CLUSTERSPERTABLE] = cluster;
+        ok = blockwrite(table);
+    }
+    if (ok && newtable && !direct)
+    {
+        *tablenum = table.num;
+        ok = blockwrite(indirect);
+    }
+    if (!ok)
+    {
+        if (newtable)
+            blockfree(table.num);
+        if (newindirect)
+            blockfree(indirect.num);
+        return false;
+    }
+
+    if (newtable && direct)
+        *tablenum = table.num;
+    if (newindirect)
+        inode.blocks[CLUSTERDIRECT] = indirect.num;
+    return inodewrite(inode);
+}
+
+/*
+    Gives back the last clusters of a compressed inode, up to count blocks
+    but one cluster at least, and the tables they leave empty. The size
+    shrinks to the clusters left.
+*/
+bool ApeFileSystem::clustertrim(ApeInode& inode, uint32_t count)
+{
+    ApeBlock indirect;
+    ApeCluster cluster;
+    uint32_t freed = 0;
+
+    while (inode.blockscount > 0)
+    {
+        uint32_t index = inode.blockscount - 1;
+        if (!clusterentry(inode, index, cluster))
+            return false;
+        if (freed > 0 && freed + clusterblocks(cluster) > count)
+            break;
+        for (uint32_t i = 0; i < clusterblocks(cluster); i++)
+            blockfree(cluster.start + i);
+        freed += clusterblocks(cluster);
+        inode.blockscount--;
+        if (index % CLUSTERSPERTABLE != 0)
+            continue;
+
+        // its table is left empty, and the table of tables with the first one in it
+        uint32_t table = index / CLUSTERSPERTABLE;
+        if (table < CLUSTERDIRECT)
+        {
+            blockfree(inode.blocks[table]);
+            inode.blocks[table] = INVALIDBLOCK;
+        }
+        else if (!blockread(inode.blocks[CLUSTERDIRECT], indirect))
+        {
+            return false;
+        }
+        else
+        {
+            blocknum_t& tablenum = ((blocknum_t*)indirect.data)[table - CLUSTERDIRECT];
+            blockfree(tablenum);
+            tablenum = INVALIDBLOCK;
+            if (table > CLUSTERDIRECT && !blockwrite(indirect))
+                return false;
+            if (table == CLUSTERDIRECT)
+            {
+                blockfree(inode.blocks[CLUSTERDIRECT]);
+                inode.blocks[CLUSTERDIRECT] = INVALIDBLOCK;
+            }
+        }
+    }
+
+    inode.size = min(inode.size, (uint64_t)inode.blockscount * CLUSTERSIZE);
+    return inodewrite(inode);
+}
+
+uint32_t ApeFileSystem::clusterblocks(const ApeCluster& cluster)
+{
+    return ((cluster.size & ~CLUSTERRAW) + BLOCKSIZE - 1) / BLOCKSIZE;
+}
+
+/*
+    Files whose whole blocks go through the dedup table
+*/
+bool ApeFileSystem::dedupable(const ApeInode& inode) const
+{
+    return (superblock_.features & APEFEATURE_DEDUP) && inode.isfile() && inode.hasextents();
+}
+
+/*
+    Gets the next block of a growing file for a whole block of data, like
+    blockalloc. With dedup, a block already holding the same data is mapped
+    instead and shared is set, there's nothing left to write then. The block
+    right after the last one of the file is tried first, so runs shared from
+    another file stay in one extent. The last block itself isn't shared again,
+    a run of identical blocks would otherwise take an extent per block.
+*/
+bool ApeFileSystem::dedupalloc(ApeInode& inode, ApeBlock& block, const uint8_t* data, uint32_t upcoming, bool& shared)
+{
+    shared = false;
+    if (!dedupable(inode))
+        return blockalloc(inode, block, upcoming);
+
+    uint64_t fingerprint = dedupfingerprint(data);
+    blocknum_t last = INVALIDBLOCK;
+    uint32_t run;
+    if (inode.blockscount > 0 && !blockmap(inode, inode.blockscount - 1, last, run))
+        return false;
+
+    {
+        lock_guard<mutex> lock(deduplock_);
+        dedupstats_.blocks++;
+        blocknum_t candidates[2] = {INVALIDBLOCK, INVALIDBLOCK};
+        if (last != INVALIDBLOCK && last + 1 < dedupentries_.size() &&
+            dedupentries_[last + 1].refs > 0 && dedupentries_[last + 1].fingerprint == fingerprint)
+            candidates[0] = last + 1;
+        unordered_map<uint64_t, blocknum_t>::iterator it = dedupindex_.find(fingerprint);
+        if (it != dedupindex_.end() && it->second != last)
+            candidates[1] = it->second;
+
+        for (uint32_t i = 0; i < 2 && !shared; i++)
+        {
+            // fingerprints may collide, only the same bytes are shared. Writes
+            // of the data may be in flight, the block cache is left alone.
+            if (candidates[i] == INVALIDBLOCK || !blocksread(candidates[i], 1, block.data) ||
+                memcmp(block.data, data, BLOCKSIZE) != 0)
+                continue;
+            block.num = candidates[i];
+            dedupentries_[block.num].refs++;
+            dedupdirty_.insert(block.num / DEDUPENTRIESPERBLOCK);
+            dedupstats_.shared++;
+            shared = true;
+        }
+    }
+
+    if (shared)
+    {
+        if (extentadd(inode, block.num))
+            return true;
+        // gives the reference back
+        blockfree(block.num);
+        return false;
+    }
+
+    if (!blockalloc(inode, block, upcoming))
+        return false;
+    lock_guard<mutex> lock(deduplock_);
+    ApeDedupEntry& entry = dedupentries_[block.num];
+    entry.fingerprint = fingerprint;
+    entry.refs = 1;
+    dedupdirty_.insert(block.num / DEDUPENTRIESPERBLOCK);
+    // a block found first stays the one looked up
+    dedupindex_.insert(make_pair(fingerprint, block.num));
+    return true;
+}
+
+/*
+    Called before a write from position on changes blocks of the file.
+    Blocks only the file maps leave the table, their data won't match it
+    anymore. Shared ones are copied to new blocks, and the file remapped to
+    the copies, the others mapping them keep the data. The inode lock must be held.
+*/
+bool ApeFileSystem::dedupunshare(ApeFile& file, uint64_t position, uint32_t size)
+{
+    ApeInode& inode = file.inode_->inode;
+    if (!dedupable(inode) || size == 0 || position / BLOCKSIZE >= inode.blockscount)
+        return true;
+
+    // file block position -> the shared block there
+    vector<pair<uint32_t, blocknum_t> > shared;
+    uint32_t end = (uint32_t)min((position + size - 1) / BLOCKSIZE + 1, (uint64_t)inode.blockscount);
+    for (uint32_t blockpos = (uint32_t)(position / BLOCKSIZE); blockpos < end; )
+    {
+        blocknum_t blocknum;
+        uint32_t run;
+        if (!fileblockmap(file, blockpos, blocknum, run))
+            return false;
+        run = min(run, end - blockpos);
+        lock_guard<mutex> lock(deduplock_);
+        for (uint32_t i = 0; i < run; i++)
+        {
+            if (dedupentries_[blocknum + i].refs == 1)
+                dedupdrop(blocknum + i);
+            else if (dedupentries_[blocknum + i].refs > 1)
+                shared.push_back(make_pair(blockpos + i, blocknum + i));
+        }
+        blockpos += run;
+    }
+    if (shared.empty())
+        return true;
+
+    // blocks the write covers whole have nothing worth copying
+    vector<blocknum_t> copies;
+    for (size_t i = 0; i < shared.size(); i++)
+    {
+        ApeBlock block;
+        const uint8_t* data;
+        if (!blockalloc(block))
+            return false;
+        copies.push_back(block.num);
+        uint64_t start = (uint64_t)shared[i].first * BLOCKSIZE;
+        if (start >= position && start + BLOCKSIZE <= position + size)
+            continue;
+        if ((data = blockpeek(shared[i].second, block.data)) == NULL || !blockwritedata(block.num, data))
+            return false;
+    }
+
+    // the extents of the file, the copies in place of the shared blocks
+    vector<ApeExtent> extents;
+    size_t next = 0;
+    for (uint32_t blockpos = 0; blockpos < inode.blockscount; )
+    {
+        blocknum_t blocknum;
+        uint32_t run;
+        if (!fileblockmap(file, blockpos, blocknum, run))
+            return false;
+        run = min(run, inode.blockscount - blockpos);
+        for (uint32_t i = 0; i < run; )
+        {
+            uint32_t count = run - i;
+            if (next < shared.size() && shared[next].first == blockpos + i)
+            {
+                extentpush(extents, copies[next++], 1);
+                i++;
+                continue;
+            }
+            if (next < shared.size() && shared[next].first < blockpos + run)
+                count = shared[next].first - (blockpos + i);
+            extentpush(extents, blocknum + i, count);
+            i += count;
+        }
+        blockpos += run;
+    }
+
+    if (!extentrewrite(inode, extents))
+        return false;
+    // maps of the other handles are stale now
+    file.inode_->layout++;
+    bool ok = true;
+    for (size_t i = 0; i < shared.size(); i++)
+        ok = blockfree(shared[i].second) && ok;
+    return ok;
+}
+
+/*
+    Drops a reference to a data block,
+    true once nothing maps it anymore and it's to be freed
+*/
+bool ApeFileSystem::deduprelease(blocknum_t blocknum)
+{
+    if (!(superblock_.features & APEFEATURE_DEDUP))
+        return true;
+    lock_guard<mutex> lock(deduplock_);
+    if (blocknum >= dedupentries_.size() || dedupentries_[blocknum].refs == 0)
+        return true;
+    if (dedupentries_[blocknum].refs == 1)
+    {
+        dedupdrop(blocknum);
+        return true;
+    }
+    dedupentries_[blocknum].refs--;
+    dedupdirty_.insert(blocknum / DEDUPENTRIESPERBLOCK);
+    return false;
+}
+
+/*
+    Same for many blocks, those still mapped elsewhere are taken out of blocks
+*/
+void ApeFileSystem::deduprelease(vector<blocknum_t>& blocks)
+{
+    if (!(superblock_.features & APEFEATURE_DEDUP))
+        return;
+    lock_guard<mutex> lock(deduplock_);
+    size_t kept = 0;
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+        blocknum_t blocknum = blocks[i];
+        if (blocknum < dedupentries_.size() && dedupentries_[blocknum].refs > 1)
+        {
+            dedupentries_[blocknum].refs--;
+            dedupdirty_.insert(blocknum / DEDUPENTRIESPERBLOCK);
+            continue;
+        }
+        if (blocknum < dedupentries_.size() && dedupentries_[blocknum].refs == 1)
+            dedupdrop(blocknum);
+        blocks[kept++] = blocknum;
+    }
+    blocks.resize(kept);
+}
+
+/*
+    Takes a block out of the table, the dedup lock must be held
+*/
+void ApeFileSystem::dedupdrop(blocknum_t blocknum)
+{
+    ApeDedupEntry& entry = dedupentries_[blocknum];
+    unordered_map<uint64_t, blocknum_t>::iterator it = dedupindex_.find(entry.fingerprint);
+    if (it != dedupindex_.end() && it->second == blocknum)
+        dedupindex_.erase(it);
+    memset(&entry, 0, sizeof(entry));
+    dedupdirty_.insert(blocknum / DEDUPENTRIESPERBLOCK);
+}
+
+/*
+    Writes back the table blocks changed, consecutive ones in a single write
+*/
+bool ApeFileSystem::dedupflush()
+{
+    lock_guard<mutex> lock(deduplock_);
+    bool ok = true;
+    set<uint32_t>::iterator it = dedupdirty_.begin();
+    while (it != dedupdirty_.end())
+    {
+        uint32_t first = *it;
+        uint32_t count = 1;
+        while (++it != dedupdirty_.end() && *it == first + count)
+            count++;
+        ok = metawrite(dedupoffset_ + (uint64_t)first * BLOCKSIZE, &dedupentries_[(size_t)first * DEDUPENTRIESPERBLOCK],
+                       count * BLOCKSIZE) && ok;
+    }
+    if (ok)
+        dedupdirty_.clear();
+    return ok;
+}
+
+/*
+    64 bit hash of a block, xxHash64 rounds over four lanes of 8 bytes
+*/
+uint64_t ApeFileSystem::dedupfingerprint(const uint8_t* data)
+{
+    const uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+    const uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+    const uint64_t prime3 = 0x165667B19E3779F9ULL;
+    uint64_t lanes[4] = {prime1 + prime2, prime2, 0, 0 - prime1};
+    for (uint32_t i = 0; i < BLOCKSIZE; i += sizeof(lanes))
+    {
+        for (uint32_t l = 0; l < 4; l++)
+        {
+            uint64_t word;
+            memcpy(&word, data + i + l * sizeof(word), sizeof(word));
+            lanes[l] += word * prime2;
+            lanes[l] = ((lanes[l] << 31) | (lanes[l] >> 33)) * prime1;
+        }
+    }
+    uint64_t hash = ((lanes[0] << 1) | (lanes[0] >> 63)) + ((lanes[1] << 7) | (lanes[1] >> 57)) +
+                    ((lanes[2] << 12) | (lanes[2] >> 52)) + ((lanes[3] << 18) | (lanes[3] >> 46));
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= prime3;
+    return hash ^ (hash >> 32);
+}
+
+/*
+    Reads through the readahead buffers of the handle, sequential reads
+    keep the next window in flight. Random ones read in place, unless
+    what they want was read ahead already. The inode lock must be held shared.
+*/
+uint32_t ApeFileSystem::filereadahead(ApeFile& file, void* buffer, uint32_t size)
+{
+    ApeReadahead& readahead = file.readahead_;
+    const ApeInode& inode = file.inode_->inode;
+    uint64_t start = file.position;
+    uint64_t end = start + (start < inode.size ? min((uint64_t)size, inode.size - start) : 0);
+    uint64_t position = start;
+    bool missed = false;
+
+    if (end == start)
+        return 0;
+
+    // written since, what was read ahead may be stale
+    if (readahead.generation != file.inode_->generation)
+    {
+        filereadaheaddrop(file);
+        readahead.generation = file.inode_->generation;
+    }
+
+    if (start != readahead.next)
+    {
+        if (readahead.window > 0)
+            readahead.stats.collapses++;
+        readahead.window = 0;
+    }
+    else if (readahead.window == 0)
+    {
+        readahead.window = min(READAHEADMIN, readahead.maxwindow);
+    }
+
+    while (position < end)
+    {
+        ApeReadaheadBuffer* current = filereadaheadfind(file, position / BLOCKSIZE);
+        if (current == NULL)
+        {
+            if (readahead.window == 0)
+                break;
+            // ran past what was read ahead, start over from here
+            missed = true;
+            filereadaheaddrop(file);
+            current = &readahead.buffers[0];
+            if (!filereadaheadfill(file, *current, position / BLOCKSIZE))
+                break;
+            filereadaheadsettle(*current);
+            if (current->count == 0)
+                break;
+        }
+
+        uint32_t offset = (uint32_t)(position - (uint64_t)current->start * BLOCKSIZE);
+        uint32_t length = (uint32_t)min(end - position, (uint64_t)(current->count * BLOCKSIZE - offset));
+        memcpy((uint8_t*)buffer + (position - start), &current->data[offset], length);
+        position += length;
+        if (readahead.window > 0)
+            filereadaheadnext(file, *current);
+    }
+
+    file.position = position;
+    if (position < end)
+    {
+        ApeFileRequest request;
+        if (!filequeueread(file, (uint8_t*)buffer + (position - start), end - position, request) || !filefinish(request))
+        {
+            file.position = start;
+            return 0;
+        }
+        missed = true;
+    }
+
+    if (missed)
+        readahead.stats.misses++;
+    else
+        readahead.stats.hits++;
+    return end - start;
+}
+
+/*
+    The buffer holding blockpos, once its read is done, NULL if none does
+*/
+ApeReadaheadBuffer* ApeFileSystem::filereadaheadfind(ApeFile& file, uint32_t blockpos)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        ApeReadaheadBuffer& buffer = file.readahead_.buffers[i];
+        if (blockpos < buffer.start || blockpos >= buffer.start + buffer.count)
+            continue;
+        filereadaheadsettle(buffer);
+        if (buffer.count > 0)
+            return &buffer;
+    }
+    return NULL;
+}
+
+/*
+    Submits the read of a window from blockpos into buffer, which must be
+    settled. Blocks in the block cache are copied from it, they may be newer.
+*/
+bool ApeFileSystem::filereadaheadfill(ApeFile& file, ApeReadaheadBuffer& buffer, uint32_t blockpos)
+{
+    ApeReadahead& readahead = file.readahead_;
+    const ApeInode& inode = file.inode_->inode;
+    ApeFileRequest& request = buffer.request;
+    // a packed tail isn't read ahead, it's past the blocks
+    uint32_t blocks = (uint32_t)min((inode.size + BLOCKSIZE - 1) / BLOCKSIZE, (uint64_t)inode.blockscount);
+
+    buffer.start = blockpos;
+    buffer.count = 0;
+    if (blockpos >= blocks)
+        return true;
+    uint32_t count = min(readahead.window, blocks - blockpos);
+    if (buffer.data.size() < count * BLOCKSIZE)
+        buffer.data.resize(count * BLOCKSIZE);
+
+    request.write = false;
+    request.size = count * BLOCKSIZE;
+    request.batch.reset();
+    request.blocks.clear();
+    request.spans.clear();
+    request.io.clear();
+    for (uint32_t i = 0; i < count; i++)
+    {
+        blocknum_t blocknum;
+        uint32_t run;
+        uint8_t* target = &buffer.data[i * BLOCKSIZE];
+        if (!fileblockmap(file, blockpos + i, blocknum, run))
+            return false;
+        if (!blockcache_.peek(blocknum, target))
+            filequeueblock(request, blocknum, target, true);
+    }
+
+    request.batch.add(request.io.size());
+    if (!request.io.empty() && !storage_->submit(&request.io[0], request.io.size()))
+        return false;
+    buffer.count = count;
+    buffer.pending = true;
+    readahead.stats.blocks += count;
+    return true;
+}
+
+/*
+    Reads the window following current into the other buffer,
+    unless it's there already, doubling the window
+*/
+void ApeFileSystem::filereadaheadnext(ApeFile& file, ApeReadaheadBuffer& current)
+{
+    ApeReadahead& readahead = file.readahead_;
+    ApeReadaheadBuffer& other = &current == &readahead.buffers[0] ? readahead.buffers[1] : readahead.buffers[0];
+    uint32_t next = current.start + current.count;
+    if ((other.count > 0 && other.start == next) || (uint64_t)next * BLOCKSIZE >= file.inode_->inode.size)
+        return;
+
+    filereadaheadsettle(other);
+    readahead.window = min(readahead.window * 2, readahead.maxwindow);
+    filereadaheadfill(file, other, next);
+}
+
+/*
+    Waits for the read of a buffer, which is emptied if it failed
+*/
+void ApeFileSystem::filereadaheadsettle(ApeReadaheadBuffer& buffer)
+{
+    if (!buffer.pending)
+        return;
+    buffer.pending = false;
+    if (!buffer.request.batch.wait())
+        buffer.count = 0;
+}
+
+void ApeFileSystem::filereadaheaddrop(ApeFile& file)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        filereadaheadsettle(file.readahead_.buffers[i]);
+        file.readahead_.buffers[i].count = 0;
+    }
+}
+
+uint64_t ApeFileSystem::filesize(const ApeFile& file)
+{
+    if (!file.good())
+        return 0;
+    shared_lock<ApeRwLock> lock(file.inode_->lock);
+    const ApeWriteBuffer& writebuffer = file.writebuffer_;
+    if (writebuffer.data.empty())
+        return file.inode_->inode.size;
+    return max(file.inode_->inode.size, (uint64_t)(writebuffer.start + writebuffer.data.size()));
+}
+
+/*
+    Appends the runs of blocks holding the file, for reading
+    it straight from the image with blocksread. A packed file
+    has the rest of its data in the tail fragments.
+*/
+bool ApeFileSystem::fileextents(ApeFile& file, vector<ApeExtent>& extents, ApeFragments& tail)
+{
+    if (!fileflush(file))
+        return false;
+
+    shared_lock<ApeRwLock> lock(file.inode_->lock);
+    const ApeInode& inode = file.inode_->inode;
+    uint32_t blockpos = 0;
+    memset(&tail, 0, sizeof(tail));
+    if (inode.ispacked())
+        tail = *inode.fragments();
+    // blocks of clusters only make sense decompressed
+    if (inode.iscompressed())
+        return true;
+    while (blockpos < inode.blockscount)
+    {
+        ApeExtent extent;
+        uint32_t run;
+        if (!fileblockmap(file, blockpos, extent.start, run))
+            return false;
+        extent.count = min(run, inode.blockscount - blockpos);
+        extentpush(extents, extent.start, extent.count);
+        blockpos += extent.count;
+    }
+    return true;
+}
+
+bool ApeFileSystem::filehostinfo(ApeFile& file, ApeHostInfo& info)
+{
+    if (!file.good() || !(superblock_.features & APEFEATURE_HOSTINFO))
+        return false;
+    shared_lock<ApeRwLock> lock(file.inode_->lock);
+    info = file.inode_->inode.host;
+    return true;
+}
+
+bool ApeFileSystem::filesethostinfo(ApeFile& file, const ApeHostInfo& info)
+{
+    if (!file.good() || !(superblock_.features & APEFEATURE_HOSTINFO))
+        return false;
+    ApeJournalHandle transaction(*this);
+    unique_lock<ApeRwLock> lock(file.inode_->lock);
+    file.inode_->inode.host = info;
+    return inodewrite(file.inode_->inode);
+}
+
+bool ApeFileSystem::fileseek(ApeFile& file, ApeFileSeekMode seekmode, int64_t offset)
+{
+    // seeks are bound by the size, buffered writes included
+    if (!fileflush(file))
+        return false;
+
+    shared_lock<ApeRwLock> lock(file.inode_->lock);
+    const ApeInode& inode = file.inode_->inode;
+
+    switch (seekmode)
+    {
+    case APESEEK_CUR:
+        if ((int64_t)file.position + offset >= 0 && (uint64_t)((int64_t)file.position + offset) < inode.size)
+        {
+            file.position += offset;
+            return true;
+        }
+        break;
+
+    case APESEEK_END:
+        if (offset <= 0 && (uint64_t)-offset <= inode.size)
+        {
+            file.position = inode.size + offset;
+            return true;
+        }
+        break;
+
+    case APESEEK_SET:
+        if (offset >= 0 && (uint64_t)offset < inode.size)
+        {
+            file.position = offset;
+            return true;
+        }
+        break;
+    }
+
+    return false;
+}
+
+uint64_t ApeFileSystem::tell(const ApeFile& file)
+{
+    return file.position;
+}
+
+void ApeFileSystem::fileclose(ApeFile& file)
+{
+    if (file.good())
+    {
+        // nowhere to report a failure, flush or sync first to know
+        tailflush(file);
+        // blocks held for the file would otherwise be committed with the packing as allocated
+        reservationrelease(file.inodenum);
+        if (file.written_)
+            tailpack(file);
+        if (file.written_ && syncpolicy_ == APESYNC_CLOSE)
+            filesync(file);
+    }
+    filedetach(file);
+}
+
+
+bool ApeFileSystem::fileexists(const string& filepath)
+{
+    shared_lock<ApeRwLock> lock(namespacelock_);
+    ApeInode inode;
+    return (inodeopen(filepath, inode) && inode.isfile());
+}
+
+bool ApeFileSystem::inodealloc(ApeInode& inode)
+{
+    uint32_t freebit;
+    {
+        lock_guard<mutex> lock(inodeslock_);
+        freebit = inodesbitmap_.findunsetbit();
+        if (freebit == NOBIT)
+            return false;
+        inodesbitmap_.setbit(freebit);
+    }
+    memset(&inode, 0, sizeof(ApeInode));
+    inode.num = freebit;
+    if (superblock_.features & APEFEATURE_EXTENTS)
+    {
+        // no extents, no extent blocks
+        inode.flags = APEFLAG_EXTENTS;
+        inode.blocks[EXTENTCHAIN] = INVALIDBLOCK;
+        inode.blocks[EXTENTCHAIN + 1] = INVALIDBLOCK;
+    }
+    else
+    {
+        // fill the block table with INVALIDBLOCKS
+        memset(&inode.blocks, 0xFF, sizeof(inode.blocks));
+    }
+    return true;
+}
+
+bool ApeFileSystem::inodefree(inodenum_t inodenum)
+{
+    {
+        lock_guard<mutex> lock(inodecachelock_);
+        map<inodenum_t, ApeCachedInode>::iterator it = inodecache_.find(inodenum);
+        if (it != inodecache_.end())
+        {
+            // nothing to write back for a freed inode,
+            // handles still open on it keep their entry until closed
+            if (it->second.dirty.exchange(false))
+                dirtyinodes_--;
+            if (it->second.pins == 0)
+            {
+                inodelru_.erase(it->second.lru);
+                inodecache_.erase(it);
+            }
+        }
+    }
+    // the number may come back as a different directory
+    dentrydrop(inodenum);
+    lock_guard<mutex> lock(inodeslock_);
+    return inodesbitmap_.unsetbit(inodenum);
+}
+
+/*
+    Marks the bits past the first bits as used, the inode bitmap
+    covers more inodes than the inode table can hold
+*/
+void ApeFileSystem::bitmaplimit(ApeBitMap& bitmap, uint32_t bits)
+{
+    for (uint32_t i = bits; i < bitmap.size() * 8; i++)
+        bitmap.setbit(i);
+}
+
+/*
+    Writes back the dirty parts of a bitmap,
+    consecutive dirty chunks go in a single write
+*/
+bool ApeFileSystem::bitmapflush(ApeBitMap& bitmap, uint64_t offset)
+{
+    uint32_t chunk = bitmap.nextdirtychunk(0);
+    while (chunk != NOBIT)
+    {
+        uint32_t last = chunk;
+        while (bitmap.nextdirtychunk(last + 1) == last + 1)
+            last++;
+
+        uint32_t start = chunk * bitmap.chunksize();
+        uint32_t end = min((last + 1) * bitmap.chunksize(), bitmap.size());
+        if (!metawrite(offset + start, (uint8_t*)bitmap.bits() + start, end - start))
+            return false;
+
+        chunk = bitmap.nextdirtychunk(last + 1);
+    }
+    bitmap.cleardirty();
+    return true;
+}
+
+/*
+    Blocks held for growing files go out free, they'd stay allocated
+    for good if the image isn't closed. The blocks lock must be held.
+*/
+bool ApeFileSystem::blocksbitmapflush()
+{
+    map<inodenum_t, ApeReservation>::iterator it;
+    for (it = reservations_.begin(); it != reservations_.end(); ++it)
+    {
+        for (uint32_t i = 0; i < it->second.count; i++)
+            blocksbitmap_.unsetbit(it->second.start + i);
+    }
+    bool ok = bitmapflush(blocksbitmap_, blocksbitmapoffset_);
+    for (it = reservations_.begin(); it != reservations_.end(); ++it)
+    {
+        for (uint32_t i = 0; i < it->second.count; i++)
+            blocksbitmap_.setbit(it->second.start + i);
+    }
+    return ok;
+}
+
+ApeJournalHandle::ApeJournalHandle(ApeFileSystem& owner, bool active, uint32_t blocks)
+    : owner_(owner), active_(active), pages_(blocks * owner.journalblockpages() + JOURNALCALLPAGES)
+{
+    if (active_)
+        owner_.journalstart(pages_);
+}
+
+ApeJournalHandle::~ApeJournalHandle()
+{
+    if (active_)
+        owner_.journalstop(pages_);
+}
+
+/*
+    Metadata reads see what's waiting for the commit
+*/
+bool ApeFileSystem::metaread(uint64_t offset, void* data, uint32_t size)
+{
+    if (!journal_.attached())
+        return storage_->read(offset, data, size);
+
+    uint8_t* target = (uint8_t*)data;
+    while (size > 0)
+    {
+        uint32_t length = min(BLOCKSIZE - (uint32_t)(offset % BLOCKSIZE), size);
+        {
+            lock_guard<mutex> lock(journalpageslock_);
+            map<uint32_t, vector<uint8_t> >::iterator it = journalpages_.find(offset / BLOCKSIZE);
+            if (it != journalpages_.end())
+                memcpy(target, &it->second[offset % BLOCKSIZE], length);
+            else if (!storage_->read(offset, target, length))
+                return false;
+        }
+        offset += length;
+        target += length;
+        size -= length;
+    }
+    return true;
+}
+
+/*
+    With a journal, metadata is kept in memory, page by page,
+    until it's committed
+*/
+bool ApeFileSystem::metawrite(uint64_t offset, const void* data, uint32_t size)
+{
+    if (!journal_.attached())
+        return storage_->write(offset, data, size);
+
+    const uint8_t* source = (const uint8_t*)data;
+    lock_guard<mutex> lock(journalpageslock_);
+    while (size > 0)
+    {
+        uint32_t page = offset / BLOCKSIZE;
+        uint32_t length = min(BLOCKSIZE - (uint32_t)(offset % BLOCKSIZE), size);
+        map<uint32_t, vector<uint8_t> >::iterator it = journalpages_.find(page);
+        if (it == journalpages_.end())
+        {
+            it = journalpages_.insert(make_pair(page, vector<uint8_t>(BLOCKSIZE))).first;
+            // the rest of the page is logged too
+            if (length < BLOCKSIZE && !storage_->read((uint64_t)page * BLOCKSIZE, &it->second[0], BLOCKSIZE))
+            {
+                journalpages_.erase(it);
+                return false;
+            }
+        }
+        memcpy(&it->second[offset % BLOCKSIZE], source, length);
+        offset += length;
+        source += length;
+        size -= length;
+    }
+    return true;
+}
+
+/*
+    Copies the page at offset if it's waiting for the commit,
+    for readers going straight to a mapped image
+*/
+bool ApeFileSystem::journalpeek(uint64_t offset, void* data)
+{
+    if (!journal_.attached())
+        return false;
+    lock_guard<mutex> lock(journalpageslock_);
+    map<uint32_t, vector<uint8_t> >::iterator it = journalpages_.find(offset / BLOCKSIZE);
+    if (it == journalpages_.end())
+        return false;
+    memcpy(data, &it->second[0], BLOCKSIZE);
+    return true;
+}
+
+/*
+    Starts a call that may dirty up to pages pages. The pages waiting and
+    those the calls running may still dirty always fit in a transaction,
+    the call waits for running ones to end or commits what's waiting first.
+*/
+void ApeFileSystem::journalstart(uint32_t pages)
+{
+    if (!journal_.attached())
+        return;
+    uint32_t capacity = journal_.capacity();
+    pages = min(pages, capacity);
+
+    unique_lock<mutex> lock(journalcallslock_);
+    while (true)
+    {
+        uint32_t pending = journalpending();
+        if (pending + journalreserved_ + pages <= capacity)
+            break;
+        if (journalreserved_ > 0 && pending + pages <= capacity)
+        {
+            journalcallsdone_.wait(lock);
+            continue;
+        }
+        // a failed commit leaves the call to fail on its own
+        lock.unlock();
+        bool ok = journalcommit(true);
+        lock.lock();
+        if (!ok)
+            break;
+    }
+    journalreserved_ += pages;
+    lock.unlock();
+    journallock_.lock_shared();
+}
+
+/*
+    Syncs right away with APESYNC_WRITE. Otherwise commits once the pages
+    waiting fill half a transaction, the calls that ran meanwhile all go in the same one.
+*/
+void ApeFileSystem::journalstop(uint32_t pages)
+{
+    if (journal_.attached())
+    {
+        journallock_.unlock_shared();
+        lock_guard<mutex> lock(journalcallslock_);
+        journalreserved_ -= min(pages, journal_.capacity());
+        journalcallsdone_.notify_all();
+    }
+    if (syncpolicy_ == APESYNC_WRITE)
+        flush();
+    else if (journal_.attached() && journalpending() >= journal_.capacity() / 2)
+        journalcommit(false);
+}
+
+/*
+    Pages the next commit would log, at most
+*/
+uint32_t ApeFileSystem::journalpending()
+{
+    uint32_t pending = blockcache_.dirtycount() + dirtyinodes_;
+    {
+        lock_guard<mutex> lock(inodeslock_);
+        pending += inodesbitmap_.dirtychunks();
+    }
+    {
+        lock_guard<mutex> lock(blockslock_);
+        pending += blocksbitmap_.dirtychunks() + min((uint32_t)journalfreed_.size(), superblock_.blockmaps);
+    }
+    {
+        lock_guard<mutex> lock(deduplock_);
+        pending += dedupdirty_.size();
+    }
+    lock_guard<mutex> lock(journalpageslock_);
+    return pending + journalpages_.size();
+}
+
+/*
+    Blocks one call may write or give back, the pages it dirties then take
+    half a transaction at most. Bigger writes and deletes go a batch per call.
+*/
+uint32_t ApeFileSystem::journalbatch() const
+{
+    uint32_t half = journal_.capacity() / 2;
+    uint32_t blockpages = journalblockpages();
+    return half > JOURNALCALLPAGES + blockpages ? (half - JOURNALCALLPAGES) / blockpages : 1;
+}
+
+/*
+    Pages each block a call writes or gives back may dirty
+*/
+uint32_t ApeFileSystem::journalblockpages() const
+{
+    return JOURNALBLOCKPAGES + ((superblock_.features & APEFEATURE_DEDUP) ? JOURNALDEDUPPAGES : 0);
+}
+
+/*
+    Writes back everything dirty into the pages, logs them as one
+    transaction and puts them in place. Unless forced, it's left for
+    later if another call committed in the meantime.
+*/
+bool ApeFileSystem::journalcommit(bool force)
+{
+    unique_lock<ApeRwLock> lock(journallock_);
+    if (!force && journalpending() < journal_.capacity() / 2)
+        return true;
+
+    // freed blocks have nothing worth writing back, the image gets them free
+    vector<blocknum_t> freed;
+    {
+        lock_guard<mutex> blockslock(blockslock_);
+        freed.swap(journalfreed_);
+        for (size_t i = 0; i < freed.size(); i++)
+        {
+            blockcache_.drop(freed[i]);
+            {
+                lock_guard<mutex> pageslock(journalpageslock_);
+                journalpages_.erase((blocksoffset_ + (uint64_t)freed[i] * BLOCKSIZE) / BLOCKSIZE);
+            }
+            blocksbitmap_.unsetbit(freed[i]);
+        }
+    }
+    bool ok = journalwrite();
+    journalhold(freed);
+    return ok;
+}
+
+/*
+    The commit itself, see journalcommit
+*/
+bool ApeFileSystem::journalwrite()
+{
+    bool ok;
+    ok = inodeflush();
+    ok = blockcache_.flush() && ok;
+    {
+        lock_guard<mutex> inodeslock(inodeslock_);
+        ok = bitmapflush(inodesbitmap_, inodesbitmapoffset_) && ok;
+    }
+    {
+        lock_guard<mutex> blockslock(blockslock_);
+        ok = blocksbitmapflush() && ok;
+    }
+    ok = dedupflush() && ok;
+    if (!ok)
+        return false;
+
+    // writebacks from outside of a transaction, like evictions, wait here
+    lock_guard<mutex> pageslock(journalpageslock_);
+    vector<ApeJournalPage> pages;
+    map<uint32_t, vector<uint8_t> >::iterator it;
+    for (it = journalpages_.begin(); it != journalpages_.end(); ++it)
+    {
+        ApeJournalPage page = {it->first, &it->second[0]};
+        pages.push_back(page);
+    }
+    // file data written since the last commit still has to reach the disk
+    if (pages.empty())
+        return storage_->sync();
+
+    // journalstart keeps the pages within a transaction, replay sees all of a commit or none
+    if (!journal_.commit(pages))
+        return false;
+    for (size_t i = 0; i < pages.size(); i++)
+        ok = storage_->write((uint64_t)pages[i].index * BLOCKSIZE, pages[i].data, BLOCKSIZE) && ok;
+    if (ok)
+        journalpages_.clear();
+    return ok;
+}
+
+/*
+    Replay writes the pages of the last transactions again, stale contents
+    for blocks freed since. Those that are free are held, allocated in memory
+    only, so no data lands in them until the journal moved on. Each commit
+    gives them back and holds what's still replayable again.
+*/
+void ApeFileSystem::journalhold(const vector<blocknum_t>& blocks)
+{
+    lock_guard<mutex> lock(blockslock_);
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+        uint32_t page = (blocksoffset_ + (uint64_t)blocks[i] * BLOCKSIZE) / BLOCKSIZE;
+        if (!blocksbitmap_.getbit(blocks[i]) && journal_.replayable(page))
+        {
+            blocksbitmap_.setbit(blocks[i]);
+            journalfreed_.push_back(blocks[i]);
+        }
+    }
+}
+
+/*
+    Lists the data blocks of an inode and the
+    indirect/extent blocks used to map them
+*/
+bool ApeFileSystem::inodeblocks(const ApeInode& inode, vector<blocknum_t>& blocks)
+{
+    ApeBlock block;
+
+    if (inode.isinline())
+        return true;
+
+    if (inode.iscompressed())
+    {
+        // the cluster tables, those past the inode listed in blocks[CLUSTERDIRECT]
+        uint32_t tables = (inode.blockscount + CLUSTERSPERTABLE - 1) / CLUSTERSPERTABLE;
+        vector<blocknum_t> tablenums(inode.blocks, inode.blocks + min(tables, CLUSTERDIRECT));
+        if (tables > CLUSTERDIRECT)
+        {
+            if (!blockread(inode.blocks[CLUSTERDIRECT], block))
+                return false;
+            tablenums.insert(tablenums.end(), (blocknum_t*)block.data, (blocknum_t*)block.data + tables - CLUSTERDIRECT);
+            blocks.push_back(inode.blocks[CLUSTERDIRECT]);
+        }
+        for (uint32_t t = 0; t < tables; t++)
+        {
+            if (!blockread(tablenums[t], block))
+                return false;
+            const ApeCluster* clusters = (const ApeCluster*)block.data;
+            for (uint32_t i = 0; i < CLUSTERSPERTABLE && t * CLUSTERSPERTABLE + i < inode.blockscount; i++)
+            {
+                if (clusterblocks(clusters[i]) > CLUSTERBLOCKS)
+                    return false;
+                for (uint32_t b = 0; b < clusterblocks(clusters[i]); b++)
+                    blocks.push_back(clusters[i].start + b);
+            }
+            blocks.push_back(tablenums[t]);
+        }
+        return true;
+    }
+
+    if (inode.hasextents())
+    {
+        const ApeExtent* extents = inode.extents();
+        for (uint32_t i = 0; i < INODEEXTENTS && extents[i].count != 0; i++)
+        {
+            for (uint32_t b = 0; b < extents[i].count; b++)
+                blocks.push_back(extents[i].start + b);
+        }
+
+        blocknum_t next = inode.blocks[EXTENTCHAIN];
+        while (next != INVALIDBLOCK)
+        {
+            if (!blockread(next, block))
+                return false;
+            ApeExtentBlock* extentblock = (ApeExtentBlock*)block.data;
+            for (uint32_t i = 0; i < extentblock->count; i++)
+            {
+                for (uint32_t b = 0; b < extentblock->extents[i].count; b++)
+                    blocks.push_back(extentblock->extents[i].start + b);
+            }
+            blocks.push_back(next);
+            next = extentblock->next;
+        }
+        return true;
+    }
 
-    ApeInode inode;
-    ApeBlock block;
-    uint32_t bytesread;
+    for (uint32_t pos = 0; pos < inode.blockscount && pos < 8; pos++)
+        blocks.push_back(inode.blocks[pos]);
 
-    if (!inoderead(file.inodenum, inode))
-        return false;
+    if (inode.blocks[8] != INVALIDBLOCK)
+    {
+        if (!blockread(inode.blocks[8], block))
+            return false;
+        for (uint32_t i = 0; i < 1024 && i + 8 < inode.blockscount; i++)
+            blocks.push_back(((blocknum_t*)block.data)[i]);
+        blocks.push_back(inode.blocks[8]);
+    }
 
-    bytesread = 0;
-    while (bytesread < size && file.position < inode.size)
+    if (inode.blocks[9] != INVALIDBLOCK)
     {
-        uint32_t bytestoread = min(BLOCKSIZE - (file.position % BLOCKSIZE), min(inode.size - file.position, size - bytesread));
-        if (!blockread(inode, file.position / BLOCKSIZE, block))
-            return 0;
-        memcpy(&((uint8_t*)buffer)[bytesread], &block.data[file.position % BLOCKSIZE], bytestoread);
-        file.position += bytestoread;
-        bytesread += bytestoread;
+        ApeBlock diblock;
+        if (!blockread(inode.blocks[9], diblock))
+            return false;
+        // indexed like the whole indirect range, the first table is unused
+        for (uint32_t t = 1; t < 1024 && 8 + t * 1024 < inode.blockscount; t++)
+        {
+            blocknum_t iblocknum = ((blocknum_t*)diblock.data)[t];
+            if (!blockread(iblocknum, block))
+                return false;
+            for (uint32_t i = 0; i < 1024 && 8 + t * 1024 + i < inode.blockscount; i++)
+                blocks.push_back(((blocknum_t*)block.data)[i]);
+            blocks.push_back(iblocknum);
+        }
+        blocks.push_back(inode.blocks[9]);
     }
-    return bytesread;
+    return true;
 }
 
-uint32_t ApeFileSystem::filewrite(ApeFile& file, const void* buffer, uint32_t size)
+/*
+    Gives back all the blocks of an inode
+*/
+bool ApeFileSystem::inodefreeblocks(ApeInode& inode)
 {
-    if (!file.good())
-        return false;
+    if (inode.ispacked())
+    {
+        if (!fragmentfree(*inode.fragments()))
+            return false;
+        inode.flags &= ~APEFLAG_PACKED;
+    }
 
-    ApeInode inode;
-    if (!inoderead(file.inodenum, inode))
+    vector<blocknum_t> blocks;
+    if (!inodeblocks(inode, blocks))
         return false;
+    deduprelease(blocks);
 
-    ApeBlock block;
-    uint32_t byteswrote = 0;
-
-    while (byteswrote < size)
     {
-        if (file.position / BLOCKSIZE >= inode.blockscount)
-        {
-            // file grow
-            if (!blockalloc(inode, block))
-                return 0;
-        }
+        lock_guard<mutex> lock(blockslock_);
+        if (journal_.attached())
+            journalfreed_.insert(journalfreed_.end(), blocks.begin(), blocks.end());
         else
         {
-            // get the corresponding block
-            if (!blockread(inode, file.position / BLOCKSIZE, block))
-                return 0;
+            for (size_t i = 0; i < blocks.size(); i++)
+                blocksbitmap_.unsetbit(blocks[i]);
         }
-        uint32_t bytestowrite = min(BLOCKSIZE - (file.position % BLOCKSIZE), size - byteswrote);
-        memcpy(&block.data[file.position % BLOCKSIZE], &((uint8_t*)buffer)[byteswrote], bytestowrite);
-        if (!blockwrite(block))
+    }
+
+    inodeclearblocks(inode);
+    inode.size = 0;
+    return true;
+}
+
+/*
+    Gives back up to count blocks off the end of an extent mapped inode,
+    its packed tail first, or the last clusters of a compressed one.
+    The size shrinks to the blocks left.
+*/
+bool ApeFileSystem::inodetrimblocks(ApeInode& inode, uint32_t count)
+{
+    if (inode.iscompressed())
+        return clustertrim(inode, count);
+    if (inode.ispacked())
+    {
+        if (!fragmentfree(*inode.fragments()))
             return false;
-        file.position += bytestowrite;
-        byteswrote += bytestowrite;
+        inode.flags &= ~APEFLAG_PACKED;
+    }
 
-        if (file.position > inode.size)
-        {
-            inode.size = file.position;
-            if (!inodewrite(inode))
-                return 0; // that's a problem D:
-        }
+    vector<blocknum_t> blocks;
+    while (blocks.size() < count && inode.blockscount > 0)
+    {
+        if (!extenttruncate(inode, count - (uint32_t)blocks.size(), blocks))
+            return false;
     }
-    return byteswrote;
+    for (size_t i = 0; i < blocks.size(); i++)
+        blockfree(blocks[i]);
+
+    inode.size = min(inode.size, (uint64_t)inode.blockscount * BLOCKSIZE);
+    return inodewrite(inode);
 }
 
-uint32_t ApeFileSystem::filesize(const ApeFile& file)
+/*
+    Whether the inode maps more than count blocks, a compressed one counting
+    its clusters whole, and inodetrimblocks can give them back
+*/
+bool ApeFileSystem::inodetrimmable(const ApeInode& inode, uint32_t count)
 {
-    ApeInode inode;
-    if (!inoderead(file.inodenum, inode))
-        return 0;
-    return inode.size;
+    if (inode.iscompressed())
+        return (uint64_t)inode.blockscount * CLUSTERBLOCKS > count;
+    return inode.hasextents() && inode.blockscount > count;
 }
 
-bool ApeFileSystem::fileseek(ApeFile& file, ApeFileSeekMode seekmode, int32_t offset)
+/*
+    Leaves the inode without blocks, mapped the way its flags say
+*/
+void ApeFileSystem::inodeclearblocks(ApeInode& inode)
 {
-    if (!file.good())
+    if (inode.hasextents())
+    {
+        memset(&inode.blocks, 0, sizeof(inode.blocks));
+        inode.blocks[EXTENTCHAIN] = INVALIDBLOCK;
+        inode.blocks[EXTENTCHAIN + 1] = INVALIDBLOCK;
+    }
+    else if (inode.isinline())
+    {
+        memset(&inode.blocks, 0, sizeof(inode.blocks));
+    }
+    else
+    {
+        memset(&inode.blocks, 0xFF, sizeof(inode.blocks));
+    }
+    inode.blockscount = 0;
+}
+
+bool ApeFileSystem::inoderead(inodenum_t inodenum, ApeInode& inode)
+{
+    ApeCachedInode* cached = inodepin(inodenum);
+    if (cached == NULL)
         return false;
+    {
+        shared_lock<ApeRwLock> lock(cached->lock);
+        inode = cached->inode;
+    }
+    return inodeunpin(inodenum, false);
+}
 
-    ApeInode inode;
-    if (!inoderead(file.inodenum, inode))
+/*
+    Updates the cached inode, the table is written on flush,
+    when the last open file using it is closed or when it's evicted.
+    inode may be the cached one itself, its lock is then already held.
+*/
+bool ApeFileSystem::inodewrite(ApeInode& inode)
+{
+    assert(inode.flags != 0);
+    ApeCachedInode* cached = inodepin(inode.num, false);
+    if (cached == NULL)
         return false;
+    if (&cached->inode != &inode)
+    {
+        unique_lock<ApeRwLock> lock(cached->lock);
+        cached->inode = inode;
+        if (!cached->dirty.exchange(true))
+            dirtyinodes_++;
+    }
+    else if (!cached->dirty.exchange(true))
+    {
+        dirtyinodes_++;
+    }
+    return inodeunpin(inode.num, false);
+}
 
-    switch (seekmode)
+/*
+    Returns the cache entry of inodenum, making it the most recently used.
+    On a miss it's read from the inode table if load is set.
+    The cache lock must be held.
+*/
+ApeCachedInode* ApeFileSystem::inodecached(inodenum_t inodenum, bool load)
+{
+    map<inodenum_t, ApeCachedInode>::iterator it = inodecache_.find(inodenum);
+    if (it != inodecache_.end())
     {
-    case APESEEK_CUR:
-        if (file.position + offset >= 0 && file.position + offset < inode.size)
-        {
-            file.position += offset;
-            return true;
-        }
-        break;
+        inodelru_.splice(inodelru_.begin(), inodelru_, it->second.lru);
+        return &it->second;
+    }
 
-    case APESEEK_END:
-        if (offset <= 0 && inode.size + offset >= 0)
-        {
-            file.position = inode.size + offset;
-            return true;
-        }
-        break;
+    if (!inodeevict())
+        return NULL;
 
-    case APESEEK_SET:
-        if (offset >= 0 && (uint32_t)offset < inode.size)
-        {
-            file.position = offset;
-            return true;
-        }
-        break;
+    ApeInode inode;
+    if (load)
+    {
+        uint8_t record[INODESIZE];
+        if (!metaread(inodesoffset_ + (uint64_t)inodenum * inodesize_, record, inodesize_))
+            return NULL;
+        inodedecode(record, inode);
     }
 
-    return false;
+    // entries hold a lock, they're built in place
+    ApeCachedInode& cached = inodecache_[inodenum];
+    if (load)
+        cached.inode = inode;
+    cached.pins = 0;
+    cached.generation = 0;
+    cached.layout = 0;
+    cached.dirty = false;
+    inodelru_.push_front(inodenum);
+    cached.lru = inodelru_.begin();
+    return &cached;
 }
 
-uint32_t ApeFileSystem::tell(const ApeFile& file)
+/*
+    Makes room for one more inode, dropping the least recently used unpinned ones.
+    If all are pinned the cache grows past INODECACHESIZE.
+*/
+bool ApeFileSystem::inodeevict()
 {
-    return file.position;
+    list<inodenum_t>::iterator it = inodelru_.end();
+    while (inodecache_.size() >= INODECACHESIZE && it != inodelru_.begin())
+    {
+        --it;
+        ApeCachedInode& cached = inodecache_[*it];
+        if (cached.pins != 0)
+            continue;
+        if (cached.dirty && !inodewriteback(cached))
+            return false;
+        inodecache_.erase(*it);
+        it = inodelru_.erase(it);
+    }
+    return true;
 }
 
-void ApeFileSystem::fileclose(ApeFile& file)
+/*
+    Nobody may be changing the inode, either it's
+    unpinned under the cache lock or its lock is held
+*/
+bool ApeFileSystem::inodewriteback(ApeCachedInode& cached)
 {
-    file.close();
+    uint8_t record[INODESIZE];
+    inodeencode(cached.inode, record);
+    if (!metawrite(inodesoffset_ + (uint64_t)cached.inode.num * inodesize_, record, inodesize_))
+        return false;
+    if (cached.dirty.exchange(false))
+        dirtyinodes_--;
+    return true;
 }
 
+/*
+    Bytes of a table record before blocks, the rest of it
+    is in blocks and tail of ApeInode
+*/
+uint32_t ApeFileSystem::inodeheadersize() const
+{
+    if (superblock_.version >= APEVERSION_3)
+        return offsetof(ApeInodeRaw, blocks);
+    return offsetof(ApeInodeRawV1, blocks);
+}
 
-bool ApeFileSystem::fileexists(const string& filepath)
+/*
+    Records smaller than ApeInode leave the rest of it blank,
+    the host info is the end of the record
+*/
+void ApeFileSystem::inodedecode(const uint8_t* record, ApeInode& inode) const
 {
-    ApeInode inode;
-    return (inodeopen(filepath, inode) && inode.isfile());
+    memset(&inode, 0, sizeof(inode));
+    if (superblock_.version >= APEVERSION_3)
+    {
+        memcpy(&inode, record, offsetof(ApeInodeRaw, blocks));
+    }
+    else
+    {
+        ApeInodeRawV1 raw;
+        memcpy(&raw, record, offsetof(ApeInodeRawV1, blocks));
+        inode.num = raw.num;
+        inode.flags = raw.flags;
+        inode.size = raw.size;
+        inode.blockscount = raw.blockscount;
+    }
+    uint32_t header = inodeheadersize();
+    memcpy(inode.blocks, record + header, inodesize_ - header);
+    if (superblock_.features & APEFEATURE_HOSTINFO)
+        memcpy(&inode.host, record + inodesize_ - sizeof(ApeHostInfo), sizeof(ApeHostInfo));
 }
 
-bool ApeFileSystem::inodealloc(ApeInode& inode)
+/*
+    Version 1 and 2 records can't take inodes past inodemaxsize
+*/
+void ApeFileSystem::inodeencode(const ApeInode& inode, uint8_t* record) const
 {
-    uint32_t freebit = inodesbitmap_.findunsetbit();
-    if (freebit == NOBIT)
-        return false;
-    inodesbitmap_.setbit(freebit);
-    memset(&inode, 0, sizeof(ApeInode));
-    // fill the block table with INVALIDBLOCKS
-    memset(&inode.blocks, 0xFF, sizeof(inode.blocks));
-    inode.num = freebit;
+    if (superblock_.version >= APEVERSION_3)
+    {
+        memcpy(record, &inode, offsetof(ApeInodeRaw, blocks));
+    }
+    else
+    {
+        ApeInodeRawV1 raw;
+        memset(&raw, 0, sizeof(raw));
+        raw.num = inode.num;
+        raw.flags = inode.flags;
+        raw.size = (uint32_t)inode.size;
+        raw.blockscount = (uint16_t)inode.blockscount;
+        memcpy(record, &raw, offsetof(ApeInodeRawV1, blocks));
+    }
+    uint32_t header = inodeheadersize();
+    memcpy(record + header, inode.blocks, inodesize_ - header);
+    if (superblock_.features & APEFEATURE_HOSTINFO)
+        memcpy(record + inodesize_ - sizeof(ApeHostInfo), &inode.host, sizeof(ApeHostInfo));
+}
 
-	file_.seekg(inodesbitmapoffset_);
-	file_.write((char*)inodesbitmap_.bits(), inodesbitmap_.size());
-    return file_.good();
+/*
+    Largest the file can grow to, bound by its block count and how its
+    blocks are mapped. Inline files are taken for what they turn into.
+*/
+uint64_t ApeFileSystem::inodemaxsize(const ApeInode& inode) const
+{
+    bool compressed = inode.iscompressed() || (inode.isinline() && (superblock_.features & APEFEATURE_COMPRESS));
+    bool extents = inode.hasextents() || (inode.isinline() && (superblock_.features & APEFEATURE_EXTENTS));
+    uint64_t count = superblock_.version >= APEVERSION_3 ? UINT32_MAX : UINT16_MAX;
+    uint64_t size;
+    if (compressed)
+    {
+        // blockscount counts clusters
+        count = min(count, (uint64_t)(CLUSTERDIRECT + BLOCKSPERTABLE) * CLUSTERSPERTABLE);
+        size = count * CLUSTERSIZE;
+    }
+    else
+    {
+        if (!extents)
+            count = min(count, 8 + BLOCKSPERTABLE + (uint64_t)BLOCKSPERTABLE * BLOCKSPERTABLE);
+        size = count * BLOCKSIZE;
+    }
+    if (superblock_.version < APEVERSION_3)
+        size = min(size, (uint64_t)UINT32_MAX);
+    return size;
 }
 
-bool ApeFileSystem::inodefree(inodenum_t inodenum)
+/*
+    Writes back all the dirty inodes, in ascending inode order.
+    Pinned ones may be in use, they're written under their lock.
+*/
+bool ApeFileSystem::inodeflush()
 {
-    if (!inodesbitmap_.unsetbit(inodenum))
-		return false;
+    bool ok = true;
+    vector<ApeCachedInode*> pinned;
+    {
+        lock_guard<mutex> lock(inodecachelock_);
+        for (map<inodenum_t, ApeCachedInode>::iterator it = inodecache_.begin(); it != inodecache_.end(); ++it)
+        {
+            ApeCachedInode& cached = it->second;
+            if (!cached.dirty)
+                continue;
+            if (cached.pins == 0)
+            {
+                ok = inodewriteback(cached) && ok;
+            }
+            else
+            {
+                cached.pins++;
+                pinned.push_back(&cached);
+            }
+        }
+    }
 
-	file_.seekg(inodesbitmapoffset_);
-	file_.write((char*)inodesbitmap_.bits(), inodesbitmap_.size());
-	return file_.good();
+    // the cache lock can't be held while waiting on an inode
+    for (size_t i = 0; i < pinned.size(); i++)
+    {
+        {
+            shared_lock<ApeRwLock> lock(pinned[i]->lock);
+            ok = inodewriteback(*pinned[i]) && ok;
+        }
+        ok = inodeunpin(pinned[i]->inode.num, false) && ok;
+    }
+    return ok;
 }
 
-bool ApeFileSystem::inoderead(inodenum_t inodenum, ApeInode& inode)
+/*
+    Returns the cached inode, kept in memory until inodeunpin
+*/
+ApeCachedInode* ApeFileSystem::inodepin(inodenum_t inodenum, bool load)
 {
-    file_.seekp(inodesoffset_ + inodenum * sizeof(ApeInodeRaw));
-    file_.read((char*)&inode, sizeof(ApeInodeRaw));
-    return file_.good();
+    lock_guard<mutex> lock(inodecachelock_);
+    ApeCachedInode* cached = inodecached(inodenum, load);
+    if (cached == NULL)
+        return NULL;
+    cached->pins++;
+    return cached;
 }
 
-bool ApeFileSystem::inodewrite(ApeInode& inode)
+/*
+    With writeback, the inode is written once the last open file using it lets go
+*/
+bool ApeFileSystem::inodeunpin(inodenum_t inodenum, bool writeback)
 {
-    assert(inode.flags != 0);
-    file_.seekp(inodesoffset_ + inode.num * sizeof(ApeInodeRaw));
-    file_.write((char*)&inode, sizeof(ApeInodeRaw));
-    return file_.good();
+    lock_guard<mutex> lock(inodecachelock_);
+    map<inodenum_t, ApeCachedInode>::iterator it = inodecache_.find(inodenum);
+    if (it == inodecache_.end())
+        return false;
+    ApeCachedInode& cached = it->second;
+    if (cached.pins > 0 && --cached.pins == 0 && writeback && cached.dirty)
+        return inodewriteback(cached);
+    return true;
 }
 
 bool ApeFileSystem::inodeopen(const string& path, ApeInode& inode)
@@ -657,67 +4167,423 @@ bool ApeFileSystem::inodeopen(const string& path, ApeInode& inode)
     return true;
 }
 
-bool ApeFileSystem::create(const string& fspath, uint32_t fssize)
+bool ApeFileSystem::create(const string& fspath, uint64_t fssize, uint32_t cacheblocks, ApeStorageType storage, ApeSyncPolicy sync,
+                           ApeCompression compression, bool dedup)
+{
+    // a block map covers 128mb, block numbers stop short of INVALIDBLOCK
+    const uint64_t mapbytes = (uint64_t)BLOCKSIZE * 8 * BLOCKSIZE;
+    const uint32_t maxblockmaps = INVALIDBLOCK / (BLOCKSIZE * 8);
+
+    close();
+    if ((fssize + mapbytes - 1) / mapbytes > maxblockmaps || !storageopen(fspath, true, storage, sync))
+        return false;
+    syncpolicy_ = sync;
+    blockcache_.reserve(storage_->mapped() ? 0 : cacheblocks);
+    blockcache_.resetstats();
+
+    // set the superblock
+    memset(&superblock_, 0, sizeof(ApeSuperBlock));
+    superblock_.blockmaps = max((fssize + mapbytes - 1) / mapbytes, (uint64_t)1);
+    superblock_.filesystembytes = superblock_.blockmaps * mapbytes;
+    superblock_.inodemaps = MAXINODES / BLOCKSIZE / 8;
+    // one inode for every two blocks
+    superblock_.inodetableblocks = min(superblock_.blockmaps * BLOCKSIZE * 8 / 2, MAXINODES) / (BLOCKSIZE / INODESIZE);
+    strcpy(superblock_.magic, "apefs");
+    superblock_.version = APEVERSION;
+    superblock_.features = APEFEATURE_EXTENTS | APEFEATURE_DIRHASH | APEFEATURE_JOURNAL | APEFEATURE_INLINE | APEFEATURE_TAILS |
+                           APEFEATURE_HOSTINFO;
+    if (compression != APECOMPRESS_NONE)
+    {
+        superblock_.features |= APEFEATURE_COMPRESS;
+        superblock_.compression = compression;
+    }
+    superblock_.journalblocks = min(max(superblock_.blockmaps * BLOCKSIZE * 8 / 64, MINJOURNALBLOCKS), MAXJOURNALBLOCKS);
+    if (dedup)
+    {
+        superblock_.features |= APEFEATURE_DEDUP;
+        superblock_.dedupblocks = superblock_.blockmaps * BLOCKSIZE * 8 / DEDUPENTRIESPERBLOCK;
+    }
+
+    setoffsets();
+
+    // the new image reads as zeros, blank maps, inode table and journal included
+    if (!storage_->grow(imagesize()))
+        return false;
+    journal_.attach(storage_, journaloffset_, superblock_.journalblocks, BLOCKSIZE);
+
+    // write superblock to file, it has the first block to itself
+    if (!storage_->write(0, &superblock_, sizeof(ApeSuperBlock)))
+        return false;
+
+    // init bitmaps
+    inodesbitmap_.reserve(superblock_.inodemaps * BLOCKSIZE);
+    inodesbitmap_.unsetall();
+	blocksbitmap_.reserve(superblock_.blockmaps * BLOCKSIZE);
+    blocksbitmap_.unsetall();
+    bitmaplimit(inodesbitmap_, inodetableblocks_ * BLOCKSIZE / inodesize_);
+    dedupentries_.resize((size_t)superblock_.dedupblocks * DEDUPENTRIESPERBLOCK);
+
+    // create root folder
+    ApeInode rootinode;
+    if (!inodealloc(rootinode))
+        return false;
+    assert(rootinode.num == 0);
+    rootinode.flags |= APEFLAG_DIRECTORY;
+    return inodewrite(rootinode);
+}
+
+
+/*
+    Region offsets from the superblock,
+    version 1 images start the bitmaps right after the packed superblock
+*/
+void ApeFileSystem::setoffsets()
+{
+    if (superblock_.version == APEVERSION_1)
+    {
+        inodesbitmapoffset_ = SUPERBLOCKV1SIZE;
+    }
+    else
+    {
+        inodesbitmapoffset_ = BLOCKSIZE;
+    }
+    blocksbitmapoffset_ = inodesbitmapoffset_ + superblock_.inodemaps * BLOCKSIZE;
+    inodesoffset_ = blocksbitmapoffset_ + (uint64_t)superblock_.blockmaps * BLOCKSIZE;
+    if (superblock_.features & APEFEATURE_INLINE)
+    {
+        inodesize_ = INODESIZE;
+        inodetableblocks_ = superblock_.inodetableblocks;
+    }
+    else
+    {
+        inodesize_ = sizeof(ApeInodeRawV1);
+        inodetableblocks_ = superblock_.inodeblocks;
+    }
+    journaloffset_ = inodesoffset_ + (uint64_t)inodetableblocks_ * BLOCKSIZE;
+    dedupoffset_ = journaloffset_ + (uint64_t)superblock_.journalblocks * BLOCKSIZE;
+    blocksoffset_ = dedupoffset_ + (uint64_t)superblock_.dedupblocks * BLOCKSIZE;
+}
+
+/*
+    Bytes from the start of the image to the end of its last block
+*/
+uint64_t ApeFileSystem::imagesize() const
+{
+    return blocksoffset_ + (uint64_t)superblock_.blockmaps * BLOCKSIZE * 8 * BLOCKSIZE;
+}
+
+uint64_t ApeFileSystem::size() const
+{
+    if (superblock_.version >= APEVERSION_3)
+        return superblock_.filesystembytes;
+    return (uint64_t)superblock_.blockmaps * BLOCKSIZE * 8 * BLOCKSIZE;
+}
+
+ApeSyncPolicy ApeFileSystem::syncpolicy() const
+{
+    return syncpolicy_;
+}
+
+ApeCompression ApeFileSystem::compression() const
+{
+    if (!(superblock_.features & APEFEATURE_COMPRESS))
+        return APECOMPRESS_NONE;
+    return (ApeCompression)superblock_.compression;
+}
+
+bool ApeFileSystem::dedup() const
+{
+    return (superblock_.features & APEFEATURE_DEDUP) != 0;
+}
+
+ApeDedupStats ApeFileSystem::dedupstats() const
+{
+    lock_guard<mutex> lock(deduplock_);
+    return dedupstats_;
+}
+
+/*
+    Block and inode usage, straight from the bitmap counters.
+    Blocks waiting for the journal commit count as free.
+*/
+bool ApeFileSystem::statfs(ApeFsStat& stat) const
+{
+    if (!storage_->isopen())
+        return false;
+
+    stat.blocksize = BLOCKSIZE;
+    stat.totalinodes = inodetableblocks_ * BLOCKSIZE / inodesize_;
+    {
+        lock_guard<mutex> lock(blockslock_);
+        stat.totalblocks = blocksbitmap_.size() * 8;
+        stat.freeblocks = blocksbitmap_.countunset() + journalfreed_.size();
+    }
+    lock_guard<mutex> lock(inodeslock_);
+    stat.freeinodes = inodesbitmap_.countunset();
+    return true;
+}
+
+/*
+    Reads data blocks straight from the image, those in the block cache
+    or the journal pages may be newer and are copied over. Lets tools restoring many files read
+    the image in block order with large reads, see fileextents.
+*/
+bool ApeFileSystem::blocksread(blocknum_t start, uint32_t count, void* buffer)
+{
+    if (!storage_->isopen() || count == 0 || count > (uint32_t)-1 / BLOCKSIZE)
+        return false;
+    {
+        lock_guard<mutex> lock(blockslock_);
+        uint32_t total = blocksbitmap_.size() * 8;
+        if (start >= total || count > total - start)
+            return false;
+    }
+
+    if (!storage_->read(blocksoffset_ + (uint64_t)start * BLOCKSIZE, buffer, count * BLOCKSIZE))
+        return false;
+    // fragment blocks are metadata, they may be waiting for the commit
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint8_t* data = (uint8_t*)buffer + (size_t)i * BLOCKSIZE;
+        if (!blockcache_.peek(start + i, data))
+            journalpeek(blocksoffset_ + (uint64_t)(start + i) * BLOCKSIZE, data);
+    }
+    return true;
+}
+
+/*
+    Walks the tree from the root and cross-checks it against the bitmaps,
+    what's wrong is appended to problems. Must not run along other calls,
+    writes in flight would show up as problems.
+*/
+bool ApeFileSystem::check(vector<string>& problems)
 {
-    file_.open(fspath.c_str(), ios::in | ios::out | ios::binary | ios::trunc);
-    if (!file_.good())
+    unique_lock<ApeRwLock> lock(namespacelock_);
+    if (!storage_->isopen())
         return false;
 
-    // set the superblock
-    superblock_.blockmaps = (uint8_t) ceil((float)fssize / BLOCKSIZE / (BLOCKSIZE * 8));
-    superblock_.filesystemsize = superblock_.blockmaps * BLOCKSIZE;
-    superblock_.inodemaps = MAXINODES / BLOCKSIZE / 8;
-    superblock_.inodeblocks = (uint8_t) ceil((float)BLOCKSIZE + sizeof(ApeInodeRaw));
-    strcpy(superblock_.magic, "apefs");
-    superblock_.version = 1;
+    uint32_t totalblocks;
+    {
+        lock_guard<mutex> blockslock(blockslock_);
+        totalblocks = blocksbitmap_.size() * 8;
+    }
+    uint32_t totalinodes = inodetableblocks_ * BLOCKSIZE / inodesize_;
+    vector<inodenum_t> owners(totalblocks, INVALIDINODE);
+    vector<uint32_t> uses(totalblocks, 0); // shared blocks are used more than once
+    map<blocknum_t, vector<inodenum_t> > fragmentowners; // shared by packed files
+    vector<bool> reachable(totalinodes, false);
+    size_t firstproblem = problems.size();
+    ostringstream problem;
+
+    // inodes to visit, with their path and the kind their entry says they are
+    vector<pair<inodenum_t, string> > pending;
+    vector<uint8_t> pendingflags;
+    pending.push_back(make_pair(0, string("/")));
+    pendingflags.push_back(APEFLAG_DIRECTORY);
+    reachable[0] = true;
+
+    while (!pending.empty())
+    {
+        inodenum_t num = pending.back().first;
+        string path = pending.back().second;
+        uint8_t flags = pendingflags.back();
+        pending.pop_back();
+        pendingflags.pop_back();
+
+        ApeInode inode;
+        if (!inoderead(num, inode))
+        {
+            problems.push_back(path + ": inode can't be read");
+            continue;
+        }
+
+        problem.str("");
+        if (inode.num != num)
+            problem << path << ": inode " << num << " says it's inode " << inode.num;
+        else if ((inode.flags & (APEFLAG_FILE | APEFLAG_DIRECTORY)) != flags)
+            problem << path << ": inode kind doesn't match its directory entry";
+        else if (inode.isinline() && (inode.size > inlinesize() || inode.blockscount != 0))
+            problem << path << ": inline data of " << inode.size << " bytes past the inode";
+        else if (inode.iscompressed() && inode.blockscount != (inode.size + (uint64_t)CLUSTERSIZE - 1) / CLUSTERSIZE)
+            problem << path << ": size " << inode.size << " doesn't match its " << inode.blockscount << " clusters";
+        else if (inode.isfile() && !inode.isinline() && !inode.ispacked() && !inode.iscompressed() &&
+                 inode.size > (uint64_t)inode.blockscount * BLOCKSIZE)
+            problem << path << ": size " << inode.size << " past its " << inode.blockscount << " blocks";
+        if (!problem.str().empty())
+            problems.push_back(problem.str());
+
+        if (inode.ispacked())
+        {
+            const ApeFragments& fragments = *inode.fragments();
+            uint64_t tail = inode.size - (uint64_t)inode.blockscount * BLOCKSIZE;
+            problem.str("");
+            if (!inode.hasextents() || inode.size <= (uint64_t)inode.blockscount * BLOCKSIZE ||
+                tail > (uint64_t)fragments.count * FRAGMENTSIZE || tail + FRAGMENTSIZE <= (uint64_t)fragments.count * FRAGMENTSIZE)
+                problem << path << ": tail of " << tail << " bytes doesn't match its " << fragments.count << " fragments";
+            else if (fragments.block >= totalblocks || fragments.first == 0 || fragments.first + fragments.count > FRAGMENTSPERBLOCK)
+                problem << path << ": tail fragments " << fragments.first << "+" << fragments.count << " of block " << fragments.block << " out of range";
+            if (!problem.str().empty())
+            {
+                problems.push_back(problem.str());
+            }
+            else
+            {
+                vector<inodenum_t>& fragmentowner = fragmentowners[fragments.block];
+                fragmentowner.resize(FRAGMENTSPERBLOCK, INVALIDINODE);
+                for (uint32_t i = fragments.first; i < (uint32_t)fragments.first + fragments.count; i++)
+                {
+                    problem.str("");
+                    if (fragmentowner[i] != INVALIDINODE)
+                        problem << path << ": fragment " << i << " of block " << fragments.block << " also used by inode " << fragmentowner[i];
+                    else
+                        fragmentowner[i] = num;
+                    if (!problem.str().empty())
+                        problems.push_back(problem.str());
+                }
+            }
+        }
 
-    // set the offsets
-	inodesbitmapoffset_ = sizeof(ApeSuperBlock);
-	blocksbitmapoffset_ = inodesbitmapoffset_ + superblock_.inodemaps * BLOCKSIZE;
-	inodesoffset_ = blocksbitmapoffset_ + superblock_.blockmaps * BLOCKSIZE;
-	blocksoffset_ = inodesoffset_ + superblock_.inodeblocks * BLOCKSIZE;
+        vector<blocknum_t> blocks;
+        if (!inodeblocks(inode, blocks))
+            problems.push_back(path + ": block map can't be read");
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            problem.str("");
+            if (blocks[i] >= totalblocks)
+                problem << path << ": block " << blocks[i] << " out of range";
+            else if (owners[blocks[i]] != INVALIDINODE && (blocks[i] >= dedupentries_.size() || dedupentries_[blocks[i]].refs < 2))
+                problem << path << ": block " << blocks[i] << " also used by inode " << owners[blocks[i]];
+            else
+                owners[blocks[i]] = num;
+            if (blocks[i] < totalblocks)
+                uses[blocks[i]]++;
+            if (!problem.str().empty())
+                problems.push_back(problem.str());
+        }
 
-    // write superblock to file
-    file_.write((char*)&superblock_, sizeof(ApeSuperBlock));
+        if (!inode.isdirectory())
+            continue;
 
-    // write all necessary blanks
-    char *blank = new char[BLOCKSIZE];
-    memset(blank, 0, BLOCKSIZE);
+        vector<ApeDirectoryEntry> entries;
+        if (!directoryentries(inode, entries))
+            problems.push_back(path + ": entries can't be read");
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            string entrypath = joinpath(path, entries[i].name);
+            problem.str("");
+            if (entries[i].inodenum >= totalinodes)
+                problem << entrypath << ": inode " << entries[i].inodenum << " out of range";
+            else if (reachable[entries[i].inodenum])
+                problem << entrypath << ": inode " << entries[i].inodenum << " linked twice";
+            if (!problem.str().empty())
+            {
+                problems.push_back(problem.str());
+                continue;
+            }
+            reachable[entries[i].inodenum] = true;
+            pending.push_back(make_pair(entries[i].inodenum, entrypath));
+            pendingflags.push_back(entries[i].flags & (APEFLAG_FILE | APEFLAG_DIRECTORY));
+        }
+    }
 
-    int totalblanks = superblock_.blockmaps + superblock_.inodemaps + superblock_.inodeblocks;
-    for (int i = 0; i < totalblanks; i++)
-        file_.write(blank, BLOCKSIZE);
+    // fragment blocks have to say the same about who owns what
+    map<blocknum_t, vector<inodenum_t> >::iterator fragmentit;
+    for (fragmentit = fragmentowners.begin(); fragmentit != fragmentowners.end(); ++fragmentit)
+    {
+        blocknum_t num = fragmentit->first;
+        const vector<inodenum_t>& fragmentowner = fragmentit->second;
+        ApeBlock block;
+        const ApeFragmentHeader* header = (const ApeFragmentHeader*)block.data;
+        problem.str("");
+        if (owners[num] != INVALIDINODE)
+            problem << "fragment block " << num << " also used by inode " << owners[num];
+        else if (!blockread(num, block) || header->magic != FRAGMENTMAGIC)
+            problem << "fragment block " << num << " has no fragment header";
+        if (!problem.str().empty())
+        {
+            problems.push_back(problem.str());
+            continue;
+        }
 
-    delete[] blank;
+        for (uint32_t i = 1; i < FRAGMENTSPERBLOCK; i++)
+        {
+            if (owners[num] == INVALIDINODE)
+                owners[num] = fragmentowner[i];
+            problem.str("");
+            if (header->owners[i] != fragmentowner[i])
+                problem << "fragment " << i << " of block " << num << " owned by inode " << (int32_t)header->owners[i]
+                        << " but used by inode " << (int32_t)fragmentowner[i];
+            if (!problem.str().empty())
+                problems.push_back(problem.str());
+        }
+    }
 
-    // init bitmaps
-    inodesbitmap_.reserve(superblock_.inodemaps * BLOCKSIZE);
-    inodesbitmap_.unsetall();
-	blocksbitmap_.reserve(superblock_.blockmaps * BLOCKSIZE);
-    blocksbitmap_.unsetall();
+    {
+        lock_guard<mutex> inodeslock(inodeslock_);
+        for (inodenum_t num = 0; num < totalinodes; num++)
+        {
+            problem.str("");
+            if (reachable[num] && !inodesbitmap_.getbit(num))
+                problem << "inode " << num << " in use but free in the bitmap";
+            else if (!reachable[num] && inodesbitmap_.getbit(num))
+                problem << "inode " << num << " allocated but unreachable";
+            if (!problem.str().empty())
+                problems.push_back(problem.str());
+        }
+    }
 
-    // create root folder
-    ApeInode rootinode;
-    if (!inodealloc(rootinode))
-        return false;
-    assert(rootinode.num == 0);
-    rootinode.flags = APEFLAG_DIRECTORY;
-    return inodewrite(rootinode);
-}
+    // the dedup table has to count every use of a block in it
+    {
+        lock_guard<mutex> deduplock(deduplock_);
+        for (blocknum_t num = 0; num < totalblocks && num < dedupentries_.size(); num++)
+        {
+            problem.str("");
+            if (dedupentries_[num].refs > 0 && dedupentries_[num].refs != uses[num])
+                problem << "block " << num << " used " << uses[num] << " times but counts " << dedupentries_[num].refs << " references";
+            if (!problem.str().empty())
+                problems.push_back(problem.str());
+        }
+    }
 
+    lock_guard<mutex> blockslock(blockslock_);
+    // blocks freed since the last commit have no owner but are still allocated
+    vector<bool> freed(totalblocks, false);
+    for (size_t i = 0; i < journalfreed_.size(); i++)
+    {
+        if (journalfreed_[i] < totalblocks)
+            freed[journalfreed_[i]] = true;
+    }
+    // blocks held for growing files are allocated but have no owner yet
+    map<inodenum_t, ApeReservation>::iterator it;
+    for (it = reservations_.begin(); it != reservations_.end(); ++it)
+    {
+        for (uint32_t i = 0; i < it->second.count; i++)
+        {
+            if (it->second.start + i < totalblocks)
+                owners[it->second.start + i] = it->first;
+        }
+    }
+    for (blocknum_t num = 0; num < totalblocks; num++)
+    {
+        problem.str("");
+        if (owners[num] != INVALIDINODE && !blocksbitmap_.getbit(num))
+            problem << "block " << num << " of inode " << owners[num] << " free in the bitmap";
+        else if (owners[num] == INVALIDINODE && blocksbitmap_.getbit(num) && !freed[num])
+            problem << "block " << num << " allocated but unused";
+        if (!problem.str().empty())
+            problems.push_back(problem.str());
+    }
 
-uint32_t ApeFileSystem::size() const
-{
-    return superblock_.filesystemsize;
+    return problems.size() == firstproblem;
 }
 
 bool ApeFileSystem::parsepath(const string &path, vector<string> &parsedpath)
 {
     parsedpath.clear();
-    unsigned int sep = path.find('/');
+    string::size_type sep = path.find('/');
     while (sep != string::npos)
     {
-        unsigned int nextsep = path.find('/', sep + 1);
+        string::size_type nextsep = path.find('/', sep + 1);
         string piece = path.substr(sep + 1, nextsep - 1 - sep);
         if (piece.length() > 0)
             parsedpath.push_back(piece);
@@ -738,7 +4604,7 @@ string ApeFileSystem::joinpath(const string& p1, const string& p2)
 
 string ApeFileSystem::extractdirectory(const string &path)
 {
-	unsigned int sep = path.rfind('/');
+	string::size_type sep = path.rfind('/');
 	if (sep != string::npos && sep == path.length() - 1)
 	{
 		sep = path.rfind('/', sep - 1);
@@ -752,12 +4618,12 @@ string ApeFileSystem::extractdirectory(const string &path)
 
 string ApeFileSystem::extractfilename(const string &path)
 {
-    unsigned int sep;
+    string::size_type sep;
 	if (path.length() != 0 && path[path.length() - 1] == '/')
 	{
 		sep = path.rfind('/', path.length() - 2);
 		if (sep != string::npos)
-			return path.substr(sep + 1, path.length() - 2);
+			return path.substr(sep + 1, path.length() - 2 - sep);
 	}
 	else
 	{
@@ -780,59 +4646,43 @@ bool ApeFileSystem::directoryaddentry(ApeInode& inode, ApeDirectoryEntry& entry)
     if (directoryfindentry(inode, entry.name, dummyentry))
         return false;
 
+    if (!directorystoreentry(inode, entry))
+        return false;
+    dentryinsert(inode.num, entry.name, entry.inodenum, entry.flags);
+    return true;
+}
+
+/*
+    Writes the entry in the first directory block with room for it.
+    Linear directories that outgrow DIRHASHBLOCKS are converted to hashed ones.
+*/
+bool ApeFileSystem::directorystoreentry(ApeInode& inode, ApeDirectoryEntry& entry)
+{
+    if (inode.ishashed())
+        return directoryhashinsert(inode, entry);
+
     ApeBlock block;
-    entry.namelen = entry.name.length();
-    entry.entrysize = entry.realsize();
+    int32_t sizedelta;
 
     int n = -1;
     while (blockread(inode, ++n, block))
     {
-        unsigned int i = 0;
-        ApeDirectoryEntryRaw *pentry = NULL;
-        ApeDirectoryEntryRaw *ientry = (ApeDirectoryEntryRaw*)&block.data[0];
-
-        while (i < BLOCKSIZE && ientry->entrysize != 0)
+        if (directoryblockinsert(block, entry, sizedelta))
         {
-            int entryfreesize = ientry->freesize();
-
-            // fits in the free space?
-            if (entryfreesize >= entry.entrysize)
-            {
-                ientry->entrysize -= entryfreesize;
-                entry.entrysize = entryfreesize;
-                entry.write(&block.data[i + ientry->entrysize]);
-                return blockwrite(block);
-            }
-
-            pentry = ientry;
-            i += ientry->entrysize;
-            ientry = (ApeDirectoryEntryRaw*)&block.data[i];
-        }
-
-        // fits after the last (if any) entry?
-        if (i < BLOCKSIZE)
-        {
-            int freesize = pentry ? BLOCKSIZE - (i - pentry->freesize()) : BLOCKSIZE - i;
-            if (freesize >= entry.entrysize)
-            {
-                if (pentry)
-                {
-                    inode.size -= pentry->freesize();
-                    pentry->entrysize = pentry->realsize();
-                }
-                inode.size += entry.entrysize;
-                entry.write(&block.data[BLOCKSIZE - freesize]);
-                return inodewrite(inode) && blockwrite(block);
-            }
+            inode.size += sizedelta;
+            return (sizedelta == 0 || inodewrite(inode)) && blockwrite(block);
         }
     }
 
+    if (inode.blockscount >= DIRHASHBLOCKS && (superblock_.features & APEFEATURE_DIRHASH) != 0)
+        return directoryhashconvert(inode, entry);
+
     // we will need a new block
     if (blockalloc(inode, block))
     {
         block.fill(0); // fill null entries
-        entry.write(&block.data[0]);
-        inode.size += entry.entrysize;
+        directoryblockinsert(block, entry, sizedelta);
+        inode.size += sizedelta;
         return inodewrite(inode) && blockwrite(block);
     }
 
@@ -841,94 +4691,467 @@ bool ApeFileSystem::directoryaddentry(ApeInode& inode, ApeDirectoryEntry& entry)
 
 bool ApeFileSystem::directoryfindentry(ApeInode& inode, const string& name, ApeDirectoryEntry& entry)
 {
+    if (dentrylookup(inode.num, name, entry))
+        return entry.inodenum != INVALIDINODE;
+
     ApeBlock block;
+    const uint8_t* data;
+    bool found = false;
 
-    int n = -1;
-    while (blockread(inode, ++n, block))
+    if (inode.ishashed())
     {
-        unsigned int i = 0;
+        uint32_t slot;
+        found = directoryhashslot(inode, directoryhash(name), slot) &&
+                (data = blockpeek(inode, slot & DIRSLOTPOSMASK, block.data)) != NULL &&
+                directoryblockfind(data, name, entry);
+    }
+    else
+    {
+        int n = -1;
+        while (!found && (data = blockpeek(inode, ++n, block.data)) != NULL)
+            found = directoryblockfind(data, name, entry);
+    }
 
-        do
+    if (found)
+        dentryinsert(inode.num, name, entry.inodenum, entry.flags);
+    else
+        dentryinsert(inode.num, name, INVALIDINODE, 0);
+    return found;
+}
+
+bool ApeFileSystem::directoryremoveentry(ApeInode& inode, const string& name)
+{
+    if (!directoryeraseentry(inode, name))
+        return false;
+    dentryinsert(inode.num, name, INVALIDINODE, 0);
+    return true;
+}
+
+bool ApeFileSystem::directoryeraseentry(ApeInode& inode, const string& name)
+{
+    ApeBlock block;
+    int32_t sizedelta;
+    bool found = false;
+
+    if (inode.ishashed())
+    {
+        uint32_t slot;
+        found = directoryhashslot(inode, directoryhash(name), slot) &&
+                blockread(inode, slot & DIRSLOTPOSMASK, block) &&
+                directoryblockremove(block, name, sizedelta);
+    }
+    else
+    {
+        int n = -1;
+        while (!found && blockread(inode, ++n, block))
+            found = directoryblockremove(block, name, sizedelta);
+    }
+
+    if (!found)
+        return false;
+    if (sizedelta != 0)
+    {
+        inode.size += sizedelta;
+        if (!inodewrite(inode))
+            return false;
+    }
+    return blockwrite(block);
+}
+
+/*
+    32 bit FNV-1a of a name, picks its bucket in hashed directories
+*/
+uint32_t ApeFileSystem::directoryhash(const string& name)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < name.length(); i++)
+    {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+    Reads the index slot of hash in a hashed directory
+*/
+bool ApeFileSystem::directoryhashslot(const ApeInode& inode, uint32_t hash, uint32_t& slot)
+{
+    uint32_t index = hash & (DIRINDEXSLOTS - 1);
+    ApeBlock block;
+    const uint8_t* data = blockpeek(inode, index / DIRSLOTSPERBLOCK, block.data);
+    if (data == NULL)
+        return false;
+    slot = ((const uint32_t*)data)[index % DIRSLOTSPERBLOCK];
+    return true;
+}
+
+/*
+    Inserts in the bucket of the name hash, splitting it while it's full
+*/
+bool ApeFileSystem::directoryhashinsert(ApeInode& inode, ApeDirectoryEntry& entry)
+{
+    uint32_t hash = directoryhash(entry.name);
+    ApeBlock block;
+    uint32_t slot;
+    int32_t sizedelta;
+
+    for (;;)
+    {
+        if (!directoryhashslot(inode, hash, slot) || !blockread(inode, slot & DIRSLOTPOSMASK, block))
+            return false;
+
+        if (directoryblockinsert(block, entry, sizedelta))
         {
-            ApeDirectoryEntryRaw* ientry = (ApeDirectoryEntryRaw*)&block.data[i];
-            if (ientry->entrysize == 0)
-                break;
+            inode.size += sizedelta;
+            return (sizedelta == 0 || inodewrite(inode)) && blockwrite(block);
+        }
+
+        // a full bucket at the maximum depth can't take more names of this hash
+        if ((slot >> DIRSLOTDEPTHSHIFT) >= DIRINDEXDEPTH || !directoryhashsplit(inode, hash, slot, block))
+            return false;
+    }
+}
+
+/*
+    Splits the bucket of hash in two, its names move to a new bucket
+    when the hash bit of the new depth is set. Buckets are never merged back.
+*/
+bool ApeFileSystem::directoryhashsplit(ApeInode& inode, uint32_t hash, uint32_t slot, ApeBlock& bucket)
+{
+    uint32_t depth = slot >> DIRSLOTDEPTHSHIFT;
+    uint32_t bucketpos = slot & DIRSLOTPOSMASK;
+
+    ApeBlock newbucket;
+    if (!blockalloc(inode, newbucket))
+        return false;
+    uint32_t newbucketpos = inode.blockscount - 1;
+
+    vector<ApeDirectoryEntry> entries;
+    directoryblockentries(bucket.data, entries);
+    bucket.fill(0);
+    newbucket.fill(0);
+
+    // repacking drops the free space entries kept, the size follows
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        int32_t sizedelta;
+        ApeBlock& target = ((directoryhash(entries[i].name) >> depth) & 1) ? newbucket : bucket;
+        inode.size -= entries[i].entrysize;
+        directoryblockinsert(target, entries[i], sizedelta);
+        inode.size += sizedelta;
+    }
+
+    // every slot of the old bucket gets the new depth, half of them the new bucket
+    ApeBlock index;
+    uint32_t indexpos = INVALIDBLOCK;
+    for (uint32_t i = hash & ((1 << depth) - 1); i < DIRINDEXSLOTS; i += 1 << depth)
+    {
+        if (i / DIRSLOTSPERBLOCK != indexpos)
+        {
+            if (indexpos != INVALIDBLOCK && !blockwrite(index))
+                return false;
+            indexpos = i / DIRSLOTSPERBLOCK;
+            if (!blockread(inode, indexpos, index))
+                return false;
+        }
+        uint32_t pos = ((i >> depth) & 1) ? newbucketpos : bucketpos;
+        ((uint32_t*)index.data)[i % DIRSLOTSPERBLOCK] = ((depth + 1) << DIRSLOTDEPTHSHIFT) | pos;
+    }
+
+    return blockwrite(index) && blockwrite(bucket) && blockwrite(newbucket) && inodewrite(inode);
+}
+
+/*
+    Turns a full linear directory into a hashed one, entry included.
+    The names are spread over enough buckets to leave each a quarter free.
+*/
+bool ApeFileSystem::directoryhashconvert(ApeInode& inode, ApeDirectoryEntry& entry)
+{
+    vector<ApeDirectoryEntry> entries;
+    ApeBlock block;
+    const uint8_t* data;
+    uint32_t run;
+
+    int n = -1;
+    while ((data = blockpeek(inode, ++n, block.data)) != NULL)
+        directoryblockentries(data, entries);
+    entry.namelen = entry.name.length();
+    entry.entrysize = entry.realsize();
+    entries.push_back(entry);
+
+    vector<uint32_t> hashes(entries.size());
+    for (size_t i = 0; i < entries.size(); i++)
+        hashes[i] = directoryhash(entries[i].name);
+
+    uint32_t depth = 0;
+    for (;;)
+    {
+        vector<uint32_t> used(1 << depth, 0);
+        bool fits = true;
+        for (size_t i = 0; i < entries.size() && fits; i++)
+        {
+            uint32_t& bucketused = used[hashes[i] & ((1 << depth) - 1)];
+            bucketused += entries[i].realsize();
+            fits = bucketused <= BLOCKSIZE * 3 / 4;
+        }
+        if (fits)
+            break;
+        if (++depth > DIRINDEXDEPTH)
+            return false;
+    }
+
+    uint32_t buckets = 1 << depth;
+    while (inode.blockscount < DIRINDEXBLOCKS + buckets)
+    {
+        if (!blockalloc(inode, block))
+            return false;
+    }
 
-            if (ientry->namelen == name.length())
+    for (uint32_t pos = 0; pos < DIRINDEXBLOCKS; pos++)
+    {
+        if (!blockmap(inode, pos, block.num, run))
+            return false;
+        uint32_t* slots = (uint32_t*)block.data;
+        for (uint32_t i = 0; i < DIRSLOTSPERBLOCK; i++)
+            slots[i] = (depth << DIRSLOTDEPTHSHIFT) | (DIRINDEXBLOCKS + ((pos * DIRSLOTSPERBLOCK + i) & (buckets - 1)));
+        if (!blockwrite(block))
+            return false;
+    }
+
+    // blocks past the buckets, if any, are left empty
+    inode.size = 0;
+    for (uint32_t pos = DIRINDEXBLOCKS; pos < inode.blockscount; pos++)
+    {
+        if (!blockmap(inode, pos, block.num, run))
+            return false;
+        block.fill(0);
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            int32_t sizedelta;
+            if (DIRINDEXBLOCKS + (hashes[i] & (buckets - 1)) == pos)
             {
-                entry.read(ientry);
-                if (entry.name == name)
-                    return true;
+                directoryblockinsert(block, entries[i], sizedelta);
+                inode.size += sizedelta;
             }
+        }
+        if (!blockwrite(block))
+            return false;
+    }
+
+    inode.flags |= APEFLAG_HASHED;
+    return inodewrite(inode);
+}
+
+/*
+    Directory block helpers, the same format is used by linear
+    directories and hashed directory buckets.
+    The directory size is the space taken by its entries (free space kept
+    after an entry included), sizedelta receives the change.
+*/
+bool ApeFileSystem::directoryblockfind(const uint8_t* data, const string& name, ApeDirectoryEntry& entry)
+{
+    unsigned int i = 0;
+
+    do
+    {
+        ApeDirectoryEntryRaw* ientry = (ApeDirectoryEntryRaw*)&data[i];
+        if (ientry->entrysize == 0)
+            break;
 
-            i += ientry->entrysize;
+        if (ientry->namelen == name.length())
+        {
+            entry.read(ientry);
+            if (entry.name == name)
+                return true;
         }
-        while (i < BLOCKSIZE);
+
+        i += ientry->entrysize;
     }
+    while (i + sizeof(ApeDirectoryEntryRaw) <= BLOCKSIZE);
 
     return false;
 }
 
-bool ApeFileSystem::directoryremoveentry(ApeInode& inode, const string& name)
+void ApeFileSystem::directoryblockentries(const uint8_t* data, vector<ApeDirectoryEntry>& entries)
 {
-    ApeBlock block;
-    int n = -1;
+    unsigned int i = 0;
 
-    while (blockread(inode, ++n, block))
+    do
     {
-        unsigned int i = 0;
-        ApeDirectoryEntryRaw *pentry = NULL;
+        ApeDirectoryEntryRaw* ientry = (ApeDirectoryEntryRaw*)&data[i];
+        if (ientry->entrysize == 0)
+            break;
 
-        do
+        ApeDirectoryEntry entry;
+        entry.read(ientry);
+        entries.push_back(entry);
+
+        i += ientry->entrysize;
+    }
+    while (i + sizeof(ApeDirectoryEntryRaw) <= BLOCKSIZE);
+}
+
+bool ApeFileSystem::directoryblockinsert(ApeBlock& block, ApeDirectoryEntry& entry, int32_t& sizedelta)
+{
+    entry.namelen = entry.name.length();
+    entry.entrysize = entry.realsize();
+
+    unsigned int i = 0;
+    ApeDirectoryEntryRaw *pentry = NULL;
+    ApeDirectoryEntryRaw *ientry = (ApeDirectoryEntryRaw*)&block.data[0];
+
+    while (i + sizeof(ApeDirectoryEntryRaw) <= BLOCKSIZE && ientry->entrysize != 0)
+    {
+        int entryfreesize = ientry->freesize();
+
+        // fits in the free space?
+        if (entryfreesize >= entry.entrysize)
         {
-            ApeDirectoryEntryRaw *ientry = (ApeDirectoryEntryRaw*)&block.data[i];
-            if (ientry->entrysize == 0)
-                break;
+            ientry->entrysize -= entryfreesize;
+            entry.entrysize = entryfreesize;
+            entry.write(&block.data[i + ientry->entrysize]);
+            sizedelta = 0;
+            return true;
+        }
+
+        pentry = ientry;
+        i += ientry->entrysize;
+        ientry = (ApeDirectoryEntryRaw*)&block.data[i];
+    }
+
+    // fits after the last (if any) entry?
+    if (i < BLOCKSIZE)
+    {
+        int freesize = pentry ? BLOCKSIZE - (i - pentry->freesize()) : BLOCKSIZE - i;
+        if (freesize >= entry.entrysize)
+        {
+            sizedelta = entry.entrysize;
+            if (pentry)
+            {
+                sizedelta -= pentry->freesize();
+                pentry->entrysize = pentry->realsize();
+            }
+            entry.write(&block.data[BLOCKSIZE - freesize]);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool ApeFileSystem::directoryblockremove(ApeBlock& block, const string& name, int32_t& sizedelta)
+{
+    unsigned int i = 0;
+    ApeDirectoryEntryRaw *pentry = NULL;
 
-            if (ientry->namelen == name.length())
+    do
+    {
+        ApeDirectoryEntryRaw *ientry = (ApeDirectoryEntryRaw*)&block.data[i];
+        if (ientry->entrysize == 0)
+            break;
+
+        if (ientry->namelen == name.length())
+        {
+            ApeDirectoryEntry entry;
+            entry.read(ientry);
+            if (entry.name == name)
             {
-                ApeDirectoryEntry entry;
-                entry.read(ientry);
-                if (entry.name == name)
+                sizedelta = 0;
+                if (pentry)
+                {
+                    // if there is a previous entry increase its size
+                    pentry->entrysize += ientry->entrysize;
+                }
+                else
                 {
-                    if (pentry)
+                    // first entry of the block
+                    unsigned int n = i + ientry->entrysize;
+                    ApeDirectoryEntryRaw *nentry = (ApeDirectoryEntryRaw*)&block.data[n];
+                    if (n + sizeof(ApeDirectoryEntryRaw) <= BLOCKSIZE && nentry->entrysize != 0)
                     {
-                        // if there is a previous entry increase its size
-                        pentry->entrysize += ientry->entrysize;
+                        // replace current with the next entry
+                        nentry->entrysize += ientry->entrysize;
+                        memmove(ientry, nentry, nentry->realsize());
                     }
                     else
                     {
-                        // first entry of the block
-                        ApeDirectoryEntryRaw *nentry = (ApeDirectoryEntryRaw*)&block.data[i + ientry->entrysize];
-                        if (nentry->entrysize != 0)
-                        {
-                            // replace current with the next entry
-                            nentry->entrysize += ientry->entrysize;
-                            memcpy(ientry, nentry, nentry->realsize());
-                        }
-                        else
-                        {
-                            // the first and final entry of the block
-                            // just mark as empty
-                            inode.size -= ientry->entrysize;
-                            ientry->entrysize = 0;
-                            if (!inodewrite(inode))
-                                return false;
-                        }
+                        // the first and final entry of the block, mark as empty
+                        // clearing the name too, a shorter entry written later can't end in it
+                        sizedelta = -(int32_t)ientry->entrysize;
+                        memset(ientry, 0, ientry->entrysize);
                     }
-                    return blockwrite(block);
                 }
+                return true;
             }
-
-            i += ientry->entrysize;
-            pentry = ientry;
         }
-        while (i < BLOCKSIZE);
+
+        i += ientry->entrysize;
+        pentry = ientry;
     }
+    while (i + sizeof(ApeDirectoryEntryRaw) <= BLOCKSIZE);
 
     return false;
 }
 
+/*
+    Looks name up in the dentry cache, entry.inodenum is INVALIDINODE
+    if the name is known not to exist. Returns false on a miss.
+*/
+bool ApeFileSystem::dentrylookup(inodenum_t parent, const string& name, ApeDirectoryEntry& entry)
+{
+    lock_guard<mutex> lock(dentrylock_);
+    map<ApeDentryKey, ApeCachedDentry>::iterator it = dentrycache_.find(ApeDentryKey(parent, name));
+    if (it == dentrycache_.end())
+        return false;
+
+    dentrylru_.splice(dentrylru_.begin(), dentrylru_, it->second.lru);
+    entry.inodenum = it->second.inodenum;
+    entry.flags = it->second.flags;
+    entry.name = name;
+    entry.namelen = name.length();
+    entry.entrysize = entry.realsize();
+    return true;
+}
+
+void ApeFileSystem::dentryinsert(inodenum_t parent, const string& name, inodenum_t inodenum, uint8_t flags)
+{
+    lock_guard<mutex> lock(dentrylock_);
+    ApeDentryKey key(parent, name);
+    map<ApeDentryKey, ApeCachedDentry>::iterator it = dentrycache_.find(key);
+    if (it == dentrycache_.end())
+    {
+        if (dentrycache_.size() >= DENTRYCACHESIZE)
+        {
+            dentrycache_.erase(dentrylru_.back());
+            dentrylru_.pop_back();
+        }
+        dentrylru_.push_front(key);
+        it = dentrycache_.insert(make_pair(key, ApeCachedDentry())).first;
+        it->second.lru = dentrylru_.begin();
+    }
+    else
+    {
+        dentrylru_.splice(dentrylru_.begin(), dentrylru_, it->second.lru);
+    }
+    it->second.inodenum = inodenum;
+    it->second.flags = flags;
+}
+
+/*
+    Forgets all the cached names of a directory
+*/
+void ApeFileSystem::dentrydrop(inodenum_t parent)
+{
+    lock_guard<mutex> lock(dentrylock_);
+    map<ApeDentryKey, ApeCachedDentry>::iterator it = dentrycache_.lower_bound(ApeDentryKey(parent, ""));
+    while (it != dentrycache_.end() && it->first.first == parent)
+    {
+        dentrylru_.erase(it->second.lru);
+        dentrycache_.erase(it++);
+    }
+}
+
 uint16_t ApeDirectoryEntryRaw::realsize() const
 {
     return sizeof(ApeDirectoryEntryRaw) + namelen + 1;
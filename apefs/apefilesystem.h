@@ -5,18 +5,45 @@
 #ifndef APEFILESYSTEM_H
 #define APEFILESYSTEM_H
 
-#include <fstream>
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
+#include <list>
+#include <unordered_map>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <shared_mutex>
+#include <stddef.h>
 #include <stdint.h>
 #include "apebitmap.h"
+#include "apeblockcache.h"
+#include "apestorage.h"
+#include "apeio.h"
+#include "apelock.h"
+#include "apejournal.h"
 
 using namespace std;
 
 const uint32_t BLOCKSIZE = 1024*4; // 4kb
 const uint32_t MAXINODES = 3 * BLOCKSIZE * 8; // 3 map blocks ~~ 100k inodes
+const uint32_t DEFAULTCACHEBLOCKS = 1024; // 4mb of cached blocks
+const uint32_t INODECACHESIZE = 4096; // inodes kept in memory, open ones don't count
+const uint32_t DENTRYCACHESIZE = 65536; // directory entries kept in memory
+const uint32_t MINRESERVATION = 8; // blocks reserved ahead of a growing file
+const uint32_t MAXRESERVATION = 256; // 1mb
+const uint32_t MAXALLOCRUN = 8192; // 32mb, largest run reserved for a single write
+const uint32_t MAXTRANSFER = 64 * BLOCKSIZE; // 256kb, contiguous blocks merged into one read or write
+const uint32_t WRITEBUFFERSIZE = 64 * BLOCKSIZE; // 256kb, default write buffer of a handle
+const uint32_t READAHEADMIN = 4; // blocks read ahead once reads turn sequential
+const uint32_t READAHEADMAX = 64; // 256kb, default limit of the readahead window
+const uint32_t MINJOURNALBLOCKS = 512; // 2mb
+const uint32_t MAXJOURNALBLOCKS = 3072; // 12mb, transactions can't carry much more anyway
+const uint32_t JOURNALBLOCKPAGES = 2; // pages a block written or freed may dirty: its bitmap page, extents
+const uint32_t JOURNALDEDUPPAGES = 3; // and with dedup: the entries of its old and new data, the block it frees
+const uint32_t JOURNALCALLPAGES = 16; // pages a call may dirty besides: inodes, directories, fragments
 
 typedef uint32_t inodenum_t;
 typedef uint32_t blocknum_t;
@@ -31,54 +58,292 @@ struct ApeBlock
     void fill(uint8_t fillbyte);
 };
 
+/*
+    On-disk format versions
+*/
+const uint8_t APEVERSION_1 = 1; // superblock packed right before the bitmaps
+const uint8_t APEVERSION_2 = 2; // superblock in its own block, feature flags
+const uint8_t APEVERSION_3 = 3; // 64 bit sizes, see ApeInodeRaw
+const uint8_t APEVERSION = APEVERSION_3; // version of newly created images
+
+/*
+    Superblock feature flags (version 2+)
+*/
+const uint32_t APEFEATURE_EXTENTS = 1; // new inodes map their blocks with extents
+const uint32_t APEFEATURE_DIRHASH = 2; // large directories get a hash index
+const uint32_t APEFEATURE_JOURNAL = 4; // metadata goes through the journal region
+const uint32_t APEFEATURE_INLINE = 8; // INODESIZE inodes, small files are kept in them
+const uint32_t APEFEATURE_TAILS = 16; // small file tails share blocks, needs APEFEATURE_INLINE
+const uint32_t APEFEATURE_COMPRESS = 32; // file data is compressed in clusters, needs APEFEATURE_INLINE
+const uint32_t APEFEATURE_DEDUP = 64; // identical data blocks are stored once, see ApeDedupEntry
+const uint32_t APEFEATURE_HOSTINFO = 128; // inodes end with an ApeHostInfo, needs APEFEATURE_INLINE
+const uint32_t APEFEATURES = APEFEATURE_EXTENTS | APEFEATURE_DIRHASH | APEFEATURE_JOURNAL | APEFEATURE_INLINE |
+                             APEFEATURE_TAILS | APEFEATURE_COMPRESS | APEFEATURE_DEDUP |
+                             APEFEATURE_HOSTINFO; // features this code knows
+
+/*
+    Codec of the compressed files of an image, picked when it's created
+*/
+enum ApeCompression {APECOMPRESS_NONE, APECOMPRESS_LZ};
+
 /*
     The main file header.
-    Sits at the end of the file
+    Sits at the start of the file
  */
 struct ApeSuperBlock
 {
     char magic[5]; // "apefs"
     uint8_t version;
-    uint32_t filesystemsize;
+    uint32_t filesystemsize; // versions 1 and 2
     uint32_t blockmaps; // number of block maps after the superblock
     uint8_t inodemaps; // number of inode maps after block maps
     uint8_t inodeblocks; // number of blocks reserved for inode table
+    // version 2
+    uint32_t features;
+    uint32_t journalblocks; // blocks between the inode table and the data blocks
+    uint32_t inodetableblocks; // replaces inodeblocks with APEFEATURE_INLINE
+    uint32_t compression; // ApeCompression, with APEFEATURE_COMPRESS
+    uint32_t dedupblocks; // dedup table, between the journal and the data blocks
+    // version 3
+    uint64_t filesystembytes; // of the data blocks, filesystemsize can't hold it
 };
 
+// version 1 superblocks end where the version 2 fields begin
+const uint32_t SUPERBLOCKV1SIZE = offsetof(ApeSuperBlock, features);
+
 /*
     Inode flags for extra info
 */
 const uint8_t APEFLAG_FILE = 1;
 const uint8_t APEFLAG_DIRECTORY = 2;
+const uint8_t APEFLAG_EXTENTS = 4; // blocks[] holds extents, not block numbers
+const uint8_t APEFLAG_HASHED = 8; // directory with a hash index
+const uint8_t APEFLAG_INLINE = 16; // file data in the inode, from blocks[] on
+const uint8_t APEFLAG_PACKED = 32; // the last partial block is in fragments, see ApeFragments
+const uint8_t APEFLAG_COMPRESSED = 64; // data stored in clusters, see ApeCluster
+
+/*
+    A run of count contiguous blocks
+*/
+struct ApeExtent
+{
+    blocknum_t start;
+    uint32_t count;
+};
+
+const uint32_t INODEEXTENTS = 4; // extents stored in blocks[0..7]
+const uint32_t EXTENTCHAIN = 8; // blocks[8] is the first extent block, if any
+
+/*
+    Extent block, holds the extents that didn't fit in the inode.
+    Extent blocks are chained through next.
+*/
+struct ApeExtentBlock
+{
+    uint32_t count;
+    blocknum_t next;
+    ApeExtent extents[(BLOCKSIZE - 2 * sizeof(uint32_t)) / sizeof(ApeExtent)];
+};
+
+const uint32_t EXTENTSPERBLOCK = sizeof(ApeExtentBlock::extents) / sizeof(ApeExtent);
+
+/*
+    Tail packing. The data past the last whole block of a file, when small
+    enough, goes to a run of fragments of a block shared with other tails.
+    Fragment 0 of such a block is its header, it names the owner of each fragment.
+*/
+const uint32_t FRAGMENTSIZE = 256;
+const uint32_t FRAGMENTSPERBLOCK = BLOCKSIZE / FRAGMENTSIZE;
+const uint32_t MAXTAILSIZE = (FRAGMENTSPERBLOCK - 1) * FRAGMENTSIZE; // 3.75kb, larger tails keep their block
+const uint32_t FRAGMENTMAGIC = 0x46455041; // "APEF"
+
+struct ApeFragmentHeader
+{
+    uint32_t magic;
+    inodenum_t owners[FRAGMENTSPERBLOCK]; // INVALIDINODE when free, owners[0] is the header itself
+};
+
+/*
+    Tail of a packed file, count fragments of block from first on
+*/
+struct ApeFragments
+{
+    blocknum_t block;
+    uint16_t first;
+    uint16_t count;
+};
+
+/*
+    Compressed files. The data is cut in clusters of CLUSTERSIZE bytes, each
+    compressed on its own into a run of blocks, so reading anywhere only
+    decompresses the cluster it lands in. A cluster that doesn't shrink by
+    a block at least is stored as is.
+*/
+const uint32_t CLUSTERSIZE = 16 * BLOCKSIZE; // 64kb
+const uint32_t CLUSTERBLOCKS = CLUSTERSIZE / BLOCKSIZE;
+const uint32_t CLUSTERRAW = 0x80000000; // ApeCluster size flag, stored uncompressed
+const uint32_t CLUSTERDIRECT = 9; // blocks[0..8] are cluster tables, blocks[9] a table of more of them
+
+/*
+    Where a cluster is stored, size bytes from block start on
+*/
+struct ApeCluster
+{
+    blocknum_t start;
+    uint32_t size;
+};
+
+const uint32_t CLUSTERSPERTABLE = BLOCKSIZE / sizeof(ApeCluster);
+
+/*
+    Deduplication. The dedup table has an entry per data block, whole
+    blocks written to files get their fingerprint recorded there, and a
+    file writing the same data again maps the block already holding it.
+    refs counts the places files map the block at, it's only freed once
+    the last one goes. Compressed files are left out.
+*/
+struct ApeDedupEntry
+{
+    uint64_t fingerprint;
+    uint32_t refs; // 0 when the block isn't in the table
+    uint32_t unused;
+};
+
+const uint32_t DEDUPENTRIESPERBLOCK = BLOCKSIZE / sizeof(ApeDedupEntry);
 
 /*
     mimics a real unix inode
-    the raw part is saved/loaded from the file directly
+    the raw part is the start of its record in the inode table,
+    version 3 records have it as is
 */
 struct ApeInodeRaw
 {
     inodenum_t num; // "inode number"
     uint8_t flags;
-    uint32_t size; // size in bytes
-    uint16_t blockscount;
+    uint32_t blockscount;
+    uint64_t size; // size in bytes
     /*
         8 direct blocks -> 8 * 4096 = 32kb
         1 indirect block table -> 1024 * 4096 = 4mb
         1 double indirect block table -> 1024 * 1024 * 4096 = 4gb
+        or, with APEFLAG_EXTENTS, the way past 4gb
+        4 extents followed by a chain of extent blocks
+        or, with APEFLAG_COMPRESSED
+        blockscount clusters, listed in cluster tables
     */
     blocknum_t blocks[10];
 };
 
-const uint32_t INODESPERBLOCK = BLOCKSIZE / sizeof(ApeInodeRaw);
+/*
+    Inode record of version 1 and 2 images, 32 bit sizes
+    and at most 65535 blocks, or clusters, per file
+*/
+struct ApeInodeRawV1
+{
+    inodenum_t num;
+    uint8_t flags;
+    uint32_t size;
+    uint16_t blockscount;
+    blocknum_t blocks[10];
+};
+
+const uint32_t INODESPERBLOCK = BLOCKSIZE / sizeof(ApeInodeRawV1); // version 1 tables
+
+const uint32_t INODESIZE = 256; // bytes per inode in the table, with APEFEATURE_INLINE
+const uint32_t INLINEDATASIZE = INODESIZE - offsetof(ApeInodeRawV1, blocks); // largest inline file, of a version 2 image
+
+/*
+    What a file was copied from, as the host saw it, for backups to tell
+    whether it changed since. With APEFEATURE_HOSTINFO it takes the end of
+    the inode record, inline files hold that much less. All zeros until
+    it's set, writes to the file leave it alone.
+*/
+struct ApeHostInfo
+{
+    uint64_t size;
+    int64_t mtime; // seconds
+    uint32_t mtimensec;
+    uint32_t hashed; // 1 when hash is set
+    uint64_t hash; // of the contents, up to the caller
+};
 
 /*
     The above raw inode structure
-    plus variable size info, like data Blocks numbers
+    plus variable size info, like data Blocks numbers.
+    With APEFEATURE_INLINE the table record carries on into tail,
+    packed files keep their ApeFragments there. blocks and tail hold
+    what follows the raw part of any record version, see inodedecode.
 */
 struct ApeInode: ApeInodeRaw
 {
+    uint8_t tail[INLINEDATASIZE - sizeof(ApeInodeRaw::blocks)];
+    ApeHostInfo host; // with APEFEATURE_HOSTINFO
     bool isdirectory() const;
     bool isfile() const;
+    bool hasextents() const;
+    bool ishashed() const;
+    bool isinline() const;
+    bool ispacked() const;
+    bool iscompressed() const;
+    ApeExtent* extents();
+    const ApeExtent* extents() const;
+    uint8_t* inlinedata();
+    const uint8_t* inlinedata() const;
+    ApeFragments* fragments();
+    const ApeFragments* fragments() const;
+};
+
+/*
+    Hashed directories.
+    Blocks 0..DIRINDEXBLOCKS-1 hold DIRINDEXSLOTS slots picked by the low bits
+    of the name hash, each slot is (local depth << 24) | bucket block position.
+    Buckets are regular directory blocks.
+*/
+const uint32_t DIRHASHBLOCKS = 4; // linear directories growing past this get hashed
+const uint32_t DIRINDEXDEPTH = 12;
+const uint32_t DIRINDEXSLOTS = 1 << DIRINDEXDEPTH;
+const uint32_t DIRSLOTSPERBLOCK = BLOCKSIZE / sizeof(uint32_t);
+const uint32_t DIRINDEXBLOCKS = DIRINDEXSLOTS / DIRSLOTSPERBLOCK;
+const uint32_t DIRSLOTDEPTHSHIFT = 24;
+const uint32_t DIRSLOTPOSMASK = (1 << DIRSLOTDEPTHSHIFT) - 1;
+
+/*
+    Inode table cache entry.
+    Pinned entries are in use (by open files, or for the duration of a call)
+    and are never evicted. lock guards inode, pins and lru the cache lock.
+*/
+struct ApeCachedInode
+{
+    ApeInode inode;
+    ApeRwLock lock;
+    atomic<bool> dirty;
+    uint32_t generation; // bumped by every write, under the exclusive lock
+    uint32_t layout; // bumped when blocks of the file are remapped in place, see ApeBlockMap
+    uint32_t pins;
+    list<inodenum_t>::iterator lru;
+};
+
+/*
+    Dentry cache key and entry, (parent directory inode, name) -> (inode, flags).
+    An inodenum of INVALIDINODE records that the name doesn't exist.
+*/
+typedef pair<inodenum_t, string> ApeDentryKey;
+
+struct ApeCachedDentry
+{
+    inodenum_t inodenum;
+    uint8_t flags;
+    list<ApeDentryKey>::iterator lru;
+};
+
+/*
+    Blocks allocated ahead of a growing file,
+    given back when the file is closed
+*/
+struct ApeReservation
+{
+    blocknum_t start;
+    uint32_t count;
 };
 
 /*
@@ -103,11 +368,33 @@ struct ApeDirectoryEntry : ApeDirectoryEntryRaw
     void write(void *buffer);
 };
 
+/*
+    Filesystem usage, see ApeFileSystem::statfs
+*/
+struct ApeFsStat
+{
+    uint32_t blocksize;
+    uint32_t totalblocks;
+    uint32_t freeblocks;
+    uint32_t totalinodes;
+    uint32_t freeinodes;
+};
+
+/*
+    Dedup counters since the filesystem was opened, see ApeFileSystem::dedupstats
+*/
+struct ApeDedupStats
+{
+    uint64_t blocks; // whole blocks written to files
+    uint64_t shared; // of those, mapped to a block already holding their data
+};
+
 /*
     forward class declarations..
 */
 class ApeFile;
 class ApeFileSystem;
+class ApeJournalHandle;
 
 /*
     File open mode
@@ -120,7 +407,137 @@ enum ApeFileMode {APEFILE_CLOSE, APEFILE_OPEN, APEFILE_CREATE, APEFILE_APPEND};
 enum ApeFileSeekMode {APESEEK_SET, APESEEK_CUR, APESEEK_END};
 
 /*
-    Represents a file in the filesystem
+    When written data is made durable, besides ApeFileSystem::flush and ApeFile::sync.
+    NONE waits for the filesystem to be closed, CLOSE syncs files written
+    to when they're closed, WRITE syncs every call that changes the image.
+    Journal commits sync whatever the policy. The stream backend only gets
+    data as far as the system, it takes APESYNC_NONE alone, see ApeStorage::durable.
+*/
+enum ApeSyncPolicy {APESYNC_NONE, APESYNC_CLOSE, APESYNC_WRITE};
+
+const uint32_t BLOCKSPERTABLE = BLOCKSIZE / sizeof(blocknum_t);
+
+/*
+    Block mapping cache of an open file, keeps the indirect
+    tables or the extent block used by the last lookups.
+    Tables point at their buffer, or straight into a mapped image.
+*/
+struct ApeBlockMap
+{
+    uint32_t blockscount; // inode blockscount the map is valid for
+    uint32_t layout; // and ApeCachedInode layout
+    blocknum_t indirectnum;
+    const blocknum_t* indirect;
+    blocknum_t dindirectnum;
+    const blocknum_t* dindirect;
+    blocknum_t dindirecttablenum; // current table under the double indirect one
+    const blocknum_t* dindirecttable;
+    uint32_t extentpos; // file block position of extent
+    ApeExtent extent;
+    uint32_t extentblockpos; // file block position of the first extent in extentblock
+    blocknum_t extentblocknum;
+    const ApeExtentBlock* extentblock;
+    blocknum_t indirectbuf[BLOCKSPERTABLE];
+    blocknum_t dindirectbuf[BLOCKSPERTABLE];
+    blocknum_t dindirecttablebuf[BLOCKSPERTABLE];
+    ApeExtentBlock extentblockbuf;
+    void invalidate();
+};
+
+/*
+    Where the part of a block a request reads lands in the caller's buffer
+*/
+struct ApeFileSpan
+{
+    uint8_t* target;
+    uint32_t offset;
+    uint32_t size;
+};
+
+/*
+    A read or write in flight, see ApeFile::submitread.
+    Can be reused once completed, destroying it waits for the transfers.
+*/
+struct ApeFileRequest
+{
+    vector<ApeBlock> blocks; // bounce blocks for the unaligned head and tail
+    vector<ApeFileSpan> spans; // reads, one per bounce block used
+    vector<ApeIoRequest> io;
+    uint32_t size; // bytes read or written
+    uint64_t end; // writes, file size once done
+    bool write;
+    ApeIoBatch batch; // last, destroyed first
+};
+
+/*
+    Readahead counters, of a handle or of the whole filesystem
+*/
+struct ApeReadaheadStats
+{
+    uint64_t hits; // reads served from blocks read ahead
+    uint64_t misses; // reads that had to wait for the image
+    uint64_t blocks; // blocks read ahead
+    uint64_t collapses; // sequential runs broken by a seek
+};
+
+/*
+    Blocks read ahead by a handle, start and count are file block positions
+*/
+struct ApeReadaheadBuffer
+{
+    uint32_t start;
+    uint32_t count;
+    bool pending; // the read is still in flight
+    vector<uint8_t> data;
+    ApeFileRequest request;
+};
+
+/*
+    Readahead state of a handle. Reads carrying on where the last one ended
+    double the window up to maxwindow blocks, anything else collapses it.
+    While one buffer is read from, the next window comes into the other.
+    The buffers are dropped once the inode generation moves.
+*/
+struct ApeReadahead
+{
+    uint32_t maxwindow; // 0 disables readahead
+    uint32_t window;
+    uint64_t next; // where a sequential read starts
+    uint32_t generation;
+    ApeReadaheadBuffer buffers[2];
+    ApeReadaheadStats stats; // since the file was opened
+};
+
+/*
+    Write buffer of a handle, holds data written from start on. Nothing
+    is allocated nor written to the image until it's flushed.
+*/
+struct ApeWriteBuffer
+{
+    uint32_t capacity; // writes this big or bigger go straight through
+    uint64_t start;
+    vector<uint8_t> data;
+};
+
+/*
+    Last cluster of a compressed file a handle decompressed,
+    valid while the inode generation doesn't move
+*/
+struct ApeClusterBuffer
+{
+    uint32_t index;
+    uint32_t generation;
+    uint32_t size; // 0 when empty
+    vector<uint8_t> data;
+    vector<uint8_t> stored; // the cluster as read from the image
+};
+
+/*
+    Represents a file in the filesystem.
+    Handles of different files, or of the same one, may be used from
+    different threads, but each handle by only one thread at a time.
+    Writes are buffered by the handle, other handles see them once
+    it's flushed, or closed.
 */
 class ApeFile
 {
@@ -130,37 +547,141 @@ public:
     bool open(const string& filepath, ApeFileMode mode);
     uint32_t read(void* buffer, uint32_t size);
     uint32_t write(const void* buffer, uint32_t size);
-    bool seek(ApeFileSeekMode seekmode, int32_t offset);
-    uint32_t tell() const;
-    uint32_t size() const;
+    bool seek(ApeFileSeekMode seekmode, int64_t offset);
+    /*
+        Asynchronous read and write, from the current position which moves
+        right away, so several may be in flight. complete() waits and returns
+        the bytes transferred, a write only grows the file then.
+        Writes in flight must not share blocks, reads of a range
+        being written see the old or the new data. With a journal, a write carries
+        a bounded number of blocks, complete() tells how much of it went.
+    */
+    bool submitread(void* buffer, uint32_t size, ApeFileRequest& request);
+    bool submitwrite(const void* buffer, uint32_t size, ApeFileRequest& request);
+    uint32_t complete(ApeFileRequest& request);
+    bool flush();
+    // flush() and waits until the file, and the filesystem with it, is on the disk
+    bool sync();
+    // write buffer size in bytes, 0 writes straight through
+    void writebuffer(uint32_t bytes);
+    // readahead window limit in blocks, 0 disables it, see ApeReadahead
+    void readahead(uint32_t maxblocks);
+    const ApeReadaheadStats& readaheadstats() const;
+    // tail.count is left 0 unless the file is packed
+    bool extents(vector<ApeExtent>& extents, ApeFragments& tail);
+    bool hostinfo(ApeHostInfo& info);
+    bool sethostinfo(const ApeHostInfo& info);
+    uint64_t tell() const;
+    uint64_t size() const;
     bool good() const;
     void close();
 
-    uint32_t position;
+    uint64_t position;
     inodenum_t inodenum;
 private:
+    friend class ApeFileSystem;
     ApeFileSystem& owner_;
+    // pinned inode cache entry, shared by all the handles of the file
+    ApeCachedInode* inode_;
+    ApeBlockMap map_;
+    ApeReadahead readahead_;
+    ApeWriteBuffer writebuffer_;
+    ApeClusterBuffer cluster_;
+    uint64_t maxsize_; // inodemaxsize, writes stop there
+    bool written_; // since it was last synced
 };
 
-class ApeFileSystem
+/*
+    Open metadata transaction, for the duration of a call that changes
+    metadata. Taken before any other lock and never nested. blocks, at most
+    the call writes or gives back, bounds the pages it dirties.
+    With APESYNC_WRITE the call is synced once it ends.
+*/
+class ApeJournalHandle
+{
+public:
+    ApeJournalHandle(ApeFileSystem& owner, bool active = true, uint32_t blocks = 1);
+    ~ApeJournalHandle();
+private:
+    ApeFileSystem& owner_;
+    bool active_;
+    uint32_t pages_;
+};
+
+/*
+    The filesystem calls are thread safe, except open, create and close
+    which must not run along anything else.
+
+    With a journal, metadata changes stay in memory until they're committed,
+    in groups, to the journal region with one sync and only then written in
+    place. Calls changing metadata hold the journal lock shared, the commit
+    takes it exclusive so it never sees half of a call. A call only starts
+    once what it may dirty fits in the transaction along with what's waiting,
+    a commit is never more than one. File data goes straight to the image,
+    blocks freed are only reused after the commit, and only once replaying
+    the journal wouldn't write to them anymore.
+
+    Locks are taken in this order: the journal calls lock, the journal lock,
+    the namespace lock (shared for lookups, exclusive to change directories),
+    an inode lock (shared to read, exclusive to write a file), the inode cache lock, then
+    the dentry, fragment, dedup, bitmap, block cache and journal page locks, and
+    the storage lock last.
+*/
+class ApeFileSystem : private ApeBlockSource
 {
 public:
     ApeFileSystem();
     ~ApeFileSystem();
     // filesystem related
-    bool open(const string& fspath);
-    bool create(const string& fspath, uint32_t fssize);
+    // the block cache is left out with mapped storage, the page cache does its job.
+    // Fails with a sync policy on the stream backend, fallback included, it can't sync.
+    bool open(const string& fspath, uint32_t cacheblocks = DEFAULTCACHEBLOCKS,
+              ApeStorageType storage = APESTORAGE_MMAP, ApeSyncPolicy sync = APESYNC_NONE);
+    // with a codec, files are compressed as they're written, with dedup identical blocks are stored once
+    bool create(const string& fspath, uint64_t fssize, uint32_t cacheblocks = DEFAULTCACHEBLOCKS,
+                ApeStorageType storage = APESTORAGE_MMAP, ApeSyncPolicy sync = APESYNC_NONE,
+                ApeCompression compression = APECOMPRESS_NONE, bool dedup = false);
+    // writes back everything and waits for the disk
+    bool flush();
     bool close();
-    uint32_t size() const;
+    // bytes of data blocks
+    uint64_t size() const;
+    ApeSyncPolicy syncpolicy() const;
+    ApeCompression compression() const;
+    bool dedup() const;
+    ApeDedupStats dedupstats() const;
+    bool statfs(ApeFsStat& stat) const;
+    ApeCacheStats cachestats() const;
+    // readahead limit of the handles created from then on, in blocks
+    void readahead(uint32_t maxblocks);
+    uint32_t readahead() const;
+    ApeReadaheadStats readaheadstats() const; // of the files closed so far
+    // whether files closed from then on get their tail packed, with APEFEATURE_TAILS
+    void tailpacking(bool enabled);
+    bool tailpacking() const;
+    bool check(vector<string>& problems);
+    // count data blocks from start on, in one read, see fileextents
+    bool blocksread(blocknum_t start, uint32_t count, void* buffer);
     // file related
     bool fileexists(const string& filepath);
     bool filedelete(const string& filepath);
     bool fileopen(const string& filepath, ApeFileMode mode, ApeFile& file);
     uint32_t fileread(ApeFile& file, void* buffer, uint32_t size);
     uint32_t filewrite(ApeFile& file, const void* buffer, uint32_t size);
-    bool fileseek(ApeFile& file, ApeFileSeekMode mode, int32_t offset);
-    uint32_t tell(const ApeFile& file);
-    uint32_t filesize(const ApeFile& file);
+    bool fileflush(ApeFile& file);
+    bool filesync(ApeFile& file);
+    bool fileseek(ApeFile& file, ApeFileSeekMode mode, int64_t offset);
+    bool filesubmitread(ApeFile& file, void* buffer, uint32_t size, ApeFileRequest& request);
+    bool filesubmitwrite(ApeFile& file, const void* buffer, uint32_t size, ApeFileRequest& request);
+    uint32_t filecomplete(ApeFile& file, ApeFileRequest& request);
+    uint64_t tell(const ApeFile& file);
+    uint64_t filesize(const ApeFile& file);
+    // where the blocks of the file are in the image, in file order, and its packed tail,
+    // nothing for files only readable through a handle, compressed ones
+    bool fileextents(ApeFile& file, vector<ApeExtent>& extents, ApeFragments& tail);
+    // false unless the image has APEFEATURE_HOSTINFO
+    bool filehostinfo(ApeFile& file, ApeHostInfo& info);
+    bool filesethostinfo(ApeFile& file, const ApeHostInfo& info);
     void fileclose(ApeFile& file);
     // directory related
     bool directoryexists(const string& path);
@@ -173,33 +694,202 @@ public:
     static string joinpath(const string& p1, const string& p2);
     static bool parsepath(const string &path, vector<string> &parsedpath);
 private:
+    friend class ApeJournalHandle;
+    void setoffsets();
+    uint64_t imagesize() const;
+    bool storageopen(const string& fspath, bool truncate, ApeStorageType storage, ApeSyncPolicy sync);
     // block related
     bool blockfree(blocknum_t blocknum);
     bool blockread(blocknum_t blocknum, ApeBlock& block);
     bool blockread(const ApeInode& inode, uint32_t blockpos, ApeBlock& block);
+    const uint8_t* blockpeek(blocknum_t blocknum, void* buffer);
+    const uint8_t* blockpeek(const ApeInode& inode, uint32_t blockpos, void* buffer);
     bool blockwrite(ApeBlock& block);
+    // file data, never journaled, count blocks from blocknum on
+    bool blockwritedata(blocknum_t blocknum, const void* data, uint32_t count = 1);
     bool blockalloc(ApeBlock& block);
-    bool blockalloc(ApeInode& inode, ApeBlock& block);
+    // upcoming, blocks the caller appends right after this one
+    bool blockalloc(ApeInode& inode, ApeBlock& block, uint32_t upcoming = 0);
+    bool blockallocrun(blocknum_t goal, uint32_t count, blocknum_t& start, uint32_t& allocated);
+    bool blockallocwhole(blocknum_t goal, uint32_t count, blocknum_t& start);
+    bool blockmap(const ApeInode& inode, uint32_t blockpos, blocknum_t& blocknum, uint32_t& run);
+    bool blockmap(const ApeInode& inode, ApeBlockMap& map, uint32_t blockpos, blocknum_t& blocknum, uint32_t& run);
+    bool blockmaptable(blocknum_t tablenum, blocknum_t& cachednum, const blocknum_t*& table, blocknum_t* buffer);
+    // extent related
+    bool extentappend(ApeInode& inode, ApeBlock& block, uint32_t upcoming = 0);
+    bool extentadd(ApeInode& inode, blocknum_t blocknum);
+    bool extentrewrite(ApeInode& inode, const vector<ApeExtent>& extents);
+    static void extentpush(vector<ApeExtent>& extents, blocknum_t start, uint32_t count);
+    bool extentreserve(ApeInode& inode, blocknum_t& blocknum, uint32_t upcoming = 0);
+    bool extentdroplast(ApeInode& inode, blocknum_t& blocknum);
+    bool extenttruncate(ApeInode& inode, uint32_t count, vector<blocknum_t>& blocks);
+    void reservationrelease(inodenum_t inodenum);
+    void reservationreleaseall();
+    // block cache source
+    bool sourceread(uint32_t blocknum, void* data);
+    bool sourcewrite(uint32_t blocknum, const void* data);
     // inode related
     bool inodefree(inodenum_t inodenum);
     bool inoderead(inodenum_t inodenum, ApeInode& inode);
     bool inodewrite(ApeInode& inode);
     bool inodealloc(ApeInode& inode);
     bool inodeopen(const string& path, ApeInode& inode);
+    bool inodeblocks(const ApeInode& inode, vector<blocknum_t>& blocks);
+    bool inodefreeblocks(ApeInode& inode);
+    bool inodetrimblocks(ApeInode& inode, uint32_t count);
+    static bool inodetrimmable(const ApeInode& inode, uint32_t count);
+    void inodeclearblocks(ApeInode& inode);
+    ApeCachedInode* inodecached(inodenum_t inodenum, bool load);
+    bool inodeevict();
+    bool inodewriteback(ApeCachedInode& cached);
+    bool inodeflush();
+    // table records of the image version to and from ApeInode
+    uint32_t inodeheadersize() const;
+    void inodedecode(const uint8_t* record, ApeInode& inode) const;
+    void inodeencode(const ApeInode& inode, uint8_t* record) const;
+    uint64_t inodemaxsize(const ApeInode& inode) const;
+    ApeCachedInode* inodepin(inodenum_t inodenum, bool load = true);
+    bool inodeunpin(inodenum_t inodenum, bool writeback);
+    bool fileattach(ApeFile& file, const ApeInode& inode, uint64_t position);
+    bool filetrim(const string& filepath);
+    void filedetach(ApeFile& file);
+    bool fileblockmap(ApeFile& file, uint32_t blockpos, blocknum_t& blocknum, uint32_t& run);
+    uint32_t filereadblocks(ApeFile& file, void* buffer, uint32_t size);
+    uint32_t filewritethrough(ApeFile& file, const void* buffer, uint32_t size);
+    bool filequeueread(ApeFile& file, void* buffer, uint32_t size, ApeFileRequest& request);
+    bool filequeuewrite(ApeFile& file, const void* buffer, uint32_t size, ApeFileRequest& request);
+    void filequeueblock(ApeFileRequest& request, blocknum_t blocknum, uint8_t* data, bool direct);
+    bool filefinish(ApeFileRequest& request);
+    bool filegrow(ApeFile& file, const ApeFileRequest& request);
+    // readahead related
+    uint32_t filereadahead(ApeFile& file, void* buffer, uint32_t size);
+    ApeReadaheadBuffer* filereadaheadfind(ApeFile& file, uint32_t blockpos);
+    bool filereadaheadfill(ApeFile& file, ApeReadaheadBuffer& buffer, uint32_t blockpos);
+    void filereadaheadnext(ApeFile& file, ApeReadaheadBuffer& current);
+    static void filereadaheadsettle(ApeReadaheadBuffer& buffer);
+    static void filereadaheaddrop(ApeFile& file);
+    // inline data related
+    uint32_t inlinesize() const;
+    uint32_t inlineread(ApeFile& file, void* buffer, uint32_t size);
+    bool inlinewrite(ApeFile& file, const void* buffer, uint32_t size, bool& written);
+    bool inlinemove(ApeInode& inode, uint32_t upcoming);
+    static void inlinerequest(ApeFileRequest& request, bool write, uint32_t size, uint64_t end);
+    // tail packing related
+    uint32_t tailread(ApeFile& file, void* buffer, uint32_t size);
+    bool tailpack(ApeFile& file);
+    bool tailflush(ApeFile& file);
+    bool tailpackdata(ApeFile& file, const uint8_t* data, uint32_t size, bool& packed);
+    bool tailunpack(ApeInode& inode, uint64_t end);
+    bool fragmentalloc(inodenum_t inodenum, const uint8_t* data, uint32_t size, blocknum_t spare, ApeFragments& fragments);
+    bool fragmentfree(const ApeFragments& fragments);
+    void fragmentindex(blocknum_t blocknum, uint16_t freemask);
+    static uint32_t fragmentrun(uint16_t freemask);
+    // compression related
+    uint32_t clusterread(ApeFile& file, void* buffer, uint32_t size);
+    uint32_t clusterwrite(ApeFile& file, const void* buffer, uint32_t size);
+    bool clusterload(ApeFile& file, uint32_t index);
+    bool clusterstore(ApeInode& inode, uint32_t index, const uint8_t* data, uint32_t size);
+    bool clusterentry(const ApeInode& inode, uint32_t index, ApeCluster& cluster);
+    bool clusterset(ApeInode& inode, uint32_t index, const ApeCluster& cluster);
+    bool clustertrim(ApeInode& inode, uint32_t count);
+    static uint32_t clusterblocks(const ApeCluster& cluster);
+    // dedup related
+    bool dedupable(const ApeInode& inode) const;
+    bool dedupalloc(ApeInode& inode, ApeBlock& block, const uint8_t* data, uint32_t upcoming, bool& shared);
+    bool dedupunshare(ApeFile& file, uint64_t position, uint32_t size);
+    bool deduprelease(blocknum_t blocknum);
+    void deduprelease(vector<blocknum_t>& blocks);
+    void dedupdrop(blocknum_t blocknum);
+    bool dedupflush();
+    static uint64_t dedupfingerprint(const uint8_t* data);
+    // journal related
+    bool metaread(uint64_t offset, void* data, uint32_t size);
+    bool metawrite(uint64_t offset, const void* data, uint32_t size);
+    bool journalpeek(uint64_t offset, void* data);
+    void journalstart(uint32_t pages);
+    void journalstop(uint32_t pages);
+    uint32_t journalpending();
+    uint32_t journalbatch() const;
+    uint32_t journalblockpages() const;
+    bool journalcommit(bool force);
+    bool journalwrite();
+    void journalhold(const vector<blocknum_t>& blocks);
+    // bitmap related
+    bool bitmapflush(ApeBitMap& bitmap, uint64_t offset);
+    bool blocksbitmapflush();
+    void bitmaplimit(ApeBitMap& bitmap, uint32_t bits);
     // directory related
     bool directoryopen(const string& path, ApeInode& inode);
+    bool directoryentries(const ApeInode& inode, vector<ApeDirectoryEntry>& entries);
     bool directoryaddentry(ApeInode& inode, ApeDirectoryEntry& entry);
+    bool directorystoreentry(ApeInode& inode, ApeDirectoryEntry& entry);
     bool directoryremoveentry(ApeInode& inode, const string& name);
+    bool directoryeraseentry(ApeInode& inode, const string& name);
     bool directoryfindentry(ApeInode& inode, const string& name, ApeDirectoryEntry& entry);
+    // hashed directory related
+    static uint32_t directoryhash(const string& name);
+    bool directoryhashslot(const ApeInode& inode, uint32_t hash, uint32_t& slot);
+    bool directoryhashinsert(ApeInode& inode, ApeDirectoryEntry& entry);
+    bool directoryhashsplit(ApeInode& inode, uint32_t hash, uint32_t slot, ApeBlock& bucket);
+    bool directoryhashconvert(ApeInode& inode, ApeDirectoryEntry& entry);
+    // directory block related
+    static bool directoryblockfind(const uint8_t* data, const string& name, ApeDirectoryEntry& entry);
+    static void directoryblockentries(const uint8_t* data, vector<ApeDirectoryEntry>& entries);
+    static bool directoryblockinsert(ApeBlock& block, ApeDirectoryEntry& entry, int32_t& sizedelta);
+    static bool directoryblockremove(ApeBlock& block, const string& name, int32_t& sizedelta);
+    // dentry cache
+    bool dentrylookup(inodenum_t parent, const string& name, ApeDirectoryEntry& entry);
+    void dentryinsert(inodenum_t parent, const string& name, inodenum_t inodenum, uint8_t flags);
+    void dentrydrop(inodenum_t parent);
 
-	uint32_t inodesbitmapoffset_;
-	uint32_t blocksbitmapoffset_;
-    uint32_t inodesoffset_;
-	uint32_t blocksoffset_;
+	uint64_t inodesbitmapoffset_;
+	uint64_t blocksbitmapoffset_;
+    uint64_t inodesoffset_;
+    uint64_t journaloffset_;
+    uint64_t dedupoffset_;
+	uint64_t blocksoffset_;
+    uint32_t inodesize_; // of an inode in the table
+    uint32_t inodetableblocks_;
     ApeSuperBlock superblock_;
-    fstream file_;
+    ApeStorage* storage_;
+    ApeSyncPolicy syncpolicy_;
     ApeBitMap inodesbitmap_;
     ApeBitMap blocksbitmap_;
+    ApeBlockCache blockcache_;
+    map<inodenum_t, ApeReservation> reservations_;
+    map<inodenum_t, ApeCachedInode> inodecache_;
+    set<ApeFile*> openfiles_; // handles with an inode pinned
+    list<inodenum_t> inodelru_; // most recently used first
+    map<ApeDentryKey, ApeCachedDentry> dentrycache_;
+    list<ApeDentryKey> dentrylru_; // most recently used first
+    atomic<uint32_t> readaheadmax_;
+    ApeReadaheadStats readaheadstats_;
+    atomic<bool> tailpacking_;
+    map<blocknum_t, uint16_t> fragmentblocks_; // fragment blocks with room seen so far, bit i set if fragment i is free
+    set<blocknum_t> fragmentruns_[FRAGMENTSPERBLOCK]; // the same blocks by their longest run of free fragments
+    ApeJournal journal_;
+    map<uint32_t, vector<uint8_t> > journalpages_; // image page -> contents, not committed yet
+    vector<blocknum_t> journalfreed_; // freed since the last commit or held, still set in the bitmap
+    vector<ApeDedupEntry> dedupentries_; // the dedup table, a whole number of its blocks
+    unordered_map<uint64_t, blocknum_t> dedupindex_; // fingerprint -> a block in the table with it
+    set<uint32_t> dedupdirty_; // table blocks changed since they were written back
+    ApeDedupStats dedupstats_;
+    atomic<uint32_t> dirtyinodes_;
+    uint32_t journalreserved_; // pages the calls running may still dirty
+
+    ApeRwLock journallock_;
+    ApeRwLock namespacelock_;
+    mutable mutex inodeslock_; // inodesbitmap_
+    mutable mutex blockslock_; // blocksbitmap_, reservations_ and journalfreed_
+    mutex inodecachelock_; // inodecache_ and inodelru_
+    mutex openfileslock_; // openfiles_
+    mutex dentrylock_; // dentrycache_ and dentrylru_
+    mutex fragmentslock_; // fragmentblocks_, fragmentruns_ and the contents of fragment blocks
+    mutable mutex deduplock_; // dedupentries_, dedupindex_, dedupdirty_ and dedupstats_
+    mutable mutex readaheadlock_; // readaheadstats_
+    mutex journalpageslock_; // journalpages_
+    mutex journalcallslock_; // journalreserved_, taken before the journal lock
+    condition_variable journalcallsdone_; // journalreserved_ went down
 };
 
 #endif // APEFILESYSTEM_H
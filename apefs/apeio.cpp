@@ -0,0 +1,402 @@
+#include "apeio.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <algorithm>
+
+#ifdef APEIO_URING_SUPPORTED
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+ApeIoBatch::ApeIoBatch()
+    : pending_(0), ok_(true)
+{
+}
+
+ApeIoBatch::~ApeIoBatch()
+{
+    // the engine may still be writing to it
+    wait();
+}
+
+/*
+    Starts over, only once the previous requests are done
+*/
+void ApeIoBatch::reset()
+{
+    lock_guard<mutex> lock(lock_);
+    pending_ = 0;
+    ok_ = true;
+}
+
+void ApeIoBatch::add(uint32_t count)
+{
+    lock_guard<mutex> lock(lock_);
+    pending_ += count;
+}
+
+void ApeIoBatch::complete(bool ok)
+{
+    // notified under the lock, the waiter may destroy the batch right after
+    lock_guard<mutex> lock(lock_);
+    if (!ok)
+        ok_ = false;
+    if (--pending_ == 0)
+        finished_.notify_all();
+}
+
+bool ApeIoBatch::wait()
+{
+    unique_lock<mutex> lock(lock_);
+    while (pending_ > 0)
+        finished_.wait(lock);
+    return ok_;
+}
+
+bool ApeIoBatch::done()
+{
+    lock_guard<mutex> lock(lock_);
+    return pending_ == 0;
+}
+
+ApeIoEngine* ApeIoEngine::make(int fd, ApeIoEngineType type)
+{
+#ifdef APEIO_URING_SUPPORTED
+    if (type != APEIO_THREADS)
+    {
+        ApeIoEngine* engine = ApeUringIoEngine::make(fd, 256);
+        if (engine != NULL || type == APEIO_URING)
+            return engine;
+    }
+#else
+    if (type == APEIO_URING)
+        return NULL;
+#endif
+    return new ApeThreadIoEngine(fd, 8);
+}
+
+bool ApeIoEngine::transfer(int fd, const ApeIoRequest& request)
+{
+    uint8_t* data = (uint8_t*)request.data;
+    uint64_t offset = request.offset;
+    uint32_t size = request.size;
+    while (size > 0)
+    {
+        ssize_t done = request.write ? pwrite(fd, data, size, offset) : pread(fd, data, size, offset);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return false;
+        data += done;
+        offset += done;
+        size -= done;
+    }
+    return true;
+}
+
+ApeThreadIoEngine::ApeThreadIoEngine(int fd, uint32_t threads)
+    : fd_(fd), stop_(false)
+{
+    for (uint32_t i = 0; i < threads; i++)
+        threads_.push_back(thread(&ApeThreadIoEngine::worker, this));
+}
+
+ApeThreadIoEngine::~ApeThreadIoEngine()
+{
+    {
+        lock_guard<mutex> lock(lock_);
+        stop_ = true;
+    }
+    queued_.notify_all();
+    for (size_t i = 0; i < threads_.size(); i++)
+        threads_[i].join();
+}
+
+bool ApeThreadIoEngine::submit(ApeIoRequest* requests, uint32_t count)
+{
+    {
+        lock_guard<mutex> lock(lock_);
+        for (uint32_t i = 0; i < count; i++)
+            queue_.push_back(&requests[i]);
+    }
+    queued_.notify_all();
+    return true;
+}
+
+const char* ApeThreadIoEngine::name() const
+{
+    return "threads";
+}
+
+/*
+    Runs queued requests until stopped, what's queued by then still runs
+*/
+void ApeThreadIoEngine::worker()
+{
+    unique_lock<mutex> lock(lock_);
+    for (;;)
+    {
+        while (queue_.empty() && !stop_)
+            queued_.wait(lock);
+        if (queue_.empty())
+            return;
+
+        ApeIoRequest* request = queue_.front();
+        queue_.pop_front();
+        lock.unlock();
+        request->batch->complete(transfer(fd_, *request));
+        lock.lock();
+    }
+}
+
+#ifdef APEIO_URING_SUPPORTED
+
+static int uringsetup(uint32_t entries, io_uring_params* params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringenter(int ringfd, uint32_t submit, uint32_t complete, uint32_t flags)
+{
+    return (int)syscall(__NR_io_uring_enter, ringfd, submit, complete, flags, NULL, 0);
+}
+
+ApeUringIoEngine::ApeUringIoEngine()
+    : fd_(-1), ringfd_(-1), sqring_(NULL), sqringsize_(0), cqring_(NULL), cqringsize_(0),
+      sqes_(NULL), sqessize_(0), inflight_(0)
+{
+}
+
+/*
+    NULL if the kernel has no io_uring, or it's not allowed
+*/
+ApeUringIoEngine* ApeUringIoEngine::make(int fd, uint32_t entries)
+{
+    ApeUringIoEngine* engine = new ApeUringIoEngine();
+    if (!engine->setup(fd, entries))
+    {
+        delete engine;
+        return NULL;
+    }
+    return engine;
+}
+
+bool ApeUringIoEngine::setup(int fd, uint32_t entries)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    fd_ = fd;
+    ringfd_ = uringsetup(entries, &params);
+    if (ringfd_ < 0)
+        return false;
+    // IORING_OP_READ and IORING_OP_WRITE came along with this one
+    if ((params.features & IORING_FEAT_RW_CUR_POS) == 0)
+        return false;
+
+    sqringsize_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    cqringsize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        sqringsize_ = cqringsize_ = max(sqringsize_, cqringsize_);
+
+    void* map = mmap(NULL, sqringsize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd_, IORING_OFF_SQ_RING);
+    if (map == MAP_FAILED)
+        return false;
+    sqring_ = map;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        cqring_ = sqring_;
+    }
+    else
+    {
+        map = mmap(NULL, cqringsize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd_, IORING_OFF_CQ_RING);
+        if (map == MAP_FAILED)
+            return false;
+        cqring_ = map;
+    }
+
+    sqessize_ = params.sq_entries * sizeof(io_uring_sqe);
+    map = mmap(NULL, sqessize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd_, IORING_OFF_SQES);
+    if (map == MAP_FAILED)
+        return false;
+    sqes_ = map;
+
+    uint8_t* sq = (uint8_t*)sqring_;
+    uint8_t* cq = (uint8_t*)cqring_;
+    sqtail_ = (uint32_t*)(sq + params.sq_off.tail);
+    sqmask_ = *(uint32_t*)(sq + params.sq_off.ring_mask);
+    sqarray_ = (uint32_t*)(sq + params.sq_off.array);
+    cqhead_ = (uint32_t*)(cq + params.cq_off.head);
+    cqtail_ = (uint32_t*)(cq + params.cq_off.tail);
+    cqmask_ = *(uint32_t*)(cq + params.cq_off.ring_mask);
+    cqes_ = cq + params.cq_off.cqes;
+    // the completion ring is twice as big, it can't overflow
+    entries_ = params.sq_entries;
+
+    reaper_ = thread(&ApeUringIoEngine::reaper, this);
+    return true;
+}
+
+ApeUringIoEngine::~ApeUringIoEngine()
+{
+    if (reaper_.joinable())
+    {
+        // completions come in any order, the stop marker goes last
+        unique_lock<mutex> lock(lock_);
+        while (inflight_ > 0)
+            room_.wait(lock);
+        ApeIoRequest* stop = NULL;
+        push(IORING_OP_NOP, stop);
+        while (uringenter(ringfd_, 1, 0, 0) < 0 && errno == EINTR)
+            ;
+        lock.unlock();
+        reaper_.join();
+    }
+
+    if (sqes_ != NULL)
+        munmap(sqes_, sqessize_);
+    if (cqring_ != NULL && cqring_ != sqring_)
+        munmap(cqring_, cqringsize_);
+    if (sqring_ != NULL)
+        munmap(sqring_, sqringsize_);
+    if (ringfd_ >= 0)
+        close(ringfd_);
+}
+
+/*
+    Queues one entry in the submission ring, lock_ must be held and there must be room
+*/
+void ApeUringIoEngine::push(uint8_t opcode, const ApeIoRequest* request)
+{
+    uint32_t tail = *sqtail_;
+    uint32_t index = tail & sqmask_;
+    io_uring_sqe* sqe = (io_uring_sqe*)sqes_ + index;
+    memset(sqe, 0, sizeof(io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd_;
+    sqe->user_data = (uint64_t)(uintptr_t)request;
+    if (request != NULL)
+    {
+        sqe->off = request->offset;
+        sqe->addr = (uint64_t)(uintptr_t)request->data;
+        sqe->len = request->size;
+    }
+    sqarray_[index] = index;
+    // the kernel must see the entry before the new tail
+    __atomic_store_n(sqtail_, tail + 1, __ATOMIC_RELEASE);
+    inflight_++;
+}
+
+/*
+    What the ring doesn't take, when io_uring_enter fails or is short of
+    resources with nothing in flight to free some, comes off the ring
+    and runs right here
+*/
+bool ApeUringIoEngine::submit(ApeIoRequest* requests, uint32_t count)
+{
+    unique_lock<mutex> lock(lock_);
+    uint32_t i = 0;
+    while (i < count)
+    {
+        while (inflight_ >= entries_)
+            room_.wait(lock);
+
+        uint32_t queued = 0;
+        for (; i < count && inflight_ < entries_; i++, queued++)
+            push(requests[i].write ? IORING_OP_WRITE : IORING_OP_READ, &requests[i]);
+
+        // one syscall for the whole run
+        while (queued > 0)
+        {
+            int submitted = uringenter(ringfd_, queued, 0, 0);
+            if (submitted > 0)
+            {
+                queued -= submitted;
+                continue;
+            }
+            if (submitted < 0 && errno == EINTR)
+                continue;
+            // completions reaped meanwhile give the kernel room
+            bool busy = submitted == 0 || errno == EAGAIN || errno == EBUSY;
+            if (busy && inflight_ > queued)
+            {
+                room_.wait(lock);
+                continue;
+            }
+
+            // the kernel only reads the tail when entered, the last entries can be taken back
+            __atomic_store_n(sqtail_, *sqtail_ - queued, __ATOMIC_RELEASE);
+            inflight_ -= queued;
+            i -= queued;
+            lock.unlock();
+            room_.notify_all();
+            for (; i < count; i++)
+                requests[i].batch->complete(transfer(fd_, requests[i]));
+            return true;
+        }
+    }
+    return true;
+}
+
+const char* ApeUringIoEngine::name() const
+{
+    return "io_uring";
+}
+
+/*
+    Waits for completions and hands them to their batches.
+    Short transfers are rare on files, their rest is done right here.
+*/
+void ApeUringIoEngine::reaper()
+{
+    vector<pair<ApeIoRequest*, int32_t> > completions;
+    bool stop = false;
+    while (!stop)
+    {
+        if (uringenter(ringfd_, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+            continue;
+
+        // taken by submitters while they fill the entries, their requests are visible here
+        {
+            lock_guard<mutex> lock(lock_);
+            uint32_t head = *cqhead_;
+            uint32_t tail = __atomic_load_n(cqtail_, __ATOMIC_ACQUIRE);
+            completions.clear();
+            for (; head != tail; head++)
+            {
+                io_uring_cqe* cqe = (io_uring_cqe*)cqes_ + (head & cqmask_);
+                completions.push_back(make_pair((ApeIoRequest*)(uintptr_t)cqe->user_data, cqe->res));
+            }
+            __atomic_store_n(cqhead_, head, __ATOMIC_RELEASE);
+            inflight_ -= completions.size();
+        }
+        room_.notify_all();
+
+        for (size_t i = 0; i < completions.size(); i++)
+        {
+            ApeIoRequest* request = completions[i].first;
+            int32_t result = completions[i].second;
+            if (request == NULL)
+            {
+                stop = true;
+                continue;
+            }
+
+            bool ok = result == (int32_t)request->size;
+            if (!ok && (result > 0 || result == -EINTR || result == -EAGAIN))
+            {
+                ApeIoRequest rest = *request;
+                uint32_t done = max(result, 0);
+                rest.offset += done;
+                rest.data = (uint8_t*)rest.data + done;
+                rest.size -= done;
+                ok = transfer(fd_, rest);
+            }
+            request->batch->complete(ok);
+        }
+    }
+}
+
+#endif
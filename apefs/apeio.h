@@ -0,0 +1,137 @@
+#ifndef APEIO_H
+#define APEIO_H
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <stdint.h>
+
+using namespace std;
+
+#if defined(__linux__)
+#define APEIO_URING_SUPPORTED
+#endif
+
+class ApeIoBatch;
+
+/*
+    One transfer, completes through its batch.
+    Whoever submits it adds it to the batch first.
+*/
+struct ApeIoRequest
+{
+    uint64_t offset;
+    void* data;
+    uint32_t size;
+    bool write;
+    ApeIoBatch* batch;
+};
+
+/*
+    Counts the requests in flight of whoever submitted them,
+    wait() returns once all are done
+*/
+class ApeIoBatch
+{
+public:
+    ApeIoBatch();
+    ~ApeIoBatch();
+    void reset();
+    void add(uint32_t count);
+    void complete(bool ok);
+    bool wait(); // false if any request failed
+    bool done();
+private:
+    mutex lock_;
+    condition_variable finished_;
+    uint32_t pending_;
+    bool ok_;
+};
+
+enum ApeIoEngineType {APEIO_AUTO, APEIO_URING, APEIO_THREADS};
+
+/*
+    Runs requests against a file descriptor in the background,
+    any thread may submit
+*/
+class ApeIoEngine
+{
+public:
+    virtual ~ApeIoEngine() {}
+    // requests must stay valid until their batch is done. Each one completes
+    // through its batch whatever submit returns, a request the engine can't
+    // start is run synchronously or failed.
+    virtual bool submit(ApeIoRequest* requests, uint32_t count) = 0;
+    virtual const char* name() const = 0;
+
+    // APEIO_AUTO takes io_uring when the kernel has it, NULL if none could start
+    static ApeIoEngine* make(int fd, ApeIoEngineType type = APEIO_AUTO);
+    // synchronous pread/pwrite of a whole request
+    static bool transfer(int fd, const ApeIoRequest& request);
+};
+
+/*
+    Fallback engine, a few threads doing pread/pwrite
+*/
+class ApeThreadIoEngine : public ApeIoEngine
+{
+public:
+    ApeThreadIoEngine(int fd, uint32_t threads);
+    ~ApeThreadIoEngine();
+    bool submit(ApeIoRequest* requests, uint32_t count);
+    const char* name() const;
+private:
+    void worker();
+
+    int fd_;
+    vector<thread> threads_;
+    deque<ApeIoRequest*> queue_;
+    mutex lock_;
+    condition_variable queued_;
+    bool stop_;
+};
+
+#ifdef APEIO_URING_SUPPORTED
+/*
+    io_uring engine, through the raw syscalls.
+    Submitters fill the submission ring, a thread reaps the completions.
+*/
+class ApeUringIoEngine : public ApeIoEngine
+{
+public:
+    ~ApeUringIoEngine();
+    bool submit(ApeIoRequest* requests, uint32_t count);
+    const char* name() const;
+    static ApeUringIoEngine* make(int fd, uint32_t entries);
+private:
+    ApeUringIoEngine();
+    bool setup(int fd, uint32_t entries);
+    void reaper();
+    void push(uint8_t opcode, const ApeIoRequest* request);
+
+    int fd_; // the file
+    int ringfd_;
+    void* sqring_;
+    size_t sqringsize_;
+    void* cqring_;
+    size_t cqringsize_;
+    void* sqes_;
+    size_t sqessize_;
+    uint32_t* sqtail_;
+    uint32_t sqmask_;
+    uint32_t* sqarray_;
+    uint32_t* cqhead_;
+    uint32_t* cqtail_;
+    uint32_t cqmask_;
+    void* cqes_;
+    uint32_t entries_;
+    uint32_t inflight_; // submitted and not reaped, kept within the rings
+    mutex lock_;
+    condition_variable room_;
+    thread reaper_;
+};
+#endif
+
+#endif // APEIO_H
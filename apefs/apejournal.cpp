@@ -0,0 +1,201 @@
+#include "apejournal.h"
+#include <string.h>
+#include <algorithm>
+
+static bool crc32table(uint32_t* table)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        table[i] = c;
+    }
+    return true;
+}
+
+static uint32_t crc32(uint32_t crc, const uint8_t* data, size_t size)
+{
+    static uint32_t table[256];
+    static bool ready = crc32table(table);
+    (void)ready;
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+ApeJournal::ApeJournal()
+    : storage_(NULL), offset_(0), pages_(0), pagesize_(0), head_(0), sequence_(1)
+{
+}
+
+void ApeJournal::attach(ApeStorage* storage, uint64_t offset, uint32_t pages, uint32_t pagesize)
+{
+    storage_ = storage;
+    offset_ = offset;
+    pages_ = pages;
+    pagesize_ = pagesize;
+    head_ = 0;
+    sequence_ = 1;
+    recent_[0].clear();
+    recent_[1].clear();
+}
+
+void ApeJournal::detach()
+{
+    storage_ = NULL;
+    pages_ = 0;
+    recent_[0].clear();
+    recent_[1].clear();
+}
+
+bool ApeJournal::attached() const
+{
+    return storage_ != NULL;
+}
+
+uint32_t ApeJournal::capacity() const
+{
+    if (pages_ < 6)
+        return 0;
+    return min(pages_ / 3 - 1, (uint32_t)((pagesize_ - sizeof(ApeJournalDescriptor)) / sizeof(uint32_t)));
+}
+
+/*
+    The descriptor has to be at the start of transaction,
+    with the pages it lists right after it
+*/
+uint32_t ApeJournal::checksum(const uint8_t* transaction) const
+{
+    ApeJournalDescriptor descriptor = *(const ApeJournalDescriptor*)transaction;
+    descriptor.checksum = 0;
+    uint32_t crc = crc32(0, (const uint8_t*)&descriptor, sizeof(descriptor));
+    crc = crc32(crc, transaction + sizeof(descriptor), descriptor.count * sizeof(uint32_t));
+    return crc32(crc, transaction + pagesize_, (size_t)descriptor.count * pagesize_);
+}
+
+/*
+    Logs the pages as one transaction and syncs the image
+*/
+bool ApeJournal::commit(const vector<ApeJournalPage>& pages)
+{
+    if (pages.empty())
+        return true;
+    if (storage_ == NULL || pages.size() > capacity())
+        return false;
+
+    uint32_t length = pages.size() + 1;
+    if (head_ + length > pages_)
+        head_ = 0;
+
+    vector<uint8_t> transaction((size_t)length * pagesize_, 0);
+    ApeJournalDescriptor* descriptor = (ApeJournalDescriptor*)&transaction[0];
+    uint32_t* indexes = (uint32_t*)(descriptor + 1);
+    descriptor->magic = JOURNALMAGIC;
+    descriptor->count = pages.size();
+    descriptor->sequence = sequence_;
+    for (size_t i = 0; i < pages.size(); i++)
+    {
+        indexes[i] = pages[i].index;
+        memcpy(&transaction[(i + 1) * pagesize_], pages[i].data, pagesize_);
+    }
+    descriptor->checksum = checksum(&transaction[0]);
+
+    if (!storage_->write(offset_ + (uint64_t)head_ * pagesize_, &transaction[0], transaction.size()) || !storage_->sync())
+        return false;
+    head_ += length;
+    sequence_++;
+    logged(&transaction[0]);
+    return true;
+}
+
+bool ApeJournal::replayable(uint32_t index) const
+{
+    return binary_search(recent_[0].begin(), recent_[0].end(), index) ||
+           binary_search(recent_[1].begin(), recent_[1].end(), index);
+}
+
+void ApeJournal::replayablepages(vector<uint32_t>& indexes) const
+{
+    indexes.insert(indexes.end(), recent_[0].begin(), recent_[0].end());
+    indexes.insert(indexes.end(), recent_[1].begin(), recent_[1].end());
+}
+
+/*
+    Makes transaction the last one replay() writes
+*/
+void ApeJournal::logged(const uint8_t* transaction)
+{
+    const ApeJournalDescriptor* descriptor = (const ApeJournalDescriptor*)transaction;
+    const uint32_t* indexes = (const uint32_t*)(descriptor + 1);
+    recent_[0].swap(recent_[1]);
+    recent_[1].assign(indexes, indexes + descriptor->count);
+    sort(recent_[1].begin(), recent_[1].end());
+}
+
+bool ApeJournal::apply(const uint8_t* transaction)
+{
+    const ApeJournalDescriptor* descriptor = (const ApeJournalDescriptor*)transaction;
+    const uint32_t* indexes = (const uint32_t*)(descriptor + 1);
+    for (uint32_t i = 0; i < descriptor->count; i++)
+    {
+        if (!storage_->write((uint64_t)indexes[i] * pagesize_, transaction + (i + 1) * pagesize_, pagesize_))
+            return false;
+    }
+    return true;
+}
+
+/*
+    Writes the last committed transaction back in place, and the one
+    before it if it's still there. New transactions go after the last one.
+*/
+bool ApeJournal::replay(uint32_t& replayed)
+{
+    replayed = 0;
+    if (storage_ == NULL)
+        return false;
+
+    vector<uint8_t> region((size_t)pages_ * pagesize_);
+    if (!storage_->read(offset_, &region[0], region.size()))
+        return false;
+
+    // (sequence, page) of every intact transaction
+    vector<pair<uint64_t, uint32_t> > found;
+    for (uint32_t page = 0; page < pages_; page++)
+    {
+        const uint8_t* transaction = &region[(size_t)page * pagesize_];
+        const ApeJournalDescriptor* descriptor = (const ApeJournalDescriptor*)transaction;
+        if (descriptor->magic != JOURNALMAGIC || descriptor->count == 0 || descriptor->count > capacity() ||
+            page + 1 + descriptor->count > pages_ || checksum(transaction) != descriptor->checksum)
+            continue;
+        found.push_back(make_pair(descriptor->sequence, page));
+    }
+
+    head_ = 0;
+    sequence_ = 1;
+    recent_[0].clear();
+    recent_[1].clear();
+    if (found.empty())
+        return true;
+
+    sort(found.begin(), found.end());
+    uint64_t sequence = found.back().first;
+    uint32_t last = found.back().second;
+    if (found.size() > 1 && found[found.size() - 2].first == sequence - 1)
+    {
+        if (!apply(&region[(size_t)found[found.size() - 2].second * pagesize_]))
+            return false;
+        logged(&region[(size_t)found[found.size() - 2].second * pagesize_]);
+        replayed++;
+    }
+    if (!apply(&region[(size_t)last * pagesize_]) || !storage_->sync())
+        return false;
+    logged(&region[(size_t)last * pagesize_]);
+    replayed++;
+
+    head_ = last + 1 + ((const ApeJournalDescriptor*)&region[(size_t)last * pagesize_])->count;
+    sequence_ = sequence + 1;
+    return true;
+}
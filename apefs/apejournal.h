@@ -0,0 +1,69 @@
+#ifndef APEJOURNAL_H
+#define APEJOURNAL_H
+
+#include <vector>
+#include <stdint.h>
+#include "apestorage.h"
+
+using namespace std;
+
+/*
+    A page to log, index is its position in the image in pages
+*/
+struct ApeJournalPage
+{
+    uint32_t index;
+    const uint8_t* data;
+};
+
+/*
+    First page of a transaction, the page indexes follow it
+*/
+struct ApeJournalDescriptor
+{
+    uint32_t magic;
+    uint32_t count; // pages carried, their contents follow the descriptor
+    uint64_t sequence;
+    uint32_t checksum; // crc32 of the descriptor (this field zeroed) and the contents
+    uint32_t reserved;
+};
+
+const uint32_t JOURNALMAGIC = 0x4a455041; // "APEJ"
+
+/*
+    Write-ahead log of image pages, kept in a region of the image.
+    Transactions follow each other around the region and a single sync
+    makes one durable, torn ones fail their checksum. The pages of the
+    previous transaction may not be in place yet when the last one is
+    committed, so replay() writes both again. Transactions hold at most
+    a third of the region, the last two are always intact.
+*/
+class ApeJournal
+{
+public:
+    ApeJournal();
+    void attach(ApeStorage* storage, uint64_t offset, uint32_t pages, uint32_t pagesize);
+    void detach();
+    bool attached() const;
+    uint32_t capacity() const; // pages one transaction can carry
+    // pages must be in place once it returns, before the next commit
+    bool commit(const vector<ApeJournalPage>& pages);
+    bool replay(uint32_t& replayed);
+    // replay() may write the page again, it's in one of the last two transactions
+    bool replayable(uint32_t index) const;
+    void replayablepages(vector<uint32_t>& indexes) const;
+private:
+    void logged(const uint8_t* transaction);
+    bool apply(const uint8_t* transaction);
+    uint32_t checksum(const uint8_t* transaction) const;
+
+    ApeStorage* storage_;
+    uint64_t offset_; // of the region in the image
+    uint32_t pages_; // region size
+    uint32_t pagesize_;
+    uint32_t head_; // where the next transaction goes
+    uint64_t sequence_; // of the next transaction
+    vector<uint32_t> recent_[2]; // sorted page indexes of the last two transactions, the last one second
+};
+
+#endif // APEJOURNAL_H
@@ -0,0 +1,41 @@
+#include "apelock.h"
+
+ApeRwLock::ApeRwLock()
+    : reading_(0), waiting_(0), writing_(false)
+{
+}
+
+void ApeRwLock::lock()
+{
+    unique_lock<mutex> lock(lock_);
+    waiting_++;
+    while (writing_ || reading_ > 0)
+        writers_.wait(lock);
+    waiting_--;
+    writing_ = true;
+}
+
+void ApeRwLock::unlock()
+{
+    lock_guard<mutex> lock(lock_);
+    writing_ = false;
+    if (waiting_ > 0)
+        writers_.notify_one();
+    else
+        readers_.notify_all();
+}
+
+void ApeRwLock::lock_shared()
+{
+    unique_lock<mutex> lock(lock_);
+    while (writing_ || waiting_ > 0)
+        readers_.wait(lock);
+    reading_++;
+}
+
+void ApeRwLock::unlock_shared()
+{
+    lock_guard<mutex> lock(lock_);
+    if (--reading_ == 0 && waiting_ > 0)
+        writers_.notify_one();
+}
@@ -0,0 +1,32 @@
+#ifndef APELOCK_H
+#define APELOCK_H
+
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
+
+using namespace std;
+
+/*
+    Reader-writer lock that lets a waiting writer in before new readers,
+    a file being read nonstop can still be written.
+    Works with unique_lock and shared_lock.
+*/
+class ApeRwLock
+{
+public:
+    ApeRwLock();
+    void lock();
+    void unlock();
+    void lock_shared();
+    void unlock_shared();
+private:
+    mutex lock_;
+    condition_variable readers_;
+    condition_variable writers_;
+    uint32_t reading_;
+    uint32_t waiting_; // writers
+    bool writing_;
+};
+
+#endif // APELOCK_H
@@ -0,0 +1,174 @@
+#include "apelz.h"
+#include <string.h>
+
+static uint32_t lzread32(const uint8_t* data)
+{
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static uint32_t lzhash(uint32_t value)
+{
+    return (value * 2654435761u) >> (32 - LZHASHBITS);
+}
+
+/*
+    Writes the rest of a length that didn't fit in its token nibble
+*/
+static uint8_t* lzlength(uint8_t* out, uint32_t length)
+{
+    while (length >= 255)
+    {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = (uint8_t)length;
+    return out;
+}
+
+/*
+    Appends a sequence, returns NULL if it doesn't fit before end.
+    matchlength 0 for the last one, literals only.
+*/
+static uint8_t* lzsequence(uint8_t* out, uint8_t* end, const uint8_t* literals, uint32_t count,
+                           uint32_t offset, uint32_t matchlength)
+{
+    // token, lengths past their nibble, literals and offset
+    uint64_t needed = 1 + (count >= 15 ? count / 255 + 1 : 0) + count + (matchlength > 0 ? 2 + (matchlength - LZMINMATCH) / 255 + 1 : 0);
+    if (needed > (uint64_t)(end - out))
+        return NULL;
+
+    uint8_t* token = out++;
+    *token = (uint8_t)(count >= 15 ? 15 << 4 : count << 4);
+    if (count >= 15)
+        out = lzlength(out, count - 15);
+    memcpy(out, literals, count);
+    out += count;
+    if (matchlength == 0)
+        return out;
+
+    *out++ = (uint8_t)offset;
+    *out++ = (uint8_t)(offset >> 8);
+    uint32_t length = matchlength - LZMINMATCH;
+    *token |= (uint8_t)(length >= 15 ? 15 : length);
+    if (length >= 15)
+        out = lzlength(out, length - 15);
+    return out;
+}
+
+/*
+    Greedy parse, the last position each 4 byte sequence was seen at is kept
+    in a small hash table. Runs without matches are skipped faster and faster.
+*/
+uint32_t ApeLz::compress(const uint8_t* source, uint32_t size, uint8_t* target, uint32_t capacity)
+{
+    if (size > LZMAXINPUT)
+        return 0;
+
+    uint16_t table[1 << LZHASHBITS];
+    memset(table, 0, sizeof(table));
+    uint8_t* out = target;
+    uint8_t* end = target + capacity;
+    uint32_t anchor = 0;
+    uint32_t pos = 1;
+
+    while (size >= LZMATCHLIMIT && pos <= size - LZMATCHLIMIT)
+    {
+        uint32_t sequence = lzread32(source + pos);
+        uint32_t hash = lzhash(sequence);
+        uint32_t candidate = table[hash];
+        table[hash] = (uint16_t)pos;
+        if (pos - candidate > 0xFFFF || lzread32(source + candidate) != sequence)
+        {
+            pos += 1 + ((pos - anchor) >> 6);
+            continue;
+        }
+
+        // extend backwards over the pending literals, then forwards
+        while (pos > anchor && candidate > 0 && source[pos - 1] == source[candidate - 1])
+        {
+            pos--;
+            candidate--;
+        }
+        uint32_t matchend = pos + LZMINMATCH;
+        uint32_t limit = size - LZLASTLITERALS;
+        while (matchend < limit && source[matchend] == source[candidate + (matchend - pos)])
+            matchend++;
+
+        out = lzsequence(out, end, source + anchor, pos - anchor, pos - candidate, matchend - pos);
+        if (out == NULL)
+            return 0;
+        pos = matchend;
+        anchor = pos;
+    }
+
+    out = lzsequence(out, end, source + anchor, size - anchor, 0, 0);
+    return out == NULL ? 0 : out - target;
+}
+
+/*
+    Reads a length carried on past its token nibble, ok is cleared if the data ends first
+*/
+static uint32_t lzdecodelength(const uint8_t*& in, const uint8_t* end, bool& ok)
+{
+    uint32_t length = 0;
+    uint8_t byte;
+    do
+    {
+        if (in >= end || length > LZMAXINPUT)
+        {
+            ok = false;
+            return 0;
+        }
+        byte = *in++;
+        length += byte;
+    }
+    while (byte == 255);
+    return length;
+}
+
+bool ApeLz::decompress(const uint8_t* source, uint32_t sourcesize, uint8_t* target, uint32_t size)
+{
+    const uint8_t* in = source;
+    const uint8_t* inend = source + sourcesize;
+    uint8_t* out = target;
+    uint8_t* outend = target + size;
+    bool ok = true;
+
+    while (in < inend)
+    {
+        uint8_t token = *in++;
+        uint32_t count = token >> 4;
+        if (count == 15)
+            count += lzdecodelength(in, inend, ok);
+        if (!ok || count > (size_t)(inend - in) || count > (size_t)(outend - out))
+            return false;
+        memcpy(out, in, count);
+        in += count;
+        out += count;
+        if (in == inend)
+            break;
+
+        if (inend - in < 2)
+            return false;
+        uint32_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        uint32_t length = token & 15;
+        if (length == 15)
+            length += lzdecodelength(in, inend, ok);
+        length += LZMINMATCH;
+        if (!ok || offset == 0 || offset > (size_t)(out - target) || length > (size_t)(outend - out))
+            return false;
+
+        // overlapping matches repeat the last offset bytes, copied offset at a time
+        while (length > 0)
+        {
+            uint32_t chunk = length < offset ? length : offset;
+            memcpy(out, out - offset, chunk);
+            out += chunk;
+            length -= chunk;
+        }
+    }
+    return out == outend;
+}
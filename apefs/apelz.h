@@ -0,0 +1,27 @@
+#ifndef APELZ_H
+#define APELZ_H
+
+#include <stdint.h>
+
+const uint32_t LZMAXINPUT = 65536; // match offsets are 16 bits
+const uint32_t LZMINMATCH = 4;
+const uint32_t LZHASHBITS = 12;
+const uint32_t LZLASTLITERALS = 5; // the data always ends with literals
+const uint32_t LZMATCHLIMIT = 12; // no match starts this close to the end
+
+/*
+    Byte oriented LZ77 codec, the LZ4 block layout. Each sequence is a token
+    (literal count << 4 | match length - LZMINMATCH, 15 meaning more length
+    bytes follow), the literals, then the match offset, 2 bytes little endian.
+    The last sequence only has literals.
+*/
+class ApeLz
+{
+public:
+    // compressed size, 0 if it doesn't fit in capacity or size is too large
+    static uint32_t compress(const uint8_t* source, uint32_t size, uint8_t* target, uint32_t capacity);
+    // fails unless source decodes to exactly size bytes
+    static bool decompress(const uint8_t* source, uint32_t sourcesize, uint8_t* target, uint32_t size);
+};
+
+#endif // APELZ_H
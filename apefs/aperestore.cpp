@@ -0,0 +1,329 @@
+#include "aperestore.h"
+#include <thread>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static bool piecebefore(const ApeRestorePiece& a, const ApeRestorePiece& b)
+{
+    return a.start < b.start;
+}
+
+ApeRestore::ApeRestore(ApeFileSystem& fs, uint32_t workers)
+    : fs_(fs), workers_(max(workers, (uint32_t)1)), done_(false), failed_(false)
+{
+    stats_.files = 0;
+    stats_.directories = 0;
+    stats_.bytes = 0;
+    stats_.reads = 0;
+    stats_.readbytes = 0;
+}
+
+const ApeRestoreStats& ApeRestore::stats() const
+{
+    return stats_;
+}
+
+bool ApeRestore::makedir(const string& path)
+{
+    struct stat s;
+    if (mkdir(path.c_str(), 0777) == 0)
+        return true;
+    return errno == EEXIST && stat(path.c_str(), &s) == 0 && S_ISDIR(s.st_mode);
+}
+
+bool ApeRestore::run(const string& source, const string& target)
+{
+    files_.clear();
+    pieces_.clear();
+    if (!makedir(target) || !plan(source, target))
+        return false;
+    return extract();
+}
+
+/*
+    Creates the directories and the files that aren't in blocks,
+    the others only get their pieces listed
+*/
+bool ApeRestore::plan(const string& source, const string& target)
+{
+    vector<ApeDirectoryEntry> entries;
+    if (!fs_.directoryenum(source, entries))
+        return false;
+
+    vector<ApeExtent> extents;
+    ApeFragments tail;
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        string path = ApeFileSystem::joinpath(target, entries[i].name);
+        if (entries[i].isdirectory())
+        {
+            if (!makedir(path) || !plan(ApeFileSystem::joinpath(source, entries[i].name), path))
+                return false;
+            stats_.directories++;
+            continue;
+        }
+
+        ApeFile file(fs_);
+        extents.clear();
+        if (!file.open(ApeFileSystem::joinpath(source, entries[i].name), APEFILE_OPEN) || !file.extents(extents, tail))
+            return false;
+
+        stats_.files++;
+        if (extents.empty() && tail.count == 0)
+        {
+            // empty, kept in its inode or compressed, nothing to read in block order
+            if (!copy(file, path))
+                return false;
+            continue;
+        }
+
+        ApeRestoreFile restored = {path, file.size(), file.size(), -1};
+        uint32_t index = files_.size();
+        files_.push_back(restored);
+
+        // blocks past the size hold nothing, big runs are cut to fit a read
+        uint32_t blocks = (uint32_t)((restored.size + BLOCKSIZE - 1) / BLOCKSIZE);
+        if (tail.count > 0)
+            blocks = (uint32_t)(restored.size / BLOCKSIZE);
+        uint32_t blockpos = 0;
+        for (size_t e = 0; e < extents.size() && blockpos < blocks; e++)
+        {
+            for (uint32_t done = 0; done < extents[e].count && blockpos < blocks; )
+            {
+                uint32_t count = min(min(extents[e].count - done, blocks - blockpos), RESTOREREADBLOCKS);
+                ApeRestorePiece piece = {extents[e].start + done, count, index, blockpos, 0};
+                pieces_.push_back(piece);
+                done += count;
+                blockpos += count;
+            }
+        }
+        if (blockpos < blocks)
+            return false;
+        if (tail.count > 0)
+        {
+            ApeRestorePiece piece = {tail.block, 1, index, blockpos, tail.first * FRAGMENTSIZE};
+            pieces_.push_back(piece);
+        }
+    }
+    return true;
+}
+
+/*
+    Restores a file through its handle, right away, a read buffer at a time
+*/
+bool ApeRestore::copy(ApeFile& file, const string& path)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        return false;
+
+    uint64_t size = file.size();
+    vector<uint8_t> data(min(size, (uint64_t)RESTOREREADBLOCKS * BLOCKSIZE));
+    uint64_t copied = 0;
+    bool ok = true;
+    while (copied < size && ok)
+    {
+        uint32_t length = (uint32_t)min(size - copied, (uint64_t)data.size());
+        ok = file.read(&data[0], length) == length;
+        for (uint32_t written = 0; written < length && ok; )
+        {
+            ssize_t result = ::write(fd, &data[written], length - written);
+            if (result < 0 && errno == EINTR)
+                continue;
+            ok = result > 0;
+            if (ok)
+                written += result;
+        }
+        if (ok)
+            copied += length;
+    }
+    stats_.bytes += copied;
+    return close(fd) == 0 && ok;
+}
+
+/*
+    Reads the pieces in block order, a read takes in the pieces that follow
+    as long as they start close enough and it doesn't outgrow its buffer.
+    Pieces may overlap, when files share blocks, like packed tails do.
+*/
+bool ApeRestore::extract()
+{
+    stable_sort(pieces_.begin(), pieces_.end(), piecebefore);
+
+    buffers_.resize(workers_ + 2);
+    freebuffers_.clear();
+    bufferusers_.assign(buffers_.size(), 0);
+    for (uint32_t i = 0; i < buffers_.size(); i++)
+        freebuffers_.push_back(i);
+    queues_.assign(workers_, deque<ApeRestoreBatch>());
+    done_ = false;
+    failed_ = false;
+
+    vector<thread> threads;
+    for (uint32_t i = 0; i < workers_; i++)
+        threads.push_back(thread(&ApeRestore::work, this, i));
+
+    size_t first = 0;
+    while (first < pieces_.size() && !failed_)
+    {
+        uint32_t start = pieces_[first].start;
+        uint32_t end = start + pieces_[first].count;
+        size_t last = first + 1;
+        while (last < pieces_.size() && pieces_[last].start <= end + RESTOREGAPBLOCKS &&
+               max(end, pieces_[last].start + pieces_[last].count) - start <= RESTOREREADBLOCKS)
+        {
+            end = max(end, pieces_[last].start + pieces_[last].count);
+            last++;
+        }
+
+        uint32_t buffer;
+        {
+            unique_lock<mutex> lock(lock_);
+            while (freebuffers_.empty())
+                released_.wait(lock);
+            buffer = freebuffers_.back();
+            freebuffers_.pop_back();
+        }
+
+        buffers_[buffer].resize((size_t)RESTOREREADBLOCKS * BLOCKSIZE);
+        if (!fs_.blocksread(start, end - start, &buffers_[buffer][0]) || !dispatch(buffer, start, first, last))
+        {
+            failed_ = true;
+            break;
+        }
+        stats_.reads++;
+        stats_.readbytes += (uint64_t)(end - start) * BLOCKSIZE;
+        first = last;
+    }
+
+    {
+        lock_guard<mutex> lock(lock_);
+        done_ = true;
+    }
+    queued_.notify_all();
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+
+    buffers_.clear();
+    return !failed_;
+}
+
+/*
+    Hands the pieces first..last-1, read into buffer from block start on,
+    to the workers writing their files
+*/
+bool ApeRestore::dispatch(uint32_t buffer, uint32_t start, size_t first, size_t last)
+{
+    vector<ApeRestoreBatch> batches(workers_);
+    for (size_t i = first; i < last; i++)
+    {
+        const ApeRestorePiece& piece = pieces_[i];
+        const ApeRestoreFile& file = files_[piece.file];
+        ApeRestoreWrite write;
+        write.file = piece.file;
+        write.offset = (uint64_t)piece.blockpos * BLOCKSIZE;
+        write.data = &buffers_[buffer][(size_t)(piece.start - start) * BLOCKSIZE + piece.offset];
+        write.size = (uint32_t)min((uint64_t)(piece.count * BLOCKSIZE - piece.offset), file.size - write.offset);
+        batches[piece.file % workers_].writes.push_back(write);
+    }
+
+    uint32_t users = 0;
+    {
+        lock_guard<mutex> lock(lock_);
+        for (uint32_t w = 0; w < workers_; w++)
+        {
+            if (batches[w].writes.empty())
+                continue;
+            batches[w].buffer = buffer;
+            queues_[w].push_back(batches[w]);
+            users++;
+        }
+        bufferusers_[buffer] = users;
+        if (users == 0)
+            freebuffers_.push_back(buffer);
+    }
+    queued_.notify_all();
+    return users != 0;
+}
+
+/*
+    Writes out the batches queued for the worker until there are no more
+    pieces, after a failure batches are only released
+*/
+void ApeRestore::work(uint32_t worker)
+{
+    unique_lock<mutex> lock(lock_);
+    while (true)
+    {
+        while (queues_[worker].empty() && !done_)
+            queued_.wait(lock);
+        if (queues_[worker].empty())
+            break;
+
+        ApeRestoreBatch batch;
+        batch.buffer = queues_[worker].front().buffer;
+        batch.writes.swap(queues_[worker].front().writes);
+        queues_[worker].pop_front();
+        lock.unlock();
+
+        uint64_t bytes = 0;
+        for (size_t i = 0; i < batch.writes.size() && !failed_; i++)
+        {
+            if (!write(batch.writes[i]))
+                failed_ = true;
+            bytes += batch.writes[i].size;
+        }
+
+        lock.lock();
+        stats_.bytes += bytes;
+        if (--bufferusers_[batch.buffer] == 0)
+        {
+            freebuffers_.push_back(batch.buffer);
+            released_.notify_one();
+        }
+    }
+    lock.unlock();
+
+    // files left open didn't get all their pieces
+    for (size_t i = worker; i < files_.size(); i += workers_)
+    {
+        if (files_[i].fd >= 0)
+        {
+            close(files_[i].fd);
+            files_[i].fd = -1;
+        }
+    }
+}
+
+bool ApeRestore::write(const ApeRestoreWrite& write)
+{
+    ApeRestoreFile& file = files_[write.file];
+    if (file.fd < 0)
+    {
+        file.fd = open(file.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (file.fd < 0)
+            return false;
+    }
+
+    uint32_t written = 0;
+    while (written < write.size)
+    {
+        ssize_t result = pwrite(file.fd, write.data + written, write.size - written, (off_t)write.offset + written);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            return false;
+        written += result;
+    }
+
+    file.left -= min(file.left, (uint64_t)write.size);
+    if (file.left == 0)
+    {
+        bool ok = close(file.fd) == 0;
+        file.fd = -1;
+        return ok;
+    }
+    return true;
+}
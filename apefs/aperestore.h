@@ -0,0 +1,114 @@
+#ifndef APERESTORE_H
+#define APERESTORE_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
+#include "apefilesystem.h"
+
+using namespace std;
+
+const uint32_t RESTOREREADBLOCKS = 2048; // 8mb, largest read of the image
+const uint32_t RESTOREGAPBLOCKS = 16; // 64kb, gaps this small are read through rather than skipped
+const uint32_t RESTOREWORKERS = 4; // default threads writing to the host
+
+/*
+    A file to restore, written by worker file % workers only.
+    The host file is open from its first write to its last one.
+*/
+struct ApeRestoreFile
+{
+    string path; // on the host
+    uint64_t size;
+    uint64_t left; // bytes still to write
+    int fd;
+};
+
+/*
+    Part of a file sitting in one run of blocks of the image,
+    or in the fragments of a packed tail
+*/
+struct ApeRestorePiece
+{
+    blocknum_t start;
+    uint32_t count;
+    uint32_t file; // index in the plan
+    uint32_t blockpos; // in the file
+    uint32_t offset; // of the data in the first block, tails don't start it
+};
+
+/*
+    Bytes of a read buffer going to a file
+*/
+struct ApeRestoreWrite
+{
+    uint32_t file;
+    uint64_t offset;
+    const uint8_t* data;
+    uint32_t size;
+};
+
+/*
+    Writes from one read buffer for one worker
+*/
+struct ApeRestoreBatch
+{
+    uint32_t buffer;
+    vector<ApeRestoreWrite> writes;
+};
+
+struct ApeRestoreStats
+{
+    uint32_t files;
+    uint32_t directories;
+    uint64_t bytes; // written to the host
+    uint32_t reads; // of the image
+    uint64_t readbytes; // gaps read through included
+};
+
+/*
+    Restores a tree of the image to the host. The files are planned first,
+    each is cut in pieces along the runs of blocks it's stored in. The
+    pieces are then read in block order, neighbours sharing large reads,
+    so the image is read in about one pass whatever the tree looks like.
+    Workers write the buffers read out to the host files meanwhile.
+    The filesystem must not be changed while it runs.
+*/
+class ApeRestore
+{
+public:
+    ApeRestore(ApeFileSystem& fs, uint32_t workers = RESTOREWORKERS);
+    // source is a directory of the image, target one on the host, created if needed
+    bool run(const string& source, const string& target);
+    const ApeRestoreStats& stats() const;
+private:
+    bool plan(const string& source, const string& target);
+    bool copy(ApeFile& file, const string& path);
+    bool extract();
+    bool dispatch(uint32_t buffer, uint32_t start, size_t first, size_t last);
+    void work(uint32_t worker);
+    bool write(const ApeRestoreWrite& write);
+    static bool makedir(const string& path);
+
+    ApeFileSystem& fs_;
+    uint32_t workers_;
+    ApeRestoreStats stats_;
+    vector<ApeRestoreFile> files_;
+    vector<ApeRestorePiece> pieces_;
+    vector<vector<uint8_t> > buffers_;
+
+    mutex lock_; // everything below
+    condition_variable queued_; // a batch for the workers, or done_
+    condition_variable released_; // a buffer back in freebuffers_
+    vector<deque<ApeRestoreBatch> > queues_; // per worker
+    vector<uint32_t> freebuffers_;
+    vector<uint32_t> bufferusers_; // workers yet to write out each buffer
+    bool done_;
+    atomic<bool> failed_;
+};
+
+#endif // APERESTORE_H
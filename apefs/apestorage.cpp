@@ -0,0 +1,375 @@
+#include "apestorage.h"
+#include <string.h>
+#include <algorithm>
+
+#if defined(APESTORAGE_MMAP_SUPPORTED) || defined(APESTORAGE_PIO_SUPPORTED)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+ApeStorage* ApeStorage::make(ApeStorageType type)
+{
+#ifdef APESTORAGE_MMAP_SUPPORTED
+    if (type == APESTORAGE_MMAP)
+        return new ApeMappedStorage();
+#endif
+#ifdef APESTORAGE_PIO_SUPPORTED
+    if (type == APESTORAGE_PIO)
+        return new ApePositionalStorage();
+#endif
+    return new ApeStreamStorage();
+}
+
+/*
+    Enough where flush() already waits for the disk, streams can't get
+    any further than their own buffer
+*/
+bool ApeStorage::sync()
+{
+    return flush();
+}
+
+bool ApeStorage::durable() const
+{
+    return true;
+}
+
+bool ApeStorage::mapped() const
+{
+    return false;
+}
+
+const uint8_t* ApeStorage::data(uint64_t offset, uint32_t size) const
+{
+    return NULL;
+}
+
+bool ApeStorage::submit(ApeIoRequest* requests, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        ApeIoRequest& request = requests[i];
+        if (request.write)
+            request.batch->complete(write(request.offset, request.data, request.size));
+        else
+            request.batch->complete(read(request.offset, request.data, request.size));
+    }
+    return true;
+}
+
+bool ApeStreamStorage::durable() const
+{
+    return false;
+}
+
+bool ApeStreamStorage::open(const string& path, bool truncate)
+{
+    close();
+    ios::openmode mode = ios::in | ios::out | ios::binary;
+    if (truncate)
+        mode |= ios::trunc;
+    file_.clear();
+    file_.open(path.c_str(), mode);
+    return file_.good();
+}
+
+bool ApeStreamStorage::close()
+{
+    if (!file_.is_open())
+        return true;
+    file_.close();
+    return file_.good();
+}
+
+bool ApeStreamStorage::isopen() const
+{
+    return file_.is_open();
+}
+
+bool ApeStreamStorage::grow(uint64_t size)
+{
+    file_.seekp(0, ios::end);
+    if ((uint64_t)file_.tellp() >= size)
+        return file_.good();
+    // writing the last byte extends the file, the gap reads as zeros
+    file_.seekp(size - 1);
+    file_.put(0);
+    return file_.good();
+}
+
+bool ApeStreamStorage::read(uint64_t offset, void* data, uint32_t size)
+{
+    lock_guard<mutex> lock(lock_);
+    file_.seekg(offset);
+    file_.read((char*)data, size);
+    return file_.good();
+}
+
+bool ApeStreamStorage::write(uint64_t offset, const void* data, uint32_t size)
+{
+    lock_guard<mutex> lock(lock_);
+    file_.seekp(offset);
+    file_.write((const char*)data, size);
+    return file_.good();
+}
+
+bool ApeStreamStorage::flush()
+{
+    lock_guard<mutex> lock(lock_);
+    file_.flush();
+    return file_.good();
+}
+
+#ifdef APESTORAGE_PIO_SUPPORTED
+
+ApePositionalStorage::ApePositionalStorage()
+    : fd_(-1), engine_(NULL)
+{
+}
+
+ApePositionalStorage::~ApePositionalStorage()
+{
+    close();
+}
+
+bool ApePositionalStorage::open(const string& path, bool truncate)
+{
+    close();
+    int flags = O_RDWR;
+    if (truncate)
+        flags |= O_CREAT | O_TRUNC;
+    fd_ = ::open(path.c_str(), flags, 0644);
+    if (fd_ < 0)
+        return false;
+    engine_ = ApeIoEngine::make(fd_);
+    return true;
+}
+
+bool ApePositionalStorage::close()
+{
+    if (fd_ < 0)
+        return true;
+    // lets the requests in flight finish
+    delete engine_;
+    engine_ = NULL;
+    bool ok = ::close(fd_) == 0;
+    fd_ = -1;
+    return ok;
+}
+
+bool ApePositionalStorage::isopen() const
+{
+    return fd_ >= 0;
+}
+
+bool ApePositionalStorage::grow(uint64_t size)
+{
+    struct stat st;
+    if (fstat(fd_, &st) != 0)
+        return false;
+    if ((uint64_t)st.st_size >= size)
+        return true;
+    return ftruncate(fd_, size) == 0;
+}
+
+bool ApePositionalStorage::read(uint64_t offset, void* data, uint32_t size)
+{
+    // short reads only happen at the end of the file
+    while (size > 0)
+    {
+        ssize_t done = pread(fd_, data, size, offset);
+        if (done <= 0)
+            return false;
+        data = (uint8_t*)data + done;
+        offset += done;
+        size -= done;
+    }
+    return true;
+}
+
+bool ApePositionalStorage::write(uint64_t offset, const void* data, uint32_t size)
+{
+    while (size > 0)
+    {
+        ssize_t done = pwrite(fd_, data, size, offset);
+        if (done <= 0)
+            return false;
+        data = (const uint8_t*)data + done;
+        offset += done;
+        size -= done;
+    }
+    return true;
+}
+
+/*
+    Writes are already in the page cache, nothing to push
+*/
+bool ApePositionalStorage::flush()
+{
+    return fd_ >= 0;
+}
+
+bool ApePositionalStorage::sync()
+{
+#ifdef __APPLE__
+    return fd_ >= 0 && fsync(fd_) == 0;
+#else
+    return fd_ >= 0 && fdatasync(fd_) == 0;
+#endif
+}
+
+bool ApePositionalStorage::submit(ApeIoRequest* requests, uint32_t count)
+{
+    if (engine_ == NULL)
+        return ApeStorage::submit(requests, count);
+    return engine_->submit(requests, count);
+}
+
+#endif
+
+#ifdef APESTORAGE_MMAP_SUPPORTED
+
+ApeMappedStorage::ApeMappedStorage()
+    : fd_(-1), map_(NULL), size_(0), dirtystart_(0), dirtyend_(0)
+{
+}
+
+ApeMappedStorage::~ApeMappedStorage()
+{
+    close();
+}
+
+bool ApeMappedStorage::open(const string& path, bool truncate)
+{
+    close();
+    int flags = O_RDWR;
+    if (truncate)
+        flags |= O_CREAT | O_TRUNC;
+    fd_ = ::open(path.c_str(), flags, 0644);
+    if (fd_ < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd_, &st) != 0)
+    {
+        close();
+        return false;
+    }
+    size_ = st.st_size;
+    if (!remap())
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool ApeMappedStorage::close()
+{
+    if (fd_ < 0)
+        return true;
+    bool ok = flush();
+    if (map_ != NULL)
+        munmap(map_, size_);
+    ok = ::close(fd_) == 0 && ok;
+    fd_ = -1;
+    map_ = NULL;
+    size_ = 0;
+    return ok;
+}
+
+bool ApeMappedStorage::isopen() const
+{
+    return fd_ >= 0;
+}
+
+/*
+    Maps the whole file, an empty file has no mapping
+*/
+bool ApeMappedStorage::remap()
+{
+    if (map_ != NULL)
+        munmap(map_, size_);
+    map_ = NULL;
+    if (size_ == 0)
+        return true;
+
+    void* map = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (map == MAP_FAILED)
+        return false;
+    map_ = (uint8_t*)map;
+    return true;
+}
+
+bool ApeMappedStorage::grow(uint64_t size)
+{
+    if (size <= size_)
+        return true;
+    // the pages written so far stay in the page cache, remapping loses nothing
+    if (ftruncate(fd_, size) != 0)
+        return false;
+    if (map_ != NULL)
+        munmap(map_, size_);
+    map_ = NULL;
+    size_ = size;
+    return remap();
+}
+
+bool ApeMappedStorage::read(uint64_t offset, void* data, uint32_t size)
+{
+    if (map_ == NULL || offset + size > size_)
+        return false;
+    memcpy(data, map_ + offset, size);
+    return true;
+}
+
+bool ApeMappedStorage::write(uint64_t offset, const void* data, uint32_t size)
+{
+    if (map_ == NULL || offset + size > size_)
+        return false;
+    memcpy(map_ + offset, data, size);
+
+    lock_guard<mutex> lock(dirtylock_);
+    if (dirtystart_ == dirtyend_)
+    {
+        dirtystart_ = offset;
+        dirtyend_ = offset + size;
+    }
+    else
+    {
+        dirtystart_ = min(dirtystart_, offset);
+        dirtyend_ = max(dirtyend_, offset + size);
+    }
+    return true;
+}
+
+bool ApeMappedStorage::flush()
+{
+    lock_guard<mutex> lock(dirtylock_);
+    if (dirtystart_ == dirtyend_)
+        return true;
+
+    // msync wants a page aligned start
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t start = dirtystart_ - dirtystart_ % page;
+    if (msync(map_ + start, dirtyend_ - start, MS_SYNC) != 0)
+        return false;
+    dirtystart_ = dirtyend_ = 0;
+    return true;
+}
+
+bool ApeMappedStorage::mapped() const
+{
+    return true;
+}
+
+const uint8_t* ApeMappedStorage::data(uint64_t offset, uint32_t size) const
+{
+    if (map_ == NULL || offset + size > size_)
+        return NULL;
+    return map_ + offset;
+}
+
+#endif
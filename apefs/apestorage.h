@@ -0,0 +1,133 @@
+#ifndef APESTORAGE_H
+#define APESTORAGE_H
+
+#include <fstream>
+#include <string>
+#include <mutex>
+#include <stdint.h>
+#include "apeio.h"
+
+using namespace std;
+
+#if defined(__unix__) || defined(__APPLE__)
+#define APESTORAGE_MMAP_SUPPORTED
+#define APESTORAGE_PIO_SUPPORTED
+#endif
+
+/*
+    Storage backends, APESTORAGE_MMAP and APESTORAGE_PIO fall back
+    to APESTORAGE_STREAM where the system doesn't have them
+*/
+enum ApeStorageType {APESTORAGE_STREAM, APESTORAGE_MMAP, APESTORAGE_PIO};
+
+/*
+    The image file the filesystem lives in.
+    read, write, data and flush may be called from several threads.
+*/
+class ApeStorage
+{
+public:
+    virtual ~ApeStorage() {}
+    virtual bool open(const string& path, bool truncate) = 0;
+    virtual bool close() = 0;
+    virtual bool isopen() const = 0;
+    virtual bool grow(uint64_t size) = 0; // makes the image at least size bytes, zero filled
+    virtual bool read(uint64_t offset, void* data, uint32_t size) = 0;
+    virtual bool write(uint64_t offset, const void* data, uint32_t size) = 0;
+    virtual bool flush() = 0;
+    // flush() and waits until what was written is on the disk
+    virtual bool sync();
+    // true if sync() gets what was written to the disk
+    virtual bool durable() const;
+    // true if data() hands out pointers into the image
+    virtual bool mapped() const;
+    // size bytes of the image at offset, NULL if not mapped or out of bounds.
+    // Valid until close() or grow(), writes show up through it.
+    virtual const uint8_t* data(uint64_t offset, uint32_t size) const;
+    // starts the requests, each completes through its batch even when it fails.
+    // They must stay valid until then, flush() doesn't wait for them.
+    // Runs them right away by default.
+    virtual bool submit(ApeIoRequest* requests, uint32_t count);
+
+    static ApeStorage* make(ApeStorageType type);
+};
+
+/*
+    iostream backend, every call seeks and copies through the stream buffer.
+    The stream has a single position, calls are serialized. Flushing only
+    hands the data to the system, it can't wait for the disk.
+*/
+class ApeStreamStorage : public ApeStorage
+{
+public:
+    bool open(const string& path, bool truncate);
+    bool close();
+    bool isopen() const;
+    bool grow(uint64_t size);
+    bool read(uint64_t offset, void* data, uint32_t size);
+    bool write(uint64_t offset, const void* data, uint32_t size);
+    bool flush();
+    bool durable() const;
+private:
+    fstream file_;
+    mutex lock_;
+};
+
+#ifdef APESTORAGE_PIO_SUPPORTED
+/*
+    Positional I/O backend, pread/pwrite don't share a file position
+    so calls from different threads run in parallel.
+    Submitted requests go to an io engine, io_uring if the kernel has it.
+*/
+class ApePositionalStorage : public ApeStorage
+{
+public:
+    ApePositionalStorage();
+    ~ApePositionalStorage();
+    bool open(const string& path, bool truncate);
+    bool close();
+    bool isopen() const;
+    bool grow(uint64_t size);
+    bool read(uint64_t offset, void* data, uint32_t size);
+    bool write(uint64_t offset, const void* data, uint32_t size);
+    bool flush();
+    bool sync();
+    bool submit(ApeIoRequest* requests, uint32_t count);
+private:
+    int fd_;
+    ApeIoEngine* engine_;
+};
+#endif
+
+#ifdef APESTORAGE_MMAP_SUPPORTED
+/*
+    Memory mapped backend, the whole image is mapped shared.
+    Writes go straight into the mapping, flush() msyncs the written range.
+*/
+class ApeMappedStorage : public ApeStorage
+{
+public:
+    ApeMappedStorage();
+    ~ApeMappedStorage();
+    bool open(const string& path, bool truncate);
+    bool close();
+    bool isopen() const;
+    bool grow(uint64_t size);
+    bool read(uint64_t offset, void* data, uint32_t size);
+    bool write(uint64_t offset, const void* data, uint32_t size);
+    bool flush();
+    bool mapped() const;
+    const uint8_t* data(uint64_t offset, uint32_t size) const;
+private:
+    bool remap();
+
+    int fd_;
+    uint8_t* map_;
+    uint64_t size_;
+    uint64_t dirtystart_; // range written since the last flush
+    uint64_t dirtyend_;
+    mutex dirtylock_;
+};
+#endif
+
+#endif // APESTORAGE_H
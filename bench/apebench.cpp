@@ -0,0 +1,66 @@
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include "apebench.h"
+
+struct ApeBenchEntry
+{
+    const char* name;
+    apebench_t run;
+    const char* help;
+};
+
+static const ApeBenchEntry benches[] =
+{
+    {"bitmap", bitmapbench, "free bit search on empty, half-full and 99% full bitmaps"},
+    {"compress", compressbench, "image space, write and read rates of log text, compression off and on"},
+    {"io", iobench, "random read rate against queue depth, raw engines and async ApeFile reads"},
+    {"large", largefilebench, "sequential write and read rates of a file past 4 GB"},
+    {"readahead", readaheadbench, "sequential small reads of a file against the readahead window"},
+    {"storage", storagebench, "file write, lookup and read through the stream, mmap and pio backends"},
+    {"stress", stressbench, "concurrent file operations from several threads, then a consistency check"},
+    {"sync", syncbench, "file write throughput and latency under each sync policy"},
+    {"tails", tailbench, "image space and restore reads of small files, tail packing off and on"},
+};
+
+static const size_t benchcount = sizeof(benches) / sizeof(benches[0]);
+
+double benchnow()
+{
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+string benchrate(double bytes, double seconds)
+{
+    ostringstream out;
+    out << fixed << setprecision(1) << (seconds > 0 ? bytes / seconds / (1024 * 1024) : 0) << " MB/s";
+    return out.str();
+}
+
+static void usage()
+{
+    cout << "usage: apebench <benchmark> [args...]" << endl << endl;
+    for (size_t i = 0; i < benchcount; i++)
+        cout << "  " << setw(10) << left << benches[i].name << benches[i].help << endl;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        usage();
+        return 1;
+    }
+
+    string name = argv[1];
+    vector<string> args(argv + 2, argv + argc);
+    for (size_t i = 0; i < benchcount; i++)
+    {
+        if (name == benches[i].name)
+            return benches[i].run(args);
+    }
+
+    usage();
+    return 1;
+}
@@ -0,0 +1,31 @@
+#ifndef APEBENCH_H
+#define APEBENCH_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+/*
+    Each benchmark gets the command line arguments after its name
+    and returns the process exit code
+*/
+typedef int (*apebench_t)(const vector<string>& args);
+
+int bitmapbench(const vector<string>& args);
+int compressbench(const vector<string>& args);
+int iobench(const vector<string>& args);
+int largefilebench(const vector<string>& args);
+int readaheadbench(const vector<string>& args);
+int storagebench(const vector<string>& args);
+int stressbench(const vector<string>& args);
+int syncbench(const vector<string>& args);
+int tailbench(const vector<string>& args);
+
+// wall clock in seconds
+double benchnow();
+// formats a rate like "123.4 MB/s"
+string benchrate(double bytes, double seconds);
+
+#endif // APEBENCH_H
@@ -0,0 +1,120 @@
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include "apebench.h"
+#include "../apefs/apebitmap.h"
+
+/*
+    The original byte at a time search, always from bit 0
+*/
+static uint32_t legacyfindunsetbit(ApeBitMap& bitmap)
+{
+    const uint8_t* bits = (const uint8_t*)bitmap.bits();
+    for (uint32_t i = 0; i < bitmap.size(); i++)
+    {
+        if (bits[i] != 255)
+        {
+            uint8_t byte = bits[i];
+            uint32_t bit = i * 8;
+            uint8_t mask = 128;
+            while ((byte & mask) != 0)
+            {
+                mask >>= 1;
+                bit++;
+            }
+            return bit;
+        }
+    }
+    return NOBIT;
+}
+
+enum BitmapSearch {SEARCH_LEGACY, SEARCH_FROMSTART, SEARCH_ROVER};
+
+/*
+    Allocates count bits, returns nanoseconds per allocation
+*/
+static double allocate(const vector<uint8_t>& image, BitmapSearch search, uint32_t count)
+{
+    ApeBitMap bitmap;
+    bitmap.frombuffer((void*)&image[0], image.size());
+
+    double start = benchnow();
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t bit;
+        switch (search)
+        {
+        case SEARCH_LEGACY:
+            bit = legacyfindunsetbit(bitmap);
+            break;
+        case SEARCH_FROMSTART:
+            bit = bitmap.findunsetbit(0, bitmap.size() * 8);
+            break;
+        default:
+            bit = bitmap.findunsetbit();
+            break;
+        }
+        if (bit == NOBIT)
+            break;
+        bitmap.setbit(bit);
+    }
+    return (benchnow() - start) * 1e9 / count;
+}
+
+/*
+    usage: apebench bitmap [bitmap bytes] [allocations]
+*/
+int bitmapbench(const vector<string>& args)
+{
+    uint32_t bytes = args.size() > 0 ? atoi(args[0].c_str()) : 1024 * 1024;
+    uint32_t count = args.size() > 1 ? atoi(args[1].c_str()) : 2000;
+    uint32_t bits = bytes * 8;
+
+    cout << "bitmap of " << bytes << " bytes (" << bits << " bits), "
+         << count << " allocations, ns per allocation" << endl;
+#if defined(__AVX2__)
+    cout << "vector search: avx2" << endl;
+#elif defined(__SSE2__)
+    cout << "vector search: sse2" << endl;
+#else
+    cout << "vector search: none" << endl;
+#endif
+    cout << endl;
+
+    const char* names[] = {"empty", "half-full", "99%-full"};
+    double fills[] = {0.0, 0.5, 0.99};
+
+    cout << setw(12) << left << "fill" << setw(14) << right << "legacy"
+         << setw(14) << "from start" << setw(14) << "rover" << endl;
+
+    for (int f = 0; f < 3; f++)
+    {
+        // used bits are packed at the start, like a filesystem that was filled in order,
+        // except for the 99% case where the last percent is scattered over the whole map
+        ApeBitMap bitmap;
+        bitmap.reserve(bytes);
+        bitmap.unsetall();
+        uint32_t used = (uint32_t)(bits * fills[f]);
+        if (f == 2)
+        {
+            bitmap.setall();
+            srand(42);
+            for (uint32_t i = 0; i < bits - used; i++)
+                bitmap.unsetbit(((uint32_t)rand() * 7919u) % bits);
+        }
+        else
+        {
+            for (uint32_t i = 0; i < used; i++)
+                bitmap.setbit(i);
+        }
+
+        vector<uint8_t> image((uint8_t*)bitmap.bits(), (uint8_t*)bitmap.bits() + bytes);
+
+        cout << setw(12) << left << names[f] << fixed << setprecision(1) << right
+             << setw(14) << allocate(image, SEARCH_LEGACY, count)
+             << setw(14) << allocate(image, SEARCH_FROMSTART, count)
+             << setw(14) << allocate(image, SEARCH_ROVER, count) << endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,139 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include "apebench.h"
+#include "../apefs/apefilesystem.h"
+
+/*
+    Log like text, the kind of data backups are full of.
+    The same on every run.
+*/
+static void compresscorpus(vector<uint8_t>& data, uint32_t size)
+{
+    static const char* levels[] = {"INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR"};
+    static const char* paths[] = {"/api/v1/items", "/api/v1/users", "/static/app.js", "/health", "/api/v2/orders"};
+    srand(1);
+    data.clear();
+    data.reserve(size + 256);
+    while (data.size() < size)
+    {
+        char line[256];
+        uint32_t seconds = data.size() / 2000;
+        int length = snprintf(line, sizeof(line), "2024-03-%02u %02u:%02u:%02u.%03d %-5s [worker-%d] %s %s status=%d took=%dms id=%08x\n",
+                              1 + seconds / 86400 % 28, seconds / 3600 % 24, seconds / 60 % 60, seconds % 60, rand() % 1000,
+                              levels[rand() % 6], rand() % 16, rand() % 4 ? "GET" : "POST", paths[rand() % 5],
+                              rand() % 10 ? 200 : 404, rand() % 500, rand());
+        data.insert(data.end(), line, line + length);
+    }
+    data.resize(size);
+}
+
+/*
+    Writes the corpus as one file with or without compression, then reads
+    it back whole and at random spots, from a reopened image
+*/
+static bool compressrun(const string& path, ApeCompression compression, const vector<uint8_t>& data, uint32_t reads)
+{
+    const uint32_t chunk = 1024 * 1024;
+    const uint32_t readsize = 4096;
+    ApeFileSystem fs;
+    if (!fs.create(path, data.size() + 64 * 1024 * 1024, DEFAULTCACHEBLOCKS, APESTORAGE_PIO, APESYNC_NONE, compression) ||
+        !fs.directorycreate("/bench"))
+        return false;
+
+    double start = benchnow();
+    {
+        ApeFile file(fs);
+        if (!file.open("/bench/log", APEFILE_CREATE))
+            return false;
+        for (uint32_t written = 0; written < data.size(); written += chunk)
+        {
+            uint32_t size = min(chunk, (uint32_t)data.size() - written);
+            if (file.write(&data[written], size) != size)
+                return false;
+        }
+    }
+    if (!fs.flush())
+        return false;
+    double writeseconds = benchnow() - start;
+
+    ApeFsStat stat;
+    if (!fs.close() || !fs.open(path, DEFAULTCACHEBLOCKS, APESTORAGE_PIO) || !fs.statfs(stat))
+        return false;
+
+    ApeFile file(fs);
+    vector<uint8_t> buffer(chunk);
+    if (!file.open("/bench/log", APEFILE_OPEN))
+        return false;
+    start = benchnow();
+    uint32_t total = 0;
+    uint32_t count;
+    while ((count = file.read(&buffer[0], chunk)) > 0)
+    {
+        if (total + count > data.size() || memcmp(&buffer[0], &data[total], count) != 0)
+            return false;
+        total += count;
+    }
+    double readseconds = benchnow() - start;
+    if (total != data.size())
+        return false;
+
+    srand(2);
+    start = benchnow();
+    for (uint32_t i = 0; i < reads; i++)
+    {
+        uint32_t position = (uint32_t)(((uint64_t)rand() * RAND_MAX + rand()) % (data.size() - readsize));
+        if (!file.seek(APESEEK_SET, position) || file.read(&buffer[0], readsize) != readsize ||
+            memcmp(&buffer[0], &data[position], readsize) != 0)
+            return false;
+    }
+    double randomseconds = benchnow() - start;
+
+    uint64_t used = (uint64_t)(stat.totalblocks - stat.freeblocks) * BLOCKSIZE;
+    cout << setw(8) << left << (compression == APECOMPRESS_NONE ? "none" : "lz") << right
+         << setw(10) << fixed << setprecision(1) << used / (1024.0 * 1024.0)
+         << setw(11) << setprecision(3) << (double)used / data.size()
+         << setw(14) << benchrate((double)data.size(), writeseconds)
+         << setw(14) << benchrate((double)data.size(), readseconds)
+         << setw(14) << setprecision(0) << (randomseconds > 0 ? reads / randomseconds : 0) << endl;
+    return true;
+}
+
+/*
+    usage: apebench compress [image path] [file size] [random reads]
+*/
+int compressbench(const vector<string>& args)
+{
+    string path = args.size() > 0 ? args[0] : "apebench.apefs";
+    uint32_t filesize = args.size() > 1 ? atoi(args[1].c_str()) : 128 * 1024 * 1024;
+    uint32_t reads = args.size() > 2 ? atoi(args[2].c_str()) : 20000;
+    if (filesize <= 4096)
+    {
+        cout << "file too small" << endl;
+        return 1;
+    }
+
+    vector<uint8_t> data;
+    compresscorpus(data, filesize);
+    cout << filesize / (1024 * 1024) << "MB of log text in " << path << ", then " << reads << " random 4kb reads" << endl;
+    cout << "used is the image space taken, writes include the flush" << endl << endl;
+    cout << setw(8) << left << "codec" << right << setw(10) << "used MB" << setw(11) << "used/data"
+         << setw(14) << "write" << setw(14) << "read" << setw(14) << "random/s" << endl;
+
+    const ApeCompression codecs[] = {APECOMPRESS_NONE, APECOMPRESS_LZ};
+    for (int i = 0; i < 2; i++)
+    {
+        if (!compressrun(path, codecs[i], data, reads))
+        {
+            cout << "failed" << endl;
+            remove(path.c_str());
+            return 1;
+        }
+    }
+
+    remove(path.c_str());
+    return 0;
+}
@@ -0,0 +1,213 @@
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <cstdio>
+#include "apebench.h"
+#include "../apefs/apefilesystem.h"
+
+#ifdef APESTORAGE_PIO_SUPPORTED
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static const uint32_t depths[] = {1, 2, 4, 8, 16, 32, 64};
+static const uint32_t depthcount = sizeof(depths) / sizeof(depths[0]);
+
+static uint32_t benchrandom(uint32_t& seed)
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+#ifdef APESTORAGE_PIO_SUPPORTED
+
+/*
+    Writes back and evicts the image from the page cache,
+    so reads hit the disk (if the filesystem it's on allows it)
+*/
+static void benchdropcache(const string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+/*
+    Random block reads straight through an engine, keeping depth of them in flight
+*/
+static double iorawrun(const string& path, ApeIoEngineType type, uint32_t depth, uint32_t reads, uint64_t size)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return -1;
+    ApeIoEngine* engine = ApeIoEngine::make(fd, type);
+    if (engine == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+
+    vector<ApeBlock> blocks(depth);
+    vector<ApeIoRequest> requests(depth);
+    vector<ApeIoBatch> batches(depth);
+    uint32_t seed = 1;
+    uint32_t submitted = 0;
+    bool ok = true;
+
+    double start = benchnow();
+    for (uint32_t i = 0; i < reads + depth; i++)
+    {
+        uint32_t slot = i % depth;
+        if (i >= depth)
+            ok = batches[slot].wait() && ok;
+        if (submitted == reads)
+            continue;
+
+        ApeIoRequest& request = requests[slot];
+        request.offset = (uint64_t)(benchrandom(seed) % (size / BLOCKSIZE)) * BLOCKSIZE;
+        request.data = blocks[slot].data;
+        request.size = BLOCKSIZE;
+        request.write = false;
+        request.batch = &batches[slot];
+        batches[slot].reset();
+        batches[slot].add(1);
+        ok = engine->submit(&request, 1) && ok;
+        submitted++;
+    }
+    double seconds = benchnow() - start;
+
+    delete engine;
+    close(fd);
+    return ok ? seconds : -1;
+}
+
+#endif
+
+/*
+    Random chunk reads of a file through the async ApeFile calls,
+    one handle per request in flight
+*/
+static double iofilerun(ApeFileSystem& fs, uint32_t depth, uint32_t reads, uint32_t chunk, uint32_t filesize)
+{
+    vector<ApeFile*> files;
+    vector<ApeFileRequest> requests(depth);
+    vector<uint8_t> buffer((size_t)depth * chunk);
+    for (uint32_t i = 0; i < depth; i++)
+    {
+        files.push_back(new ApeFile(fs));
+        files[i]->open("/bench/big", APEFILE_OPEN);
+    }
+
+    uint32_t seed = 2;
+    uint32_t submitted = 0;
+    bool ok = true;
+
+    double start = benchnow();
+    for (uint32_t i = 0; i < reads + depth; i++)
+    {
+        uint32_t slot = i % depth;
+        if (i >= depth)
+            ok = files[slot]->complete(requests[slot]) == chunk && ok;
+        if (submitted == reads)
+            continue;
+
+        uint32_t position = benchrandom(seed) % (filesize / chunk) * chunk;
+        ok = files[slot]->seek(APESEEK_SET, position) &&
+             files[slot]->submitread(&buffer[(size_t)slot * chunk], chunk, requests[slot]) && ok;
+        submitted++;
+    }
+    double seconds = benchnow() - start;
+
+    for (uint32_t i = 0; i < depth; i++)
+        delete files[i];
+    return ok ? seconds : -1;
+}
+
+/*
+    usage: apebench io [image path] [file size] [reads per run]
+*/
+int iobench(const vector<string>& args)
+{
+    string path = args.size() > 0 ? args[0] : "apebench.apefs";
+    uint32_t filesize = args.size() > 1 ? atoi(args[1].c_str()) : 128 * 1024 * 1024;
+    uint32_t reads = args.size() > 2 ? atoi(args[2].c_str()) : 4096;
+    const uint32_t chunk = 64 * 1024;
+    filesize -= filesize % chunk;
+
+    // one big file to read back at random
+    {
+        ApeFileSystem fs;
+        vector<uint8_t> data(1024 * 1024);
+        for (size_t i = 0; i < data.size(); i++)
+            data[i] = (uint8_t)(i * 31);
+        ApeFile file(fs);
+        if (!fs.create(path, filesize + 64 * 1024 * 1024, DEFAULTCACHEBLOCKS, APESTORAGE_PIO) ||
+            !fs.directorycreate("/bench") || !file.open("/bench/big", APEFILE_CREATE))
+        {
+            cout << "failed to create " << path << endl;
+            return 1;
+        }
+        for (uint32_t written = 0; written < filesize; written += data.size())
+        {
+            uint32_t size = min((uint32_t)data.size(), filesize - written);
+            if (file.write(&data[0], size) != size)
+            {
+                cout << "failed to write the test file" << endl;
+                return 1;
+            }
+        }
+    }
+
+    cout << reads << " random reads per run, " << filesize / (1024 * 1024) << " MB file in " << path << endl << endl;
+
+#ifdef APESTORAGE_PIO_SUPPORTED
+    cout << "raw 4 KB reads (IOPS)" << endl;
+    cout << setw(8) << left << "depth" << right << setw(14) << "io_uring" << setw(14) << "threads" << endl;
+    uint64_t imagesize = filesize + 64 * 1024 * 1024;
+    for (uint32_t d = 0; d < depthcount; d++)
+    {
+        cout << setw(8) << left << depths[d] << right;
+        ApeIoEngineType types[] = {APEIO_URING, APEIO_THREADS};
+        for (int t = 0; t < 2; t++)
+        {
+            benchdropcache(path);
+            double seconds = iorawrun(path, types[t], depths[d], reads, imagesize);
+            if (seconds < 0)
+                cout << setw(14) << "n/a";
+            else
+                cout << setw(14) << fixed << setprecision(0) << reads / seconds;
+        }
+        cout << endl;
+    }
+    cout << endl;
+#endif
+
+    cout << "ApeFile async 64 KB reads" << endl;
+    cout << setw(8) << left << "depth" << right << setw(14) << "read" << endl;
+    for (uint32_t d = 0; d < depthcount; d++)
+    {
+#ifdef APESTORAGE_PIO_SUPPORTED
+        benchdropcache(path);
+#endif
+        ApeFileSystem fs;
+        if (!fs.open(path, DEFAULTCACHEBLOCKS, APESTORAGE_PIO))
+        {
+            cout << "failed to open " << path << endl;
+            return 1;
+        }
+        double seconds = iofilerun(fs, depths[d], reads, chunk, filesize);
+        if (seconds < 0)
+        {
+            cout << "failed" << endl;
+            remove(path.c_str());
+            return 1;
+        }
+        cout << setw(8) << left << depths[d] << right << setw(14) << benchrate((double)reads * chunk, seconds) << endl;
+    }
+
+    remove(path.c_str());
+    return 0;
+}
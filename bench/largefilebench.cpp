@@ -0,0 +1,132 @@
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include "apebench.h"
+#include "../apefs/apefilesystem.h"
+
+static const uint32_t LARGECHUNK = 1024 * 1024;
+
+/*
+    Stamps the chunk with its offset in the file, so reads
+    landing at the wrong place past 4gb don't go unnoticed
+*/
+static void largestamp(vector<uint8_t>& data, uint64_t offset)
+{
+    memcpy(&data[0], &offset, sizeof(offset));
+}
+
+static bool largecheck(const vector<uint8_t>& buffer, const vector<uint8_t>& data, uint64_t offset, uint32_t size)
+{
+    uint64_t stamp;
+    memcpy(&stamp, &buffer[0], sizeof(stamp));
+    return stamp == offset && memcmp(&buffer[sizeof(stamp)], &data[sizeof(stamp)], size - sizeof(stamp)) == 0;
+}
+
+/*
+    Writes the file front to back in LARGECHUNK writes
+*/
+static double largewrite(ApeFileSystem& fs, uint64_t filesize)
+{
+    vector<uint8_t> data(LARGECHUNK);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = (uint8_t)(i * 31);
+    ApeFile file(fs);
+    if (!fs.directorycreate("/bench") || !file.open("/bench/large", APEFILE_CREATE))
+        return -1;
+
+    double start = benchnow();
+    for (uint64_t written = 0; written < filesize; written += LARGECHUNK)
+    {
+        uint32_t size = (uint32_t)min((uint64_t)LARGECHUNK, filesize - written);
+        largestamp(data, written);
+        if (file.write(&data[0], size) != size)
+            return -1;
+    }
+    if (!file.flush() || file.size() != filesize || !fs.flush())
+        return -1;
+    return benchnow() - start;
+}
+
+/*
+    Reads the file back front to back, checking every chunk,
+    then seeks to the last one and reads it again
+*/
+static double largeread(ApeFileSystem& fs, uint64_t filesize)
+{
+    vector<uint8_t> data(LARGECHUNK);
+    vector<uint8_t> buffer(LARGECHUNK);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = (uint8_t)(i * 31);
+    ApeFile file(fs);
+    if (!file.open("/bench/large", APEFILE_OPEN) || file.size() != filesize)
+        return -1;
+
+    double start = benchnow();
+    uint64_t total = 0;
+    uint32_t count;
+    while ((count = file.read(&buffer[0], LARGECHUNK)) > 0)
+    {
+        if (count < sizeof(uint64_t) || !largecheck(buffer, data, total, count))
+            return -1;
+        total += count;
+    }
+    double seconds = benchnow() - start;
+
+    uint64_t last = (filesize - 1) / LARGECHUNK * LARGECHUNK;
+    count = (uint32_t)(filesize - last);
+    if (total != filesize || !file.seek(APESEEK_SET, last) || file.read(&buffer[0], count) != count ||
+        file.tell() != filesize || !largecheck(buffer, data, last, count))
+        return -1;
+    return seconds;
+}
+
+/*
+    usage: apebench large [image path] [file size in mb] [pio|mmap]
+*/
+int largefilebench(const vector<string>& args)
+{
+    string path = args.size() > 0 ? args[0] : "apebench.apefs";
+    uint64_t filesize = (args.size() > 1 ? strtoull(args[1].c_str(), NULL, 10) : 5 * 1024) * 1024 * 1024;
+    ApeStorageType storage = APESTORAGE_PIO;
+    if (args.size() > 2 && args[2] == "mmap")
+        storage = APESTORAGE_MMAP;
+    if (filesize < LARGECHUNK)
+    {
+        cout << "the file must be at least 1 MB" << endl;
+        return 1;
+    }
+
+    cout << "sequential write and read of a " << filesize / (1024 * 1024) << " MB file in " << path << endl << endl;
+    cout << setw(14) << "write" << setw(14) << "read" << endl;
+
+    double writeseconds;
+    {
+        ApeFileSystem fs;
+        if (!fs.create(path, filesize + 256 * 1024 * 1024, DEFAULTCACHEBLOCKS, storage))
+        {
+            cout << "failed to create " << path << endl;
+            return 1;
+        }
+        writeseconds = largewrite(fs, filesize);
+    }
+
+    double readseconds = -1;
+    if (writeseconds >= 0)
+    {
+        ApeFileSystem fs;
+        if (fs.open(path, DEFAULTCACHEBLOCKS, storage))
+            readseconds = largeread(fs, filesize);
+    }
+
+    remove(path.c_str());
+    if (readseconds < 0)
+    {
+        cout << "failed" << endl;
+        return 1;
+    }
+    cout << setw(14) << benchrate((double)filesize, writeseconds)
+         << setw(14) << benchrate((double)filesize, readseconds) << endl;
+    return 0;
+}
@@ -0,0 +1,119 @@
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <cstdio>
+#include "apebench.h"
+#include "../apefs/apefilesystem.h"
+
+#ifdef APESTORAGE_PIO_SUPPORTED
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static const uint32_t windows[] = {0, 4, 16, 64, 256};
+static const uint32_t windowcount = sizeof(windows) / sizeof(windows[0]);
+
+/*
+    Writes back and evicts the image from the page cache,
+    so reads hit the disk (if the filesystem it's on allows it)
+*/
+static void benchdropcache(const string& path)
+{
+#ifdef APESTORAGE_PIO_SUPPORTED
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+#endif
+}
+
+/*
+    Reads the whole file front to back in chunk sized reads, like restore does
+*/
+static double readaheadrun(ApeFileSystem& fs, uint32_t window, uint32_t chunk, uint32_t filesize, ApeReadaheadStats& stats)
+{
+    ApeFile file(fs);
+    vector<uint8_t> buffer(chunk);
+    if (!file.open("/bench/big", APEFILE_OPEN))
+        return -1;
+    file.readahead(window);
+
+    double start = benchnow();
+    uint32_t total = 0;
+    uint32_t count;
+    while ((count = file.read(&buffer[0], chunk)) > 0)
+        total += count;
+    double seconds = benchnow() - start;
+
+    stats = file.readaheadstats();
+    return total == filesize ? seconds : -1;
+}
+
+/*
+    usage: apebench readahead [image path] [file size] [stream|pio]
+*/
+int readaheadbench(const vector<string>& args)
+{
+    string path = args.size() > 0 ? args[0] : "apebench.apefs";
+    uint32_t filesize = args.size() > 1 ? atoi(args[1].c_str()) : 64 * 1024 * 1024;
+    ApeStorageType storage = APESTORAGE_PIO;
+    if (args.size() > 2 && args[2] == "stream")
+        storage = APESTORAGE_STREAM;
+    const uint32_t chunks[] = {1024, 16 * 1024};
+
+    {
+        ApeFileSystem fs;
+        vector<uint8_t> data(1024 * 1024);
+        for (size_t i = 0; i < data.size(); i++)
+            data[i] = (uint8_t)(i * 31);
+        ApeFile file(fs);
+        if (!fs.create(path, filesize + 64 * 1024 * 1024, DEFAULTCACHEBLOCKS, storage) ||
+            !fs.directorycreate("/bench") || !file.open("/bench/big", APEFILE_CREATE))
+        {
+            cout << "failed to create " << path << endl;
+            return 1;
+        }
+        for (uint32_t written = 0; written < filesize; written += data.size())
+        {
+            uint32_t size = min((uint32_t)data.size(), filesize - written);
+            if (file.write(&data[0], size) != size)
+            {
+                cout << "failed to write the test file" << endl;
+                return 1;
+            }
+        }
+    }
+
+    cout << "sequential reads of a " << filesize / (1024 * 1024) << " MB file in " << path << endl << endl;
+    cout << setw(8) << left << "chunk" << setw(8) << "window" << right << setw(14) << "read"
+         << setw(10) << "hits" << setw(10) << "misses" << setw(12) << "blocks" << endl;
+    for (uint32_t c = 0; c < 2; c++)
+    {
+        for (uint32_t w = 0; w < windowcount; w++)
+        {
+            benchdropcache(path);
+            ApeFileSystem fs;
+            ApeReadaheadStats stats = {0, 0, 0, 0};
+            if (!fs.open(path, DEFAULTCACHEBLOCKS, storage))
+            {
+                cout << "failed to open " << path << endl;
+                return 1;
+            }
+            double seconds = readaheadrun(fs, windows[w], chunks[c], filesize, stats);
+            if (seconds < 0)
+            {
+                cout << "failed" << endl;
+                remove(path.c_str());
+                return 1;
+            }
+            cout << setw(8) << left << chunks[c] << setw(8) << windows[w] << right
+                 << setw(14) << benchrate(filesize, seconds) << setw(10) << stats.hits
+                 << setw(10) << stats.misses << setw(12) << stats.blocks << endl;
+        }
+    }
+
+    remove(path.c_str());
+    return 0;
+}
@@ -0,0 +1,100 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <cstdlib>
+#include <cstdio>
+#include "apebench.h"
+#include "../apefs/apefilesystem.h"
+
+/*
+    Writes, looks up and reads back files on a new image,
+    prints the seconds each phase took
+*/
+static bool storagerun(const string& path, ApeStorageType storage, uint32_t files, uint32_t filesize)
+{
+    vector<uint8_t> data(filesize);
+    for (uint32_t i = 0; i < filesize; i++)
+        data[i] = (uint8_t)(i * 31);
+
+    ApeFileSystem fs;
+    if (!fs.create(path, 512 * 1024 * 1024, DEFAULTCACHEBLOCKS, storage) || !fs.directorycreate("/bench"))
+        return false;
+
+    vector<string> names;
+    for (uint32_t i = 0; i < files; i++)
+    {
+        ostringstream name;
+        name << "/bench/file" << i;
+        names.push_back(name.str());
+    }
+
+    double start = benchnow();
+    for (uint32_t i = 0; i < files; i++)
+    {
+        ApeFile file(fs);
+        if (!file.open(names[i], APEFILE_CREATE) || file.write(&data[0], filesize) != filesize)
+            return false;
+    }
+    if (!fs.flush())
+        return false;
+    double write = benchnow() - start;
+
+    start = benchnow();
+    for (uint32_t i = 0; i < files; i++)
+    {
+        if (!fs.fileexists(names[i]))
+            return false;
+    }
+    vector<ApeDirectoryEntry> entries;
+    fs.directoryenum("/bench", entries);
+    double lookup = benchnow() - start;
+
+    start = benchnow();
+    for (uint32_t i = 0; i < files; i++)
+    {
+        ApeFile file(fs);
+        if (!file.open(names[i], APEFILE_OPEN) || file.read(&data[0], filesize) != filesize)
+            return false;
+    }
+    double read = benchnow() - start;
+
+    double bytes = (double)files * filesize;
+    const char* storagenames[] = {"stream", "mmap", "pio"};
+    cout << setw(10) << left << storagenames[storage] << right
+         << setw(14) << benchrate(bytes, write)
+         << setw(14) << fixed << setprecision(3) << lookup
+         << setw(14) << benchrate(bytes, read) << endl;
+    return fs.close();
+}
+
+/*
+    usage: apebench storage [image path] [files] [file size]
+*/
+int storagebench(const vector<string>& args)
+{
+    string path = args.size() > 0 ? args[0] : "apebench.apefs";
+    uint32_t files = args.size() > 1 ? atoi(args[1].c_str()) : 2000;
+    uint32_t filesize = args.size() > 2 ? atoi(args[2].c_str()) : 64 * 1024;
+
+    cout << files << " files of " << filesize << " bytes in " << path << endl;
+#ifndef APESTORAGE_MMAP_SUPPORTED
+    cout << "mmap and pio not supported, all runs use streams" << endl;
+#endif
+    cout << endl;
+    cout << setw(10) << left << "storage" << right << setw(14) << "write"
+         << setw(14) << "lookup (s)" << setw(14) << "read" << endl;
+
+    ApeStorageType storages[] = {APESTORAGE_STREAM, APESTORAGE_MMAP, APESTORAGE_PIO};
+    for (int i = 0; i < 3; i++)
+    {
+        if (!storagerun(path, storages[i], files, filesize))
+        {
+            cout << "failed" << endl;
+            remove(path.c_str());
+            return 1;
+        }
+    }
+
+    remove(path.c_str());
+    return 0;
+}
@@ -0,0 +1,261 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <map>
+#include <cstdlib>
+#include <cstdio>
+#include "apebench.h"
+#include "../apefs/apefilesystem.h"
+
+static const uint32_t LOGRECORD = 1000; // bytes per append to the shared log
+
+/*
+    Content of the shared log at offset, readers check what they get against it
+*/
+static uint8_t logbyte(uint32_t offset)
+{
+    return (uint8_t)(offset * 13 + offset / BLOCKSIZE);
+}
+
+static string filedata(uint32_t seed, uint32_t size)
+{
+    string data(size, 0);
+    for (uint32_t i = 0; i < size; i++)
+        data[i] = (char)(seed * 131 + i * 7 + (i >> 8));
+    return data;
+}
+
+static bool fileverify(ApeFileSystem& fs, const string& path, const string& data)
+{
+    ApeFile file(fs);
+    if (!file.open(path, APEFILE_OPEN) || file.size() != data.size())
+        return false;
+    string got(data.size(), 0);
+    uint32_t done = 0;
+    while (done < got.size())
+    {
+        uint32_t count = file.read(&got[done], got.size() - done);
+        if (count == 0)
+            return false;
+        done += count;
+    }
+    return got == data;
+}
+
+struct ApeStressState
+{
+    ApeFileSystem* fs;
+    uint32_t ops;
+    atomic<bool> appending;
+    atomic<uint32_t> failures;
+    atomic<uint64_t> done;
+};
+
+/*
+    Creates, rewrites, appends to, reads back and deletes files in its own
+    directory, plus a few in the shared one. files ends with what's left.
+*/
+static void stressworker(ApeStressState& state, uint32_t id, map<string, string>& files)
+{
+    ApeFileSystem& fs = *state.fs;
+    uint32_t seed = id * 2654435761u + 1;
+    ostringstream dir;
+    dir << "/t" << id;
+
+    for (uint32_t i = 0; i < state.ops; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        uint32_t op = (seed >> 8) % 100;
+        bool ok = true;
+
+        ostringstream name;
+        name << ((op % 10 == 0) ? "/shared" : dir.str()) << "/f" << id << "_" << (seed >> 12) % 64;
+        string path = name.str();
+        map<string, string>::iterator it = files.find(path);
+
+        if (op < 35 || it == files.end())
+        {
+            // create, or overwrite from scratch
+            if (it != files.end())
+                ok = fs.filedelete(path);
+            string data = filedata(seed, (seed >> 4) % (3 * BLOCKSIZE * 8));
+            ApeFile file(fs);
+            ok = ok && file.open(path, APEFILE_CREATE) && file.write(data.data(), data.size()) == data.size();
+            files[path] = data;
+        }
+        else if (op < 50)
+        {
+            string data = filedata(seed, (seed >> 4) % (BLOCKSIZE * 2) + 1);
+            ApeFile file(fs);
+            ok = file.open(path, APEFILE_APPEND) && file.write(data.data(), data.size()) == data.size();
+            it->second += data;
+        }
+        else if (op < 65)
+        {
+            ok = fs.filedelete(path) && !fs.fileexists(path);
+            files.erase(it);
+        }
+        else
+        {
+            ok = fileverify(fs, path, it->second);
+        }
+
+        if (!ok)
+            state.failures++;
+        state.done++;
+    }
+}
+
+/*
+    Keeps appending to the shared log while the others read it
+*/
+static void stressappender(ApeStressState& state, uint32_t records)
+{
+    ApeFile file(*state.fs);
+    if (!file.open("/shared/log", APEFILE_APPEND))
+    {
+        state.failures++;
+        state.appending = false;
+        return;
+    }
+
+    // every record goes out right away, the readers race it
+    file.writebuffer(0);
+    vector<uint8_t> record(LOGRECORD);
+    for (uint32_t r = 0; r < records; r++)
+    {
+        uint32_t offset = file.tell();
+        for (uint32_t i = 0; i < LOGRECORD; i++)
+            record[i] = logbyte(offset + i);
+        if (file.write(&record[0], LOGRECORD) != LOGRECORD)
+            state.failures++;
+        state.done++;
+    }
+    state.appending = false;
+}
+
+/*
+    Reads the log from the start while it grows, every byte seen must be final
+*/
+static void stressreader(ApeStressState& state)
+{
+    vector<uint8_t> buffer(64 * 1024);
+    while (state.appending)
+    {
+        ApeFile file(*state.fs);
+        if (!file.open("/shared/log", APEFILE_OPEN))
+        {
+            state.failures++;
+            return;
+        }
+
+        uint32_t offset = 0;
+        uint32_t count;
+        while ((count = file.read(&buffer[0], buffer.size())) > 0)
+        {
+            for (uint32_t i = 0; i < count; i++)
+            {
+                if (buffer[i] != logbyte(offset + i))
+                {
+                    state.failures++;
+                    return;
+                }
+            }
+            offset += count;
+        }
+        state.done++;
+    }
+}
+
+static bool stresscheck(ApeFileSystem& fs, const char* when)
+{
+    vector<string> problems;
+    if (fs.check(problems))
+        return true;
+    cout << "check " << when << " found " << problems.size() << " problems" << endl;
+    for (size_t i = 0; i < problems.size() && i < 10; i++)
+        cout << "  " << problems[i] << endl;
+    return false;
+}
+
+/*
+    usage: apebench stress [image path] [threads] [ops per thread] [stream|mmap|pio]
+*/
+int stressbench(const vector<string>& args)
+{
+    string path = args.size() > 0 ? args[0] : "apebench.apefs";
+    uint32_t threads = args.size() > 1 ? atoi(args[1].c_str()) : 8;
+    uint32_t ops = args.size() > 2 ? atoi(args[2].c_str()) : 2000;
+    ApeStorageType storage = APESTORAGE_MMAP;
+    if (args.size() > 3 && args[3] == "stream")
+        storage = APESTORAGE_STREAM;
+    else if (args.size() > 3 && args[3] == "pio")
+        storage = APESTORAGE_PIO;
+
+    ApeFileSystem fs;
+    if (!fs.create(path, 512 * 1024 * 1024, DEFAULTCACHEBLOCKS, storage) || !fs.directorycreate("/shared"))
+    {
+        cout << "failed to create " << path << endl;
+        return 1;
+    }
+    for (uint32_t t = 0; t < threads; t++)
+    {
+        ostringstream dir;
+        dir << "/t" << t;
+        ApeFile log(fs);
+        if (!fs.directorycreate(dir.str()) || (t == 0 && !log.open("/shared/log", APEFILE_CREATE)))
+        {
+            cout << "failed to create " << dir.str() << endl;
+            return 1;
+        }
+    }
+
+    cout << threads << " workers doing " << ops << " operations each, one appender and "
+         << max(threads / 2, 1u) << " readers on /shared/log" << endl;
+
+    ApeStressState state;
+    state.fs = &fs;
+    state.ops = ops;
+    state.appending = true;
+    state.failures = 0;
+    state.done = 0;
+
+    vector<map<string, string> > files(threads);
+    vector<thread> workers;
+    double start = benchnow();
+    for (uint32_t t = 0; t < threads; t++)
+        workers.push_back(thread(stressworker, ref(state), t, ref(files[t])));
+    workers.push_back(thread(stressappender, ref(state), ops));
+    for (uint32_t t = 0; t < max(threads / 2, 1u); t++)
+        workers.push_back(thread(stressreader, ref(state)));
+    for (size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+    double seconds = benchnow() - start;
+
+    cout << state.done << " operations in " << fixed << setprecision(3) << seconds << "s, "
+         << setprecision(0) << (seconds > 0 ? state.done / seconds : 0) << " ops/s, "
+         << state.failures << " failed" << endl;
+
+    bool ok = state.failures == 0 && fs.flush() && stresscheck(fs, "after the run");
+
+    // everything must have made it to the image
+    ok = ok && fs.close() && fs.open(path, DEFAULTCACHEBLOCKS, storage) && stresscheck(fs, "after reopening");
+    for (uint32_t t = 0; ok && t < threads; t++)
+    {
+        for (map<string, string>::iterator it = files[t].begin(); ok && it != files[t].end(); ++it)
+        {
+            if (!fileverify(fs, it->first, it->second))
+            {
+                cout << it->first << " doesn't match what was written" << endl;
+                ok = false;
+            }
+        }
+    }
+
+    fs.close();
+    remove(path.c_str());
+    cout << (ok ? "image consistent" : "FAILED") << endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,112 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+#include "apebench.h"
+#include "../apefs/apefilesystem.h"
+
+/*
+    Writes files in chunk sized writes on a new image with the given policy,
+    each file is created, written and closed. The time includes closing the
+    filesystem, that's when everything left is synced.
+*/
+static bool syncrun(const string& path, ApeStorageType storage, ApeSyncPolicy policy,
+                    uint32_t files, uint32_t filesize, uint32_t chunk)
+{
+    vector<uint8_t> data(filesize);
+    for (uint32_t i = 0; i < filesize; i++)
+        data[i] = (uint8_t)(i * 31);
+    vector<double> latencies;
+    const char* policynames[] = {"none", "close", "write"};
+
+    ApeFileSystem fs;
+    // streams can't sync, the filesystem refuses the other policies on them
+    if (storage == APESTORAGE_STREAM && policy != APESYNC_NONE)
+    {
+        if (fs.create(path, 512 * 1024 * 1024, DEFAULTCACHEBLOCKS, storage, policy))
+            return false;
+        cout << setw(10) << left << policynames[policy] << right << setw(14) << "refused" << endl;
+        return true;
+    }
+    if (!fs.create(path, 512 * 1024 * 1024, DEFAULTCACHEBLOCKS, storage, policy) || !fs.directorycreate("/bench"))
+        return false;
+
+    double start = benchnow();
+    for (uint32_t i = 0; i < files; i++)
+    {
+        ostringstream name;
+        name << "/bench/file" << i;
+        double filestart = benchnow();
+        ApeFile file(fs);
+        if (!file.open(name.str(), APEFILE_CREATE))
+            return false;
+        for (uint32_t written = 0; written < filesize; written += chunk)
+        {
+            uint32_t size = min(chunk, filesize - written);
+            if (file.write(&data[written], size) != size)
+                return false;
+        }
+        file.close();
+        latencies.push_back(benchnow() - filestart);
+    }
+    if (!fs.close())
+        return false;
+    double seconds = benchnow() - start;
+
+    sort(latencies.begin(), latencies.end());
+    double total = 0;
+    for (size_t i = 0; i < latencies.size(); i++)
+        total += latencies[i];
+
+    cout << setw(10) << left << policynames[policy] << right
+         << setw(14) << benchrate((double)files * filesize, seconds)
+         << setw(12) << fixed << setprecision(0) << files / seconds
+         << setw(12) << setprecision(3) << total / files * 1000
+         << setw(12) << latencies[latencies.size() * 99 / 100] * 1000 << endl;
+    return true;
+}
+
+/*
+    usage: apebench sync [image path] [files] [file size] [write size] [stream|mmap|pio]
+*/
+int syncbench(const vector<string>& args)
+{
+    string path = args.size() > 0 ? args[0] : "apebench.apefs";
+    uint32_t files = args.size() > 1 ? atoi(args[1].c_str()) : 500;
+    uint32_t filesize = args.size() > 2 ? atoi(args[2].c_str()) : 64 * 1024;
+    uint32_t chunk = args.size() > 3 ? atoi(args[3].c_str()) : 16 * 1024;
+    ApeStorageType storage = APESTORAGE_PIO;
+    if (args.size() > 4 && args[4] == "stream")
+        storage = APESTORAGE_STREAM;
+    else if (args.size() > 4 && args[4] == "mmap")
+        storage = APESTORAGE_MMAP;
+    if (files == 0 || chunk == 0)
+    {
+        cout << "nothing to write" << endl;
+        return 1;
+    }
+
+    cout << files << " files of " << filesize << " bytes, written " << chunk << " bytes at a time, in " << path << endl;
+    cout << "latency is per file, from create to close, in ms" << endl;
+    if (storage == APESTORAGE_STREAM)
+        cout << "the stream backend only hands data to the system, it runs with policy none alone" << endl;
+    cout << endl;
+    cout << setw(10) << left << "policy" << right << setw(14) << "write" << setw(12) << "files/s"
+         << setw(12) << "mean" << setw(12) << "p99" << endl;
+
+    ApeSyncPolicy policies[] = {APESYNC_NONE, APESYNC_CLOSE, APESYNC_WRITE};
+    for (int p = 0; p < 3; p++)
+    {
+        if (!syncrun(path, storage, policies[p], files, filesize, chunk))
+        {
+            cout << "failed" << endl;
+            remove(path.c_str());
+            return 1;
+        }
+    }
+
+    remove(path.c_str());
+    return 0;
+}
@@ -0,0 +1,106 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <cstdlib>
+#include <cstdio>
+#include <unistd.h>
+#include "apebench.h"
+#include "../apefs/apefilesystem.h"
+#include "../apefs/aperestore.h"
+
+static string tailname(const string& dir, uint32_t i)
+{
+    ostringstream name;
+    name << dir << "/file" << i;
+    return name.str();
+}
+
+/*
+    Writes the small file corpus to a new image, with tail packing on or off,
+    reopens it and restores it to the host. Sizes are the same on every run.
+*/
+static bool tailrun(const string& path, const string& target, bool packing,
+                    uint32_t files, uint32_t minsize, uint32_t maxsize)
+{
+    vector<uint8_t> data(maxsize);
+    for (uint32_t i = 0; i < maxsize; i++)
+        data[i] = (uint8_t)(i * 31);
+
+    ApeFileSystem fs;
+    if (!fs.create(path, 512 * 1024 * 1024) || !fs.directorycreate("/bench"))
+        return false;
+    fs.tailpacking(packing);
+
+    srand(1);
+    uint64_t bytes = 0;
+    for (uint32_t i = 0; i < files; i++)
+    {
+        uint32_t size = minsize + (maxsize > minsize ? rand() % (maxsize - minsize + 1) : 0);
+        ApeFile file(fs);
+        if (!file.open(tailname("/bench", i), APEFILE_CREATE) || file.write(&data[0], size) != size)
+            return false;
+        bytes += size;
+    }
+
+    ApeFsStat stat;
+    if (!fs.close() || !fs.open(path) || !fs.statfs(stat))
+        return false;
+
+    ApeRestore restore(fs);
+    double start = benchnow();
+    bool ok = restore.run("/bench", target);
+    double seconds = benchnow() - start;
+    const ApeRestoreStats& stats = restore.stats();
+    ok = ok && stats.bytes == bytes;
+
+    for (uint32_t i = 0; i < files; i++)
+        remove(tailname(target, i).c_str());
+    rmdir(target.c_str());
+    if (!ok)
+        return false;
+
+    uint64_t used = (uint64_t)(stat.totalblocks - stat.freeblocks) * BLOCKSIZE;
+    cout << setw(10) << left << (packing ? "on" : "off") << right
+         << setw(12) << fixed << setprecision(1) << used / (1024.0 * 1024.0)
+         << setw(12) << setprecision(2) << (double)used / bytes
+         << setw(10) << stats.reads
+         << setw(12) << setprecision(1) << stats.readbytes / (1024.0 * 1024.0)
+         << setw(14) << benchrate((double)bytes, seconds) << endl;
+    return true;
+}
+
+/*
+    usage: apebench tails [image path] [files] [min size] [max size] [restore directory]
+*/
+int tailbench(const vector<string>& args)
+{
+    string path = args.size() > 0 ? args[0] : "apebench.apefs";
+    uint32_t files = args.size() > 1 ? atoi(args[1].c_str()) : 20000;
+    uint32_t minsize = args.size() > 2 ? atoi(args[2].c_str()) : 300;
+    uint32_t maxsize = args.size() > 3 ? atoi(args[3].c_str()) : 12 * 1024;
+    string target = args.size() > 4 ? args[4] : "apebench.restore";
+    if (files == 0 || maxsize == 0 || minsize > maxsize)
+    {
+        cout << "nothing to write" << endl;
+        return 1;
+    }
+
+    cout << files << " files of " << minsize << " to " << maxsize << " bytes in " << path
+         << ", restored to " << target << endl;
+    cout << "used is the image space taken, restore reads and read MB are of the image" << endl << endl;
+    cout << setw(10) << left << "packing" << right << setw(12) << "used MB" << setw(12) << "used/data"
+         << setw(10) << "reads" << setw(12) << "read MB" << setw(14) << "restore" << endl;
+
+    for (int packing = 0; packing < 2; packing++)
+    {
+        if (!tailrun(path, target, packing != 0, files, minsize, maxsize))
+        {
+            cout << "failed" << endl;
+            remove(path.c_str());
+            return 1;
+        }
+    }
+
+    remove(path.c_str());
+    return 0;
+}
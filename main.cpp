@@ -1,12 +1,68 @@
 #include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
 #include <string>
+#include <chrono>
+#include <map>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include "apefs/apefilesystem.h"
+#include "apefs/aperestore.h"
 
 using namespace std;
 
+struct BackupStats
+{
+    uint32_t files; // copied
+    uint64_t bytes;
+    uint32_t unchanged; // left as they were by an incremental run
+    uint32_t removed; // gone from the host since the last incremental run
+};
+
+/*
+    FNV-1a, carried on from hash over the next size bytes
+*/
+uint64_t hashdata(uint64_t hash, const char* data, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= (uint8_t)data[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+const uint64_t HASHSTART = 0xCBF29CE484222325ULL;
+
+bool hashfile(const string& filepath, uint64_t& hash)
+{
+    ifstream file(filepath.c_str(), ios::in | ios::binary);
+    if (!file.good())
+        return false;
+
+    char buffer[64 * 1024];
+    hash = HASHSTART;
+    while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0)
+        hash = hashdata(hash, buffer, file.gcount());
+    return file.eof();
+}
+
+bool hoststat(const string& filepath, ApeHostInfo& info)
+{
+    struct stat s;
+    if (stat(filepath.c_str(), &s) != 0)
+        return false;
+    memset(&info, 0, sizeof(info));
+    info.size = s.st_size;
+    info.mtime = s.st_mtime;
+#ifndef WIN32
+    info.mtimensec = s.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
 void makedir(const string& dir)
 {
 #ifdef WIN32
@@ -39,7 +95,12 @@ void printfs(ApeFileSystem& fs, const string &path = "/", int level = 0)
     }
 }
 
-bool backupfile(const string& filepath, const string& backuppath, ApeFileSystem& fs)
+/*
+    Copies a file to the image. With host, what stat said about it, the
+    contents are hashed on the way and recorded with it in the inode.
+*/
+bool backupfile(const string& filepath, const string& backuppath, ApeFileSystem& fs, BackupStats& stats,
+                const ApeHostInfo* host = NULL)
 {
     fstream file;
     file.open(filepath.c_str(), ios::in | ios::out | ios::binary);
@@ -51,19 +112,31 @@ bool backupfile(const string& filepath, const string& backuppath, ApeFileSystem&
         return false;
 
     char buffer[1024];
-    int count = 0;
+    uint64_t count = 0;
+    uint64_t hash = HASHSTART;
     while (!file.eof())
     {
         file.read(buffer, sizeof(buffer));
         count += file.gcount();
         if (bfile.write(buffer, file.gcount()) != file.gcount())
             return false;
+        if (host)
+            hash = hashdata(hash, buffer, file.gcount());
     }
 
-    return true;
+    stats.files++;
+    stats.bytes += count;
+    if (host == NULL)
+        return true;
+
+    ApeHostInfo info = *host;
+    info.size = count;
+    info.hashed = 1;
+    info.hash = hash;
+    return bfile.sethostinfo(info);
 }
 
-bool backup(const string& srcpath, ApeFileSystem& fs, const string& relpath = "/")
+bool backup(const string& srcpath, ApeFileSystem& fs, BackupStats& stats, const string& relpath = "/")
 {
     dirent *entry;
     DIR *dp;
@@ -81,14 +154,14 @@ bool backup(const string& srcpath, ApeFileSystem& fs, const string& relpath = "/
         {
             if (entry->d_name[0] == '.')
                 continue;
-            if (!fs.directorycreate(relpath + entry->d_name))
+            if (!fs.directorycreate(fs.joinpath(relpath, entry->d_name)))
                 return false;
-            if (!backup(fs.joinpath(srcpath, entry->d_name), fs, fs.joinpath(relpath, entry->d_name)))
+            if (!backup(fs.joinpath(srcpath, entry->d_name), fs, stats, fs.joinpath(relpath, entry->d_name)))
                 return false;
         }
         else
         {
-            if (!backupfile(fs.joinpath(srcpath, entry->d_name), fs.joinpath(relpath, entry->d_name), fs))
+            if (!backupfile(fs.joinpath(srcpath, entry->d_name), fs.joinpath(relpath, entry->d_name), fs, stats))
                 return false;
         }
     }
@@ -98,49 +171,184 @@ bool backup(const string& srcpath, ApeFileSystem& fs, const string& relpath = "/
     return true;
 }
 
-bool restorefile(const string& backuppath, const string& filepath, ApeFileSystem& fs)
+/*
+    Takes an entry, and whatever is under it, out of the image
+*/
+bool removeentry(ApeFileSystem& fs, const string& path, bool directory)
 {
-    fstream file;
-    file.open(filepath.c_str(), ios::in | ios::out | ios::binary | ios::trunc);
-    if (!file.good())
-        return false;
+    if (!directory)
+        return fs.filedelete(path);
 
-    ApeFile bfile(fs);
-    if (!bfile.open(backuppath, APEFILE_OPEN))
+    vector<ApeDirectoryEntry> entries;
+    if (!fs.directoryenum(path, entries))
         return false;
-
-    char buffer[1024];
-
-    while (bfile.tell() < bfile.size())
+    for (size_t i = 0; i < entries.size(); i++)
     {
-        int count = bfile.read(buffer, sizeof(buffer));
-        file.write(buffer, count);
-        if (!file.good())
+        if (!removeentry(fs, fs.joinpath(path, entries[i].name), entries[i].isdirectory()))
             return false;
     }
+    return fs.directorydelete(path);
+}
 
-    return true;
+/*
+    Whether the copy in the image is still the file on the host. When only
+    the mtime moved and hashing, the contents are hashed to tell, an
+    unchanged file gets the new mtime recorded.
+*/
+bool unchanged(const string& filepath, const string& backuppath, ApeFileSystem& fs, const ApeHostInfo& host, bool hashing)
+{
+    ApeFile bfile(fs);
+    ApeHostInfo info;
+    if (!bfile.open(backuppath, APEFILE_OPEN) || !bfile.hostinfo(info) || !info.hashed ||
+        info.size != host.size || bfile.size() != host.size)
+        return false;
+    if (info.mtime == host.mtime && info.mtimensec == host.mtimensec)
+        return true;
+
+    uint64_t hash;
+    if (!hashing || !hashfile(filepath, hash) || hash != info.hash)
+        return false;
+    info.mtime = host.mtime;
+    info.mtimensec = host.mtimensec;
+    return bfile.sethostinfo(info);
 }
 
-bool restore(const string& dstpath, ApeFileSystem& fs, const string& srcpath = "/")
+/*
+    Brings relpath of the image in line with srcpath. Only files whose size
+    or mtime changed are copied again, entries the host doesn't have anymore
+    are removed. Hidden directories are skipped, like backup does.
+*/
+bool incremental(const string& srcpath, ApeFileSystem& fs, BackupStats& stats, bool hashing, const string& relpath = "/")
 {
+    // name -> whether it's a directory, what's left once the host is listed is gone
+    map<string, bool> stale;
     vector<ApeDirectoryEntry> entries;
-    fs.directoryenum(srcpath, entries);
-    for (int i = 0; i < entries.size(); i++)
+    if (!fs.directoryenum(relpath, entries))
+        return false;
+    for (size_t i = 0; i < entries.size(); i++)
+        stale[entries[i].name] = entries[i].isdirectory();
+
+    DIR *dp = opendir(srcpath.c_str());
+    if (dp == NULL)
+        return false;
+
+    bool ok = true;
+    dirent *entry;
+    while (ok && (entry = readdir(dp)))
     {
-        if (entries[i].isdirectory())
+        string filepath = fs.joinpath(srcpath, entry->d_name);
+        string backuppath = fs.joinpath(relpath, entry->d_name);
+        struct stat s;
+        ApeHostInfo host;
+        if (stat(filepath.c_str(), &s) != 0)
+            continue;
+        if (S_ISDIR(s.st_mode) && entry->d_name[0] == '.')
+            continue;
+
+        map<string, bool>::iterator it = stale.find(entry->d_name);
+        bool found = it != stale.end();
+        bool wasdirectory = found && it->second;
+        if (found)
+            stale.erase(it);
+
+        if (S_ISDIR(s.st_mode))
         {
-            makedir(fs.joinpath(dstpath, entries[i].name));
-            if (!restore(fs.joinpath(dstpath, entries[i].name), fs, fs.joinpath(srcpath, entries[i].name)))
-                return false;
+            if (found && !wasdirectory)
+                ok = fs.filedelete(backuppath);
+            if (ok && !wasdirectory)
+                ok = fs.directorycreate(backuppath);
+            ok = ok && incremental(filepath, fs, stats, hashing, backuppath);
+            continue;
         }
-        else
+
+        if (!hoststat(filepath, host))
+            continue;
+        if (found && !wasdirectory && unchanged(filepath, backuppath, fs, host, hashing))
         {
-            if (!restorefile(fs.joinpath(srcpath, entries[i].name), fs.joinpath(dstpath, entries[i].name), fs))
-                return false;
+            stats.unchanged++;
+            continue;
         }
+        if (found)
+            ok = removeentry(fs, backuppath, wasdirectory);
+        ok = ok && backupfile(filepath, backuppath, fs, stats, &host);
+    }
+    closedir(dp);
+
+    map<string, bool>::iterator it;
+    for (it = stale.begin(); it != stale.end() && ok; ++it)
+    {
+        ok = removeentry(fs, fs.joinpath(relpath, it->first), it->second);
+        stats.removed++;
+    }
+    return ok;
+}
+
+/*
+    Backs up srcpath to a new snapshot directory of the image. Blocks the
+    earlier snapshots already hold are shared, when the image dedups.
+*/
+bool snapshot(const string& srcpath, ApeFileSystem& fs, string& snapshotpath)
+{
+    uint32_t number = 1;
+    do
+    {
+        ostringstream name;
+        name << "/snapshot" << number++;
+        snapshotpath = name.str();
     }
+    while (fs.directoryexists(snapshotpath));
 
+    ApeFsStat before, after;
+    BackupStats stats = {0, 0, 0, 0};
+    ApeDedupStats dedupbefore = fs.dedupstats();
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    if (!fs.statfs(before) || !fs.directorycreate(snapshotpath) || !backup(srcpath, fs, stats, snapshotpath) ||
+        !fs.flush() || !fs.statfs(after))
+        return false;
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    ApeDedupStats dedupafter = fs.dedupstats();
+
+    const double mb = 1024.0 * 1024.0;
+    uint64_t shared = dedupafter.shared - dedupbefore.shared;
+    cout << fixed << setprecision(1) << snapshotpath << ": " << stats.files << " files, "
+         << stats.bytes / mb << " MB in " << setprecision(2) << seconds << " s, "
+         << setprecision(1) << (seconds > 0 ? stats.bytes / mb / seconds : 0.0) << " MB/s" << endl;
+    cout << "image grew " << ((int64_t)before.freeblocks - after.freeblocks) * BLOCKSIZE / mb << " MB";
+    if (fs.dedup())
+        cout << ", " << shared << " of " << dedupafter.blocks - dedupbefore.blocks << " blocks were already there, "
+             << shared * BLOCKSIZE / mb << " MB saved";
+    cout << endl;
+    return true;
+}
+
+/*
+    Brings the image's copy of srcpath up to date, the work done
+    follows what changed on the host since the last run
+*/
+bool update(const string& srcpath, ApeFileSystem& fs, const string& backuppath, bool hashing)
+{
+    BackupStats stats = {0, 0, 0, 0};
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    if ((!fs.directoryexists(backuppath) && !fs.directorycreate(backuppath)) ||
+        !incremental(srcpath, fs, stats, hashing, backuppath) || !fs.flush())
+        return false;
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << fixed << setprecision(1) << backuppath << ": " << stats.files << " files copied, "
+         << stats.bytes / (1024.0 * 1024.0) << " MB, " << stats.unchanged << " unchanged, "
+         << stats.removed << " removed in " << setprecision(2) << seconds << " s" << endl;
+    return true;
+}
+
+bool restore(const string& dstpath, ApeFileSystem& fs, const string& srcpath = "/")
+{
+    ApeRestore restorer(fs);
+    if (!restorer.run(srcpath, dstpath))
+        return false;
+
+    const ApeRestoreStats& stats = restorer.stats();
+    cout << stats.files << " files, " << stats.directories << " directories, "
+         << stats.bytes << " bytes in " << stats.reads << " reads" << endl;
     return true;
 }
 
@@ -150,11 +358,16 @@ int main(int argc, char **argv)
     string backupfs = "backup.apefs";
     string restorefolder;
     string backupfolder;
+    // snapshot adds a copy of the folder, incremental updates /current,
+    // incremental-hash also hashes files whose mtime moved before copying them
+    string mode = "snapshot";
 
-    if (argc > 3)
+    if (argc > 2)
     {
         backupfolder = argv[1];
         restorefolder = argv[2];
+        if (argc > 3)
+            mode = argv[3];
     }
     else
     {
@@ -168,22 +381,40 @@ int main(int argc, char **argv)
         restorefolder = buffer;
     }
 
+    if (mode != "snapshot" && mode != "incremental" && mode != "incremental-hash")
+    {
+        cout << "Unknown backup mode " << mode << ", snapshot, incremental or incremental-hash\n";
+        exit(1);
+    }
+
     cout << "Backup in progress..." << endl;
 
-    if (!fs.create(backupfs, 1024 * 1024 * 100)) // 100 mb
+    // each run adds a snapshot to the image, identical blocks are kept once
+    bool opened;
+    if (ifstream(backupfs.c_str()).good())
+        opened = fs.open(backupfs);
+    else
+        opened = fs.create(backupfs, 1024 * 1024 * 100, DEFAULTCACHEBLOCKS, APESTORAGE_MMAP, APESYNC_NONE, APECOMPRESS_NONE, true); // 100 mb
+    if (!opened)
     {
         cout << "Couldn't create filesystem\n";
         getchar();
         exit(1);
     }
 
-    if (backup(backupfolder, fs))
+    string snapshotpath = "/current";
+    bool ok;
+    if (mode == "snapshot")
+        ok = snapshot(backupfolder, fs, snapshotpath);
+    else
+        ok = update(backupfolder, fs, snapshotpath, mode == "incremental-hash");
+    if (ok)
     {
         cout << "Backup ok!" << endl << endl;
         cout << "Restoring..." << endl;
         fs.open(backupfs);
         makedir(restorefolder);
-        if (restore(restorefolder, fs))
+        if (restore(restorefolder, fs, snapshotpath))
             cout << "Restore ok!" << endl << endl;
         else
             cout << "Restore error!" << endl << endl;
@@ -0,0 +1,854 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include "../apefs/apefilesystem.h"
+
+using namespace std;
+
+/*
+    Regression tests, each gets a path it may create an image at
+    and returns whether it passed.
+
+    usage: apetest [test] [image path]
+*/
+
+typedef bool (*apetest_t)(const string& path);
+
+/*
+    Opens the image again and runs the consistency check on it
+*/
+static bool testcheck(ApeFileSystem& fs, const string& path)
+{
+    vector<string> problems;
+    if (!fs.close() || !fs.open(path) || !fs.check(problems))
+        return false;
+    for (size_t i = 0; i < problems.size(); i++)
+        cout << "  " << problems[i] << endl;
+    return problems.empty();
+}
+
+/*
+    Closing the filesystem under a handle leaves the handle closed
+*/
+static bool testcloseopen(const string& path)
+{
+    ApeFileSystem fs;
+    ApeFile file(fs);
+    uint8_t data[100] = {1};
+    if (!fs.create(path, 16 * 1024 * 1024) || !file.open("/open", APEFILE_CREATE) ||
+        file.write(data, sizeof(data)) != sizeof(data))
+        return false;
+    if (!fs.close() || file.good())
+        return false;
+    file.close();
+    if (!fs.open(path) || !fs.fileexists("/open"))
+        return false;
+    return testcheck(fs, path);
+}
+
+/*
+    What a handle still buffers when the filesystem is closed lands in the file
+*/
+static bool testclosewrite(const string& path)
+{
+    ApeFileSystem fs;
+    ApeFile file(fs);
+    vector<uint8_t> data(3 * BLOCKSIZE + 123);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = (uint8_t)(i * 7);
+    if (!fs.create(path, 16 * 1024 * 1024) || !file.open("/buffered", APEFILE_CREATE))
+        return false;
+    file.writebuffer(64 * 1024);
+    if (file.write(&data[0], (uint32_t)data.size()) != data.size() || !fs.close())
+        return false;
+
+    vector<uint8_t> buffer(data.size());
+    if (!fs.open(path) || !file.open("/buffered", APEFILE_OPEN) || file.size() != data.size() ||
+        file.read(&buffer[0], (uint32_t)buffer.size()) != buffer.size() || buffer != data)
+        return false;
+    file.close();
+    return testcheck(fs, path);
+}
+
+/*
+    The stream backend can't sync, a sync policy is refused with it
+    rather than going unkept. Without one it opens as usual.
+*/
+static bool teststreamsync(const string& path)
+{
+    ApeFileSystem fs;
+    if (fs.create(path, 16 * 1024 * 1024, DEFAULTCACHEBLOCKS, APESTORAGE_STREAM, APESYNC_CLOSE) ||
+        !fs.create(path, 16 * 1024 * 1024, DEFAULTCACHEBLOCKS, APESTORAGE_STREAM) || !fs.close() ||
+        fs.open(path, DEFAULTCACHEBLOCKS, APESTORAGE_STREAM, APESYNC_WRITE) || !fs.open(path, DEFAULTCACHEBLOCKS, APESTORAGE_STREAM))
+        return false;
+    return testcheck(fs, path);
+}
+
+/*
+    Writing and deleting a big file whose dedup table pages would overflow
+    a journal transaction, a batch of blocks per call so every commit fits
+    in one. Replaying must not bring back the file deleted by the last commit.
+*/
+static bool testjournalcapacity(const string& path)
+{
+    const uint32_t chunk = 1024 * 1024;
+    ApeFileSystem fs;
+    ApeFsStat before;
+    ApeFsStat after;
+    vector<uint8_t> data(chunk);
+    if (!fs.create(path, 2048ULL * 1024 * 1024, DEFAULTCACHEBLOCKS, APESTORAGE_MMAP, APESYNC_NONE, APECOMPRESS_NONE, true))
+        return false;
+    {
+        // the root directory gets its block with the first entry
+        ApeFile file(fs);
+        if (!file.open("/big", APEFILE_CREATE) || !fs.statfs(before))
+            return false;
+        // no two blocks alike, every one gets its own dedup entry
+        for (uint32_t i = 0; i < 1200; i++)
+        {
+            for (uint32_t offset = 0; offset < chunk; offset += BLOCKSIZE)
+            {
+                uint32_t blockpos = i * (chunk / BLOCKSIZE) + offset / BLOCKSIZE;
+                memcpy(&data[offset], &blockpos, sizeof(blockpos));
+            }
+            if (file.write(&data[0], chunk) != chunk)
+                return false;
+        }
+    }
+    if (!fs.flush())
+        return false;
+
+    ApeFile file(fs);
+    if (!file.open("/x", APEFILE_CREATE))
+        return false;
+    file.close();
+    if (!fs.flush() || !fs.filedelete("/big") || !fs.flush() || !fs.close())
+        return false;
+
+    if (!fs.open(path) || fs.fileexists("/big") || !fs.fileexists("/x") || !fs.statfs(after) ||
+        after.freeblocks != before.freeblocks)
+        return false;
+    return testcheck(fs, path);
+}
+
+/*
+    Fills block i of data with the stamp of block i of the file
+*/
+static void teststamp(vector<uint8_t>& data, const vector<uint32_t>& stamps)
+{
+    data.assign(stamps.size() * BLOCKSIZE, 0);
+    for (size_t i = 0; i < stamps.size(); i++)
+        memcpy(&data[i * BLOCKSIZE], &stamps[i], sizeof(stamps[i]));
+}
+
+/*
+    Deleting big files sharing blocks, given back a batch per transaction.
+    The second one alternates blocks of the first with its own, its extents
+    spanning several extent blocks.
+*/
+static bool testdedupdelete(const string& path)
+{
+    ApeFileSystem fs;
+    ApeFsStat before;
+    ApeFsStat after;
+    vector<uint32_t> first;
+    vector<uint32_t> second;
+    for (uint32_t i = 0; i < 1024; i++)
+        first.push_back(i);
+    for (uint32_t i = 0; i < 2048; i++)
+        second.push_back(i % 2 == 0 ? i / 2 : 1024 + i);
+
+    vector<uint8_t> data;
+    vector<uint8_t> buffer;
+    ApeFile file(fs);
+    // the root directory gets its block with the first entry
+    if (!fs.create(path, 64 * 1024 * 1024, DEFAULTCACHEBLOCKS, APESTORAGE_MMAP, APESYNC_NONE, APECOMPRESS_NONE, true) ||
+        !fs.directorycreate("/d") || !fs.statfs(before))
+        return false;
+    teststamp(data, first);
+    if (!file.open("/first", APEFILE_CREATE) || file.write(&data[0], (uint32_t)data.size()) != data.size())
+        return false;
+    teststamp(data, second);
+    if (!file.open("/second", APEFILE_CREATE))
+        return false;
+    for (size_t offset = 0; offset < data.size(); offset += BLOCKSIZE)
+    {
+        if (file.write(&data[offset], BLOCKSIZE) != BLOCKSIZE)
+            return false;
+    }
+    file.close();
+
+    buffer.resize(data.size());
+    if (!fs.filedelete("/first") || !fs.close() || !fs.open(path) || !file.open("/second", APEFILE_OPEN) ||
+        file.read(&buffer[0], (uint32_t)buffer.size()) != buffer.size() || buffer != data)
+        return false;
+    file.close();
+    if (!fs.filedelete("/second") || !fs.statfs(after) || after.freeblocks != before.freeblocks)
+        return false;
+    return testcheck(fs, path);
+}
+
+/*
+    Small files closed with their tail still buffered get it packed without
+    a block taken for it and given back, the blocks and fragment blocks
+    used follow each other. They read back the same once reopened.
+*/
+static bool testtailclose(const string& path)
+{
+    const uint32_t files = 64;
+    const uint32_t size = BLOCKSIZE + 900;
+    ApeFileSystem fs;
+    ApeFsStat before;
+    ApeFsStat after;
+    vector<uint8_t> data(size);
+    vector<uint8_t> buffer(size);
+    if (!fs.create(path, 16 * 1024 * 1024) || !fs.directorycreate("/d") || !fs.statfs(before))
+        return false;
+    for (uint32_t i = 0; i < files; i++)
+    {
+        ApeFile file(fs);
+        memset(&data[0], (int)i, size);
+        if (!file.open("/f" + to_string(i), APEFILE_CREATE) || file.write(&data[0], size) != size)
+            return false;
+    }
+    // a block each, and three tails of four fragments to a fragment block
+    uint32_t used = files + (files + 2) / 3;
+    if (!fs.close() || !fs.open(path) || !fs.statfs(after) || before.freeblocks - after.freeblocks != used)
+        return false;
+
+    blocknum_t lowest = INVALIDBLOCK;
+    blocknum_t highest = 0;
+    for (uint32_t i = 0; i < files; i++)
+    {
+        ApeFile file(fs);
+        vector<ApeExtent> extents;
+        ApeFragments tail;
+        memset(&data[0], (int)i, size);
+        if (!file.open("/f" + to_string(i), APEFILE_OPEN) || file.read(&buffer[0], size) != size || buffer != data ||
+            !file.extents(extents, tail) || extents.size() != 1 || extents[0].count != 1 || tail.count == 0)
+            return false;
+        lowest = min(lowest, min(extents[0].start, tail.block));
+        highest = max(highest, max(extents[0].start, tail.block));
+    }
+    return highest - lowest + 1 == used && testcheck(fs, path);
+}
+
+/*
+    Fills data with bytes that don't compress
+*/
+static void testnoise(vector<uint8_t>& data, uint32_t seed)
+{
+    for (size_t i = 0; i < data.size(); i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        data[i] = (uint8_t)(seed >> 16);
+    }
+}
+
+/*
+    Writing a compressed file on an image whose free blocks are scattered
+    in short runs, with one run long enough past many of them, then
+    overwriting its start. The clusters go to that run, the whole writes
+    are done.
+*/
+static bool testcompressoverwrite(const string& path)
+{
+    ApeFileSystem fs;
+    ApeFsStat stat;
+    vector<uint8_t> data;
+    vector<uint8_t> buffer;
+    uint8_t patch[59];
+    uint32_t files = 0;
+    if (!fs.create(path, 128 * 1024 * 1024, DEFAULTCACHEBLOCKS, APESTORAGE_MMAP, APESYNC_NONE, APECOMPRESS_LZ))
+        return false;
+    // one to five blocks each until the image is about full
+    while (fs.statfs(stat) && stat.freeblocks > 16)
+    {
+        ApeFile file(fs);
+        data.resize(min(files % 5 + 1, stat.freeblocks - 8) * BLOCKSIZE);
+        testnoise(data, files);
+        if (!file.open("/f" + to_string(files), APEFILE_CREATE) || file.write(&data[0], (uint32_t)data.size()) != data.size())
+            return false;
+        files++;
+    }
+    // every other one deleted, a row of them three quarters in
+    for (uint32_t i = 0; i < files; i++)
+    {
+        bool row = i >= files * 3 / 4 && i < files * 3 / 4 + 20;
+        if ((i % 2 == 0 || row) && !fs.filedelete("/f" + to_string(i)))
+            return false;
+    }
+    // the blocks given back are free once committed
+    if (!fs.flush())
+        return false;
+
+    ApeFile file(fs);
+    data.resize(91154);
+    testnoise(data, files);
+    memset(patch, 0x5a, sizeof(patch));
+    if (!file.open("/c", APEFILE_CREATE) || file.write(&data[0], (uint32_t)data.size()) != data.size() ||
+        !file.seek(APESEEK_SET, 0) || file.write(patch, sizeof(patch)) != sizeof(patch))
+        return false;
+    file.close();
+
+    memcpy(&data[0], patch, sizeof(patch));
+    buffer.resize(data.size());
+    if (!file.open("/c", APEFILE_OPEN) || file.read(&buffer[0], (uint32_t)buffer.size()) != buffer.size() || buffer != data)
+        return false;
+    file.close();
+    return testcheck(fs, path);
+}
+
+/*
+    Deleting a compressed file mapping more blocks than a call may give back,
+    its clusters go from the end a batch per transaction along with the
+    cluster tables they leave empty
+*/
+static bool testcompressdelete(const string& path)
+{
+    ApeFileSystem fs;
+    ApeFsStat before;
+    ApeFsStat after;
+    vector<uint8_t> data(3 * 1024 * 1024 + 1000);
+    testnoise(data, 1);
+    if (!fs.create(path, 64 * 1024 * 1024, DEFAULTCACHEBLOCKS, APESTORAGE_MMAP, APESYNC_NONE, APECOMPRESS_LZ) ||
+        !fs.directorycreate("/d") || !fs.statfs(before))
+        return false;
+    {
+        ApeFile file(fs);
+        if (!file.open("/big", APEFILE_CREATE) || file.write(&data[0], (uint32_t)data.size()) != data.size())
+            return false;
+    }
+    if (!fs.filedelete("/big") || fs.fileexists("/big") || !fs.flush() || !fs.statfs(after) ||
+        after.freeblocks != before.freeblocks)
+        return false;
+    return testcheck(fs, path);
+}
+
+/*
+    Reads a file back and gets its extents, which must map each of its
+    blocks once, in runs merged as far as they go, and not on used
+*/
+static bool testruns(ApeFileSystem& fs, const string& name, const vector<uint8_t>& data,
+    vector<ApeExtent>& extents, vector<bool>& used)
+{
+    ApeFile file(fs);
+    ApeFragments tail;
+    vector<uint8_t> buffer(data.size());
+    extents.clear();
+    if (!file.open(name, APEFILE_OPEN) || file.read(&buffer[0], (uint32_t)buffer.size()) != buffer.size() ||
+        buffer != data || !file.extents(extents, tail) || tail.count != 0)
+        return false;
+    uint32_t blocks = 0;
+    for (size_t i = 0; i < extents.size(); i++)
+    {
+        if (i > 0 && extents[i - 1].start + extents[i - 1].count == extents[i].start)
+            return false;
+        for (uint32_t j = 0; j < extents[i].count; j++)
+        {
+            blocknum_t blocknum = extents[i].start + j;
+            if (blocknum >= used.size() || used[blocknum])
+                return false;
+            used[blocknum] = true;
+        }
+        blocks += extents[i].count;
+    }
+    return blocks == data.size() / BLOCKSIZE;
+}
+
+/*
+    Two files growing a block at a time side by side get runs reserved
+    for them growing with the file, few enough extents that they spill
+    out of the inode into an extent block but not many more. One written
+    at once is one run. They map the same once reopened.
+*/
+static bool testextentruns(const string& path)
+{
+    const uint32_t blocks = 1024;
+    ApeFileSystem fs;
+    ApeFsStat stat;
+    vector<uint8_t> first(blocks * BLOCKSIZE);
+    vector<uint8_t> second(blocks * BLOCKSIZE);
+    testnoise(first, 1);
+    testnoise(second, 2);
+    if (!fs.create(path, 64 * 1024 * 1024) || !fs.statfs(stat))
+        return false;
+    {
+        ApeFile a(fs);
+        ApeFile b(fs);
+        ApeFile whole(fs);
+        if (!a.open("/a", APEFILE_CREATE) || !b.open("/b", APEFILE_CREATE) || !whole.open("/whole", APEFILE_CREATE))
+            return false;
+        a.writebuffer(0);
+        b.writebuffer(0);
+        for (uint32_t i = 0; i < blocks; i++)
+        {
+            if (a.write(&first[i * BLOCKSIZE], BLOCKSIZE) != BLOCKSIZE ||
+                b.write(&second[i * BLOCKSIZE], BLOCKSIZE) != BLOCKSIZE)
+                return false;
+        }
+        if (whole.write(&first[0], (uint32_t)first.size()) != first.size())
+            return false;
+    }
+
+    vector<ApeExtent> extents[3];
+    vector<ApeExtent> reopened;
+    vector<bool> used(stat.totalblocks);
+    if (!testruns(fs, "/a", first, extents[0], used) || !testruns(fs, "/b", second, extents[1], used) ||
+        !testruns(fs, "/whole", first, extents[2], used) || extents[2].size() != 1)
+        return false;
+    for (int i = 0; i < 2; i++)
+    {
+        if (extents[i].size() <= INODEEXTENTS || extents[i].size() > 16)
+            return false;
+    }
+
+    if (!fs.close() || !fs.open(path))
+        return false;
+    used.assign(stat.totalblocks, false);
+    const char* names[] = {"/a", "/b", "/whole"};
+    for (int i = 0; i < 3; i++)
+    {
+        if (!testruns(fs, names[i], i == 1 ? second : first, reopened, used) || reopened.size() != extents[i].size())
+            return false;
+        for (size_t j = 0; j < reopened.size(); j++)
+        {
+            if (reopened[j].start != extents[i][j].start || reopened[j].count != extents[i][j].count)
+                return false;
+        }
+    }
+    return testcheck(fs, path);
+}
+
+/*
+    Small writes through a handle's buffer, read back and overwritten before
+    they're written out, are seen by another handle once flushed and land in
+    one run once closed. The file reads back the same reopened.
+*/
+static bool testbufferclose(const string& path)
+{
+    const uint32_t piece = 1024;
+    ApeFileSystem fs;
+    ApeFile file(fs);
+    ApeFile other(fs);
+    vector<uint8_t> data(40 * BLOCKSIZE + 300);
+    vector<uint8_t> buffer(data.size());
+    testnoise(data, 3);
+    if (!fs.create(path, 16 * 1024 * 1024) || !file.open("/buffered", APEFILE_CREATE))
+        return false;
+    file.writebuffer(16 * BLOCKSIZE);
+    for (uint32_t offset = 0; offset < 10 * BLOCKSIZE; offset += piece)
+    {
+        if (file.write(&data[offset], piece) != piece)
+            return false;
+    }
+
+    // what's buffered reads back, and overwriting it stays in the buffer
+    uint8_t patch[100];
+    memset(patch, 0xa5, sizeof(patch));
+    memcpy(&data[5 * BLOCKSIZE + 10], patch, sizeof(patch));
+    if (!file.seek(APESEEK_SET, 5 * BLOCKSIZE) || file.read(&buffer[0], 10) != 10 ||
+        memcmp(&buffer[0], &data[5 * BLOCKSIZE], 10) != 0 || file.write(patch, sizeof(patch)) != sizeof(patch))
+        return false;
+
+    // flushed, another handle sees it
+    if (!file.flush() || !other.open("/buffered", APEFILE_OPEN) || other.size() != 10 * BLOCKSIZE ||
+        other.read(&buffer[0], 10 * BLOCKSIZE) != 10 * BLOCKSIZE || memcmp(&buffer[0], &data[0], 10 * BLOCKSIZE) != 0)
+        return false;
+    other.close();
+
+    if (!file.seek(APESEEK_END, 0))
+        return false;
+    for (uint32_t offset = 10 * BLOCKSIZE; offset < data.size(); offset += piece)
+    {
+        uint32_t size = min(piece, (uint32_t)data.size() - offset);
+        if (file.write(&data[offset], size) != size)
+            return false;
+    }
+    file.close();
+
+    vector<ApeExtent> extents;
+    ApeFragments tail;
+    if (!fs.close() || !fs.open(path) || !file.open("/buffered", APEFILE_OPEN) || file.size() != data.size() ||
+        file.read(&buffer[0], (uint32_t)buffer.size()) != buffer.size() || buffer != data ||
+        !file.extents(extents, tail) || extents.size() != 1)
+        return false;
+    file.close();
+    return testcheck(fs, path);
+}
+
+/*
+    Whole image file in or out of memory
+*/
+static bool testimage(const string& path, vector<uint8_t>& image, bool write)
+{
+    FILE* file = fopen(path.c_str(), write ? "wb" : "rb");
+    if (file == NULL)
+        return false;
+    if (!write)
+    {
+        fseek(file, 0, SEEK_END);
+        image.resize(ftell(file));
+        fseek(file, 0, SEEK_SET);
+    }
+    size_t done = write ? fwrite(&image[0], 1, image.size(), file) : fread(&image[0], 1, image.size(), file);
+    return fclose(file) == 0 && done == image.size();
+}
+
+/*
+    Reads a file back whole, it must hold data
+*/
+static bool testreadback(ApeFileSystem& fs, const string& name, const vector<uint8_t>& data)
+{
+    ApeFile file(fs);
+    vector<uint8_t> buffer(data.size() + 1);
+    return file.open(name, APEFILE_OPEN) && file.size() == data.size() &&
+        file.read(&buffer[0], (uint32_t)buffer.size()) == data.size() && equal(data.begin(), data.end(), buffer.begin());
+}
+
+/*
+    A crash right after a commit, none of its metadata in place: the image
+    as it was before with the journal and data blocks of after. Replay
+    brings the whole commit, a file written and one deleted. With the
+    commit torn it brings none of it.
+*/
+static bool testjournalreplay(const string& path)
+{
+    const uint32_t files = 10;
+    ApeFileSystem fs;
+    ApeFsStat before;
+    ApeFsStat after;
+    ApeFsStat stat;
+    vector<uint8_t> data[files];
+    vector<uint8_t> added(5 * BLOCKSIZE + 100);
+    testnoise(added, 100);
+    if (!fs.create(path, 64 * 1024 * 1024) || !fs.directorycreate("/d"))
+        return false;
+    for (uint32_t i = 0; i < files; i++)
+    {
+        ApeFile file(fs);
+        data[i].resize(i * 700 + 1);
+        testnoise(data[i], i);
+        if (!file.open("/d/f" + to_string(i), APEFILE_CREATE) || file.write(&data[i][0], (uint32_t)data[i].size()) != data[i].size())
+            return false;
+    }
+    vector<uint8_t> old;
+    if (!fs.flush() || !fs.statfs(before) || !testimage(path, old, false))
+        return false;
+
+    {
+        ApeFile file(fs);
+        if (!file.open("/d/added", APEFILE_CREATE) || file.write(&added[0], (uint32_t)added.size()) != added.size())
+            return false;
+    }
+    vector<uint8_t> image;
+    if (!fs.filedelete("/d/f3") || !fs.flush() || !fs.statfs(after) || !testimage(path, image, false) ||
+        !fs.close() || image.size() != old.size())
+        return false;
+
+    // the metadata and dedup table of before, the journal and data of after
+    ApeSuperBlock superblock;
+    memcpy(&superblock, &image[0], sizeof(superblock));
+    size_t journal = (1 + superblock.inodemaps + superblock.blockmaps + superblock.inodetableblocks) * (size_t)BLOCKSIZE;
+    size_t dedup = journal + superblock.journalblocks * (size_t)BLOCKSIZE;
+    size_t blocks = dedup + superblock.dedupblocks * (size_t)BLOCKSIZE;
+    copy(old.begin(), old.begin() + journal, image.begin());
+    copy(old.begin() + dedup, old.begin() + blocks, image.begin() + dedup);
+    if (!testimage(path, image, true) || !fs.open(path) || !fs.statfs(stat) || stat.freeblocks != after.freeblocks ||
+        fs.fileexists("/d/f3") || !testreadback(fs, "/d/added", added))
+        return false;
+    for (uint32_t i = 0; i < files; i++)
+    {
+        if (i != 3 && !testreadback(fs, "/d/f" + to_string(i), data[i]))
+            return false;
+    }
+    if (!testcheck(fs, path) || !fs.close())
+        return false;
+
+    // the commit torn where the journal first changed
+    size_t torn = journal;
+    while (torn < dedup && image[torn] == old[torn])
+        torn++;
+    if (torn == dedup)
+        return false;
+    image[torn] ^= 0xff;
+    if (!testimage(path, image, true) || !fs.open(path) || !fs.statfs(stat) || stat.freeblocks != before.freeblocks ||
+        fs.fileexists("/d/added"))
+        return false;
+    for (uint32_t i = 0; i < files; i++)
+    {
+        if (!testreadback(fs, "/d/f" + to_string(i), data[i]))
+            return false;
+    }
+    return testcheck(fs, path);
+}
+
+/*
+    Appends to a file up to size bytes of data and closes it, then gets
+    the blocks and tail it's left with
+*/
+static bool testgrow(ApeFileSystem& fs, const string& name, const vector<uint8_t>& data, uint32_t size,
+    uint32_t& blocks, ApeFragments& tail)
+{
+    ApeFile file(fs);
+    vector<ApeExtent> extents;
+    if (!file.open(name, fs.fileexists(name) ? APEFILE_OPEN : APEFILE_CREATE) || !file.seek(APESEEK_END, 0))
+        return false;
+    uint32_t start = (uint32_t)file.tell();
+    if (file.write(&data[start], size - start) != size - start)
+        return false;
+    file.close();
+    blocks = 0;
+    if (!file.open(name, APEFILE_OPEN) || !file.extents(extents, tail))
+        return false;
+    for (size_t i = 0; i < extents.size(); i++)
+        blocks += extents[i].count;
+    return true;
+}
+
+/*
+    A small file kept in its inode grows into a packed tail, then a block
+    and a tail, then whole blocks, sharing its fragment block with another
+    file whose tail is overwritten meanwhile. Each step takes the
+    blocks it should, they read back the same reopened and give every
+    block back once deleted.
+*/
+static bool testinlinetail(const string& path)
+{
+    ApeFileSystem fs;
+    ApeFsStat before;
+    ApeFsStat stat;
+    ApeFragments tail;
+    ApeFragments other;
+    uint32_t blocks;
+    vector<uint8_t> small(3 * BLOCKSIZE);
+    vector<uint8_t> shared(1000);
+    testnoise(small, 5);
+    testnoise(shared, 6);
+    // the root directory gets its block with the first entry
+    if (!fs.create(path, 16 * 1024 * 1024) || !fs.directorycreate("/d") || !fs.statfs(before))
+        return false;
+
+    // in the inode
+    if (!testgrow(fs, "/small", small, 100, blocks, tail) || blocks != 0 || tail.count != 0 ||
+        !fs.statfs(stat) || stat.freeblocks != before.freeblocks)
+        return false;
+    // out of it into fragments, the other tail beside them
+    if (!testgrow(fs, "/small", small, 1500, blocks, tail) || blocks != 0 || tail.count != 6 ||
+        !testgrow(fs, "/shared", shared, 1000, blocks, other) || blocks != 0 || other.count != 4 ||
+        other.block != tail.block || !fs.statfs(stat) || stat.freeblocks != before.freeblocks - 1)
+        return false;
+
+    {
+        ApeFile file(fs);
+        uint8_t patch[10];
+        memset(patch, 0x3c, sizeof(patch));
+        memcpy(&shared[500], patch, sizeof(patch));
+        if (!file.open("/shared", APEFILE_OPEN) || !file.seek(APESEEK_SET, 500) ||
+            file.write(patch, sizeof(patch)) != sizeof(patch))
+            return false;
+    }
+    // a block and the tail packed again, then no tail at all
+    if (!testgrow(fs, "/small", small, BLOCKSIZE + 700, blocks, tail) || blocks != 1 || tail.count != 3 ||
+        !testreadback(fs, "/shared", shared) ||
+        !testgrow(fs, "/small", small, 3 * BLOCKSIZE, blocks, tail) || blocks != 3 || tail.count != 0)
+        return false;
+
+    if (!fs.close() || !fs.open(path) || !testreadback(fs, "/small", small) || !testreadback(fs, "/shared", shared) ||
+        !fs.filedelete("/small") || !fs.filedelete("/shared") || !fs.flush() || !fs.statfs(stat) ||
+        stat.freeblocks != before.freeblocks)
+        return false;
+    return testcheck(fs, path);
+}
+
+/*
+    Writes data to a file at offset, then reads the whole file back
+*/
+static bool testoverwrite(ApeFileSystem& fs, const string& name, vector<uint8_t>& data, uint32_t offset,
+    const vector<uint8_t>& patch)
+{
+    ApeFile file(fs);
+    copy(patch.begin(), patch.end(), data.begin() + offset);
+    if (!file.open(name, APEFILE_OPEN) || !file.seek(APESEEK_SET, offset) ||
+        file.write(&patch[0], (uint32_t)patch.size()) != patch.size())
+        return false;
+    file.close();
+    return testreadback(fs, name, data);
+}
+
+/*
+    Overwriting a compressed file across a cluster boundary with data that
+    doesn't compress, then with data that does again. The clusters take
+    blocks and give them back as they grow and shrink, the file reads back
+    the same each time, and deleting it gives every block back.
+*/
+static bool testcompressrewrite(const string& path)
+{
+    ApeFileSystem fs;
+    ApeFsStat before;
+    ApeFsStat packed;
+    ApeFsStat stat;
+    vector<uint8_t> data(5 * CLUSTERSIZE + 777);
+    vector<uint8_t> noise(CLUSTERSIZE);
+    vector<uint8_t> zeros(CLUSTERSIZE);
+    testnoise(noise, 7);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = (uint8_t)(i / 64);
+    if (!fs.create(path, 64 * 1024 * 1024, DEFAULTCACHEBLOCKS, APESTORAGE_MMAP, APESYNC_NONE, APECOMPRESS_LZ) ||
+        !fs.directorycreate("/d") || !fs.statfs(before))
+        return false;
+    {
+        ApeFile file(fs);
+        if (!file.open("/c", APEFILE_CREATE) || file.write(&data[0], (uint32_t)data.size()) != data.size())
+            return false;
+    }
+    if (!testreadback(fs, "/c", data) || !fs.statfs(packed) || before.freeblocks - packed.freeblocks >= data.size() / BLOCKSIZE)
+        return false;
+
+    // two clusters no longer compress
+    if (!testoverwrite(fs, "/c", data, CLUSTERSIZE + CLUSTERSIZE / 2, noise) || !fs.flush() || !fs.statfs(stat) ||
+        packed.freeblocks - stat.freeblocks < CLUSTERSIZE / BLOCKSIZE)
+        return false;
+    // and shrink again
+    if (!testoverwrite(fs, "/c", data, CLUSTERSIZE + CLUSTERSIZE / 2, zeros) || !fs.flush() || !fs.statfs(stat) ||
+        stat.freeblocks < packed.freeblocks)
+        return false;
+
+    if (!fs.close() || !fs.open(path) || !testreadback(fs, "/c", data) || !fs.filedelete("/c") || !fs.flush() ||
+        !fs.statfs(stat) || stat.freeblocks != before.freeblocks)
+        return false;
+    return testcheck(fs, path);
+}
+
+/*
+    Writes a file of the stamped blocks, then tells how many blocks
+    it took from the image
+*/
+static bool teststamped(ApeFileSystem& fs, const string& name, const vector<uint32_t>& stamps, uint32_t& taken)
+{
+    ApeFile file(fs);
+    ApeFsStat before;
+    ApeFsStat after;
+    vector<uint8_t> data;
+    teststamp(data, stamps);
+    if (!fs.statfs(before) || !file.open(name, APEFILE_CREATE) || file.write(&data[0], (uint32_t)data.size()) != data.size())
+        return false;
+    file.close();
+    if (!fs.statfs(after))
+        return false;
+    taken = before.freeblocks - after.freeblocks;
+    return true;
+}
+
+/*
+    A file copied whole, and one sharing half of it with a block of its own
+    repeated. Only blocks not seen yet are taken, overwriting a shared block
+    leaves the other file as it was, and each delete gives back only the
+    blocks no other file maps any more. The files left read back the same.
+*/
+static bool testdeduprefs(const string& path)
+{
+    ApeFileSystem fs;
+    ApeFsStat before;
+    ApeFsStat stat;
+    vector<uint32_t> a;
+    vector<uint32_t> c;
+    vector<uint8_t> data;
+    uint32_t taken;
+    for (uint32_t i = 0; i < 64; i++)
+        a.push_back(i);
+    for (uint32_t i = 32; i < 64; i++)
+        c.push_back(i);
+    for (uint32_t i = 1000; i < 1032; i++)
+        c.push_back(i);
+    c.push_back(1000);
+    // the root directory gets its block with the first entry
+    if (!fs.create(path, 64 * 1024 * 1024, DEFAULTCACHEBLOCKS, APESTORAGE_MMAP, APESYNC_NONE, APECOMPRESS_NONE, true) ||
+        !fs.directorycreate("/d") || !fs.statfs(before))
+        return false;
+    if (!teststamped(fs, "/a", a, taken) || taken != 64 || !teststamped(fs, "/b", a, taken) || taken != 0 ||
+        !teststamped(fs, "/c", c, taken) || taken != 32 || fs.dedupstats().shared != 64 + 32 + 1)
+        return false;
+
+    // block 5 of b gets its own, a keeps the one they shared
+    vector<uint32_t> b = a;
+    b[5] = 2000;
+    vector<uint8_t> patch;
+    teststamp(patch, vector<uint32_t>(1, b[5]));
+    teststamp(data, b);
+    if (!testoverwrite(fs, "/b", data, 5 * BLOCKSIZE, patch) || !fs.statfs(stat) ||
+        stat.freeblocks != before.freeblocks - 64 - 32 - 1)
+        return false;
+    teststamp(data, a);
+    if (!testreadback(fs, "/a", data))
+        return false;
+
+    // b's own block, then a's blocks c doesn't share
+    if (!fs.filedelete("/b") || !fs.statfs(stat) || stat.freeblocks != before.freeblocks - 64 - 32 ||
+        !fs.filedelete("/a") || !fs.statfs(stat) || stat.freeblocks != before.freeblocks - 64)
+        return false;
+    teststamp(data, c);
+    if (!fs.close() || !fs.open(path) || !testreadback(fs, "/c", data) || !fs.filedelete("/c") || !fs.flush() ||
+        !fs.statfs(stat) || stat.freeblocks != before.freeblocks)
+        return false;
+    return testcheck(fs, path);
+}
+
+struct ApeTestEntry
+{
+    const char* name;
+    apetest_t run;
+    const char* help;
+};
+
+static const ApeTestEntry tests[] =
+{
+    {"closeopen", testcloseopen, "closing the filesystem with a file still open"},
+    {"closewrite", testclosewrite, "closing the filesystem with writes still buffered in a handle"},
+    {"streamsync", teststreamsync, "sync policies on the stream backend, which can't sync"},
+    {"journalcapacity", testjournalcapacity, "a big file's dedup table changes spread over commits, then reopening"},
+    {"compressdelete", testcompressdelete, "deleting a big compressed file, a batch of clusters per transaction"},
+    {"dedupdelete", testdedupdelete, "deleting big files sharing blocks, a batch of blocks per transaction"},
+    {"tailclose", testtailclose, "packing the tails of small files as they're closed"},
+    {"compressoverwrite", testcompressoverwrite, "overwriting a compressed file with the free blocks scattered"},
+    {"extentruns", testextentruns, "runs reserved for files growing side by side, their extents"},
+    {"bufferclose", testbufferclose, "small writes buffered in a handle, read, overwritten, flushed and closed"},
+    {"journalreplay", testjournalreplay, "replaying a commit none of whose metadata made it in place, then torn"},
+    {"inlinetail", testinlinetail, "a small file growing out of its inode through a packed tail to whole blocks"},
+    {"compressrewrite", testcompressrewrite, "overwriting compressed clusters so they grow, then shrink again"},
+    {"deduprefs", testdeduprefs, "files sharing blocks overwritten and deleted one after the other"},
+};
+
+static const size_t testcount = sizeof(tests) / sizeof(tests[0]);
+
+int main(int argc, char **argv)
+{
+    string name = argc > 1 ? argv[1] : "all";
+    string path = argc > 2 ? argv[2] : "apetest.apefs";
+    int failed = 0;
+    int run = 0;
+    for (size_t i = 0; i < testcount; i++)
+    {
+        if (name != "all" && name != tests[i].name)
+            continue;
+        cout << setw(18) << left << tests[i].name << flush;
+        bool ok = tests[i].run(path);
+        cout << (ok ? "ok" : "FAILED") << endl;
+        remove(path.c_str());
+        failed += ok ? 0 : 1;
+        run++;
+    }
+
+    if (run == 0)
+    {
+        cout << "usage: apetest [test] [image path]" << endl << endl;
+        for (size_t i = 0; i < testcount; i++)
+            cout << "  " << setw(18) << left << tests[i].name << tests[i].help << endl;
+        return 1;
+    }
+    return failed > 0 ? 1 : 0;
+}
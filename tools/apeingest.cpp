@@ -0,0 +1,457 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../apefs/apefilesystem.h"
+
+using namespace std;
+
+/*
+    Copies a host directory tree into a new image through a pipeline:
+    walkers list the host directories, readers load the files in big
+    chunks and a single writer feeds the filesystem, in batches.
+
+    usage: apeingest <source dir> <image> [image size in mb] [walkers] [readers] [none|lz]
+*/
+
+const uint32_t INGESTCHUNK = 4 * 1024 * 1024; // file bytes a reader hands over at once
+const uint64_t INGESTINFLIGHT = 256 * 1024 * 1024; // bytes read and not written yet
+const uint32_t INGESTBATCH = 64; // items the writer takes at once
+const uint32_t INGESTQUEUED = 65536; // files listed and not read yet
+
+/*
+    Blocking FIFO between two stages. push waits while more than limit
+    is queued, counting each item by its cost. After close(), pop drains
+    what's left and then returns false.
+*/
+template <class T>
+class ApeIngestQueue
+{
+public:
+    ApeIngestQueue(uint64_t limit)
+        : limit_(limit), cost_(0), closed_(false)
+    {
+    }
+
+    void push(T& item, uint64_t cost)
+    {
+        unique_lock<mutex> lock(lock_);
+        // something too big for the limit still goes, alone
+        while (cost_ > 0 && cost_ + cost > limit_)
+            notfull_.wait(lock);
+        items_.push_back(make_pair(move(item), cost));
+        cost_ += cost;
+        notempty_.notify_one();
+    }
+
+    // up to max items at once
+    bool pop(vector<T>& items, size_t max)
+    {
+        unique_lock<mutex> lock(lock_);
+        while (items_.empty() && !closed_)
+            notempty_.wait(lock);
+        if (items_.empty())
+            return false;
+        while (!items_.empty() && items.size() < max)
+        {
+            items.push_back(move(items_.front().first));
+            cost_ -= items_.front().second;
+            items_.pop_front();
+        }
+        notfull_.notify_all();
+        return true;
+    }
+
+    void close()
+    {
+        lock_guard<mutex> lock(lock_);
+        closed_ = true;
+        notempty_.notify_all();
+    }
+
+    uint64_t cost()
+    {
+        lock_guard<mutex> lock(lock_);
+        return cost_;
+    }
+private:
+    deque<pair<T, uint64_t> > items_;
+    uint64_t limit_;
+    uint64_t cost_;
+    bool closed_;
+    mutex lock_;
+    condition_variable notempty_;
+    condition_variable notfull_;
+};
+
+/*
+    A host path and where it goes in the image
+*/
+struct ApeIngestPath
+{
+    string source;
+    string target;
+};
+
+/*
+    Writer work, a directory to create or a chunk of a file.
+    The chunks of a file come in order, the first one creates it.
+*/
+struct ApeIngestItem
+{
+    bool directory;
+    string target;
+    uint64_t file; // id of the file the chunk belongs to
+    bool first;
+    bool last;
+    bool failed; // the reader gave up, what was written is deleted
+    vector<uint8_t> data;
+};
+
+struct ApeIngestState
+{
+    ApeIngestState()
+        : pendingdirs(0), files(INGESTQUEUED), items(INGESTINFLIGHT), nextfile(0),
+          dirsdone(0), filesdone(0), bytesread(0), byteswritten(0), skipped(0), errors(0)
+    {
+    }
+
+    ApeFileSystem fs;
+    // directories left to walk, walkers are done once none is pending
+    deque<ApeIngestPath> dirs;
+    uint32_t pendingdirs; // queued or being walked
+    mutex dirslock;
+    condition_variable dirsready;
+    ApeIngestQueue<ApeIngestPath> files;
+    ApeIngestQueue<ApeIngestItem> items;
+    atomic<uint64_t> nextfile;
+    // progress
+    atomic<uint64_t> dirsdone;
+    atomic<uint64_t> filesdone;
+    atomic<uint64_t> bytesread;
+    atomic<uint64_t> byteswritten;
+    atomic<uint64_t> skipped; // links, devices and the like
+    atomic<uint64_t> errors;
+};
+
+static void ingesterror(ApeIngestState& state, const string& what, const string& path)
+{
+    static mutex lock;
+    state.errors++;
+    lock_guard<mutex> guard(lock);
+    cerr << what << ": " << path << endl;
+}
+
+/*
+    Lists host directories, subdirectories are created in the image
+    before anything inside them is listed, files go to the readers
+*/
+static void ingestwalker(ApeIngestState& state)
+{
+    while (true)
+    {
+        ApeIngestPath dir;
+        {
+            unique_lock<mutex> lock(state.dirslock);
+            while (state.dirs.empty() && state.pendingdirs > 0)
+                state.dirsready.wait(lock);
+            if (state.dirs.empty())
+                return;
+            dir = state.dirs.front();
+            state.dirs.pop_front();
+        }
+
+        vector<ApeIngestPath> subdirs;
+        DIR* dp = opendir(dir.source.c_str());
+        if (dp == NULL)
+            ingesterror(state, "can't list", dir.source);
+
+        dirent* entry;
+        while (dp != NULL && (entry = readdir(dp)) != NULL)
+        {
+            string name = entry->d_name;
+            if (name == "." || name == "..")
+                continue;
+
+            ApeIngestPath path = {ApeFileSystem::joinpath(dir.source, name), ApeFileSystem::joinpath(dir.target, name)};
+            unsigned char type = entry->d_type;
+            if (type == DT_UNKNOWN)
+            {
+                // only some filesystems leave it out, stat only then
+                struct stat s;
+                if (lstat(path.source.c_str(), &s) != 0)
+                {
+                    ingesterror(state, "can't stat", path.source);
+                    continue;
+                }
+                type = S_ISDIR(s.st_mode) ? DT_DIR : S_ISREG(s.st_mode) ? DT_REG : DT_LNK;
+            }
+
+            if (type == DT_DIR)
+            {
+                ApeIngestItem item;
+                item.directory = true;
+                item.target = path.target;
+                state.items.push(item, 0);
+                subdirs.push_back(path);
+            }
+            else if (type == DT_REG)
+            {
+                state.files.push(path, 1);
+            }
+            else
+            {
+                state.skipped++;
+            }
+        }
+        if (dp != NULL)
+            closedir(dp);
+
+        lock_guard<mutex> lock(state.dirslock);
+        state.dirs.insert(state.dirs.end(), subdirs.begin(), subdirs.end());
+        state.pendingdirs += subdirs.size();
+        state.pendingdirs--;
+        state.dirsdone++;
+        state.dirsready.notify_all();
+    }
+}
+
+/*
+    Reads files in INGESTCHUNK pieces and hands them to the writer
+*/
+static void ingestreader(ApeIngestState& state)
+{
+    vector<ApeIngestPath> paths;
+    while (state.files.pop(paths, 1))
+    {
+        ApeIngestPath path = paths[0];
+        paths.clear();
+
+        int fd = open(path.source.c_str(), O_RDONLY);
+        struct stat s;
+        if (fd < 0 || fstat(fd, &s) != 0)
+        {
+            ingesterror(state, "can't open", path.source);
+            if (fd >= 0)
+                close(fd);
+            continue;
+        }
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+        uint64_t file = state.nextfile++;
+        uint64_t total = 0;
+        bool first = true;
+        bool eof = false;
+        while (!eof)
+        {
+            ApeIngestItem item;
+            item.directory = false;
+            item.target = path.target;
+            item.file = file;
+            item.first = first;
+            item.failed = false;
+            // one byte more than what's left, the read past it finds the end
+            uint64_t left = (uint64_t)s.st_size > total ? s.st_size - total : 0;
+            item.data.resize(left > 0 ? min((uint64_t)INGESTCHUNK, left + 1) : 64 * 1024);
+
+            size_t filled = 0;
+            while (filled < item.data.size())
+            {
+                ssize_t count = read(fd, &item.data[filled], item.data.size() - filled);
+                if (count <= 0)
+                {
+                    eof = true;
+                    item.failed = count < 0;
+                    break;
+                }
+                filled += count;
+            }
+            item.data.resize(filled);
+            item.last = eof;
+            total += filled;
+            state.bytesread += filled;
+            if (item.failed)
+            {
+                ingesterror(state, "can't read", path.source);
+                item.data.clear();
+            }
+            state.items.push(item, item.data.size());
+            first = false;
+        }
+        close(fd);
+    }
+}
+
+/*
+    Creates the directories and files in the image, in the order the
+    other stages queued them
+*/
+static void ingestwriter(ApeIngestState& state)
+{
+    map<uint64_t, ApeFile*> open;
+    vector<ApeIngestItem> batch;
+    while (state.items.pop(batch, INGESTBATCH))
+    {
+        for (size_t i = 0; i < batch.size(); i++)
+        {
+            ApeIngestItem& item = batch[i];
+            if (item.directory)
+            {
+                if (!state.fs.directorycreate(item.target))
+                    ingesterror(state, "can't create the directory", item.target);
+                continue;
+            }
+
+            if (item.first)
+            {
+                ApeFile* file = new ApeFile(state.fs);
+                if (!file->open(item.target, APEFILE_CREATE))
+                {
+                    ingesterror(state, "can't create the file", item.target);
+                    delete file;
+                    file = NULL;
+                }
+                open[item.file] = file;
+            }
+
+            ApeFile* file = open[item.file];
+            if (file != NULL && !item.data.empty())
+            {
+                if (file->write(&item.data[0], item.data.size()) == item.data.size())
+                {
+                    state.byteswritten += item.data.size();
+                }
+                else
+                {
+                    ingesterror(state, "can't write", item.target);
+                    item.failed = true;
+                }
+            }
+
+            if (file != NULL && (item.last || item.failed))
+            {
+                delete file;
+                open[item.file] = NULL;
+                if (item.failed)
+                    state.fs.filedelete(item.target);
+                else
+                    state.filesdone++;
+            }
+            if (item.last)
+                open.erase(item.file);
+        }
+        batch.clear();
+    }
+}
+
+static double ingestnow()
+{
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void ingestreport(ApeIngestState& state, double seconds, double rate)
+{
+    cout << fixed << setprecision(1) << setw(8) << seconds << "s"
+         << setw(10) << state.filesdone << " files"
+         << setw(8) << state.dirsdone << " dirs"
+         << setw(10) << state.byteswritten / (1024.0 * 1024.0) << " MB"
+         << setw(9) << rate / (1024 * 1024) << " MB/s"
+         << setw(7) << state.items.cost() / (1024 * 1024) << " MB queued" << endl;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        cout << "usage: apeingest <source dir> <image> [image size in mb] [walkers] [readers] [none|lz]" << endl;
+        return 1;
+    }
+
+    string source = argv[1];
+    string image = argv[2];
+    uint64_t sizemb = argc > 3 ? strtoull(argv[3], NULL, 10) : 1024;
+    uint32_t walkers = argc > 4 ? max(atoi(argv[4]), 1) : 4;
+    uint32_t readers = argc > 5 ? max(atoi(argv[5]), 1) : 8;
+    ApeCompression compression = argc > 6 && string(argv[6]) == "lz" ? APECOMPRESS_LZ : APECOMPRESS_NONE;
+
+    ApeIngestState* state = new ApeIngestState();
+    if (sizemb == 0 ||
+        !state->fs.create(image, sizemb * 1024 * 1024, DEFAULTCACHEBLOCKS, APESTORAGE_PIO, APESYNC_NONE, compression))
+    {
+        cout << "can't create " << image << endl;
+        delete state;
+        return 1;
+    }
+
+    ApeIngestPath root = {source, "/"};
+    state->dirs.push_back(root);
+    state->pendingdirs = 1;
+
+    double start = ingestnow();
+    vector<thread> walking;
+    vector<thread> reading;
+    for (uint32_t i = 0; i < walkers; i++)
+        walking.push_back(thread(ingestwalker, ref(*state)));
+    for (uint32_t i = 0; i < readers; i++)
+        reading.push_back(thread(ingestreader, ref(*state)));
+    thread writer(ingestwriter, ref(*state));
+
+    // each stage ends once the one before it is done
+    atomic<bool> done(false);
+    thread closer([&]()
+    {
+        for (size_t i = 0; i < walking.size(); i++)
+            walking[i].join();
+        state->files.close();
+        for (size_t i = 0; i < reading.size(); i++)
+            reading[i].join();
+        state->items.close();
+        writer.join();
+        done = true;
+    });
+
+    double last = start;
+    uint64_t lastbytes = 0;
+    while (!done)
+    {
+        this_thread::sleep_for(chrono::milliseconds(100));
+        double now = ingestnow();
+        if (now - last < 1 && !done)
+            continue;
+        uint64_t bytes = state->byteswritten;
+        ingestreport(*state, now - start, (bytes - lastbytes) / (now - last));
+        last = now;
+        lastbytes = bytes;
+    }
+    closer.join();
+
+    // the rest goes to the disk now
+    bool ok = state->fs.close();
+    double seconds = ingestnow() - start;
+    cout << endl << state->filesdone << " files and " << state->dirsdone << " directories, "
+         << fixed << setprecision(1) << state->byteswritten / (1024.0 * 1024.0) << " MB in " << seconds << "s, "
+         << state->byteswritten / (1024.0 * 1024.0) / seconds << " MB/s, "
+         << setprecision(0) << state->filesdone / seconds << " files/s" << endl;
+    if (state->skipped > 0)
+        cout << state->skipped << " entries skipped, not files nor directories" << endl;
+    if (state->errors > 0 || !ok)
+        cout << state->errors << " errors" << endl;
+
+    bool clean = ok && state->errors == 0;
+    delete state;
+    return clean ? 0 : 1;
+}